@@ -0,0 +1,732 @@
+/*
+Benchmarks for the B+tree, run with make bench or ./bench [num_keys].
+
+Every structure runs the same workloads over num_keys keys (1,000,000 by default):
+
+    seq insert      insert 0, 1, 2... into an empty structure
+    rand insert     insert the keys in random order, this is the data set for the rest
+    rand get        look up every key in random order
+    zipf get        look up keys drawn from a scrambled Zipfian distribution (theta 0.99)
+    ycsb a          50% zipf get, 50% update of an existing key
+    ycsb b          95% zipf get, 5% update
+    ycsb e          95% scan of 100 entries from a zipf key, 5% insert of a new key
+    rand delete     delete every key in random order
+
+Keys are distinct 32-bit values (i * an odd constant), so the same data set works for both
+key types. All of the keys of a workload are generated before it is timed. Each operation is
+also timed on its own with the timestamp counter for the percentiles, which adds a little
+to every operation. Structures that can't run a workload show "-" for it: the sorted array
+can't take inserts (every insert would move half the array) and is built with a sort instead,
+and the hash table has no order to scan in.
+
+Bytes/entry is the memory of the nodes (or arrays) divided by the number of entries
+right after the rand insert load.
+
+The "huge" tree is the degree 64 one with its nodes in a huge page arena (btree_allocator.h),
+for the difference fewer TLB misses make to the random workloads. The "buffered" tree keeps
+64-entry leaves but buffers writes in its inner nodes (BTREE_BUFFERED), trading slower gets
+for random inserts that touch the leaves in batches.
+*/
+#define _POSIX_C_SOURCE 199309L
+// MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE for the huge page arena
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BTREE_NAME btree_u64_16
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 16
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+
+#define BTREE_NAME btree_u64_64
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 64
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+
+#define BTREE_NAME btree_u64_256
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 256
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+
+#define BTREE_NAME btree_u64_64_huge
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 64
+#define BTREE_ALLOCATOR
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_ALLOCATOR
+
+#define BTREE_NAME btree_u64_64_buffered
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_LEAF_MAX_DEGREE 64
+#define BTREE_INNER_MAX_DEGREE 16
+#define BTREE_BUFFERED
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_LEAF_MAX_DEGREE
+#undef BTREE_INNER_MAX_DEGREE
+#undef BTREE_BUFFERED
+
+#define BTREE_NAME btree_u32_64
+#define BTREE_KEY_TYPE uint32_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 64
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+
+#define BTREE_NAME btree_u32_256
+#define BTREE_KEY_TYPE uint32_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 256
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+
+#define SCAN_LENGTH 100
+#define ZIPF_THETA 0.99
+
+// the operations a workload needs from a structure, NULL if it doesn't support one
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *structure);
+    // build from n sorted keys, for structures without insert
+    bool (*build)(void *structure, const uint64_t *keys, size_t n);
+    bool (*insert)(void *structure, uint64_t key, uint64_t value);
+    bool (*get)(void *structure, uint64_t key, uint64_t *value);
+    bool (*update)(void *structure, uint64_t key, uint64_t value);
+    bool (*remove)(void *structure, uint64_t key);
+    // sum of the values of up to n entries from the first key >= key
+    uint64_t (*scan)(void *structure, uint64_t key, size_t n);
+    size_t (*bytes_used)(void *structure);
+} bench_ops_t;
+
+// with name##_bench_create and name##_bench_destroy defined beforehand
+#define BENCH_BTREE_OPS_WITH_CREATE(name, key_type, label)                                           \
+    static bool name##_bench_insert(void *tree, uint64_t key, uint64_t value) {                       \
+        return name##_insert(tree, (key_type)key, value);                                             \
+    }                                                                                                 \
+    static bool name##_bench_get(void *tree, uint64_t key, uint64_t *value) {                         \
+        return name##_lookup(tree, (key_type)key, value);                                             \
+    }                                                                                                 \
+    static bool name##_bench_update(void *tree, uint64_t key, uint64_t value) {                       \
+        return name##_upsert(tree, (key_type)key, value, NULL);                                       \
+    }                                                                                                 \
+    static bool name##_bench_remove(void *tree, uint64_t key) {                                       \
+        return name##_remove(tree, (key_type)key, NULL);                                              \
+    }                                                                                                 \
+    static uint64_t name##_bench_scan(void *tree, uint64_t key, size_t n) {                           \
+        name##_cursor_t cursor;                                                                       \
+        uint64_t sum = 0;                                                                             \
+        bool valid = name##_cursor_seek(&cursor, tree, (key_type)key);                                \
+        for (size_t i = 0; i < n && valid; i++, valid = name##_cursor_next(&cursor)) {                \
+            sum += name##_cursor_value(&cursor);                                                      \
+        }                                                                                             \
+        return sum;                                                                                   \
+    }                                                                                                 \
+    static size_t name##_bench_bytes_used(void *tree) {                                               \
+        btree_stats_t stats;                                                                          \
+        name##_stats(tree, &stats);                                                                   \
+        return stats.bytes_used;                                                                      \
+    }                                                                                                 \
+    static const bench_ops_t name##_bench_ops = {                                                     \
+        label, name##_bench_create, name##_bench_destroy, NULL, name##_bench_insert,                  \
+        name##_bench_get, name##_bench_update, name##_bench_remove, name##_bench_scan,                \
+        name##_bench_bytes_used                                                                       \
+    };
+
+#define BENCH_BTREE_OPS(name, key_type, label)                                                       \
+    static void *name##_bench_create(void) { return name##_new(); }                                   \
+    static void name##_bench_destroy(void *tree) { name##_destroy(tree); }                            \
+    BENCH_BTREE_OPS_WITH_CREATE(name, key_type, label)
+
+BENCH_BTREE_OPS(btree_u64_16, uint64_t, "btree u64 degree 16")
+BENCH_BTREE_OPS(btree_u64_64, uint64_t, "btree u64 degree 64")
+BENCH_BTREE_OPS(btree_u64_256, uint64_t, "btree u64 degree 256")
+
+// one tree at a time, each with an arena of its own
+static btree_hugepage_arena_t *bench_arena;
+
+static void *btree_u64_64_huge_bench_create(void) {
+    bench_arena = btree_hugepage_arena_new(-1);
+    if (bench_arena == NULL) return NULL;
+    btree_allocator_t allocator = btree_hugepage_arena_allocator(bench_arena);
+    return btree_u64_64_huge_new_with_allocator(&allocator);
+}
+
+static void btree_u64_64_huge_bench_destroy(void *tree) {
+    btree_u64_64_huge_destroy(tree);
+    btree_hugepage_arena_destroy(bench_arena);
+    bench_arena = NULL;
+}
+
+BENCH_BTREE_OPS_WITH_CREATE(btree_u64_64_huge, uint64_t, "btree u64 64 huge")
+BENCH_BTREE_OPS(btree_u64_64_buffered, uint64_t, "btree u64 64 buffered")
+BENCH_BTREE_OPS(btree_u32_64, uint32_t, "btree u32 degree 64")
+BENCH_BTREE_OPS(btree_u32_256, uint32_t, "btree u32 degree 256")
+
+/* Sorted array baseline, searched with a plain binary search. */
+
+typedef struct {
+    uint64_t *keys;
+    uint64_t *values;
+    size_t n;
+} sorted_array_t;
+
+static void *sorted_array_create(void) {
+    return calloc(1, sizeof(sorted_array_t));
+}
+
+static void sorted_array_destroy(void *structure) {
+    sorted_array_t *array = structure;
+    free(array->keys);
+    free(array->values);
+    free(array);
+}
+
+static bool sorted_array_build(void *structure, const uint64_t *keys, size_t n) {
+    sorted_array_t *array = structure;
+    array->keys = malloc(n * sizeof(uint64_t));
+    array->values = malloc(n * sizeof(uint64_t));
+    if (array->keys == NULL || array->values == NULL) return false;
+    memcpy(array->keys, keys, n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        array->values[i] = keys[i];
+    }
+    array->n = n;
+    return true;
+}
+
+static size_t sorted_array_lower_bound(sorted_array_t *array, uint64_t key) {
+    size_t lo = 0, hi = array->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (array->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool sorted_array_get(void *structure, uint64_t key, uint64_t *value) {
+    sorted_array_t *array = structure;
+    size_t i = sorted_array_lower_bound(array, key);
+    if (i == array->n || array->keys[i] != key) return false;
+    *value = array->values[i];
+    return true;
+}
+
+static bool sorted_array_update(void *structure, uint64_t key, uint64_t value) {
+    sorted_array_t *array = structure;
+    size_t i = sorted_array_lower_bound(array, key);
+    if (i == array->n || array->keys[i] != key) return false;
+    array->values[i] = value;
+    return true;
+}
+
+static uint64_t sorted_array_scan(void *structure, uint64_t key, size_t n) {
+    sorted_array_t *array = structure;
+    uint64_t sum = 0;
+    for (size_t i = sorted_array_lower_bound(array, key); i < array->n && n > 0; i++, n--) {
+        sum += array->values[i];
+    }
+    return sum;
+}
+
+static size_t sorted_array_bytes_used(void *structure) {
+    return ((sorted_array_t *)structure)->n * 2 * sizeof(uint64_t);
+}
+
+static const bench_ops_t sorted_array_ops = {
+    "sorted array", sorted_array_create, sorted_array_destroy, sorted_array_build, NULL,
+    sorted_array_get, sorted_array_update, NULL, sorted_array_scan, sorted_array_bytes_used
+};
+
+/* Hash table baseline, open addressing with linear probing, kept at most half full. */
+
+typedef struct {
+    uint64_t *keys;
+    uint64_t *values;
+    bool *used;
+    size_t mask;
+    size_t n;
+} hash_table_t;
+
+static inline size_t hash_table_slot(hash_table_t *table, uint64_t key) {
+    return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & table->mask;
+}
+
+static bool hash_table_alloc(hash_table_t *table, size_t capacity) {
+    table->keys = malloc(capacity * sizeof(uint64_t));
+    table->values = malloc(capacity * sizeof(uint64_t));
+    table->used = calloc(capacity, sizeof(bool));
+    table->mask = capacity - 1;
+    table->n = 0;
+    return table->keys != NULL && table->values != NULL && table->used != NULL;
+}
+
+static void *hash_table_create(void) {
+    hash_table_t *table = calloc(1, sizeof(hash_table_t));
+    if (table == NULL) return NULL;
+    if (!hash_table_alloc(table, 16)) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void hash_table_destroy(void *structure) {
+    hash_table_t *table = structure;
+    free(table->keys);
+    free(table->values);
+    free(table->used);
+    free(table);
+}
+
+static bool hash_table_insert(void *structure, uint64_t key, uint64_t value);
+
+static bool hash_table_grow(hash_table_t *table) {
+    hash_table_t old = *table;
+    if (!hash_table_alloc(table, (old.mask + 1) * 2)) return false;
+    for (size_t i = 0; i <= old.mask; i++) {
+        if (old.used[i]) hash_table_insert(table, old.keys[i], old.values[i]);
+    }
+    free(old.keys);
+    free(old.values);
+    free(old.used);
+    return true;
+}
+
+static bool hash_table_insert(void *structure, uint64_t key, uint64_t value) {
+    hash_table_t *table = structure;
+    if ((table->n + 1) * 2 > table->mask + 1 && !hash_table_grow(table)) return false;
+    size_t i = hash_table_slot(table, key);
+    while (table->used[i]) {
+        if (table->keys[i] == key) {
+            table->values[i] = value;
+            return true;
+        }
+        i = (i + 1) & table->mask;
+    }
+    table->used[i] = true;
+    table->keys[i] = key;
+    table->values[i] = value;
+    table->n++;
+    return true;
+}
+
+static bool hash_table_find(hash_table_t *table, uint64_t key, size_t *slot) {
+    for (size_t i = hash_table_slot(table, key); table->used[i]; i = (i + 1) & table->mask) {
+        if (table->keys[i] == key) {
+            *slot = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool hash_table_get(void *structure, uint64_t key, uint64_t *value) {
+    hash_table_t *table = structure;
+    size_t i;
+    if (!hash_table_find(table, key, &i)) return false;
+    *value = table->values[i];
+    return true;
+}
+
+static bool hash_table_update(void *structure, uint64_t key, uint64_t value) {
+    return hash_table_insert(structure, key, value);
+}
+
+static bool hash_table_remove(void *structure, uint64_t key) {
+    // backward shift deletion, so that no probe sequence is cut short
+    hash_table_t *table = structure;
+    size_t i;
+    if (!hash_table_find(table, key, &i)) return false;
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & table->mask;
+        if (!table->used[j]) break;
+        size_t home = hash_table_slot(table, table->keys[j]);
+        // move j back into the hole at i unless its home slot lies cyclically in (i, j]
+        if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+            table->keys[i] = table->keys[j];
+            table->values[i] = table->values[j];
+            i = j;
+        }
+    }
+    table->used[i] = false;
+    table->n--;
+    return true;
+}
+
+static size_t hash_table_bytes_used(void *structure) {
+    hash_table_t *table = structure;
+    return (table->mask + 1) * (2 * sizeof(uint64_t) + sizeof(bool));
+}
+
+static const bench_ops_t hash_table_ops = {
+    "hash table", hash_table_create, hash_table_destroy, NULL, hash_table_insert,
+    hash_table_get, hash_table_update, hash_table_remove, NULL, hash_table_bytes_used
+};
+
+/* Key generation */
+
+static uint64_t rng_state = UINT64_C(0x2545F4914F6CDD1D);
+
+static inline uint64_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+static inline double rng_double(void) {
+    return (double)(rng_next() >> 11) / (double)(UINT64_C(1) << 53);
+}
+
+static inline uint64_t bench_key(uint64_t i) {
+    // distinct for every i < 2^32, and spread out so that random keys don't arrive in order
+    return (uint64_t)(uint32_t)(i * UINT64_C(0x9E3779B1));
+}
+
+static void shuffle(uint64_t *keys, size_t n) {
+    for (size_t i = n; i > 1; i--) {
+        size_t j = (size_t)(rng_next() % i);
+        uint64_t tmp = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+/* Zipfian generator from YCSB (Gray et al., "Quickly generating billion-record synthetic
+   databases"), scrambled like YCSB's so the popular items are spread over the key space.
+*/
+typedef struct {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf_t;
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0.0;
+    for (uint64_t i = 1; i <= n; i++) {
+        sum += 1.0 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void zipf_init(zipf_t *zipf, uint64_t n, double theta) {
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = zeta(n, theta);
+    zipf->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta(2, theta) / zipf->zetan);
+}
+
+static uint64_t zipf_next(zipf_t *zipf) {
+    double u = rng_double();
+    double uz = u * zipf->zetan;
+    uint64_t rank;
+    if (uz < 1.0) {
+        rank = 0;
+    } else if (uz < 1.0 + pow(0.5, zipf->theta)) {
+        rank = 1;
+    } else {
+        rank = (uint64_t)((double)zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+        if (rank >= zipf->n) rank = zipf->n - 1;
+    }
+    // FNV-style scramble of the rank into an item index
+    return ((rank + 1) * UINT64_C(0x100000001B3) ^ UINT64_C(0xCBF29CE484222325)) % zipf->n;
+}
+
+/* Timing */
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static double ticks_per_ns = 0.0;
+
+static void calibrate_ticks(void) {
+    double start = now_seconds();
+    uint64_t start_ticks = btree_ticks();
+    while (now_seconds() - start < 0.05) {
+    }
+    uint64_t ticks = btree_ticks() - start_ticks;
+    ticks_per_ns = (double)ticks / ((now_seconds() - start) * 1e9);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t *latencies;
+
+static void report(const char *structure, const char *workload, size_t n, double seconds) {
+    qsort(latencies, n, sizeof(uint64_t), compare_u64);
+    printf("%-22s %-12s %9.2f", structure, workload, (double)n / seconds / 1e6);
+    if (ticks_per_ns > 0.0) {
+        printf(" %9.0f %9.0f\n", (double)latencies[n / 2] / ticks_per_ns,
+               (double)latencies[n - 1 - n / 100] / ticks_per_ns);
+    } else {
+        printf(" %9s %9s\n", "-", "-");
+    }
+}
+
+static void skip(const char *structure, const char *workload) {
+    printf("%-22s %-12s %9s %9s %9s\n", structure, workload, "-", "-", "-");
+}
+
+/* Workloads */
+
+enum { OP_GET, OP_UPDATE, OP_SCAN, OP_INSERT };
+
+typedef struct {
+    size_t n;
+    uint64_t *seq_keys;
+    uint64_t *rand_keys;
+    uint64_t *sorted_keys;
+    uint64_t *zipf_keys;
+    uint64_t *mixed_keys[3];
+    uint8_t *mixed_ops[3];
+} workloads_t;
+
+static const char *mixed_names[3] = {"ycsb a", "ycsb b", "ycsb e"};
+
+static volatile uint64_t sink;
+
+static bool run_inserts(const bench_ops_t *ops, void *structure, const uint64_t *keys, size_t n,
+                        const char *workload) {
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t = btree_ticks();
+        if (!ops->insert(structure, keys[i], keys[i])) return false;
+        latencies[i] = btree_ticks() - t;
+    }
+    report(ops->name, workload, n, now_seconds() - start);
+    return true;
+}
+
+static void run_gets(const bench_ops_t *ops, void *structure, const uint64_t *keys, size_t n,
+                     const char *workload) {
+    uint64_t sum = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t = btree_ticks();
+        uint64_t value = 0;
+        ops->get(structure, keys[i], &value);
+        sum += value;
+        latencies[i] = btree_ticks() - t;
+    }
+    report(ops->name, workload, n, now_seconds() - start);
+    sink = sum;
+}
+
+static void run_mixed(const bench_ops_t *ops, void *structure, const uint64_t *keys,
+                      const uint8_t *op_types, size_t n, const char *workload) {
+    uint64_t sum = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t = btree_ticks();
+        uint64_t value = 0;
+        switch (op_types[i]) {
+        case OP_GET:
+            ops->get(structure, keys[i], &value);
+            sum += value;
+            break;
+        case OP_UPDATE:
+            ops->update(structure, keys[i], keys[i] + 1);
+            break;
+        case OP_SCAN:
+            sum += ops->scan(structure, keys[i], SCAN_LENGTH);
+            break;
+        case OP_INSERT:
+            ops->insert(structure, keys[i], keys[i]);
+            break;
+        }
+        latencies[i] = btree_ticks() - t;
+    }
+    report(ops->name, workload, n, now_seconds() - start);
+    sink = sum;
+}
+
+static void run_deletes(const bench_ops_t *ops, void *structure, const uint64_t *keys, size_t n) {
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t = btree_ticks();
+        ops->remove(structure, keys[i]);
+        latencies[i] = btree_ticks() - t;
+    }
+    report(ops->name, "rand delete", n, now_seconds() - start);
+}
+
+static void bench(const bench_ops_t *ops, workloads_t *w) {
+    size_t n = w->n;
+    void *structure;
+    if (ops->insert != NULL) {
+        structure = ops->create();
+        if (structure == NULL || !run_inserts(ops, structure, w->seq_keys, n, "seq insert")) {
+            fprintf(stderr, "%s: out of memory\n", ops->name);
+            exit(1);
+        }
+        ops->destroy(structure);
+    } else {
+        skip(ops->name, "seq insert");
+    }
+
+    structure = ops->create();
+    if (structure == NULL) {
+        fprintf(stderr, "%s: out of memory\n", ops->name);
+        exit(1);
+    }
+    bool loaded;
+    if (ops->insert != NULL) {
+        loaded = run_inserts(ops, structure, w->rand_keys, n, "rand insert");
+    } else {
+        skip(ops->name, "rand insert");
+        loaded = ops->build(structure, w->sorted_keys, n);
+    }
+    if (!loaded) {
+        fprintf(stderr, "%s: out of memory\n", ops->name);
+        exit(1);
+    }
+    double bytes_per_entry = (double)ops->bytes_used(structure) / (double)n;
+
+    run_gets(ops, structure, w->rand_keys, n, "rand get");
+    run_gets(ops, structure, w->zipf_keys, n, "zipf get");
+    for (size_t i = 0; i < 3; i++) {
+        bool scans = i == 2;
+        if ((scans && (ops->scan == NULL || ops->insert == NULL)) || (!scans && ops->update == NULL)) {
+            skip(ops->name, mixed_names[i]);
+        } else {
+            run_mixed(ops, structure, w->mixed_keys[i], w->mixed_ops[i], n, mixed_names[i]);
+        }
+    }
+    if (ops->remove != NULL) {
+        run_deletes(ops, structure, w->rand_keys, n);
+    } else {
+        skip(ops->name, "rand delete");
+    }
+    printf("%-22s %-12s %9.1f\n\n", ops->name, "bytes/entry", bytes_per_entry);
+    ops->destroy(structure);
+}
+
+static void *checked_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+int main(int argc, char **argv) {
+    size_t n = 1000000;
+    if (argc > 1) n = (size_t)strtoull(argv[1], NULL, 10);
+    if (n < 100 || n > (UINT64_C(1) << 31)) {
+        fprintf(stderr, "usage: %s [num_keys], 100 <= num_keys <= 2^31\n", argv[0]);
+        return 1;
+    }
+
+    workloads_t w;
+    w.n = n;
+    w.seq_keys = checked_malloc(n * sizeof(uint64_t));
+    w.rand_keys = checked_malloc(n * sizeof(uint64_t));
+    w.sorted_keys = checked_malloc(n * sizeof(uint64_t));
+    w.zipf_keys = checked_malloc(n * sizeof(uint64_t));
+    latencies = checked_malloc(n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        w.seq_keys[i] = i;
+        w.rand_keys[i] = bench_key(i);
+    }
+    memcpy(w.sorted_keys, w.rand_keys, n * sizeof(uint64_t));
+    qsort(w.sorted_keys, n, sizeof(uint64_t), compare_u64);
+    shuffle(w.rand_keys, n);
+
+    zipf_t zipf;
+    zipf_init(&zipf, n, ZIPF_THETA);
+    for (size_t i = 0; i < n; i++) {
+        w.zipf_keys[i] = bench_key(zipf_next(&zipf));
+    }
+    // percentage of gets (a, b) or scans (e) in each mixed workload
+    const unsigned read_percent[3] = {50, 95, 95};
+    uint64_t next_new_key = n;
+    for (size_t m = 0; m < 3; m++) {
+        w.mixed_keys[m] = checked_malloc(n * sizeof(uint64_t));
+        w.mixed_ops[m] = checked_malloc(n);
+        for (size_t i = 0; i < n; i++) {
+            bool read = rng_next() % 100 < read_percent[m];
+            if (m == 2 && !read) {
+                w.mixed_ops[m][i] = OP_INSERT;
+                w.mixed_keys[m][i] = bench_key(next_new_key++);
+            } else {
+                w.mixed_ops[m][i] = read ? (m == 2 ? OP_SCAN : OP_GET) : OP_UPDATE;
+                w.mixed_keys[m][i] = bench_key(zipf_next(&zipf));
+            }
+        }
+    }
+
+    calibrate_ticks();
+    printf("%zu keys, %d-entry scans, zipf theta %.2f\n\n", n, SCAN_LENGTH, ZIPF_THETA);
+    printf("%-22s %-12s %9s %9s %9s\n", "structure", "workload", "Mops/s", "p50 ns", "p99 ns");
+
+    const bench_ops_t *structures[] = {
+        &btree_u64_16_bench_ops, &btree_u64_64_bench_ops, &btree_u64_256_bench_ops, &btree_u64_64_huge_bench_ops,
+        &btree_u64_64_buffered_bench_ops, &btree_u32_64_bench_ops, &btree_u32_256_bench_ops, &sorted_array_ops, &hash_table_ops,
+    };
+    for (size_t i = 0; i < sizeof(structures) / sizeof(structures[0]); i++) {
+        bench(structures[i], &w);
+    }
+
+    free(w.seq_keys);
+    free(w.rand_keys);
+    free(w.sorted_keys);
+    free(w.zipf_keys);
+    for (size_t m = 0; m < 3; m++) {
+        free(w.mixed_keys[m]);
+        free(w.mixed_ops[m]);
+    }
+    free(latencies);
+    return 0;
+}
@@ -5,12 +5,325 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define BTREE_DEFAULT_NODE_MAX_DEGREE 256
 #define BTREE_MAX_HEIGHT 128
+#define BTREE_CACHE_LINE_SIZE 64
+#define BTREE_PAGE_SIZE 4096
+
+#ifndef BTREE_FROZEN_ALIGNMENT
+#define BTREE_FROZEN_ALIGNMENT 64
+#endif
+
+#ifndef BTREE_GET_MANY_GROUP_SIZE
+#define BTREE_GET_MANY_GROUP_SIZE 16
+#endif
+
+// inner levels above its leaf a cursor keeps for hinted searches, when it has a leaf chain to scan
+#ifndef BTREE_CURSOR_PATH_HEIGHT
+#define BTREE_CURSOR_PATH_HEIGHT 4
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BTREE_MMAP_AVAILABLE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "btree_allocator.h"
+
+/* Header of a saved frozen tree. The file is position-independent: the header is followed
+   by the key nodes at nodes_offset, exactly as they are laid out in memory, and the values
+   at values_offset, so a mapped file can be searched in place.
+
+   The key and value sizes, node degree, alignment and byte order have to match
+   the tree type that opens the file. Bump BTREE_FILE_VERSION on any change to the layout.
+*/
+#define BTREE_FILE_MAGIC "BTREEFRZ"
+#define BTREE_FILE_VERSION 1
+#define BTREE_FILE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t node_max_degree;
+    uint32_t alignment;
+    uint64_t count;
+    uint64_t node_size;
+    uint64_t nodes_offset;
+    uint64_t values_offset;
+    uint64_t file_size;
+} btree_file_header_t;
+
+/* Counters kept by a tree compiled with BTREE_STATS. lookups, inserts and deletes count
+   entries (a get_many of n keys is n lookups, a delete_range of n entries n deletes),
+   the rest count events in the structure of the tree. With BTREE_BUFFERED, inserts and
+   deletes are counted when the buffered writes reach the leaves.
+*/
+typedef struct {
+    uint64_t lookups;
+    uint64_t inserts;
+    uint64_t deletes;
+    uint64_t leaf_splits;
+    uint64_t inner_splits;
+    uint64_t leaf_borrows;
+    uint64_t inner_borrows;
+    uint64_t leaf_merges;
+    uint64_t inner_merges;
+    uint64_t root_grows;
+    uint64_t root_shrinks;
+} btree_counters_t;
+
+/* Latency histograms kept with BTREE_STATS_LATENCY, in ticks of the CPU's timestamp
+   counter (see btree_ticks). Bucket i counts the calls that took [2^(i-1), 2^i) ticks,
+   bucket 0 the ones that took none.
+*/
+#define BTREE_LATENCY_BUCKETS 64
+
+typedef struct {
+    uint64_t lookup[BTREE_LATENCY_BUCKETS];
+    uint64_t insert[BTREE_LATENCY_BUCKETS];
+    uint64_t remove[BTREE_LATENCY_BUCKETS];
+} btree_latency_t;
+
+#define BTREE_FILL_BUCKETS 10
+
+typedef struct {
+    // zero unless the tree was compiled with BTREE_STATS / BTREE_STATS_LATENCY
+    btree_counters_t counters;
+    btree_latency_t latency;
+    // number of levels, 1 for a tree that is a single leaf
+    size_t height;
+    size_t entries;
+    size_t leaves;
+    size_t inner_nodes;
+    // nodes at each height, leaves at 0
+    size_t nodes_per_level[BTREE_MAX_HEIGHT];
+    // nodes by degree / max degree in steps of 1/BTREE_FILL_BUCKETS, full nodes in the last bucket
+    size_t fill_histogram[BTREE_FILL_BUCKETS + 1];
+    // entries and children over the capacity of all the nodes
+    double fill_factor;
+    // memory taken by the nodes reachable from the root, and their message buffers
+    size_t bytes_used;
+    // writes waiting in the buffers of a BTREE_BUFFERED tree
+    size_t messages;
+} btree_stats_t;
+
+// the kinds of write a BTREE_BUFFERED tree keeps in its buffers, see put and erase
+typedef enum {
+    BTREE_MESSAGE_INSERT,
+    BTREE_MESSAGE_UPSERT,
+    BTREE_MESSAGE_DELETE
+} btree_message_op_t;
+
+static inline uint64_t btree_ticks(void) {
+    // a cheap, monotonic (per core) timestamp, 0 where there is none
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return 0;
+#endif
+}
+
+static inline size_t btree_latency_bucket(uint64_t start) {
+    // histogram bucket for a call that started at start
+    uint64_t ticks = btree_ticks() - start;
+    // start can be from another core whose counter is ahead, count that as no time
+    if (ticks == 0 || ticks >= (UINT64_C(1) << 63)) return 0;
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)(64 - __builtin_clzll(ticks));
+#else
+    size_t bucket = 0;
+    while ((ticks >> bucket) > 0) bucket++;
+    return bucket;
+#endif
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BTREE_PREFETCH(addr) __builtin_prefetch((addr), 0, 3)
+#else
+#define BTREE_PREFETCH(addr) ((void)(addr))
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#define BTREE_SIMD_AVAILABLE
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+
+#ifndef BTREE_SIMD_SEARCH_BLOCK
+#define BTREE_SIMD_SEARCH_BLOCK 32
+#endif
+
+/* Count the keys in a[0..n) that are less than key (or less than or equal to key
+   if or_equal is set), n / (vector width) compares at a time and no branches on the keys.
+
+   The SSE/AVX integer compares are signed only, so unsigned keys are passed
+   with flip set to the sign bit, which maps the unsigned order onto the signed one.
+*/
+static inline size_t btree_simd_count_less_32(const uint32_t *a, size_t n, uint32_t key, uint32_t flip, bool or_equal) {
+    int32_t k = (int32_t)(key ^ flip);
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i key8 = _mm256_set1_epi32(k);
+    __m256i flip8 = _mm256_set1_epi32((int32_t)flip);
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)), flip8);
+        // with or_equal count the keys > key and subtract at the end
+        __m256i cmp = or_equal ? _mm256_cmpgt_epi32(v, key8) : _mm256_cmpgt_epi32(key8, v);
+        count += (size_t)__builtin_popcount((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(cmp)));
+    }
+#endif
+    __m128i key4 = _mm_set1_epi32(k);
+    __m128i flip4 = _mm_set1_epi32((int32_t)flip);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)), flip4);
+        __m128i cmp = or_equal ? _mm_cmpgt_epi32(v, key4) : _mm_cmpgt_epi32(key4, v);
+        count += (size_t)__builtin_popcount((unsigned)_mm_movemask_ps(_mm_castsi128_ps(cmp)));
+    }
+    for (; i < n; i++) {
+        int32_t v = (int32_t)(a[i] ^ flip);
+        count += or_equal ? (v > k) : (k > v);
+    }
+    return or_equal ? n - count : count;
+}
+
+static inline size_t btree_simd_count_less_64(const uint64_t *a, size_t n, uint64_t key, uint64_t flip, bool or_equal) {
+    int64_t k = (int64_t)(key ^ flip);
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i key4 = _mm256_set1_epi64x(k);
+    __m256i flip4 = _mm256_set1_epi64x((int64_t)flip);
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)), flip4);
+        __m256i cmp = or_equal ? _mm256_cmpgt_epi64(v, key4) : _mm256_cmpgt_epi64(key4, v);
+        count += (size_t)__builtin_popcount((unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(cmp)));
+    }
+#elif defined(__SSE4_2__)
+    __m128i key2 = _mm_set1_epi64x(k);
+    __m128i flip2 = _mm_set1_epi64x((int64_t)flip);
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)), flip2);
+        __m128i cmp = or_equal ? _mm_cmpgt_epi64(v, key2) : _mm_cmpgt_epi64(key2, v);
+        count += (size_t)__builtin_popcount((unsigned)_mm_movemask_pd(_mm_castsi128_pd(cmp)));
+    }
+#endif
+    // SSE2 has no 64-bit compare, the rest is a branchless scalar count
+    for (; i < n; i++) {
+        int64_t v = (int64_t)(a[i] ^ flip);
+        count += or_equal ? (v > k) : (k > v);
+    }
+    return or_equal ? n - count : count;
+}
+#endif
 
 #endif // BTREE_H
 
+#if defined(BTREE_CONCURRENT) && !defined(BTREE_CONCURRENT_H)
+#define BTREE_CONCURRENT_H
+
+#include <pthread.h>
+
+#ifndef BTREE_CACHE_LINE_SIZE
+#define BTREE_CACHE_LINE_SIZE 64
+#endif
+
+#ifndef BTREE_EPOCH_STRIPES
+#define BTREE_EPOCH_STRIPES 16
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BTREE_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define BTREE_CPU_RELAX() ((void)0)
+#endif
+
+/* Node versions for optimistic lock coupling. The version is bumped on every unlock,
+   so a reader that sees the same unlocked version before and after reading a node
+   knows that nothing changed in between.
+*/
+#define BTREE_VERSION_OBSOLETE UINT64_C(1)
+#define BTREE_VERSION_LOCKED UINT64_C(2)
+
+// most nodes a single write can lock: the leaf, plus a parent and a sibling per level
+#define BTREE_LOCK_SET_SIZE (2 * BTREE_MAX_HEIGHT + 2)
+
+/* Epoch-based reclamation. Readers register in the current epoch (one of three counters,
+   striped over cache lines by thread so they don't all contend on one line) for the
+   duration of an operation. A writer only moves the epoch forward once nobody is left
+   in the previous one, so a node retired in epoch e can no longer be reached by anyone
+   once the epoch reaches e + 2 and can go back to the memory pool.
+*/
+typedef struct {
+    uint64_t count;
+    char padding[BTREE_CACHE_LINE_SIZE - sizeof(uint64_t)];
+} btree_epoch_counter_t;
+
+typedef struct {
+    uint64_t global;
+    char padding[BTREE_CACHE_LINE_SIZE - sizeof(uint64_t)];
+    btree_epoch_counter_t active[3][BTREE_EPOCH_STRIPES];
+} btree_epoch_t;
+
+static uint64_t btree_epoch_next_stripe = 0;
+static __thread size_t btree_epoch_thread_stripe = SIZE_MAX;
+
+static inline size_t btree_epoch_stripe(void) {
+    if (btree_epoch_thread_stripe == SIZE_MAX) {
+        btree_epoch_thread_stripe = (size_t)(__atomic_fetch_add(&btree_epoch_next_stripe, 1, __ATOMIC_RELAXED) % BTREE_EPOCH_STRIPES);
+    }
+    return btree_epoch_thread_stripe;
+}
+
+static inline uint64_t *btree_epoch_enter(btree_epoch_t *epoch) {
+    // returns the counter to pass to btree_epoch_exit
+    size_t stripe = btree_epoch_stripe();
+    while (true) {
+        uint64_t e = __atomic_load_n(&epoch->global, __ATOMIC_SEQ_CST);
+        uint64_t *count = &epoch->active[e % 3][stripe].count;
+        __atomic_fetch_add(count, 1, __ATOMIC_SEQ_CST);
+        // if the epoch moved on in the meantime, the counter may belong to a later epoch
+        if (__atomic_load_n(&epoch->global, __ATOMIC_SEQ_CST) == e) return count;
+        __atomic_fetch_sub(count, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void btree_epoch_exit(uint64_t *count) {
+    __atomic_fetch_sub(count, 1, __ATOMIC_RELEASE);
+}
+
+static inline bool btree_epoch_try_advance(btree_epoch_t *epoch, uint64_t *new_epoch) {
+    // only one thread at a time may advance the epoch
+    uint64_t e = __atomic_load_n(&epoch->global, __ATOMIC_SEQ_CST);
+    size_t previous = (size_t)((e + 2) % 3);
+    for (size_t i = 0; i < BTREE_EPOCH_STRIPES; i++) {
+        if (__atomic_load_n(&epoch->active[previous][i].count, __ATOMIC_SEQ_CST) != 0) return false;
+    }
+    __atomic_store_n(&epoch->global, e + 1, __ATOMIC_SEQ_CST);
+    *new_epoch = e + 1;
+    return true;
+}
+
+#endif
+
 #ifndef BTREE_NAME
 #error "Must define BTREE_NAME"
 #endif
@@ -24,11 +337,34 @@
 #define BTREE_TYPED(name) BTREE_CONCAT(BTREE_NAME, _##name)
 #define BTREE_FUNC(func) BTREE_CONCAT(BTREE_NAME, _##func)
 
+/*
+Values are stored inline in the leaves. By default they are void pointers,
+define BTREE_VALUE_TYPE to store e.g. a uint64_t or a small struct directly.
+
+BTREE_VALUE_NULL is what get/delete return when the key is not found
+(NULL for pointers, all zeros for other types). Where that is also a valid value,
+use get_ptr/remove, which report a missing key separately.
+*/
+#ifndef BTREE_VALUE_TYPE
+#define BTREE_VALUE_TYPE void *
+#define BTREE_VALUE_TYPE_DEFINED
+#endif
+
+#ifndef BTREE_VALUE_NULL
+#ifdef BTREE_VALUE_TYPE_DEFINED
+#define BTREE_VALUE_NULL NULL
+#else
+#define BTREE_VALUE_NULL ((BTREE_VALUE_TYPE){0})
+#endif
+#define BTREE_VALUE_NULL_DEFINED
+#endif
+
 #ifndef BTREE_KEY_LESS_THAN
 static inline bool BTREE_FUNC(key_less_than)(BTREE_KEY_TYPE key, BTREE_KEY_TYPE node_key) {
     return key < node_key;
 }
 #define BTREE_KEY_LESS_THAN BTREE_FUNC(key_less_than)
+#define BTREE_KEY_LESS_THAN_DEFINED
 #endif
 
 #ifndef BTREE_KEY_EQUALS
@@ -36,6 +372,65 @@ static inline bool BTREE_FUNC(key_equals)(BTREE_KEY_TYPE key, BTREE_KEY_TYPE nod
     return key == node_key;
 }
 #define BTREE_KEY_EQUALS BTREE_FUNC(key_equals)
+#define BTREE_KEY_EQUALS_DEFINED
+#endif
+
+#if defined(BTREE_CONCURRENT) && defined(BTREE_SNAPSHOTS)
+#error "BTREE_CONCURRENT and BTREE_SNAPSHOTS can't be used together"
+#endif
+
+#if defined(BTREE_CONCURRENT) && defined(BTREE_ORDER_STATISTICS)
+#error "BTREE_ORDER_STATISTICS can't be used with BTREE_CONCURRENT, whose inserts and deletes only lock the leaf"
+#endif
+
+#if defined(BTREE_STATS_LATENCY) && !defined(BTREE_STATS)
+#error "BTREE_STATS_LATENCY needs BTREE_STATS"
+#endif
+
+#if defined(BTREE_BUFFERED) && (defined(BTREE_CONCURRENT) || defined(BTREE_SNAPSHOTS) || defined(BTREE_ORDER_STATISTICS))
+#error "BTREE_BUFFERED can't be used with BTREE_CONCURRENT, BTREE_SNAPSHOTS or BTREE_ORDER_STATISTICS"
+#endif
+
+/* Inserts at or above the last key go straight to the rightmost leaf (see append_to_last_leaf),
+   unless BTREE_NO_APPEND_FAST_PATH is defined. Snapshots share leaves between trees and
+   concurrent writers would race on the cached leaf, so those modes always descend.
+   Buffered writes don't go to the leaves directly at all.
+*/
+#if !defined(BTREE_CONCURRENT) && !defined(BTREE_SNAPSHOTS) && !defined(BTREE_BUFFERED) && !defined(BTREE_NO_APPEND_FAST_PATH)
+#define BTREE_APPEND_FAST_PATH
+#endif
+
+/*
+With BTREE_BUFFERED, writes are buffered on their way down the tree, as in a B-epsilon tree.
+insert, put and erase (and upsert and remove, after reading the key) add a message to the
+root's buffer instead of going to a leaf. Once a buffer would hold more than BTREE_BUFFER_SIZE
+messages, the ones bound for the child with the most of them move down into that child's
+buffer in one go, or if the child is a leaf, are merged into it together. A leaf is then
+reached once for all of the writes that arrive with it rather than once for each, at the
+cost of gets searching the buffers on their way down. Running out of memory on the way
+never drops a message, it stays buffered, and a single write that returns false wasn't made.
+
+The fewer children an inner node has, the more messages go down to each at a time, so
+buffered trees do best with a BTREE_INNER_MAX_DEGREE well below the leaves'. Cursors, range
+deletes, split_at, join, freeze and compact apply every buffered write first (see flush).
+*/
+#if defined(BTREE_BUFFERED) && !defined(BTREE_BUFFER_SIZE)
+#define BTREE_BUFFER_SIZE (4 * BTREE_INNER_MAX_DEGREE)
+#define BTREE_BUFFER_SIZE_DEFINED
+#endif
+
+/*
+BTREE_PARALLEL adds parallel_bulk_load and parallel_scan, which split their work over
+pthreads (link with -pthread). A thread only gets a part of a bulk load if there are at least
+BTREE_PARALLEL_MIN_ENTRIES entries for it, starting a thread costs more than copying fewer.
+*/
+#ifdef BTREE_PARALLEL
+#include <pthread.h>
+#endif
+
+#if defined(BTREE_PARALLEL) && !defined(BTREE_PARALLEL_MIN_ENTRIES)
+#define BTREE_PARALLEL_MIN_ENTRIES 16384
+#define BTREE_PARALLEL_MIN_ENTRIES_DEFINED
 #endif
 
 #ifndef BTREE_NODE_MAX_DEGREE
@@ -43,9 +438,111 @@ static inline bool BTREE_FUNC(key_equals)(BTREE_KEY_TYPE key, BTREE_KEY_TYPE nod
 #define BTREE_NODE_MAX_DEGREE_DEFINED
 #endif
 
-#ifndef BTREE_NODE_MIN_DEGREE
-#define BTREE_NODE_MIN_DEGREE ((BTREE_NODE_MAX_DEGREE) / 2)
-#define BTREE_NODE_MIN_DEGREE_DEFINED
+/*
+Leaves and inner nodes have separate fanouts, BTREE_LEAF_MAX_DEGREE and BTREE_INNER_MAX_DEGREE,
+which both default to BTREE_NODE_MAX_DEGREE. Leaves hold values and inner nodes hold child
+pointers, so the same degree gives them different sizes.
+
+Instead of a degree, BTREE_LEAF_NODE_SIZE and BTREE_INNER_NODE_SIZE (or BTREE_NODE_SIZE for
+both) can give a target node size in bytes, e.g. 256, 4096 or (2 << 20). The degree is then
+the largest one for which the node fits in that size with the key and value types, and those
+nodes are allocated aligned to BTREE_NODE_ALIGNMENT bytes, by default a cache line for nodes
+smaller than a page and a page for the rest. BTREE_NODE_ALIGNMENT can also be set on its own
+to align nodes of a given degree.
+
+The minimum degrees default to half of the maximums, or to BTREE_NODE_MIN_DEGREE for both.
+
+With BTREE_ALLOCATOR, a tree made with new_with_allocator takes all of its memory (nodes,
+pools and the tree itself) from a btree_allocator_t, e.g. the huge page arena in
+btree_allocator.h. Nodes then come from aligned pools, to a cache line unless aligned otherwise.
+*/
+#ifdef BTREE_NODE_SIZE
+#ifndef BTREE_LEAF_NODE_SIZE
+#define BTREE_LEAF_NODE_SIZE BTREE_NODE_SIZE
+#define BTREE_LEAF_NODE_SIZE_DEFINED
+#endif
+#ifndef BTREE_INNER_NODE_SIZE
+#define BTREE_INNER_NODE_SIZE BTREE_NODE_SIZE
+#define BTREE_INNER_NODE_SIZE_DEFINED
+#endif
+#endif
+
+/* The sized degrees leave room for the header, the leaf links and the most padding there can
+   be between the arrays, so a node may come out an entry or two short of its size.
+*/
+#ifndef BTREE_LEAF_MAX_DEGREE
+#ifdef BTREE_LEAF_NODE_SIZE
+#define BTREE_LEAF_MAX_DEGREE \
+    (((BTREE_LEAF_NODE_SIZE) - sizeof(BTREE_TYPED(node_t)) - 3 * sizeof(void *)) / (sizeof(BTREE_KEY_TYPE) + sizeof(BTREE_VALUE_TYPE)) - 1)
+#else
+#define BTREE_LEAF_MAX_DEGREE BTREE_NODE_MAX_DEGREE
+#endif
+#define BTREE_LEAF_MAX_DEGREE_DEFINED
+#endif
+
+#ifndef BTREE_INNER_MAX_DEGREE
+#ifdef BTREE_INNER_NODE_SIZE
+#ifdef BTREE_BUFFERED
+// the message buffer's pointer and counts
+#define BTREE_INNER_HEADER_SIZE (sizeof(BTREE_TYPED(node_t)) + sizeof(void *) + 2 * sizeof(uint32_t))
+#else
+#define BTREE_INNER_HEADER_SIZE sizeof(BTREE_TYPED(node_t))
+#endif
+#ifdef BTREE_ORDER_STATISTICS
+#define BTREE_INNER_ENTRY_SIZE (sizeof(BTREE_KEY_TYPE) + sizeof(void *) + sizeof(size_t))
+#else
+#define BTREE_INNER_ENTRY_SIZE (sizeof(BTREE_KEY_TYPE) + sizeof(void *))
+#endif
+#define BTREE_INNER_MAX_DEGREE \
+    (((BTREE_INNER_NODE_SIZE) - BTREE_INNER_HEADER_SIZE - sizeof(BTREE_KEY_TYPE) - sizeof(void *)) / BTREE_INNER_ENTRY_SIZE)
+#else
+#define BTREE_INNER_MAX_DEGREE BTREE_NODE_MAX_DEGREE
+#endif
+#define BTREE_INNER_MAX_DEGREE_DEFINED
+#endif
+
+#ifndef BTREE_LEAF_MIN_DEGREE
+#ifdef BTREE_NODE_MIN_DEGREE
+#define BTREE_LEAF_MIN_DEGREE BTREE_NODE_MIN_DEGREE
+#else
+#define BTREE_LEAF_MIN_DEGREE ((BTREE_LEAF_MAX_DEGREE) / 2)
+#endif
+#define BTREE_LEAF_MIN_DEGREE_DEFINED
+#endif
+
+#ifndef BTREE_INNER_MIN_DEGREE
+#ifdef BTREE_NODE_MIN_DEGREE
+#define BTREE_INNER_MIN_DEGREE BTREE_NODE_MIN_DEGREE
+#else
+#define BTREE_INNER_MIN_DEGREE ((BTREE_INNER_MAX_DEGREE) / 2)
+#endif
+#define BTREE_INNER_MIN_DEGREE_DEFINED
+#endif
+
+#ifndef BTREE_LEAF_NODE_ALIGNMENT
+#if defined(BTREE_NODE_ALIGNMENT)
+#define BTREE_LEAF_NODE_ALIGNMENT BTREE_NODE_ALIGNMENT
+#define BTREE_LEAF_NODE_ALIGNMENT_DEFINED
+#elif defined(BTREE_LEAF_NODE_SIZE)
+#define BTREE_LEAF_NODE_ALIGNMENT ((BTREE_LEAF_NODE_SIZE) < BTREE_PAGE_SIZE ? BTREE_CACHE_LINE_SIZE : BTREE_PAGE_SIZE)
+#define BTREE_LEAF_NODE_ALIGNMENT_DEFINED
+#elif defined(BTREE_ALLOCATOR)
+#define BTREE_LEAF_NODE_ALIGNMENT BTREE_CACHE_LINE_SIZE
+#define BTREE_LEAF_NODE_ALIGNMENT_DEFINED
+#endif
+#endif
+
+#ifndef BTREE_INNER_NODE_ALIGNMENT
+#if defined(BTREE_NODE_ALIGNMENT)
+#define BTREE_INNER_NODE_ALIGNMENT BTREE_NODE_ALIGNMENT
+#define BTREE_INNER_NODE_ALIGNMENT_DEFINED
+#elif defined(BTREE_INNER_NODE_SIZE)
+#define BTREE_INNER_NODE_ALIGNMENT ((BTREE_INNER_NODE_SIZE) < BTREE_PAGE_SIZE ? BTREE_CACHE_LINE_SIZE : BTREE_PAGE_SIZE)
+#define BTREE_INNER_NODE_ALIGNMENT_DEFINED
+#elif defined(BTREE_ALLOCATOR)
+#define BTREE_INNER_NODE_ALIGNMENT BTREE_CACHE_LINE_SIZE
+#define BTREE_INNER_NODE_ALIGNMENT_DEFINED
+#endif
 #endif
 
 /*
@@ -62,442 +559,5077 @@ At the inner nodes (height > 0)
 
 Howver, at the leaf level (height = 0)
     - keys are the search keys
-    - children are the values
+    - values are the values
 
-Therefore we use the same number of keys and children throughout all the nodes
+Therefore we use the same number of keys and children/values throughout all the nodes
 in contrast to the traditional B-tree where nodes have one fewer keys than children, forming separators.
+
+Leaves and inner nodes are separate structs from separate memory pools, so that neither
+carries an array it doesn't use. Both start with the same BTREE_NODE header, which is
+what the tree and the children arrays point to, and the height in the header tells
+which of the two a node is.
+
+The leaves are also chained together in key order through prev/next, so that a range
+scan can walk from one leaf to the next without going back through the inner nodes.
+Those links are NULL at either end of the chain.
+
+With BTREE_SNAPSHOTS, nodes are reference counted and can be shared between a tree and its
+snapshots (see snapshot below). A shared leaf would need different neighbors in each tree,
+so there are no leaf links in that mode and cursors go back up through the inner nodes.
+
+With BTREE_ORDER_STATISTICS, inner nodes also store the number of entries under each child,
+which every write keeps up to date, so that rank, select and count_range take O(log n).
+
+With BTREE_BUFFERED, inner nodes also hold a buffer of writes that haven't been applied to
+the leaves below them yet. A message for key belongs to the child that key would go to,
+and moves with that child when nodes split, borrow or merge.
 */
 typedef struct BTREE_TYPED(node) {
-    uint16_t degree;
+#ifdef BTREE_CONCURRENT
+    uint64_t version;
+#endif
+    uint32_t degree;
     uint16_t height;
-    BTREE_KEY_TYPE keys[BTREE_NODE_MAX_DEGREE];
-    struct BTREE_TYPED(node) *children[BTREE_NODE_MAX_DEGREE];
+#ifdef BTREE_SNAPSHOTS
+    // number of parents (and roots) referencing the node
+    uint32_t refcount;
+#endif
 } BTREE_TYPED(node_t);
 
 #define BTREE_NODE BTREE_TYPED(node_t)
 
-#define BTREE_NODE_MEMORY_POOL_NAME BTREE_TYPED(node_memory_pool)
+typedef struct BTREE_TYPED(leaf_node) {
+    BTREE_NODE node;
+    BTREE_KEY_TYPE keys[BTREE_LEAF_MAX_DEGREE];
+    BTREE_VALUE_TYPE values[BTREE_LEAF_MAX_DEGREE];
+#ifndef BTREE_SNAPSHOTS
+    struct BTREE_TYPED(leaf_node) *prev;
+    struct BTREE_TYPED(leaf_node) *next;
+#endif
+} BTREE_TYPED(leaf_node_t);
+
+#define BTREE_LEAF_NODE BTREE_TYPED(leaf_node_t)
+
+#ifdef BTREE_BUFFERED
+typedef struct {
+    BTREE_KEY_TYPE key;
+    // unused for BTREE_MESSAGE_DELETE
+    BTREE_VALUE_TYPE value;
+    // a btree_message_op_t
+    uint8_t op;
+} BTREE_TYPED(message_t);
+
+#define BTREE_MESSAGE BTREE_TYPED(message_t)
+#endif
+
+typedef struct BTREE_TYPED(inner_node) {
+    BTREE_NODE node;
+#ifdef BTREE_BUFFERED
+    // writes not yet applied below this node, sorted by key and oldest first among equal keys
+    BTREE_MESSAGE *messages;
+    uint32_t num_messages;
+    uint32_t messages_capacity;
+#endif
+    BTREE_KEY_TYPE keys[BTREE_INNER_MAX_DEGREE];
+    BTREE_NODE *children[BTREE_INNER_MAX_DEGREE];
+#ifdef BTREE_ORDER_STATISTICS
+    // number of entries in the subtree under each child
+    size_t counts[BTREE_INNER_MAX_DEGREE];
+#endif
+} BTREE_TYPED(inner_node_t);
+
+#define BTREE_INNER_NODE BTREE_TYPED(inner_node_t)
+
+// sized nodes must fit their size, and every degree must leave room to split and merge
+typedef char BTREE_TYPED(leaf_degree_check)[BTREE_LEAF_MAX_DEGREE >= 4 && BTREE_LEAF_MIN_DEGREE <= BTREE_LEAF_MAX_DEGREE / 2 ? 1 : -1];
+typedef char BTREE_TYPED(inner_degree_check)[BTREE_INNER_MAX_DEGREE >= 4 && BTREE_INNER_MIN_DEGREE <= BTREE_INNER_MAX_DEGREE / 2 ? 1 : -1];
+#ifdef BTREE_LEAF_NODE_SIZE
+typedef char BTREE_TYPED(leaf_size_check)[sizeof(BTREE_LEAF_NODE) <= (BTREE_LEAF_NODE_SIZE) ? 1 : -1];
+#endif
+#ifdef BTREE_INNER_NODE_SIZE
+typedef char BTREE_TYPED(inner_size_check)[sizeof(BTREE_INNER_NODE) <= (BTREE_INNER_NODE_SIZE) ? 1 : -1];
+#endif
+
+#define BTREE_AS_LEAF(n) ((BTREE_LEAF_NODE *)(n))
+#define BTREE_AS_INNER(n) ((BTREE_INNER_NODE *)(n))
+
+#define BTREE_LEAF_MEMORY_POOL_NAME BTREE_TYPED(leaf_memory_pool)
+
+#define MEMORY_POOL_NAME BTREE_LEAF_MEMORY_POOL_NAME
+#define MEMORY_POOL_TYPE BTREE_LEAF_NODE
+#ifdef BTREE_LEAF_NODE_ALIGNMENT
+#define MEMORY_POOL_ALIGNMENT BTREE_LEAF_NODE_ALIGNMENT
+#include "btree_aligned_pool.h"
+#undef MEMORY_POOL_ALIGNMENT
+#else
+#include "memory_pool/memory_pool.h"
+#endif
+#undef MEMORY_POOL_NAME
+#undef MEMORY_POOL_TYPE
+
+#define BTREE_LEAF_MEMORY_POOL_FUNC(name) BTREE_CONCAT(BTREE_LEAF_MEMORY_POOL_NAME, _##name)
 
-#define MEMORY_POOL_NAME BTREE_NODE_MEMORY_POOL_NAME
-#define MEMORY_POOL_TYPE BTREE_NODE
+#define BTREE_INNER_MEMORY_POOL_NAME BTREE_TYPED(inner_memory_pool)
+
+#define MEMORY_POOL_NAME BTREE_INNER_MEMORY_POOL_NAME
+#define MEMORY_POOL_TYPE BTREE_INNER_NODE
+#ifdef BTREE_INNER_NODE_ALIGNMENT
+#define MEMORY_POOL_ALIGNMENT BTREE_INNER_NODE_ALIGNMENT
+#include "btree_aligned_pool.h"
+#undef MEMORY_POOL_ALIGNMENT
+#else
 #include "memory_pool/memory_pool.h"
+#endif
 #undef MEMORY_POOL_NAME
 #undef MEMORY_POOL_TYPE
 
-#define BTREE_NODE_MEMORY_POOL_FUNC(name) BTREE_CONCAT(BTREE_NODE_MEMORY_POOL_NAME, _##name)
+#define BTREE_INNER_MEMORY_POOL_FUNC(name) BTREE_CONCAT(BTREE_INNER_MEMORY_POOL_NAME, _##name)
 
 typedef struct {
     BTREE_TYPED(node_t) *root;
-    BTREE_TYPED(node_memory_pool) *pool;
+    BTREE_TYPED(leaf_memory_pool) *leaf_pool;
+    BTREE_TYPED(inner_memory_pool) *inner_pool;
+    // number of trees sharing the memory pools (a tree with its snapshots, or split from it)
+    size_t *pool_users;
+#ifdef BTREE_ALLOCATOR
+    btree_allocator_t allocator;
+#endif
+#ifdef BTREE_CONCURRENT
+    // taken by writers that split, merge or borrow between nodes
+    pthread_mutex_t write_mutex;
+    btree_epoch_t epoch;
+    // nodes removed from the tree in each of the last three epochs
+    BTREE_NODE **retired[3];
+    size_t num_retired[3];
+    size_t retired_capacity[3];
+    // nodes locked by the write holding write_mutex
+    BTREE_NODE *locked[BTREE_LOCK_SET_SIZE];
+    size_t num_locked;
+#endif
+#ifdef BTREE_APPEND_FAST_PATH
+    // the rightmost leaf as of the last insert that reached it, NULL once it's released
+    BTREE_TYPED(leaf_node_t) *last_leaf;
+#endif
+    // where the next compact_step carries on, if a pass over the tree is under way
+    BTREE_KEY_TYPE compact_key;
+    bool compact_pending;
+#ifdef BTREE_BUFFERED
+    // messages in all of the buffers, so that a flush with none left doesn't walk the tree
+    size_t num_messages;
+#endif
+#ifdef BTREE_STATS
+    btree_counters_t counters;
+#endif
+#ifdef BTREE_STATS_LATENCY
+    btree_latency_t latency;
+#endif
 } BTREE_NAME;
 
-BTREE_NAME *BTREE_FUNC(new)(void) {
-    BTREE_NAME *tree = calloc(1, sizeof(BTREE_NAME));
-    if (tree == NULL) return NULL;
-    tree->pool = BTREE_NODE_MEMORY_POOL_FUNC(new)();
-    if (tree->pool == NULL) {
-        free(tree);
-        return NULL;
-    }
-    BTREE_NODE *root = BTREE_NODE_MEMORY_POOL_FUNC(get)(tree->pool);
-    if (root == NULL) {
-        BTREE_NODE_MEMORY_POOL_FUNC(destroy)(tree->pool);
-        free(tree);
-        return NULL;
-    }
-    root->height = 0;
-    root->degree = 0;
-    tree->root = root;
-    return tree;
-}
+/* With BTREE_STATS, BTREE_STAT_ADD adds n to one of the tree's counters, and with
+   BTREE_STATS_LATENCY, BTREE_LATENCY_RECORD adds a call timed from BTREE_LATENCY_START
+   to one of its histograms. Without them they compile away. Concurrent trees update
+   them atomically, since readers and optimistic writers don't hold the write mutex.
+*/
+#ifdef BTREE_STATS
+#ifdef BTREE_CONCURRENT
+#define BTREE_STAT_ADD(tree, counter, n) __atomic_fetch_add(&(tree)->counters.counter, (uint64_t)(n), __ATOMIC_RELAXED)
+#else
+#define BTREE_STAT_ADD(tree, counter, n) ((tree)->counters.counter += (uint64_t)(n))
+#endif
+#else
+#define BTREE_STAT_ADD(tree, counter, n) ((void)0)
+#endif
 
-void BTREE_FUNC(destroy)(BTREE_NAME *tree) {
-    if (tree == NULL) return;
-    if (tree->pool != NULL) {
-        BTREE_NODE_MEMORY_POOL_FUNC(destroy)(tree->pool);
-    }
-    free(tree);
-}
+#ifdef BTREE_STATS_LATENCY
+#define BTREE_LATENCY_START() btree_ticks()
+#ifdef BTREE_CONCURRENT
+#define BTREE_LATENCY_RECORD(tree, op, start) \
+    __atomic_fetch_add(&(tree)->latency.op[btree_latency_bucket(start)], 1, __ATOMIC_RELAXED)
+#else
+#define BTREE_LATENCY_RECORD(tree, op, start) ((tree)->latency.op[btree_latency_bucket(start)]++)
+#endif
+#else
+#define BTREE_LATENCY_START() UINT64_C(0)
+#define BTREE_LATENCY_RECORD(tree, op, start) ((void)(start))
+#endif
 
+static inline void *BTREE_FUNC(memory_calloc)(BTREE_NAME *tree, size_t size) {
+    // memory for the tree struct and its bookkeeping, from the tree's allocator if it has one
+#ifdef BTREE_ALLOCATOR
+    return btree_allocator_calloc(&tree->allocator, size);
+#else
+    (void)tree;
+    return calloc(1, size);
+#endif
+}
 
-static inline size_t BTREE_FUNC(binary_search_node)(BTREE_NODE *node, BTREE_KEY_TYPE key) {
-    /* Standard binary search, but in the case of a B-tree it tells us
-       the index of the node the search key fits between/before/after.
+static inline void *BTREE_FUNC(memory_alloc)(BTREE_NAME *tree, size_t size) {
+    // same as memory_calloc without zeroing
+#ifdef BTREE_ALLOCATOR
+    return tree->allocator.alloc(tree->allocator.context, size, BTREE_ALLOCATOR_MIN_ALIGNMENT);
+#else
+    (void)tree;
+    return malloc(size);
+#endif
+}
 
-       For node->keys[1] through node->keys[degree - 2], it's sort of like The Price Is Right.
-       Return the index that is closest to the search value without going over.
+static inline void BTREE_FUNC(memory_free)(BTREE_NAME *tree, void *ptr, size_t size) {
+#ifdef BTREE_ALLOCATOR
+    btree_allocator_free(&tree->allocator, ptr, size);
+#else
+    (void)tree;
+    (void)size;
+    free(ptr);
+#endif
+}
 
-       For the leftmost key i.e. node->keys[0], we know that the search key is less than node->keys[1]
-       but it may be less than node->keys[0]. Either way the key goes to the leftmost child.
+static inline BTREE_LEAF_NODE *BTREE_FUNC(leaf_node_new)(BTREE_NAME *tree) {
+    BTREE_LEAF_NODE *leaf = BTREE_LEAF_MEMORY_POOL_FUNC(get)(tree->leaf_pool);
+    if (leaf == NULL) return NULL;
+#ifdef BTREE_CONCURRENT
+    leaf->node.version = 0;
+#endif
+    leaf->node.degree = 0;
+    leaf->node.height = 0;
+#ifdef BTREE_SNAPSHOTS
+    leaf->node.refcount = 1;
+#else
+    leaf->prev = NULL;
+    leaf->next = NULL;
+#endif
+    return leaf;
+}
 
-       For the rightmost key i.e. node->keys[degree - 1], the search key is greater than or equal to
-       that rightmost key.
+static inline BTREE_INNER_NODE *BTREE_FUNC(inner_node_new)(BTREE_NAME *tree, uint16_t height) {
+    BTREE_INNER_NODE *inner = BTREE_INNER_MEMORY_POOL_FUNC(get)(tree->inner_pool);
+    if (inner == NULL) return NULL;
+#ifdef BTREE_CONCURRENT
+    inner->node.version = 0;
+#endif
+    inner->node.degree = 0;
+    inner->node.height = height;
+#ifdef BTREE_SNAPSHOTS
+    inner->node.refcount = 1;
+#endif
+#ifdef BTREE_BUFFERED
+    inner->messages = NULL;
+    inner->num_messages = 0;
+    inner->messages_capacity = 0;
+#endif
+    return inner;
+}
 
-       For the following set of keys:
-           [1, 2, 4, 6, 8]
+#ifdef BTREE_BUFFERED
+static inline void BTREE_FUNC(messages_free)(BTREE_NAME *tree, BTREE_INNER_NODE *inner) {
+    BTREE_FUNC(memory_free)(tree, inner->messages, inner->messages_capacity * sizeof(BTREE_MESSAGE));
+    inner->messages = NULL;
+    inner->num_messages = 0;
+    inner->messages_capacity = 0;
+}
+#endif
 
-       a search for 0 would return 0 (in the interval < 2)
-       a search for 1 would return 0 (in the interval < 2)
-       a search for 2 would return 1 (in the interval 2-4)
-       a search for 3 would return 1 (in the interval 2-4)
-       ...
-       a search for 8 would return 4 (in the interval >= 8)
-       a search for 10 would return 4 (in the interval >= 8)
-    */
-    size_t lo = 0;
-    size_t hi = (size_t)node->degree;
-    while (lo + 1 < hi) {
-        size_t mid = (lo + hi) / 2;
-        if (BTREE_KEY_LESS_THAN(key, node->keys[mid])) {
-            hi = mid;
-        } else {
-            lo = mid;
-        }
+static inline void BTREE_FUNC(node_release)(BTREE_NAME *tree, BTREE_NODE *node) {
+#ifdef BTREE_APPEND_FAST_PATH
+    if ((BTREE_NODE *)tree->last_leaf == node) tree->last_leaf = NULL;
+#endif
+    if (node->height > 0) {
+#ifdef BTREE_BUFFERED
+        BTREE_FUNC(messages_free)(tree, BTREE_AS_INNER(node));
+#endif
+        BTREE_INNER_MEMORY_POOL_FUNC(release)(tree->inner_pool, BTREE_AS_INNER(node));
+    } else {
+        BTREE_LEAF_MEMORY_POOL_FUNC(release)(tree->leaf_pool, BTREE_AS_LEAF(node));
     }
-    return lo;
 }
 
-void *BTREE_FUNC(get)(BTREE_NODE *node, BTREE_KEY_TYPE key) {
-    if (node == NULL) return NULL;
-    BTREE_NODE *current_node = node;
-    void *value;
-    if (current_node->degree == 0) return NULL;
-
-    while (current_node->height >= 0) {
-        size_t idx = BTREE_FUNC(binary_search_node)(current_node, key);
-        if (current_node->height > 0) {
-            current_node = current_node->children[idx];
-        } else {
-            // block of height 0 means we have leaf nodes
-            if (BTREE_KEY_EQUALS(key, current_node->keys[idx])) {
-                value = (void *)current_node->children[idx];
-            } else {
-                value = NULL;
-            }
-            return value;
-        }
-    }
-    return NULL;
+static inline BTREE_KEY_TYPE BTREE_FUNC(node_first_key)(BTREE_NODE *node) {
+    return node->height > 0 ? BTREE_AS_INNER(node)->keys[0] : BTREE_AS_LEAF(node)->keys[0];
 }
 
-bool BTREE_FUNC(insert)(BTREE_NAME *tree, BTREE_KEY_TYPE key, void *value) {
-    if (tree == NULL || tree->root == NULL) return false;
-    BTREE_NODE *root = tree->root;
-    BTREE_NODE *current_node = root;
-    bool finished = false;
-    if (root->height == 0 && root->degree == 0) {
-        root->keys[0] = key;
-        root->children[0] = (BTREE_NODE *)value;
-        root->degree = 1;
-        return true;
-    }
+static inline size_t BTREE_FUNC(node_max_degree)(BTREE_NODE *node) {
+    return node->height > 0 ? BTREE_INNER_MAX_DEGREE : BTREE_LEAF_MAX_DEGREE;
+}
 
-    size_t i = 0;
+static inline size_t BTREE_FUNC(node_min_degree)(BTREE_NODE *node) {
+    return node->height > 0 ? BTREE_INNER_MIN_DEGREE : BTREE_LEAF_MIN_DEGREE;
+}
 
+/*
+The subtree counts of BTREE_ORDER_STATISTICS are updated through the functions below,
+which do nothing without it. A write that inserts or deletes entries adds the change to the
+count of every child on its path first (path_count_add), then the nodes that split, merge or
+borrow move counts between them along with the children.
+*/
+static inline size_t BTREE_FUNC(subtree_count)(BTREE_NODE *node) {
+    // number of entries under node, O(degree) for an inner node
+#ifdef BTREE_ORDER_STATISTICS
+    if (node->height == 0) return (size_t)node->degree;
+    size_t count = 0;
+    for (size_t i = 0; i < (size_t)node->degree; i++) {
+        count += BTREE_AS_INNER(node)->counts[i];
+    }
+    return count;
+#else
+    (void)node;
+    return 0;
+#endif
+}
+
+static inline void BTREE_FUNC(count_add)(BTREE_INNER_NODE *inner, size_t i, ptrdiff_t delta) {
+#ifdef BTREE_ORDER_STATISTICS
+    inner->counts[i] += (size_t)delta;
+#else
+    (void)inner;
+    (void)i;
+    (void)delta;
+#endif
+}
+
+static inline void BTREE_FUNC(count_set)(BTREE_INNER_NODE *inner, size_t i, size_t count) {
+#ifdef BTREE_ORDER_STATISTICS
+    inner->counts[i] = count;
+#else
+    (void)inner;
+    (void)i;
+    (void)count;
+#endif
+}
+
+static inline void BTREE_FUNC(counts_move)(BTREE_INNER_NODE *dst, size_t dst_i, BTREE_INNER_NODE *src, size_t src_i, size_t n) {
+    // same as the memmove/memcpy of the children next to it, the ranges may overlap
+#ifdef BTREE_ORDER_STATISTICS
+    memmove(dst->counts + dst_i, src->counts + src_i, n * sizeof(size_t));
+#else
+    (void)dst;
+    (void)dst_i;
+    (void)src;
+    (void)src_i;
+    (void)n;
+#endif
+}
+
+static inline void BTREE_FUNC(path_count_add)(BTREE_INNER_NODE **stack, size_t *index_stack, size_t stack_size, ptrdiff_t delta) {
+    for (size_t i = 0; i < stack_size; i++) {
+        BTREE_FUNC(count_add)(stack[i], index_stack[i], delta);
+    }
+}
+
+static inline void BTREE_FUNC(leaf_link_after)(BTREE_LEAF_NODE *leaf, BTREE_LEAF_NODE *new_leaf) {
+    // add new_leaf to the leaf chain right after leaf
+#ifndef BTREE_SNAPSHOTS
+    new_leaf->prev = leaf;
+    new_leaf->next = leaf->next;
+    if (leaf->next != NULL) {
+        leaf->next->prev = new_leaf;
+    }
+    leaf->next = new_leaf;
+#else
+    (void)leaf;
+    (void)new_leaf;
+#endif
+}
+
+static inline void BTREE_FUNC(leaf_unlink)(BTREE_LEAF_NODE *leaf) {
+    // take a leaf that is being merged into its neighbor out of the leaf chain
+#ifndef BTREE_SNAPSHOTS
+    if (leaf->prev != NULL) {
+        leaf->prev->next = leaf->next;
+    }
+    if (leaf->next != NULL) {
+        leaf->next->prev = leaf->prev;
+    }
+#else
+    (void)leaf;
+#endif
+}
+
+static inline void BTREE_FUNC(leaf_chain_cut)(BTREE_LEAF_NODE *leaf) {
+    // end the leaf chain at leaf, the leaves after it start a chain of their own
+#ifndef BTREE_SNAPSHOTS
+    if (leaf->next != NULL) {
+        leaf->next->prev = NULL;
+    }
+    leaf->next = NULL;
+#else
+    (void)leaf;
+#endif
+}
+
+static inline void BTREE_FUNC(leaf_chain_join)(BTREE_LEAF_NODE *last, BTREE_LEAF_NODE *first) {
+    // continue the chain ending at last (if not NULL) with the chain starting at first
+#ifndef BTREE_SNAPSHOTS
+    if (last != NULL) {
+        last->next = first;
+    }
+    first->prev = last;
+#else
+    (void)last;
+    (void)first;
+#endif
+}
+
+static BTREE_NODE *BTREE_FUNC(node_writable)(BTREE_NAME *tree, BTREE_NODE **slot) {
+    /* Returns the node at *slot, ready to be written to.
+
+       With snapshots, a node that is shared with another tree is copied first and the copy
+       replaces it at *slot (the root or a child pointer in a parent that is itself writable).
+       The copy shares the children of the original, so a write only copies the path
+       from the root to the nodes it changes. Returns NULL if the memory pool runs out.
+    */
+    BTREE_NODE *node = *slot;
+#ifdef BTREE_SNAPSHOTS
+    if (node->refcount == 1) return node;
+    BTREE_NODE *copy;
+    if (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_FUNC(inner_node_new)(tree, node->height);
+        if (inner == NULL) return NULL;
+        memcpy(inner->keys, BTREE_AS_INNER(node)->keys, node->degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(inner->children, BTREE_AS_INNER(node)->children, node->degree * sizeof(BTREE_NODE *));
+        BTREE_FUNC(counts_move)(inner, 0, BTREE_AS_INNER(node), 0, (size_t)node->degree);
+        for (size_t i = 0; i < (size_t)node->degree; i++) {
+            inner->children[i]->refcount++;
+        }
+        copy = &inner->node;
+    } else {
+        BTREE_LEAF_NODE *leaf = BTREE_FUNC(leaf_node_new)(tree);
+        if (leaf == NULL) return NULL;
+        memcpy(leaf->keys, BTREE_AS_LEAF(node)->keys, node->degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(leaf->values, BTREE_AS_LEAF(node)->values, node->degree * sizeof(BTREE_VALUE_TYPE));
+        copy = &leaf->node;
+    }
+    copy->degree = node->degree;
+    node->refcount--;
+    *slot = copy;
+    return copy;
+#else
+    (void)tree;
+    return node;
+#endif
+}
+
+/*
+Define BTREE_CONCURRENT to allow several threads to use the tree at once.
+
+Readers never lock anything. Each node has a version which writers bump when they unlock it,
+and a reader descending from the root (optimistic lock coupling) checks that a node's version
+is unchanged after reading from it, starting over from the root if not.
+
+An insert or delete that stays within one leaf locks only that leaf. Splits, merges and
+borrowing between nodes take the tree's write mutex, so only one of them happens at a time,
+and lock every node they modify (through write_lock) until write_end. Nodes they remove are
+retired rather than released, and only go back to the memory pool two epochs later
+when no reader can still be looking at them.
+
+Safe to call concurrently: lookup, get_many, insert, insert_many, remove, delete and
+compact_step. get_many keeps its groups, a lookup whose node changed under it starts over
+alone while the rest of its group carries on.
+Everything else (get/get_ptr, cursors, bulk_load, freeze...) needs the tree to itself.
+With a custom BTREE_KEY_LESS_THAN, keep in mind that a reader may compare against a key
+that is in the middle of being overwritten before it finds out it has to start over.
+*/
+#ifdef BTREE_CONCURRENT
+static inline bool BTREE_FUNC(node_read_version)(BTREE_NODE *node, uint64_t *version) {
+    // waits out a writer holding the node, returns false if the node has been removed from the tree
+    uint64_t v = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+    while (v & BTREE_VERSION_LOCKED) {
+        BTREE_CPU_RELAX();
+        v = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+    }
+    *version = v;
+    return !(v & BTREE_VERSION_OBSOLETE);
+}
+
+static inline bool BTREE_FUNC(node_validate)(BTREE_NODE *node, uint64_t version) {
+    // true if nothing has written to the node since it was read at version
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == version;
+}
+
+static inline bool BTREE_FUNC(node_try_upgrade)(BTREE_NODE *node, uint64_t version) {
+    // lock the node only if it is still at the version it was read at
+    if (!__atomic_compare_exchange_n(&node->version, &version, version + BTREE_VERSION_LOCKED,
+                                     false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return true;
+}
+
+static inline void BTREE_FUNC(node_lock)(BTREE_NODE *node) {
+    while (true) {
+        uint64_t v = __atomic_load_n(&node->version, __ATOMIC_RELAXED);
+        if (!(v & BTREE_VERSION_LOCKED) && BTREE_FUNC(node_try_upgrade)(node, v)) return;
+        BTREE_CPU_RELAX();
+    }
+}
+
+static inline void BTREE_FUNC(node_unlock)(BTREE_NODE *node) {
+    // clears the lock bit and moves on to the next version
+    __atomic_fetch_add(&node->version, BTREE_VERSION_LOCKED, __ATOMIC_RELEASE);
+}
+
+static inline void BTREE_FUNC(node_unlock_unchanged)(BTREE_NODE *node, uint64_t version) {
+    // unlock a node that wasn't written to, readers that saw version don't have to start over
+    __atomic_store_n(&node->version, version, __ATOMIC_RELEASE);
+}
+#endif
+
+static inline void BTREE_FUNC(set_root)(BTREE_NAME *tree, BTREE_NODE *root) {
+#ifdef BTREE_CONCURRENT
+    __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+#else
+    tree->root = root;
+#endif
+}
+
+static inline void BTREE_FUNC(write_lock)(BTREE_NAME *tree, BTREE_NODE *node) {
+    // lock a node until write_end, if the current write doesn't already hold it
+#ifdef BTREE_CONCURRENT
+    for (size_t i = 0; i < tree->num_locked; i++) {
+        if (tree->locked[i] == node) return;
+    }
+    BTREE_FUNC(node_lock)(node);
+    tree->locked[tree->num_locked++] = node;
+#else
+    (void)tree;
+    (void)node;
+#endif
+}
+
+static inline void BTREE_FUNC(write_unlock_all)(BTREE_NAME *tree) {
+#ifdef BTREE_CONCURRENT
+    for (size_t i = 0; i < tree->num_locked; i++) {
+        BTREE_FUNC(node_unlock)(tree->locked[i]);
+    }
+    tree->num_locked = 0;
+#else
+    (void)tree;
+#endif
+}
+
+static inline void BTREE_FUNC(node_retire)(BTREE_NAME *tree, BTREE_NODE *node) {
+    /* A node that was just removed from the tree. Single threaded it goes straight back to
+       the memory pool. Concurrently it is write locked, and is marked obsolete (so that readers
+       who still reach it start over) and kept until the epoch has moved on twice.
+    */
+#ifdef BTREE_CONCURRENT
+    __atomic_fetch_or(&node->version, BTREE_VERSION_OBSOLETE, __ATOMIC_RELEASE);
+    size_t e = (size_t)(__atomic_load_n(&tree->epoch.global, __ATOMIC_RELAXED) % 3);
+    if (tree->num_retired[e] == tree->retired_capacity[e]) {
+        size_t capacity = tree->retired_capacity[e] > 0 ? tree->retired_capacity[e] * 2 : 16;
+        BTREE_NODE **retired = realloc(tree->retired[e], capacity * sizeof(BTREE_NODE *));
+        // if this fails the node just stays out of use until the pools are destroyed
+        if (retired == NULL) return;
+        tree->retired[e] = retired;
+        tree->retired_capacity[e] = capacity;
+    }
+    tree->retired[e][tree->num_retired[e]++] = node;
+#else
+    BTREE_FUNC(node_release)(tree, node);
+#endif
+}
+
+static inline void BTREE_FUNC(write_begin)(BTREE_NAME *tree) {
+    // start a write that may change the structure of the tree
+#ifdef BTREE_CONCURRENT
+    pthread_mutex_lock(&tree->write_mutex);
+#else
+    (void)tree;
+#endif
+}
+
+static inline void BTREE_FUNC(write_end)(BTREE_NAME *tree) {
+#ifdef BTREE_CONCURRENT
+    BTREE_FUNC(write_unlock_all)(tree);
+    uint64_t epoch;
+    bool retired = tree->num_retired[0] + tree->num_retired[1] + tree->num_retired[2] > 0;
+    if (retired && btree_epoch_try_advance(&tree->epoch, &epoch)) {
+        // nodes retired two epochs ago are out of reach now
+        size_t e = (size_t)((epoch + 1) % 3);
+        for (size_t i = 0; i < tree->num_retired[e]; i++) {
+            BTREE_FUNC(node_release)(tree, tree->retired[e][i]);
+        }
+        tree->num_retired[e] = 0;
+    }
+    pthread_mutex_unlock(&tree->write_mutex);
+#else
+    (void)tree;
+#endif
+}
+
+static bool BTREE_FUNC(init)(BTREE_NAME *tree) {
+    // set up a zeroed tree with its pools and an empty root
+#ifdef BTREE_ALLOCATOR
+    tree->leaf_pool = BTREE_LEAF_MEMORY_POOL_FUNC(new_with_allocator)(&tree->allocator);
+#else
+    tree->leaf_pool = BTREE_LEAF_MEMORY_POOL_FUNC(new)();
+#endif
+    if (tree->leaf_pool == NULL) {
+        return false;
+    }
+#ifdef BTREE_ALLOCATOR
+    tree->inner_pool = BTREE_INNER_MEMORY_POOL_FUNC(new_with_allocator)(&tree->allocator);
+#else
+    tree->inner_pool = BTREE_INNER_MEMORY_POOL_FUNC(new)();
+#endif
+    if (tree->inner_pool == NULL) {
+        BTREE_LEAF_MEMORY_POOL_FUNC(destroy)(tree->leaf_pool);
+        return false;
+    }
+    BTREE_LEAF_NODE *root = BTREE_FUNC(leaf_node_new)(tree);
+    if (root == NULL) {
+        BTREE_INNER_MEMORY_POOL_FUNC(destroy)(tree->inner_pool);
+        BTREE_LEAF_MEMORY_POOL_FUNC(destroy)(tree->leaf_pool);
+        return false;
+    }
+    tree->pool_users = BTREE_FUNC(memory_calloc)(tree, sizeof(size_t));
+    if (tree->pool_users == NULL) {
+        BTREE_INNER_MEMORY_POOL_FUNC(destroy)(tree->inner_pool);
+        BTREE_LEAF_MEMORY_POOL_FUNC(destroy)(tree->leaf_pool);
+        return false;
+    }
+    *tree->pool_users = 1;
+#ifdef BTREE_CONCURRENT
+    if (pthread_mutex_init(&tree->write_mutex, NULL) != 0) {
+        BTREE_FUNC(memory_free)(tree, tree->pool_users, sizeof(size_t));
+        BTREE_INNER_MEMORY_POOL_FUNC(destroy)(tree->inner_pool);
+        BTREE_LEAF_MEMORY_POOL_FUNC(destroy)(tree->leaf_pool);
+        return false;
+    }
+#endif
+    tree->root = &root->node;
+    return true;
+}
+
+#ifdef BTREE_ALLOCATOR
+BTREE_NAME *BTREE_FUNC(new_with_allocator)(const btree_allocator_t *allocator) {
+    /* A tree that takes all of its memory from allocator, which is copied,
+       so only its context has to outlive the tree.
+    */
+    if (allocator == NULL || allocator->alloc == NULL || allocator->free == NULL) return NULL;
+    BTREE_NAME *tree = btree_allocator_calloc(allocator, sizeof(BTREE_NAME));
+    if (tree == NULL) return NULL;
+    tree->allocator = *allocator;
+    if (!BTREE_FUNC(init)(tree)) {
+        btree_allocator_free(allocator, tree, sizeof(BTREE_NAME));
+        return NULL;
+    }
+    return tree;
+}
+
+BTREE_NAME *BTREE_FUNC(new)(void) {
+    btree_allocator_t allocator = btree_default_allocator();
+    return BTREE_FUNC(new_with_allocator)(&allocator);
+}
+#else
+BTREE_NAME *BTREE_FUNC(new)(void) {
+    BTREE_NAME *tree = calloc(1, sizeof(BTREE_NAME));
+    if (tree == NULL) return NULL;
+    if (!BTREE_FUNC(init)(tree)) {
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+#endif
+
+void BTREE_FUNC(release_subtree)(BTREE_NAME *tree, BTREE_NODE *node) {
+    // return a node and everything below it to the memory pools
+    if (node == NULL) return;
+#ifdef BTREE_SNAPSHOTS
+    // nodes still shared with another tree stay, along with everything below them
+    if (--node->refcount > 0) return;
+#endif
+    if (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        for (size_t i = 0; i < (size_t)node->degree; i++) {
+            BTREE_FUNC(release_subtree)(tree, inner->children[i]);
+        }
+    }
+    BTREE_FUNC(node_release)(tree, node);
+}
+
+#ifdef BTREE_BUFFERED
+static void BTREE_FUNC(release_buffers)(BTREE_NAME *tree, BTREE_NODE *node) {
+    // free the message buffers of node and the inner nodes below it, which the pools don't own
+    if (node->height == 0) return;
+    BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+    BTREE_FUNC(messages_free)(tree, inner);
+    if (node->height == 1) return;
+    for (size_t i = 0; i < (size_t)node->degree; i++) {
+        BTREE_FUNC(release_buffers)(tree, inner->children[i]);
+    }
+}
+#endif
+
+static BTREE_NODE *BTREE_FUNC(copy_subtree)(BTREE_NAME *tree, BTREE_NODE *node, BTREE_LEAF_NODE **last_leaf) {
+    /* Copy a node and everything below it into tree's memory pools, node by node.
+       The copied leaves are chained on to *last_leaf (NULL to start a new chain), which is
+       left pointing at the last one. Returns NULL if out of memory, having released the copy.
+    */
+    if (node->height == 0) {
+        BTREE_LEAF_NODE *leaf = BTREE_FUNC(leaf_node_new)(tree);
+        if (leaf == NULL) return NULL;
+        memcpy(leaf->keys, BTREE_AS_LEAF(node)->keys, node->degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(leaf->values, BTREE_AS_LEAF(node)->values, node->degree * sizeof(BTREE_VALUE_TYPE));
+        leaf->node.degree = node->degree;
+        BTREE_FUNC(leaf_chain_join)(*last_leaf, leaf);
+        *last_leaf = leaf;
+        return &leaf->node;
+    }
+    BTREE_INNER_NODE *inner = BTREE_FUNC(inner_node_new)(tree, node->height);
+    if (inner == NULL) return NULL;
+    memcpy(inner->keys, BTREE_AS_INNER(node)->keys, node->degree * sizeof(BTREE_KEY_TYPE));
+    BTREE_FUNC(counts_move)(inner, 0, BTREE_AS_INNER(node), 0, (size_t)node->degree);
+    size_t next_size = node->height > 1 ? sizeof(BTREE_INNER_NODE) : sizeof(BTREE_LEAF_NODE);
+    for (size_t i = 0; i < (size_t)node->degree; i++) {
+        if (i + 1 < (size_t)node->degree) {
+            // stream in the whole of the next child while this one is copied
+            const char *next = (const char *)BTREE_AS_INNER(node)->children[i + 1];
+            for (size_t offset = 0; offset < next_size; offset += BTREE_CACHE_LINE_SIZE) {
+                BTREE_PREFETCH(next + offset);
+            }
+        }
+        BTREE_NODE *child = BTREE_FUNC(copy_subtree)(tree, BTREE_AS_INNER(node)->children[i], last_leaf);
+        if (child == NULL) {
+            inner->node.degree = (uint32_t)i;
+            BTREE_FUNC(release_subtree)(tree, &inner->node);
+            return NULL;
+        }
+        inner->children[i] = child;
+    }
+    inner->node.degree = node->degree;
+    return &inner->node;
+}
+
+void BTREE_FUNC(destroy)(BTREE_NAME *tree) {
+    if (tree == NULL) return;
+    bool shared = *tree->pool_users > 1;
+#ifdef BTREE_CONCURRENT
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; shared && j < tree->num_retired[i]; j++) {
+            BTREE_FUNC(node_release)(tree, tree->retired[i][j]);
+        }
+        free(tree->retired[i]);
+    }
+    pthread_mutex_destroy(&tree->write_mutex);
+#endif
+    if (shared) {
+        // the pools are shared with other trees, only release the nodes no other tree uses
+        (*tree->pool_users)--;
+        BTREE_FUNC(release_subtree)(tree, tree->root);
+        BTREE_FUNC(memory_free)(tree, tree, sizeof(BTREE_NAME));
+        return;
+    }
+    BTREE_FUNC(memory_free)(tree, tree->pool_users, sizeof(size_t));
+#ifdef BTREE_BUFFERED
+    BTREE_FUNC(release_buffers)(tree, tree->root);
+#endif
+    if (tree->leaf_pool != NULL) {
+        BTREE_LEAF_MEMORY_POOL_FUNC(destroy)(tree->leaf_pool);
+    }
+    if (tree->inner_pool != NULL) {
+        BTREE_INNER_MEMORY_POOL_FUNC(destroy)(tree->inner_pool);
+    }
+    BTREE_FUNC(memory_free)(tree, tree, sizeof(BTREE_NAME));
+}
+
+#ifdef BTREE_SNAPSHOTS
+BTREE_NAME *BTREE_FUNC(snapshot)(BTREE_NAME *tree) {
+    /* Take a snapshot of the tree in O(1). The snapshot is a tree of its own that starts out
+       sharing every node with the original, and which is freed with destroy.
+
+       Nodes are reference counted, and a write to either tree copies the nodes it would change
+       on the way down if they are shared (see node_writable), so neither tree sees the other's
+       writes. A node goes back to the memory pool when the last tree using it lets go of it.
+
+       The trees share memory pools, so writes, snapshot and destroy on any of them must not
+       run at the same time, but reading one tree while another is being written to is fine.
+       Don't write through a pointer from get_ptr, the leaf may belong to a snapshot as well.
+    */
+    if (tree == NULL || tree->root == NULL) return NULL;
+    BTREE_NAME *snapshot = BTREE_FUNC(memory_calloc)(tree, sizeof(BTREE_NAME));
+    if (snapshot == NULL) return NULL;
+    *snapshot = *tree;
+#ifdef BTREE_STATS
+    memset(&snapshot->counters, 0, sizeof(btree_counters_t));
+#endif
+#ifdef BTREE_STATS_LATENCY
+    memset(&snapshot->latency, 0, sizeof(btree_latency_t));
+#endif
+    tree->root->refcount++;
+    (*tree->pool_users)++;
+    return snapshot;
+}
+#endif
+
+static size_t BTREE_FUNC(stats_node)(BTREE_NODE *node, btree_stats_t *stats) {
+    // add node and everything below it to stats, returns the number of slots they use
+    size_t degree = (size_t)node->degree;
+    stats->nodes_per_level[node->height]++;
+    stats->fill_histogram[degree * BTREE_FILL_BUCKETS / BTREE_FUNC(node_max_degree)(node)]++;
+    if (node->height == 0) {
+        stats->leaves++;
+        stats->entries += degree;
+        stats->bytes_used += sizeof(BTREE_LEAF_NODE);
+        return degree;
+    }
+    stats->inner_nodes++;
+    stats->bytes_used += sizeof(BTREE_INNER_NODE);
+#ifdef BTREE_BUFFERED
+    stats->messages += BTREE_AS_INNER(node)->num_messages;
+    stats->bytes_used += BTREE_AS_INNER(node)->messages_capacity * sizeof(BTREE_MESSAGE);
+#endif
+    size_t used = degree;
+    for (size_t i = 0; i < degree; i++) {
+        used += BTREE_FUNC(stats_node)(BTREE_AS_INNER(node)->children[i], stats);
+    }
+    return used;
+}
+
+void BTREE_FUNC(stats)(BTREE_NAME *tree, btree_stats_t *stats) {
+    /* Fill in *stats with the shape of the tree (height, nodes per level, how full they are,
+       memory used) and, if compiled in, the tree's counters and latency histograms.
+
+       This walks every node, so it is meant for monitoring rather than hot paths.
+       Like freeze, it needs a BTREE_CONCURRENT tree to itself. With snapshots, nodes
+       shared with other trees are counted in each of them.
+    */
+    if (stats == NULL) return;
+    memset(stats, 0, sizeof(btree_stats_t));
+    if (tree == NULL || tree->root == NULL) return;
+#ifdef BTREE_STATS
+    stats->counters = tree->counters;
+#endif
+#ifdef BTREE_STATS_LATENCY
+    stats->latency = tree->latency;
+#endif
+    size_t used = BTREE_FUNC(stats_node)(tree->root, stats);
+    size_t slots = stats->leaves * BTREE_LEAF_MAX_DEGREE + stats->inner_nodes * BTREE_INNER_MAX_DEGREE;
+    stats->height = (size_t)tree->root->height + 1;
+    stats->fill_factor = (double)used / (double)slots;
+}
+
+/*
+With the default comparison on integer keys the node search can use SIMD compares
+(define BTREE_NO_SIMD to turn this off). A branchless binary search narrows the keys down
+to a block of at most BTREE_SIMD_SEARCH_BLOCK keys, then all of the keys in the block
+are compared against the search key at once and the matches counted. This avoids
+the branch mispredictions of the plain binary search on random keys.
+
+The key type is checked at compile time, so for any other type this all folds away.
+*/
+#if defined(BTREE_SIMD_AVAILABLE) && !defined(BTREE_NO_SIMD) && defined(BTREE_KEY_LESS_THAN_DEFINED)
+#define BTREE_SIMD_SEARCH
+#define BTREE_KEY_TYPE_IS(type) __builtin_types_compatible_p(BTREE_KEY_TYPE, type)
+#define BTREE_KEY_IS_SIMD_INTEGER (BTREE_KEY_TYPE_IS(uint32_t) || BTREE_KEY_TYPE_IS(int32_t) \
+                                   || BTREE_KEY_TYPE_IS(uint64_t) || BTREE_KEY_TYPE_IS(int64_t) \
+                                   || BTREE_KEY_TYPE_IS(unsigned long long) || BTREE_KEY_TYPE_IS(long long))
+
+static inline size_t BTREE_FUNC(simd_search_keys)(const BTREE_KEY_TYPE *node_keys, size_t degree, BTREE_KEY_TYPE key, bool or_equal) {
+    /* The result of binary_search_keys is the number of keys in keys[1..degree) that are
+       less than or equal to the search key (or strictly less than, for binary_search_keys_before).
+       keys[0] doesn't take part, same as in the binary search.
+    */
+    if (degree <= 1) return 0;
+    const BTREE_KEY_TYPE *keys = node_keys + 1;
+    size_t base = 0;
+    size_t len = degree - 1;
+    // keys before base match, keys from base + len on do not
+    while (len > BTREE_SIMD_SEARCH_BLOCK) {
+        size_t half = len / 2;
+        bool right = or_equal ? !BTREE_KEY_LESS_THAN(key, keys[base + half]) : BTREE_KEY_LESS_THAN(keys[base + half], key);
+        base = right ? base + half : base;
+        len -= half;
+    }
+    // reinterpret the key as the matching fixed-width integer, the other branches are dead code
+    union {
+        BTREE_KEY_TYPE key;
+        uint32_t u32;
+        uint64_t u64;
+    } search_key;
+    search_key.key = key;
+    if (BTREE_KEY_TYPE_IS(uint32_t)) {
+        return base + btree_simd_count_less_32((const uint32_t *)(keys + base), len, search_key.u32, UINT32_C(0x80000000), or_equal);
+    } else if (BTREE_KEY_TYPE_IS(int32_t)) {
+        return base + btree_simd_count_less_32((const uint32_t *)(keys + base), len, search_key.u32, 0, or_equal);
+    } else if (BTREE_KEY_TYPE_IS(uint64_t) || BTREE_KEY_TYPE_IS(unsigned long long)) {
+        return base + btree_simd_count_less_64((const uint64_t *)(keys + base), len, search_key.u64, UINT64_C(0x8000000000000000), or_equal);
+    } else {
+        return base + btree_simd_count_less_64((const uint64_t *)(keys + base), len, search_key.u64, 0, or_equal);
+    }
+}
+#endif
+
+static inline size_t BTREE_FUNC(binary_search_keys)(const BTREE_KEY_TYPE *keys, size_t degree, BTREE_KEY_TYPE key) {
+    /* Standard binary search, but in the case of a B-tree it tells us
+       the index of the node the search key fits between/before/after.
+
+       For keys[1] through keys[degree - 2], it's sort of like The Price Is Right.
+       Return the index that is closest to the search value without going over.
+
+       For the leftmost key i.e. keys[0], we know that the search key is less than keys[1]
+       but it may be less than keys[0]. Either way the key goes to the leftmost child.
+
+       For the rightmost key i.e. keys[degree - 1], the search key is greater than or equal to
+       that rightmost key.
+
+       For the following set of keys:
+           [1, 2, 4, 6, 8]
+
+       a search for 0 would return 0 (in the interval < 2)
+       a search for 1 would return 0 (in the interval < 2)
+       a search for 2 would return 1 (in the interval 2-4)
+       a search for 3 would return 1 (in the interval 2-4)
+       ...
+       a search for 8 would return 4 (in the interval >= 8)
+       a search for 10 would return 4 (in the interval >= 8)
+    */
+#ifdef BTREE_SIMD_SEARCH
+    if (BTREE_KEY_IS_SIMD_INTEGER) {
+        return BTREE_FUNC(simd_search_keys)(keys, degree, key, true);
+    }
+#endif
+    size_t lo = 0;
+    size_t hi = degree;
+    while (lo + 1 < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (BTREE_KEY_LESS_THAN(key, keys[mid])) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+    return lo;
+}
+
+static inline size_t BTREE_FUNC(binary_search_keys_before)(const BTREE_KEY_TYPE *keys, size_t degree, BTREE_KEY_TYPE key) {
+    /* Same as binary_search_keys, except that it returns the index of the closest key
+       strictly less than the search key.
+
+       Equal keys can sit on both sides of a separator when there are duplicates,
+       so seeking to the first key >= search key has to go down the leftmost candidate.
+
+       For the following set of keys:
+           [1, 2, 4, 6, 8]
+
+       a search for 2 would return 0 (binary_search_keys would return 1)
+       a search for 3 would return 1
+       a search for 8 would return 3
+    */
+#ifdef BTREE_SIMD_SEARCH
+    if (BTREE_KEY_IS_SIMD_INTEGER) {
+        return BTREE_FUNC(simd_search_keys)(keys, degree, key, false);
+    }
+#endif
+    size_t lo = 0;
+    size_t hi = degree;
+    while (lo + 1 < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (BTREE_KEY_LESS_THAN(keys[mid], key)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline BTREE_LEAF_NODE *BTREE_FUNC(find_leaf)(BTREE_NODE *node, BTREE_KEY_TYPE key) {
+    while (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)node->degree, key);
+        node = inner->children[idx];
+    }
+    return BTREE_AS_LEAF(node);
+}
+
+#ifdef BTREE_BUFFERED
+/*
+The message buffers of BTREE_BUFFERED. Each one is sorted by key, oldest first among equal
+keys, so the messages for one child are a contiguous run and the newest write to a key is
+the last message for it. Buffers grow as needed and are only freed with their node or by flush.
+*/
+static inline size_t BTREE_FUNC(messages_lower_bound)(const BTREE_INNER_NODE *inner, BTREE_KEY_TYPE key) {
+    // number of messages with a key less than key
+    size_t lo = 0;
+    size_t hi = (size_t)inner->num_messages;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (BTREE_KEY_LESS_THAN(inner->messages[mid].key, key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline size_t BTREE_FUNC(messages_upper_bound)(const BTREE_INNER_NODE *inner, BTREE_KEY_TYPE key) {
+    // number of messages with a key less than or equal to key
+    size_t lo = 0;
+    size_t hi = (size_t)inner->num_messages;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (BTREE_KEY_LESS_THAN(key, inner->messages[mid].key)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+static bool BTREE_FUNC(messages_reserve)(BTREE_NAME *tree, BTREE_INNER_NODE *inner, size_t capacity) {
+    // make room for capacity messages in inner's buffer, false if out of memory
+    if (capacity <= (size_t)inner->messages_capacity) return true;
+    if (capacity > UINT32_MAX) return false;
+    size_t new_capacity = inner->messages_capacity > 0 ? 2 * (size_t)inner->messages_capacity : 16;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+    if (new_capacity > UINT32_MAX) new_capacity = capacity;
+    BTREE_MESSAGE *messages = BTREE_FUNC(memory_alloc)(tree, new_capacity * sizeof(BTREE_MESSAGE));
+    if (messages == NULL) return false;
+    if (inner->num_messages > 0) {
+        memcpy(messages, inner->messages, inner->num_messages * sizeof(BTREE_MESSAGE));
+    }
+    BTREE_FUNC(memory_free)(tree, inner->messages, inner->messages_capacity * sizeof(BTREE_MESSAGE));
+    inner->messages = messages;
+    inner->messages_capacity = (uint32_t)new_capacity;
+    return true;
+}
+
+static void BTREE_FUNC(messages_move)(BTREE_INNER_NODE *from, size_t start, size_t n, BTREE_INNER_NODE *to, size_t at) {
+    /* Move the n messages from->messages[start..start + n) to to->messages[at], which must
+       have room for them. The caller keeps both buffers sorted, by moving the runs that belong
+       to the children moving from one node to the other.
+    */
+    if (n == 0) return;
+    memmove(to->messages + at + n, to->messages + at, (to->num_messages - at) * sizeof(BTREE_MESSAGE));
+    memcpy(to->messages + at, from->messages + start, n * sizeof(BTREE_MESSAGE));
+    memmove(from->messages + start, from->messages + start + n, (from->num_messages - start - n) * sizeof(BTREE_MESSAGE));
+    to->num_messages += (uint32_t)n;
+    from->num_messages -= (uint32_t)n;
+}
+
+static bool BTREE_FUNC(messages_add)(BTREE_NAME *tree, BTREE_INNER_NODE *inner, const BTREE_MESSAGE *messages, size_t n) {
+    /* Merge n sorted messages, all newer than the ones already in inner's buffer, into it.
+       Backwards from the end like insert_many, so each buffered message moves at most once, and
+       the new messages go after the buffered ones with equal keys.
+       Returns false, with the buffer unchanged, if out of memory.
+    */
+    if (!BTREE_FUNC(messages_reserve)(tree, inner, (size_t)inner->num_messages + n)) return false;
+    size_t a = (size_t)inner->num_messages;
+    size_t b = n;
+    size_t w = a + n;
+    while (b > 0) {
+        w--;
+        if (a > 0 && BTREE_KEY_LESS_THAN(messages[b - 1].key, inner->messages[a - 1].key)) {
+            inner->messages[w] = inner->messages[--a];
+        } else {
+            inner->messages[w] = messages[--b];
+        }
+    }
+    inner->num_messages += (uint32_t)n;
+    return true;
+}
+
+static BTREE_VALUE_TYPE *BTREE_FUNC(buffered_get_ptr)(BTREE_NODE *node, BTREE_KEY_TYPE key) {
+    /* Messages are newer than everything below them, so the newest writes to key are found
+       first on the way down, last among its messages in each buffer. A delete takes out the
+       last entry for its key. Going from newest to oldest, a delete cancels the next insert,
+       and an insert or upsert that no delete cancels is the entry get returns. Deletes still
+       left at the leaf take entries off the end of the key's run there.
+    */
+    size_t deletes = 0;
+    while (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        size_t i = BTREE_FUNC(messages_upper_bound)(inner, key);
+        while (i > 0 && BTREE_KEY_EQUALS(key, inner->messages[i - 1].key)) {
+            BTREE_MESSAGE *message = &inner->messages[--i];
+            if (message->op == BTREE_MESSAGE_DELETE) {
+                deletes++;
+            } else if (deletes == 0) {
+                return &message->value;
+            } else if (message->op == BTREE_MESSAGE_INSERT) {
+                deletes--;
+            }
+        }
+        node = inner->children[BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)node->degree, key)];
+    }
+    BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+    if (leaf->node.degree == 0) return NULL;
+    size_t idx = BTREE_FUNC(binary_search_keys)(leaf->keys, (size_t)leaf->node.degree, key);
+    if (deletes <= idx && BTREE_KEY_EQUALS(key, leaf->keys[idx - deletes])) {
+        return &leaf->values[idx - deletes];
+    }
+    return NULL;
+}
+#endif
+
+BTREE_VALUE_TYPE *BTREE_FUNC(get_ptr)(BTREE_NODE *node, BTREE_KEY_TYPE key) {
+    /* Pointer to the value slot for key in its leaf, or NULL if the key is not found.
+       With BTREE_BUFFERED, the slot may be in the buffered write of the key instead.
+    */
+    if (node == NULL) return NULL;
+    if (node->degree == 0) return NULL;
+#ifdef BTREE_BUFFERED
+    return BTREE_FUNC(buffered_get_ptr)(node, key);
+#else
+    // block of height 0 means we have leaf nodes
+    BTREE_LEAF_NODE *leaf = BTREE_FUNC(find_leaf)(node, key);
+    size_t idx = BTREE_FUNC(binary_search_keys)(leaf->keys, (size_t)leaf->node.degree, key);
+    if (BTREE_KEY_EQUALS(key, leaf->keys[idx])) {
+        return &leaf->values[idx];
+    }
+    return NULL;
+#endif
+}
+
+BTREE_VALUE_TYPE BTREE_FUNC(get)(BTREE_NODE *node, BTREE_KEY_TYPE key) {
+    BTREE_VALUE_TYPE *value = BTREE_FUNC(get_ptr)(node, key);
+    if (value == NULL) return BTREE_VALUE_NULL;
+    return *value;
+}
+
+#ifdef BTREE_CONCURRENT
+static inline size_t BTREE_FUNC(node_read_degree)(BTREE_NODE *node) {
+    // a torn read is caught by validating the version afterward, but must not index out of bounds
+    size_t degree = (size_t)node->degree;
+    size_t max_degree = BTREE_FUNC(node_max_degree)(node);
+    return degree < max_degree ? degree : max_degree;
+}
+
+static inline BTREE_NODE *BTREE_FUNC(optimistic_root)(BTREE_NAME *tree, uint64_t *version) {
+    // the root and its version, must be called from inside an epoch
+    while (true) {
+        BTREE_NODE *root = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+        if (!BTREE_FUNC(node_read_version)(root, version)) continue;
+        // the root may have been split or collapsed before the version was read
+        if (root == __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE)) return root;
+    }
+}
+
+static BTREE_LEAF_NODE *BTREE_FUNC(optimistic_find_leaf)(BTREE_NAME *tree, BTREE_KEY_TYPE key, uint64_t *version) {
+    /* Descend to the leaf for key without taking any locks. The child pointer read from a node
+       is only followed once the node's version is checked again, and the child's version is read
+       before that check, so each step either sees a consistent node or starts over from the root.
+       Returns the leaf and the version it was reached at.
+
+       Must be called from inside an epoch.
+    */
+    while (true) {
+        uint64_t node_version;
+        BTREE_NODE *node = BTREE_FUNC(optimistic_root)(tree, &node_version);
+
+        bool restart = false;
+        while (node->height > 0) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+            size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, BTREE_FUNC(node_read_degree)(node), key);
+            BTREE_NODE *child = inner->children[idx];
+            uint64_t child_version;
+            if (!BTREE_FUNC(node_validate)(node, node_version)
+                || !BTREE_FUNC(node_read_version)(child, &child_version)
+                || !BTREE_FUNC(node_validate)(node, node_version)) {
+                restart = true;
+                break;
+            }
+            node = child;
+            node_version = child_version;
+        }
+        if (restart) continue;
+        *version = node_version;
+        return BTREE_AS_LEAF(node);
+    }
+}
+#endif
+
+#ifdef BTREE_CONCURRENT
+static inline bool BTREE_FUNC(optimistic_leaf_get)(BTREE_LEAF_NODE *leaf, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE *value) {
+    // search a leaf read without its lock, the caller validates its version afterward
+    size_t degree = BTREE_FUNC(node_read_degree)(&leaf->node);
+    if (degree == 0) return false;
+    size_t idx = BTREE_FUNC(binary_search_keys)(leaf->keys, degree, key);
+    if (!BTREE_KEY_EQUALS(key, leaf->keys[idx])) return false;
+    *value = leaf->values[idx];
+    return true;
+}
+
+static bool BTREE_FUNC(optimistic_lookup)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE *value) {
+    // look up key without taking any locks, must be called from inside an epoch
+    while (true) {
+        uint64_t version;
+        BTREE_LEAF_NODE *leaf = BTREE_FUNC(optimistic_find_leaf)(tree, key, &version);
+        bool found = BTREE_FUNC(optimistic_leaf_get)(leaf, key, value);
+        if (BTREE_FUNC(node_validate)(&leaf->node, version)) return found;
+    }
+}
+#endif
+
+static bool BTREE_FUNC(lookup_entry)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE *value) {
+    if (tree == NULL || tree->root == NULL) return false;
+#ifdef BTREE_CONCURRENT
+    uint64_t *epoch = btree_epoch_enter(&tree->epoch);
+    BTREE_VALUE_TYPE result = BTREE_VALUE_NULL;
+    bool found = BTREE_FUNC(optimistic_lookup)(tree, key, &result);
+    btree_epoch_exit(epoch);
+    if (found && value != NULL) *value = result;
+    return found;
+#else
+    BTREE_VALUE_TYPE *ptr = BTREE_FUNC(get_ptr)(tree->root, key);
+    if (ptr == NULL) return false;
+    if (value != NULL) *value = *ptr;
+    return true;
+#endif
+}
+
+bool BTREE_FUNC(lookup)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE *value) {
+    /* Look up key from the root of the tree, storing its value in *value (if not NULL).
+       Returns false if the key was not found.
+
+       Unlike get, this is safe to call while other threads write to a BTREE_CONCURRENT tree.
+    */
+    uint64_t start = BTREE_LATENCY_START();
+    bool found = BTREE_FUNC(lookup_entry)(tree, key, value);
+    if (tree != NULL) {
+        BTREE_STAT_ADD(tree, lookups, 1);
+        BTREE_LATENCY_RECORD(tree, lookup, start);
+    }
+    return found;
+}
+
+static inline void BTREE_FUNC(prefetch_node)(BTREE_NODE *node, bool leaf) {
+    // the header/first keys, and the middle key where the binary search starts
+    BTREE_PREFETCH(node);
+    if (leaf) {
+        BTREE_PREFETCH(&BTREE_AS_LEAF(node)->keys[BTREE_LEAF_MAX_DEGREE / 2]);
+    } else {
+        BTREE_PREFETCH(&BTREE_AS_INNER(node)->keys[BTREE_INNER_MAX_DEGREE / 2]);
+    }
+}
+
+size_t BTREE_FUNC(get_many)(BTREE_NAME *tree, BTREE_KEY_TYPE *keys, BTREE_VALUE_TYPE *values, size_t n) {
+    /* Look up n keys, writing each value (or BTREE_VALUE_NULL if the key is not found)
+       to values[i]. Returns the number of keys that were found.
+
+       With a single get, each level is a cache miss that has to be waited out before
+       the next level can be searched. Here the keys are taken in groups of
+       BTREE_GET_MANY_GROUP_SIZE which walk down the tree together one level at a time:
+       each lookup in the group searches its node and prefetches the child it is going to
+       next, so by the time the group comes back around to the first lookup on the next
+       level its node has (hopefully) arrived and the misses for the group overlap.
+
+       All leaves are at height 0, so every lookup in a group reaches the leaves on
+       the same step.
+
+       With BTREE_CONCURRENT each lookup checks the versions of its nodes as lookup does.
+       A lookup whose node changed under it drops out of the group and is done again on
+       its own from the root, the rest of the group carries on. With BTREE_BUFFERED a key
+       can be settled in any buffer on the way down, so each key is looked up on its own
+       and there is no batching.
+    */
+    if (tree == NULL || tree->root == NULL || keys == NULL || values == NULL) return 0;
+    BTREE_STAT_ADD(tree, lookups, n);
+#ifdef BTREE_BUFFERED
+    size_t hits = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (BTREE_FUNC(lookup_entry)(tree, keys[i], &values[i])) {
+            hits++;
+        } else {
+            values[i] = BTREE_VALUE_NULL;
+        }
+    }
+    return hits;
+#else
+#ifdef BTREE_CONCURRENT
+    uint64_t *epoch = btree_epoch_enter(&tree->epoch);
+    uint64_t versions[BTREE_GET_MANY_GROUP_SIZE];
+#else
+    if (tree->root->degree == 0) {
+        for (size_t i = 0; i < n; i++) {
+            values[i] = BTREE_VALUE_NULL;
+        }
+        return 0;
+    }
+#endif
+    size_t found = 0;
+    BTREE_NODE *nodes[BTREE_GET_MANY_GROUP_SIZE];
+    for (size_t start = 0; start < n; start += BTREE_GET_MANY_GROUP_SIZE) {
+        size_t group_size = n - start < BTREE_GET_MANY_GROUP_SIZE ? n - start : BTREE_GET_MANY_GROUP_SIZE;
+        BTREE_KEY_TYPE *group_keys = keys + start;
+#ifdef BTREE_CONCURRENT
+        uint64_t root_version;
+        BTREE_NODE *root = BTREE_FUNC(optimistic_root)(tree, &root_version);
+#else
+        BTREE_NODE *root = tree->root;
+#endif
+        for (size_t j = 0; j < group_size; j++) {
+            nodes[j] = root;
+#ifdef BTREE_CONCURRENT
+            versions[j] = root_version;
+#endif
+        }
+        for (uint16_t height = root->height; height > 0; height--) {
+            for (size_t j = 0; j < group_size; j++) {
+                // NULL for a lookup that dropped out of the group
+                if (nodes[j] == NULL) continue;
+                BTREE_INNER_NODE *inner = BTREE_AS_INNER(nodes[j]);
+#ifdef BTREE_CONCURRENT
+                size_t degree = BTREE_FUNC(node_read_degree)(nodes[j]);
+#else
+                size_t degree = (size_t)inner->node.degree;
+#endif
+                size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, degree, group_keys[j]);
+                BTREE_NODE *child = inner->children[idx];
+#ifdef BTREE_CONCURRENT
+                // as in optimistic_find_leaf, but a lookup whose node changed leaves the group
+                uint64_t child_version;
+                if (!BTREE_FUNC(node_validate)(nodes[j], versions[j])
+                    || !BTREE_FUNC(node_read_version)(child, &child_version)
+                    || !BTREE_FUNC(node_validate)(nodes[j], versions[j])) {
+                    nodes[j] = NULL;
+                    continue;
+                }
+                versions[j] = child_version;
+#endif
+                nodes[j] = child;
+                BTREE_FUNC(prefetch_node)(nodes[j], height == 1);
+            }
+        }
+        for (size_t j = 0; j < group_size; j++) {
+            BTREE_VALUE_TYPE value = BTREE_VALUE_NULL;
+            bool hit = false;
+#ifdef BTREE_CONCURRENT
+            if (nodes[j] != NULL) {
+                hit = BTREE_FUNC(optimistic_leaf_get)(BTREE_AS_LEAF(nodes[j]), group_keys[j], &value);
+                if (!BTREE_FUNC(node_validate)(nodes[j], versions[j])) nodes[j] = NULL;
+            }
+            if (nodes[j] == NULL) {
+                value = BTREE_VALUE_NULL;
+                hit = BTREE_FUNC(optimistic_lookup)(tree, group_keys[j], &value);
+            }
+#else
+            BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(nodes[j]);
+            size_t idx = BTREE_FUNC(binary_search_keys)(leaf->keys, (size_t)leaf->node.degree, group_keys[j]);
+            hit = BTREE_KEY_EQUALS(group_keys[j], leaf->keys[idx]);
+            if (hit) value = leaf->values[idx];
+#endif
+            values[start + j] = hit ? value : BTREE_VALUE_NULL;
+            if (hit) found++;
+        }
+    }
+#ifdef BTREE_CONCURRENT
+    btree_epoch_exit(epoch);
+#endif
+    return found;
+#endif
+}
+
+#ifdef BTREE_ORDER_STATISTICS
+size_t BTREE_FUNC(count)(BTREE_NAME *tree) {
+    // number of entries in the tree
+    if (tree == NULL || tree->root == NULL) return 0;
+    return BTREE_FUNC(subtree_count)(tree->root);
+}
+
+size_t BTREE_FUNC(rank)(BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    /* Number of entries with keys less than key, i.e. the position of the first entry
+       >= key in key order. Adds up the counts of the children left of the path to key.
+    */
+    if (tree == NULL || tree->root == NULL) return 0;
+    size_t rank = 0;
+    BTREE_NODE *node = tree->root;
+    while (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        // with duplicates, keys equal to a separator can also be in the child to its left
+        size_t idx = BTREE_FUNC(binary_search_keys_before)(inner->keys, (size_t)node->degree, key);
+        for (size_t i = 0; i < idx; i++) {
+            rank += inner->counts[i];
+        }
+        node = inner->children[idx];
+    }
+    BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+    size_t degree = (size_t)node->degree;
+    if (degree == 0) return rank;
+    size_t i = BTREE_FUNC(binary_search_keys_before)(leaf->keys, degree, key);
+    if (BTREE_KEY_LESS_THAN(leaf->keys[i], key)) i++;
+    return rank + i;
+}
+
+bool BTREE_FUNC(select)(BTREE_NAME *tree, size_t rank, BTREE_KEY_TYPE *key, BTREE_VALUE_TYPE *value) {
+    /* Find the entry at position rank (from 0) in key order and store it in *key and *value
+       (if not NULL), e.g. rank = count * 0.99 for the 99th percentile.
+       Returns false if rank is not less than the number of entries.
+    */
+    if (tree == NULL || tree->root == NULL) return false;
+    BTREE_NODE *node = tree->root;
+    while (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        size_t i = 0;
+        while (i + 1 < (size_t)node->degree && rank >= inner->counts[i]) {
+            rank -= inner->counts[i];
+            i++;
+        }
+        node = inner->children[i];
+    }
+    if (rank >= (size_t)node->degree) return false;
+    if (key != NULL) *key = BTREE_AS_LEAF(node)->keys[rank];
+    if (value != NULL) *value = BTREE_AS_LEAF(node)->values[rank];
+    return true;
+}
+
+size_t BTREE_FUNC(count_range)(BTREE_NAME *tree, BTREE_KEY_TYPE lo, BTREE_KEY_TYPE hi) {
+    // number of entries with lo <= key < hi
+    if (!BTREE_KEY_LESS_THAN(lo, hi)) return 0;
+    return BTREE_FUNC(rank)(tree, hi) - BTREE_FUNC(rank)(tree, lo);
+}
+#endif
+
+static void BTREE_FUNC(grow_root)(BTREE_NAME *tree, BTREE_INNER_NODE *new_root, BTREE_KEY_TYPE right_key, BTREE_NODE *right) {
+    /* The root was just split and right holds its upper half.
+       new_root, fresh from the pool, goes one level up with the old root and right as its two children.
+    */
+    BTREE_NODE *root = tree->root;
+    new_root->keys[0] = BTREE_FUNC(node_first_key)(root);
+    new_root->children[0] = root;
+    new_root->keys[1] = right_key;
+    new_root->children[1] = right;
+    BTREE_FUNC(count_set)(new_root, 0, BTREE_FUNC(subtree_count)(root));
+    BTREE_FUNC(count_set)(new_root, 1, BTREE_FUNC(subtree_count)(right));
+    new_root->node.degree = 2;
+    BTREE_FUNC(set_root)(tree, &new_root->node);
+    BTREE_STAT_ADD(tree, root_grows, 1);
+}
+
+static void BTREE_FUNC(spare_release)(BTREE_NAME *tree, BTREE_INNER_NODE **spare, size_t num_spare) {
+    // hand the spare nodes split_reserve took and a split didn't use back to the pool
+    while (num_spare > 0) {
+        BTREE_FUNC(node_release)(tree, &spare[--num_spare]->node);
+    }
+}
+
+static bool BTREE_FUNC(split_reserve)(BTREE_NAME *tree, BTREE_INNER_NODE **stack, size_t stack_size, uint16_t child_height,
+                                      BTREE_INNER_NODE **spare, size_t *num_spare) {
+    /* Take every node from the pool that adding a child (at child_height) below the bottom of
+       the path could need before anything in the tree changes: one for each full node from the
+       bottom of the path up, and a new root if that is all of them. So running out of memory
+       leaves the tree as it was. spare has room for BTREE_MAX_HEIGHT + 1 nodes.
+
+       insert_into_inner takes them from the end, the node for the lowest split last in spare.
+       Returns false if out of memory, having taken nothing.
+    */
+    size_t splits = 0;
+    while (splits < stack_size && (size_t)stack[stack_size - 1 - splits]->node.degree >= BTREE_INNER_MAX_DEGREE) {
+        splits++;
+    }
+    size_t needed = splits == stack_size ? splits + 1 : splits;
+    *num_spare = 0;
+    while (*num_spare < needed) {
+        // the level above the child this node splits off at, the new root being the highest
+        size_t level = needed - 1 - *num_spare;
+        BTREE_INNER_NODE *node = BTREE_FUNC(inner_node_new)(tree, (uint16_t)(child_height + 1 + level));
+        bool reserved = node != NULL;
+#ifdef BTREE_BUFFERED
+        // room for the messages that go with the new node's children, at most all of them
+        if (reserved && level < splits) {
+            reserved = BTREE_FUNC(messages_reserve)(tree, node, (size_t)stack[stack_size - 1 - level]->num_messages);
+            if (!reserved) BTREE_FUNC(node_release)(tree, &node->node);
+        }
+#endif
+        if (!reserved) {
+            BTREE_FUNC(spare_release)(tree, spare, *num_spare);
+            *num_spare = 0;
+            return false;
+        }
+        spare[(*num_spare)++] = node;
+    }
+    return true;
+}
+
+static inline bool BTREE_FUNC(path_is_rightmost)(BTREE_INNER_NODE **stack, size_t *index_stack, size_t stack_size) {
+    // whether the path took the last child at every level, i.e. ends at the right edge of the tree
+    for (size_t i = 0; i < stack_size; i++) {
+        if (index_stack[i] != (size_t)stack[i]->node.degree - 1) return false;
+    }
+    return true;
+}
+
+static void BTREE_FUNC(insert_into_inner)(BTREE_NAME *tree, BTREE_INNER_NODE **stack, size_t *index_stack, size_t stack_size,
+                                          BTREE_KEY_TYPE insert_key, BTREE_NODE *insert_child,
+                                          BTREE_INNER_NODE **spare, size_t *num_spare) {
+    /* A child on the path was split, insert its new right sibling into the parent,
+       splitting the parent and its ancestors as needed. stack holds the path of inner nodes
+       from the root down to the parent and index_stack the index of the child taken at each.
+
+       The new child goes directly to the right of the one it was split from. With duplicate
+       keys the separators can repeat, so the position is not searched for by key.
+
+       The count of the child that was split already covers both halves, the new child's
+       share moves over to it.
+
+       The new nodes come off the end of spare, which split_reserve filled for this path.
+    */
+    while (stack_size > 0) {
+        BTREE_INNER_NODE *current_node = stack[--stack_size];
+        BTREE_FUNC(write_lock)(tree, &current_node->node);
+        size_t i = index_stack[stack_size] + 1;
+        size_t degree = (size_t)current_node->node.degree;
+        size_t insert_count = BTREE_FUNC(subtree_count)(insert_child);
+        BTREE_FUNC(count_add)(current_node, i - 1, -(ptrdiff_t)insert_count);
+
+        if (degree < BTREE_INNER_MAX_DEGREE) {
+            // node still has room, move everything up to create the insertion gap
+            memmove(current_node->keys + i + 1, current_node->keys + i, (degree - i) * sizeof(BTREE_KEY_TYPE));
+            memmove(current_node->children + i + 1, current_node->children + i, (degree - i) * sizeof(BTREE_NODE *));
+            BTREE_FUNC(counts_move)(current_node, i + 1, current_node, i, degree - i);
+            current_node->keys[i] = insert_key;
+            current_node->children[i] = insert_child;
+            BTREE_FUNC(count_set)(current_node, i, insert_count);
+            current_node->node.degree++;
+            return;
+        }
+
+        /* node is full, have to split
+           split the node in half and copy the keys/children while also
+           inserting the new key/child in the correct position.
+        */
+        BTREE_INNER_NODE *new_node = spare[--*num_spare];
+        BTREE_STAT_ADD(tree, inner_splits, 1);
+        size_t right_degree = (BTREE_INNER_MAX_DEGREE + 1) / 2;
+        if (i == BTREE_INNER_MAX_DEGREE && BTREE_FUNC(path_is_rightmost)(stack, index_stack, stack_size)) {
+            /* appending at the right edge of the tree, see insert_into_leaf. The new node also
+               takes the last child, since rebalancing a child needs a sibling to borrow from.
+            */
+            right_degree = 2;
+        }
+        size_t left_degree = (BTREE_INNER_MAX_DEGREE + 1) - right_degree;
+        if (i >= left_degree) {
+            // new key goes in the upper half
+            size_t j = i - left_degree;
+            memcpy(new_node->keys, current_node->keys + left_degree, j * sizeof(BTREE_KEY_TYPE));
+            memcpy(new_node->children, current_node->children + left_degree, j * sizeof(BTREE_NODE *));
+            BTREE_FUNC(counts_move)(new_node, 0, current_node, left_degree, j);
+            new_node->keys[j] = insert_key;
+            new_node->children[j] = insert_child;
+            BTREE_FUNC(count_set)(new_node, j, insert_count);
+            memcpy(new_node->keys + j + 1, current_node->keys + i, (BTREE_INNER_MAX_DEGREE - i) * sizeof(BTREE_KEY_TYPE));
+            memcpy(new_node->children + j + 1, current_node->children + i, (BTREE_INNER_MAX_DEGREE - i) * sizeof(BTREE_NODE *));
+            BTREE_FUNC(counts_move)(new_node, j + 1, current_node, i, BTREE_INNER_MAX_DEGREE - i);
+        } else {
+            // new key goes in the lower half, the upper half is copied as is
+            memcpy(new_node->keys, current_node->keys + left_degree - 1, right_degree * sizeof(BTREE_KEY_TYPE));
+            memcpy(new_node->children, current_node->children + left_degree - 1, right_degree * sizeof(BTREE_NODE *));
+            BTREE_FUNC(counts_move)(new_node, 0, current_node, left_degree - 1, right_degree);
+            memmove(current_node->keys + i + 1, current_node->keys + i, (left_degree - 1 - i) * sizeof(BTREE_KEY_TYPE));
+            memmove(current_node->children + i + 1, current_node->children + i, (left_degree - 1 - i) * sizeof(BTREE_NODE *));
+            BTREE_FUNC(counts_move)(current_node, i + 1, current_node, i, left_degree - 1 - i);
+            current_node->keys[i] = insert_key;
+            current_node->children[i] = insert_child;
+            BTREE_FUNC(count_set)(current_node, i, insert_count);
+        }
+        current_node->node.degree = (uint32_t)left_degree;
+        new_node->node.degree = (uint32_t)right_degree;
+#ifdef BTREE_BUFFERED
+        size_t start = BTREE_FUNC(messages_lower_bound)(current_node, new_node->keys[0]);
+        BTREE_FUNC(messages_move)(current_node, start, current_node->num_messages - start, new_node, 0);
+#endif
+        // split nodes complete, insert the new node above
+        insert_key = new_node->keys[0];
+        insert_child = &new_node->node;
+    }
+    // splitting the root
+    BTREE_FUNC(grow_root)(tree, spare[--*num_spare], insert_key, insert_child);
+}
+
+static inline size_t BTREE_FUNC(leaf_insert_position)(BTREE_LEAF_NODE *leaf, BTREE_KEY_TYPE key) {
+    /* Binary search returns the index of the closest key
+       that is less than the search key if it (by definition) did not exist.
+
+       There is one special case however if the search returns 0.
+       Here we have to compare the insert key to the first key in the node.
+       If the insert key is greater, we have to increment i by 1 to insert at the correct position.
+       If it's less than the first key, we can insert at the first position.
+
+       Equal keys go after the existing ones.
+    */
+    size_t degree = (size_t)leaf->node.degree;
+    size_t i = BTREE_FUNC(binary_search_keys)(leaf->keys, degree, key);
+    if (degree > 0 && !BTREE_KEY_LESS_THAN(key, leaf->keys[i])) {
+        i++;
+    }
+    return i;
+}
+
+static inline void BTREE_FUNC(leaf_insert_at)(BTREE_LEAF_NODE *leaf, size_t i, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value) {
+    /* Node still has room to insert
+       move everything up to create the insertion gap
+
+       Example:
+       [1, 2, 4, 6, 8]
+
+        insert 5
+        [1, 2, 4, 6, 8] -> [1, 2, 4, 5, 6, 8]
+    */
+    size_t degree = (size_t)leaf->node.degree;
+    memmove(leaf->keys + i + 1, leaf->keys + i, (degree - i) * sizeof(BTREE_KEY_TYPE));
+    memmove(leaf->values + i + 1, leaf->values + i, (degree - i) * sizeof(BTREE_VALUE_TYPE));
+    leaf->keys[i] = key;
+    leaf->values[i] = value;
+    leaf->node.degree++;
+}
+
+static bool BTREE_FUNC(insert_into_leaf)(BTREE_NAME *tree, BTREE_INNER_NODE **stack, size_t *index_stack, size_t stack_size,
+                                         BTREE_LEAF_NODE *leaf, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value, BTREE_VALUE_TYPE **slot) {
+    // slot (if not NULL) gets the new entry's value slot, in whichever half of a split it ends up
+    BTREE_FUNC(write_lock)(tree, &leaf->node);
+    size_t i = BTREE_FUNC(leaf_insert_position)(leaf, key);
+    if (leaf->node.degree < BTREE_LEAF_MAX_DEGREE) {
+        BTREE_FUNC(leaf_insert_at)(leaf, i, key, value);
+        BTREE_FUNC(path_count_add)(stack, index_stack, stack_size, 1);
+        if (slot != NULL) *slot = &leaf->values[i];
+#ifdef BTREE_APPEND_FAST_PATH
+        if (leaf->next == NULL) tree->last_leaf = leaf;
+#endif
+        return true;
+    }
+
+    /* leaf is full, split it the same way as the inner nodes. The new leaf and every inner node
+       the split can cascade into are taken first, so that running out of memory changes nothing.
+    */
+    BTREE_LEAF_NODE *new_leaf = BTREE_FUNC(leaf_node_new)(tree);
+    if (new_leaf == NULL) return false;
+    BTREE_INNER_NODE *spare[BTREE_MAX_HEIGHT + 1];
+    size_t num_spare;
+    if (!BTREE_FUNC(split_reserve)(tree, stack, stack_size, 0, spare, &num_spare)) {
+        BTREE_FUNC(node_release)(tree, &new_leaf->node);
+        return false;
+    }
+    BTREE_FUNC(path_count_add)(stack, index_stack, stack_size, 1);
+    BTREE_STAT_ADD(tree, leaf_splits, 1);
+    size_t right_degree = (BTREE_LEAF_MAX_DEGREE + 1) / 2;
+    if (i == BTREE_LEAF_MAX_DEGREE && BTREE_FUNC(path_is_rightmost)(stack, index_stack, stack_size)) {
+        /* The key goes past the end of the last leaf, as it does for every key of an ascending
+           ingest. An even split would leave each leaf half empty for good, so the full leaf
+           stays full and the new one starts with just the new key. Nodes on the right edge can
+           be below the minimum degree until the next keys fill them.
+        */
+        right_degree = 1;
+    }
+    size_t left_degree = (BTREE_LEAF_MAX_DEGREE + 1) - right_degree;
+    if (i >= left_degree) {
+        size_t j = i - left_degree;
+        memcpy(new_leaf->keys, leaf->keys + left_degree, j * sizeof(BTREE_KEY_TYPE));
+        memcpy(new_leaf->values, leaf->values + left_degree, j * sizeof(BTREE_VALUE_TYPE));
+        new_leaf->keys[j] = key;
+        new_leaf->values[j] = value;
+        memcpy(new_leaf->keys + j + 1, leaf->keys + i, (BTREE_LEAF_MAX_DEGREE - i) * sizeof(BTREE_KEY_TYPE));
+        memcpy(new_leaf->values + j + 1, leaf->values + i, (BTREE_LEAF_MAX_DEGREE - i) * sizeof(BTREE_VALUE_TYPE));
+    } else {
+        memcpy(new_leaf->keys, leaf->keys + left_degree - 1, right_degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(new_leaf->values, leaf->values + left_degree - 1, right_degree * sizeof(BTREE_VALUE_TYPE));
+        memmove(leaf->keys + i + 1, leaf->keys + i, (left_degree - 1 - i) * sizeof(BTREE_KEY_TYPE));
+        memmove(leaf->values + i + 1, leaf->values + i, (left_degree - 1 - i) * sizeof(BTREE_VALUE_TYPE));
+        leaf->keys[i] = key;
+        leaf->values[i] = value;
+    }
+    leaf->node.degree = (uint32_t)left_degree;
+    new_leaf->node.degree = (uint32_t)right_degree;
+    if (slot != NULL) *slot = i >= left_degree ? &new_leaf->values[i - left_degree] : &leaf->values[i];
+
+    // link the new leaf in right after the one it was split from
+    BTREE_FUNC(leaf_link_after)(leaf, new_leaf);
+#ifdef BTREE_APPEND_FAST_PATH
+    if (new_leaf->next == NULL) tree->last_leaf = new_leaf;
+#endif
+
+    BTREE_FUNC(insert_into_inner)(tree, stack, index_stack, stack_size, new_leaf->keys[0], &new_leaf->node, spare, &num_spare);
+    BTREE_FUNC(spare_release)(tree, spare, num_spare);
+    return true;
+}
+
+#ifdef BTREE_CONCURRENT
+static bool BTREE_FUNC(optimistic_insert)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value) {
+    // insert holding only the leaf's lock, returns false without inserting if the leaf is full
+    uint64_t *epoch = btree_epoch_enter(&tree->epoch);
+    bool inserted = false;
+    while (true) {
+        uint64_t version;
+        BTREE_LEAF_NODE *leaf = BTREE_FUNC(optimistic_find_leaf)(tree, key, &version);
+        if (!BTREE_FUNC(node_try_upgrade)(&leaf->node, version)) continue;
+        // the leaf is locked and hasn't changed since the descent reached it
+        if (leaf->node.degree < BTREE_LEAF_MAX_DEGREE) {
+            BTREE_FUNC(leaf_insert_at)(leaf, BTREE_FUNC(leaf_insert_position)(leaf, key), key, value);
+            BTREE_FUNC(node_unlock)(&leaf->node);
+            inserted = true;
+        } else {
+            BTREE_FUNC(node_unlock_unchanged)(&leaf->node, version);
+        }
+        break;
+    }
+    btree_epoch_exit(epoch);
+    return inserted;
+}
+#endif
+
+static BTREE_LEAF_NODE *BTREE_FUNC(writable_path)(BTREE_NAME *tree, BTREE_KEY_TYPE key,
+                                                  BTREE_INNER_NODE **stack, size_t *index_stack, size_t *stack_size) {
+    /* Descend to the leaf where key would be inserted, recording the path in stack/index_stack
+       and copying shared nodes on the way (see node_writable). Returns NULL if out of memory.
+    */
+    BTREE_NODE *current_node = BTREE_FUNC(node_writable)(tree, &tree->root);
+    *stack_size = 0;
+    while (current_node != NULL && current_node->height > 0 && *stack_size < BTREE_MAX_HEIGHT) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(current_node);
+        size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)current_node->degree, key);
+        index_stack[*stack_size] = idx;
+        stack[(*stack_size)++] = inner;
+        current_node = BTREE_FUNC(node_writable)(tree, &inner->children[idx]);
+    }
+    if (current_node == NULL || current_node->height > 0) return NULL;
+    return BTREE_AS_LEAF(current_node);
+}
+
+static inline bool BTREE_FUNC(leaf_find)(BTREE_LEAF_NODE *leaf, BTREE_KEY_TYPE key, size_t *idx) {
+    // index of the last entry equal to key in the leaf, the same one get returns
+    size_t degree = (size_t)leaf->node.degree;
+    if (degree == 0) return false;
+    size_t i = BTREE_FUNC(binary_search_keys)(leaf->keys, degree, key);
+    if (!BTREE_KEY_EQUALS(key, leaf->keys[i])) return false;
+    *idx = i;
+    return true;
+}
+
+#ifdef BTREE_APPEND_FAST_PATH
+static inline bool BTREE_FUNC(append_to_last_leaf)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value) {
+    /* If key is at or above the last key of the rightmost leaf and that leaf has room,
+       append it there without descending from the root. Returns false, having changed
+       nothing, for insert to take the regular path.
+    */
+    BTREE_LEAF_NODE *leaf = tree->last_leaf;
+    // a leaf linked in after last_leaf (by insert_many) makes it stale, but never invalid
+    if (leaf == NULL || leaf->next != NULL) return false;
+    size_t degree = (size_t)leaf->node.degree;
+    if (degree == 0 || degree == BTREE_LEAF_MAX_DEGREE || BTREE_KEY_LESS_THAN(key, leaf->keys[degree - 1])) return false;
+    leaf->keys[degree] = key;
+    leaf->values[degree] = value;
+    leaf->node.degree++;
+#ifdef BTREE_ORDER_STATISTICS
+    // the entry is under the last child all the way down
+    BTREE_NODE *node = tree->root;
+    while (node->height > 0) {
+        size_t last = (size_t)node->degree - 1;
+        BTREE_FUNC(count_add)(BTREE_AS_INNER(node), last, 1);
+        node = BTREE_AS_INNER(node)->children[last];
+    }
+#endif
+    return true;
+}
+#endif
+
+#ifdef BTREE_BUFFERED
+// adds sorted messages to the root's buffer, see the buffered writes below
+static bool BTREE_FUNC(buffer_write)(BTREE_NAME *tree, const BTREE_MESSAGE *messages, size_t n);
+
+static inline bool BTREE_FUNC(buffer_write_one)(BTREE_NAME *tree, btree_message_op_t op, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value) {
+    BTREE_MESSAGE message;
+    message.key = key;
+    message.value = value;
+    message.op = (uint8_t)op;
+    return BTREE_FUNC(buffer_write)(tree, &message, 1);
+}
+#endif
+
+static bool BTREE_FUNC(insert_entry)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value) {
+    if (tree == NULL || tree->root == NULL) return false;
+#ifdef BTREE_BUFFERED
+    return BTREE_FUNC(buffer_write_one)(tree, BTREE_MESSAGE_INSERT, key, value);
+#endif
+#ifdef BTREE_APPEND_FAST_PATH
+    if (BTREE_FUNC(append_to_last_leaf)(tree, key, value)) return true;
+#endif
+#ifdef BTREE_CONCURRENT
+    // most inserts fit in their leaf, the others split under the write mutex
+    if (BTREE_FUNC(optimistic_insert)(tree, key, value)) return true;
+#endif
+    BTREE_FUNC(write_begin)(tree);
+    size_t stack_size;
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+
+    bool inserted = false;
+    BTREE_LEAF_NODE *leaf = BTREE_FUNC(writable_path)(tree, key, stack, index_stack, &stack_size);
+    if (leaf != NULL) {
+        inserted = BTREE_FUNC(insert_into_leaf)(tree, stack, index_stack, stack_size, leaf, key, value, NULL);
+    }
+    BTREE_FUNC(write_end)(tree);
+    return inserted;
+}
+
+bool BTREE_FUNC(insert)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value) {
+    uint64_t start = BTREE_LATENCY_START();
+    bool inserted = BTREE_FUNC(insert_entry)(tree, key, value);
+    if (tree != NULL) {
+#ifndef BTREE_BUFFERED
+        if (inserted) BTREE_STAT_ADD(tree, inserts, 1);
+#endif
+        BTREE_LATENCY_RECORD(tree, insert, start);
+    }
+    return inserted;
+}
+
+static BTREE_VALUE_TYPE *BTREE_FUNC(find_or_insert)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value, bool *found) {
+    /* Descend once for key. If the key is there, returns its value slot and sets *found,
+       otherwise inserts key with value and returns the new entry's slot.
+       Returns NULL if out of memory. Called between write_begin and write_end,
+       the leaf holding the slot stays locked until write_end.
+    */
+    size_t stack_size;
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+
+    *found = false;
+    BTREE_LEAF_NODE *leaf = BTREE_FUNC(writable_path)(tree, key, stack, index_stack, &stack_size);
+    if (leaf == NULL) return NULL;
+    // optimistic inserts and deletes change leaves under the leaf lock alone, so search under it too
+    BTREE_FUNC(write_lock)(tree, &leaf->node);
+    size_t idx;
+    if (BTREE_FUNC(leaf_find)(leaf, key, &idx)) {
+        *found = true;
+        return &leaf->values[idx];
+    }
+    // equal keys go last, and the key is not in the leaf, so this is where insert puts it
+    BTREE_VALUE_TYPE *slot = NULL;
+    if (!BTREE_FUNC(insert_into_leaf)(tree, stack, index_stack, stack_size, leaf, key, value, &slot)) return NULL;
+    BTREE_STAT_ADD(tree, inserts, 1);
+    return slot;
+}
+
+#ifdef BTREE_CONCURRENT
+static bool BTREE_FUNC(optimistic_upsert)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value,
+                                          BTREE_VALUE_TYPE *old_value, bool *found) {
+    // upsert holding only the leaf's lock, returns false without changing anything if it would split the leaf
+    uint64_t *epoch = btree_epoch_enter(&tree->epoch);
+    bool done = false;
+    while (true) {
+        uint64_t version;
+        BTREE_LEAF_NODE *leaf = BTREE_FUNC(optimistic_find_leaf)(tree, key, &version);
+        if (!BTREE_FUNC(node_try_upgrade)(&leaf->node, version)) continue;
+        size_t idx;
+        *found = BTREE_FUNC(leaf_find)(leaf, key, &idx);
+        if (*found) {
+            if (old_value != NULL) *old_value = leaf->values[idx];
+            leaf->values[idx] = value;
+            BTREE_FUNC(node_unlock)(&leaf->node);
+            done = true;
+        } else if (leaf->node.degree < BTREE_LEAF_MAX_DEGREE) {
+            BTREE_FUNC(leaf_insert_at)(leaf, BTREE_FUNC(leaf_insert_position)(leaf, key), key, value);
+            BTREE_FUNC(node_unlock)(&leaf->node);
+            BTREE_STAT_ADD(tree, inserts, 1);
+            done = true;
+        } else {
+            BTREE_FUNC(node_unlock_unchanged)(&leaf->node, version);
+        }
+        break;
+    }
+    btree_epoch_exit(epoch);
+    return done;
+}
+#endif
+
+bool BTREE_FUNC(upsert)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value, BTREE_VALUE_TYPE *old_value) {
+    /* Insert key with value, or if the key is already in the tree, replace its value in place
+       and store the previous one in *old_value (if not NULL). With duplicate keys, the entry
+       replaced is the one get returns.
+
+       Returns true if the key was already there, false if it was inserted
+       (or couldn't be, for lack of memory).
+    */
+    if (tree == NULL || tree->root == NULL) return false;
+    bool found = false;
+#ifdef BTREE_CONCURRENT
+    if (BTREE_FUNC(optimistic_upsert)(tree, key, value, old_value, &found)) return found;
+#endif
+#ifdef BTREE_BUFFERED
+    // read the key through the buffers, then buffer the write
+    BTREE_VALUE_TYPE *current = BTREE_FUNC(get_ptr)(tree->root, key);
+    found = current != NULL;
+    if (found && old_value != NULL) *old_value = *current;
+    return BTREE_FUNC(buffer_write_one)(tree, BTREE_MESSAGE_UPSERT, key, value) && found;
+#endif
+    BTREE_FUNC(write_begin)(tree);
+    BTREE_VALUE_TYPE *slot = BTREE_FUNC(find_or_insert)(tree, key, value, &found);
+    if (found) {
+        if (old_value != NULL) *old_value = *slot;
+        *slot = value;
+    }
+    BTREE_FUNC(write_end)(tree);
+    return found;
+}
+
+#if !defined(BTREE_CONCURRENT) && !defined(BTREE_BUFFERED)
+bool BTREE_FUNC(get_or_insert)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE **slot) {
+    /* Point *slot at the value for key in its leaf, inserting the key with BTREE_VALUE_NULL
+       first if it isn't in the tree, so that e.g. a counter can be updated in place:
+
+           BTREE_VALUE_TYPE *count;
+           BTREE_FUNC(get_or_insert)(tree, key, &count);
+           if (count != NULL) (*count)++;
+
+       Returns true if the key was already there. *slot is NULL if the key couldn't be
+       inserted for lack of memory. The slot is only valid until the next write to the tree
+       (or with BTREE_SNAPSHOTS, the next snapshot of it).
+
+       Not available with BTREE_CONCURRENT, since another writer could move the entry
+       while the slot is in use, use upsert there. Nor with BTREE_BUFFERED, where a new
+       key doesn't have a slot in a leaf until its insert is flushed.
+    */
+    if (slot == NULL) return false;
+    *slot = NULL;
+    if (tree == NULL || tree->root == NULL) return false;
+    bool found;
+    *slot = BTREE_FUNC(find_or_insert)(tree, key, BTREE_VALUE_NULL, &found);
+    return found;
+}
+#endif
+
+bool BTREE_FUNC(insert_many)(BTREE_NAME *tree, BTREE_KEY_TYPE *keys, BTREE_VALUE_TYPE *values, size_t n) {
+    /* Insert n keys sorted in ascending order.
+
+       Rather than descending from the root for every key, the path to the current leaf
+       is kept along with the upper bound of each node on it (the separator to the right
+       of the node in its parent). The next key only moves back up as far as the first
+       node whose range contains it before going down again.
+
+       All of the keys that land in one leaf are merged into it in a single backward pass
+       from the end of the leaf. If they don't fit, the merged entries are spread over the
+       leaf and one new leaf, and the new leaf is added to the parent, at which point the
+       path is dropped and the next key starts again from the root.
+
+       Returns false if the keys are not sorted (nothing is inserted) or if the memory pool
+       runs out (the keys before the failure remain inserted).
+
+       With BTREE_BUFFERED, the keys are buffered like single inserts, in one merge into
+       the root's buffer.
+    */
+    if (tree == NULL || tree->root == NULL || keys == NULL || values == NULL) return false;
+    for (size_t i = 1; i < n; i++) {
+        if (BTREE_KEY_LESS_THAN(keys[i], keys[i - 1])) return false;
+    }
+#ifdef BTREE_BUFFERED
+    if (n == 0) return true;
+    BTREE_MESSAGE *messages = malloc(n * sizeof(BTREE_MESSAGE));
+    if (messages == NULL) return false;
+    for (size_t i = 0; i < n; i++) {
+        messages[i].key = keys[i];
+        messages[i].value = values[i];
+        messages[i].op = BTREE_MESSAGE_INSERT;
+    }
+    bool buffered = BTREE_FUNC(buffer_write)(tree, messages, n);
+    free(messages);
+    return buffered;
+#endif
+
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+    // upper bound of the key range of the node at each depth, the leaf being at depth stack_size
+    BTREE_KEY_TYPE bounds[BTREE_MAX_HEIGHT + 1];
+    bool bounded[BTREE_MAX_HEIGHT + 1];
+    size_t stack_size = 0;
+    BTREE_LEAF_NODE *leaf = NULL;
+    BTREE_INNER_NODE *spare[BTREE_MAX_HEIGHT + 1];
+    size_t num_spare = 0;
+
+    BTREE_FUNC(write_begin)(tree);
+    bool inserted = true;
+    size_t i = 0;
+    while (i < n) {
+        BTREE_KEY_TYPE key = keys[i];
+        BTREE_NODE *current;
+        if (leaf == NULL) {
+            // no path yet, or it was invalidated by a split, start from the root
+            stack_size = 0;
+            current = BTREE_FUNC(node_writable)(tree, &tree->root);
+            bounded[0] = false;
+        } else {
+            // move up to the first node on the path whose range still contains the key
+            size_t depth = stack_size;
+            while (depth > 0 && bounded[depth] && !BTREE_KEY_LESS_THAN(key, bounds[depth])) {
+                depth--;
+            }
+            if (depth == stack_size) {
+                current = &leaf->node;
+            } else {
+                current = &stack[depth]->node;
+                stack_size = depth;
+            }
+        }
+        while (current != NULL && current->height > 0 && stack_size < BTREE_MAX_HEIGHT) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(current);
+            size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)current->degree, key);
+            index_stack[stack_size] = idx;
+            stack[stack_size++] = inner;
+            // the child ends where its right sibling starts, or where its parent ends
+            if (idx + 1 < (size_t)current->degree) {
+                bounds[stack_size] = inner->keys[idx + 1];
+                bounded[stack_size] = true;
+            } else {
+                bounds[stack_size] = bounds[stack_size - 1];
+                bounded[stack_size] = bounded[stack_size - 1];
+            }
+            current = BTREE_FUNC(node_writable)(tree, &inner->children[idx]);
+        }
+        if (current == NULL || current->height > 0) {
+            inserted = false;
+            break;
+        }
+        leaf = BTREE_AS_LEAF(current);
+        BTREE_FUNC(write_lock)(tree, &leaf->node);
+
+        // the run of keys that belong in this leaf, capped at what two leaves can hold
+        size_t degree = (size_t)leaf->node.degree;
+        size_t run = 1;
+        while (i + run < n && degree + run < 2 * BTREE_LEAF_MAX_DEGREE
+               && (!bounded[stack_size] || BTREE_KEY_LESS_THAN(keys[i + run], bounds[stack_size]))) {
+            run++;
+        }
+
+        size_t total = degree + run;
+        size_t left_degree = total;
+        BTREE_LEAF_NODE *right = NULL;
+        if (total > BTREE_LEAF_MAX_DEGREE) {
+            // split the same way insert does, the left node keeps the extra entry
+            left_degree = total - total / 2;
+            right = BTREE_FUNC(leaf_node_new)(tree);
+            if (right == NULL) {
+                inserted = false;
+                break;
+            }
+            // and the inner nodes the split can cascade into, before the leaf changes
+            if (!BTREE_FUNC(split_reserve)(tree, stack, stack_size, 0, spare, &num_spare)) {
+                BTREE_FUNC(node_release)(tree, &right->node);
+                inserted = false;
+                break;
+            }
+            BTREE_STAT_ADD(tree, leaf_splits, 1);
+        }
+
+        /* Merge backwards into [leaf | right] treated as one array, so the existing entries
+           only move once. The write position is always ahead of the next leaf entry to read.
+           On equal keys the new entry goes after the existing one, as with insert.
+        */
+        size_t a = degree;
+        size_t b = run;
+        size_t w = total;
+        while (b > 0) {
+            w--;
+            BTREE_LEAF_NODE *dst = w < left_degree ? leaf : right;
+            size_t pos = w < left_degree ? w : w - left_degree;
+            if (a > 0 && BTREE_KEY_LESS_THAN(keys[i + b - 1], leaf->keys[a - 1])) {
+                a--;
+                dst->keys[pos] = leaf->keys[a];
+                dst->values[pos] = leaf->values[a];
+            } else {
+                b--;
+                dst->keys[pos] = keys[i + b];
+                dst->values[pos] = values[i + b];
+            }
+        }
+        if (a > left_degree) {
+            // existing entries smaller than every new key that still belong in the right node
+            memcpy(right->keys, leaf->keys + left_degree, (a - left_degree) * sizeof(BTREE_KEY_TYPE));
+            memcpy(right->values, leaf->values + left_degree, (a - left_degree) * sizeof(BTREE_VALUE_TYPE));
+        }
+        i += run;
+        BTREE_FUNC(path_count_add)(stack, index_stack, stack_size, (ptrdiff_t)run);
+        BTREE_STAT_ADD(tree, inserts, run);
+
+        if (right == NULL) {
+            leaf->node.degree = (uint32_t)total;
+            // only hold on to the leaf's lock for one run at a time
+            BTREE_FUNC(write_unlock_all)(tree);
+            continue;
+        }
+        leaf->node.degree = (uint32_t)left_degree;
+        right->node.degree = (uint32_t)(total - left_degree);
+        BTREE_FUNC(leaf_link_after)(leaf, right);
+
+        BTREE_FUNC(insert_into_inner)(tree, stack, index_stack, stack_size, right->keys[0], &right->node, spare, &num_spare);
+        BTREE_FUNC(spare_release)(tree, spare, num_spare);
+        BTREE_FUNC(write_unlock_all)(tree);
+        leaf = NULL;
+    }
+    BTREE_FUNC(write_end)(tree);
+    return inserted;
+}
+
+static bool BTREE_FUNC(rebalance_leaf)(BTREE_NAME *tree, BTREE_INNER_NODE *parent, size_t current_idx) {
+    /* The leaf at parent->children[current_idx] became underfull.
+       Borrow an entry from a sibling if it can spare one, otherwise merge with it.
+       Returns true if the leaves were merged, i.e. the parent lost a child.
+
+       If the sibling is shared with a snapshot and can't be copied, the leaf is left underfull,
+       which doesn't affect searches.
+    */
+    BTREE_LEAF_NODE *current = BTREE_AS_LEAF(parent->children[current_idx]);
+    BTREE_LEAF_NODE *neighbor = NULL;
+    size_t i;
+    BTREE_FUNC(write_lock)(tree, &parent->node);
+    if (current_idx < (size_t)parent->node.degree - 1) {
+        // current is not parent's last child, check right sibling
+        neighbor = BTREE_AS_LEAF(BTREE_FUNC(node_writable)(tree, &parent->children[current_idx + 1]));
+        if (neighbor == NULL) return false;
+        BTREE_FUNC(write_lock)(tree, &neighbor->node);
+        if (neighbor->node.degree > BTREE_LEAF_MIN_DEGREE) {
+            // neighbor has at least A + 1 keys, borrow one
+            i = (size_t)current->node.degree;
+            current->keys[i] = neighbor->keys[0];
+            current->values[i] = neighbor->values[0];
+            memmove(neighbor->keys, neighbor->keys + 1, (neighbor->node.degree - 1) * sizeof(BTREE_KEY_TYPE));
+            memmove(neighbor->values, neighbor->values + 1, (neighbor->node.degree - 1) * sizeof(BTREE_VALUE_TYPE));
+            parent->keys[current_idx + 1] = neighbor->keys[0];
+            neighbor->node.degree--;
+            current->node.degree++;
+            BTREE_FUNC(count_add)(parent, current_idx, 1);
+            BTREE_FUNC(count_add)(parent, current_idx + 1, -1);
+            BTREE_STAT_ADD(tree, leaf_borrows, 1);
+            return false;
+        }
+        // sibling only has A keys, cannot borrow, have to merge
+        i = (size_t)current->node.degree;
+        // copy all keys/values from neighbor
+        memcpy(current->keys + i, neighbor->keys, neighbor->node.degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(current->values + i, neighbor->values, neighbor->node.degree * sizeof(BTREE_VALUE_TYPE));
+        // add neighbor's degree to current
+        current->node.degree += neighbor->node.degree;
+        BTREE_FUNC(count_add)(parent, current_idx, (ptrdiff_t)neighbor->node.degree);
+        // unlink neighbor from the leaf chain
+        BTREE_FUNC(leaf_unlink)(neighbor);
+        BTREE_STAT_ADD(tree, leaf_merges, 1);
+        // release neighbor node to memory pool
+        BTREE_FUNC(node_retire)(tree, &neighbor->node);
+        // remove neighbor from parent, shift parent's keys and children to the left
+        parent->node.degree--;
+        i = current_idx + 1;
+        memmove(parent->keys + i, parent->keys + i + 1, (parent->node.degree - i) * sizeof(BTREE_KEY_TYPE));
+        memmove(parent->children + i, parent->children + i + 1, (parent->node.degree - i) * sizeof(BTREE_NODE *));
+        BTREE_FUNC(counts_move)(parent, i, parent, i + 1, parent->node.degree - i);
+        return true;
+    }
+
+    // current is the last child, try left sibling
+    neighbor = BTREE_AS_LEAF(BTREE_FUNC(node_writable)(tree, &parent->children[current_idx - 1]));
+    if (neighbor == NULL) return false;
+    BTREE_FUNC(write_lock)(tree, &neighbor->node);
+    if (neighbor->node.degree > BTREE_LEAF_MIN_DEGREE) {
+        // left sibling has at least A + 1 keys, move its last entry to current's position 0
+        memmove(current->keys + 1, current->keys, current->node.degree * sizeof(BTREE_KEY_TYPE));
+        memmove(current->values + 1, current->values, current->node.degree * sizeof(BTREE_VALUE_TYPE));
+        i = (size_t)neighbor->node.degree - 1;
+        current->keys[0] = neighbor->keys[i];
+        current->values[0] = neighbor->values[i];
+        parent->keys[current_idx] = neighbor->keys[i];
+        neighbor->node.degree--;
+        current->node.degree++;
+        BTREE_FUNC(count_add)(parent, current_idx, 1);
+        BTREE_FUNC(count_add)(parent, current_idx - 1, -1);
+        BTREE_STAT_ADD(tree, leaf_borrows, 1);
+        return false;
+    }
+    // left sibling only has A keys, cannot borrow, have to merge
+    i = (size_t)neighbor->node.degree;
+    memcpy(neighbor->keys + i, current->keys, current->node.degree * sizeof(BTREE_KEY_TYPE));
+    memcpy(neighbor->values + i, current->values, current->node.degree * sizeof(BTREE_VALUE_TYPE));
+    neighbor->node.degree += current->node.degree;
+    BTREE_FUNC(count_add)(parent, current_idx - 1, (ptrdiff_t)current->node.degree);
+    // unlink current from the leaf chain
+    BTREE_FUNC(leaf_unlink)(current);
+    BTREE_STAT_ADD(tree, leaf_merges, 1);
+    BTREE_FUNC(node_retire)(tree, &current->node);
+    // decrease parent's degree. Since current is the last child,
+    // it's like popping from a stack. No need to shift keys/children
+    parent->node.degree--;
+    return true;
+}
+
+static bool BTREE_FUNC(rebalance_inner)(BTREE_NAME *tree, BTREE_INNER_NODE *parent, size_t current_idx) {
+    /* Same as rebalance_leaf for an inner node. Here the separator in the parent
+       moves down into the node when taking a child from a sibling, since the
+       first key of an inner node is not a separator.
+
+       With BTREE_BUFFERED the messages for the children that move go along with them, and
+       if there's no memory for them the node is left underfull.
+    */
+    BTREE_INNER_NODE *current = BTREE_AS_INNER(parent->children[current_idx]);
+    BTREE_INNER_NODE *neighbor = NULL;
+    size_t i;
+    BTREE_FUNC(write_lock)(tree, &parent->node);
+    if (current_idx < (size_t)parent->node.degree - 1) {
+        // current is not parent's last child, check right sibling
+        neighbor = BTREE_AS_INNER(BTREE_FUNC(node_writable)(tree, &parent->children[current_idx + 1]));
+        if (neighbor == NULL) return false;
+        BTREE_FUNC(write_lock)(tree, &neighbor->node);
+        if (neighbor->node.degree > BTREE_INNER_MIN_DEGREE) {
+            // neighbor has at least A + 1 keys, borrow one
+#ifdef BTREE_BUFFERED
+            size_t moved_messages = BTREE_FUNC(messages_lower_bound)(neighbor, neighbor->keys[1]);
+            if (!BTREE_FUNC(messages_reserve)(tree, current, (size_t)current->num_messages + moved_messages)) return false;
+            BTREE_FUNC(messages_move)(neighbor, 0, moved_messages, current, (size_t)current->num_messages);
+#endif
+            i = (size_t)current->node.degree;
+            size_t moved = BTREE_FUNC(subtree_count)(neighbor->children[0]);
+            current->keys[i] = parent->keys[current_idx + 1];
+            current->children[i] = neighbor->children[0];
+            BTREE_FUNC(count_set)(current, i, moved);
+            parent->keys[current_idx + 1] = neighbor->keys[1];
+            neighbor->keys[0] = neighbor->keys[1];
+            neighbor->children[0] = neighbor->children[1];
+            memmove(neighbor->keys + 1, neighbor->keys + 2, (neighbor->node.degree - 2) * sizeof(BTREE_KEY_TYPE));
+            memmove(neighbor->children + 1, neighbor->children + 2, (neighbor->node.degree - 2) * sizeof(BTREE_NODE *));
+            BTREE_FUNC(counts_move)(neighbor, 0, neighbor, 1, neighbor->node.degree - 1);
+            BTREE_FUNC(count_add)(parent, current_idx, (ptrdiff_t)moved);
+            BTREE_FUNC(count_add)(parent, current_idx + 1, -(ptrdiff_t)moved);
+            neighbor->node.degree--;
+            current->node.degree++;
+            BTREE_STAT_ADD(tree, inner_borrows, 1);
+            return false;
+        }
+        // sibling only has A keys, cannot borrow, have to merge
+#ifdef BTREE_BUFFERED
+        if (!BTREE_FUNC(messages_reserve)(tree, current, (size_t)current->num_messages + neighbor->num_messages)) return false;
+        BTREE_FUNC(messages_move)(neighbor, 0, (size_t)neighbor->num_messages, current, (size_t)current->num_messages);
+#endif
+        i = (size_t)current->node.degree;
+        // take neighbor's key from parent, copy all other keys from neighbor
+        current->keys[i] = parent->keys[current_idx + 1];
+        memcpy(current->keys + i + 1, neighbor->keys + 1, (neighbor->node.degree - 1) * sizeof(BTREE_KEY_TYPE));
+        // copy all children from neighbor
+        memcpy(current->children + i, neighbor->children, neighbor->node.degree * sizeof(BTREE_NODE *));
+        BTREE_FUNC(counts_move)(current, i, neighbor, 0, (size_t)neighbor->node.degree);
+        BTREE_FUNC(count_add)(parent, current_idx, (ptrdiff_t)BTREE_FUNC(subtree_count)(&neighbor->node));
+        current->node.degree += neighbor->node.degree;
+        BTREE_FUNC(node_retire)(tree, &neighbor->node);
+        BTREE_STAT_ADD(tree, inner_merges, 1);
+        parent->node.degree--;
+        i = current_idx + 1;
+        memmove(parent->keys + i, parent->keys + i + 1, (parent->node.degree - i) * sizeof(BTREE_KEY_TYPE));
+        memmove(parent->children + i, parent->children + i + 1, (parent->node.degree - i) * sizeof(BTREE_NODE *));
+        BTREE_FUNC(counts_move)(parent, i, parent, i + 1, parent->node.degree - i);
+        return true;
+    }
+
+    // current is the last child, try left sibling
+    neighbor = BTREE_AS_INNER(BTREE_FUNC(node_writable)(tree, &parent->children[current_idx - 1]));
+    if (neighbor == NULL) return false;
+    BTREE_FUNC(write_lock)(tree, &neighbor->node);
+    if (neighbor->node.degree > BTREE_INNER_MIN_DEGREE) {
+        /* Left sibling has at least A + 1 keys, take its last key/child
+           and move it current's position 0.
+
+           Diagram:
+
+                  parent
+                 /      \
+             neighbor   current
+           0 1 2 3 4 5 | 6 7 8 9
+
+           After sharing:
+
+                 parent
+                /      \
+            neighbor   current
+           0 1 2 3 4 | 5 6 7 8 9
+        */
+#ifdef BTREE_BUFFERED
+        size_t start = BTREE_FUNC(messages_lower_bound)(neighbor, neighbor->keys[neighbor->node.degree - 1]);
+        size_t moved_messages = (size_t)neighbor->num_messages - start;
+        if (!BTREE_FUNC(messages_reserve)(tree, current, (size_t)current->num_messages + moved_messages)) return false;
+        BTREE_FUNC(messages_move)(neighbor, start, moved_messages, current, 0);
+#endif
+        // move current node's keys and children to the right by 1
+        memmove(current->children + 1, current->children, current->node.degree * sizeof(BTREE_NODE *));
+        BTREE_FUNC(counts_move)(current, 1, current, 0, (size_t)current->node.degree);
+        memmove(current->keys + 2, current->keys + 1, (current->node.degree - 1) * sizeof(BTREE_KEY_TYPE));
+        i = (size_t)neighbor->node.degree - 1;
+        size_t moved = BTREE_FUNC(subtree_count)(neighbor->children[i]);
+        BTREE_FUNC(count_set)(current, 0, moved);
+        BTREE_FUNC(count_add)(parent, current_idx, (ptrdiff_t)moved);
+        BTREE_FUNC(count_add)(parent, current_idx - 1, -(ptrdiff_t)moved);
+        // neighbor's last child becomes current's first child, parent's key separates it from the old first child
+        current->children[0] = neighbor->children[i];
+        current->keys[1] = parent->keys[current_idx];
+        current->keys[0] = neighbor->keys[i];
+        parent->keys[current_idx] = neighbor->keys[i];
+        neighbor->node.degree--;
+        current->node.degree++;
+        BTREE_STAT_ADD(tree, inner_borrows, 1);
+        return false;
+    }
+    // left sibling only has A keys, cannot borrow, have to merge
+#ifdef BTREE_BUFFERED
+    if (!BTREE_FUNC(messages_reserve)(tree, neighbor, (size_t)neighbor->num_messages + current->num_messages)) return false;
+    BTREE_FUNC(messages_move)(current, 0, (size_t)current->num_messages, neighbor, (size_t)neighbor->num_messages);
+#endif
+    i = (size_t)neighbor->node.degree;
+    // take parent's key, copy all keys except the first from current to neighbor
+    neighbor->keys[i] = parent->keys[current_idx];
+    memcpy(neighbor->keys + i + 1, current->keys + 1, (current->node.degree - 1) * sizeof(BTREE_KEY_TYPE));
+    // copy over all children from sibling
+    memcpy(neighbor->children + i, current->children, current->node.degree * sizeof(BTREE_NODE *));
+    BTREE_FUNC(counts_move)(neighbor, i, current, 0, (size_t)current->node.degree);
+    BTREE_FUNC(count_add)(parent, current_idx - 1, (ptrdiff_t)BTREE_FUNC(subtree_count)(&current->node));
+    neighbor->node.degree += current->node.degree;
+    BTREE_FUNC(node_retire)(tree, &current->node);
+    BTREE_STAT_ADD(tree, inner_merges, 1);
+    parent->node.degree--;
+    return true;
+}
+
+static inline void BTREE_FUNC(leaf_remove_at)(BTREE_LEAF_NODE *leaf, size_t i) {
+    leaf->node.degree--;
+    memmove(leaf->keys + i, leaf->keys + i + 1, (leaf->node.degree - i) * sizeof(BTREE_KEY_TYPE));
+    memmove(leaf->values + i, leaf->values + i + 1, (leaf->node.degree - i) * sizeof(BTREE_VALUE_TYPE));
+}
+
+#ifdef BTREE_CONCURRENT
+static bool BTREE_FUNC(optimistic_remove)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE *value, bool *removed) {
+    /* Delete holding only the leaf's lock. Returns false without deleting if the leaf would
+       become underfull, otherwise sets *removed to whether the key was found.
+    */
+    uint64_t *epoch = btree_epoch_enter(&tree->epoch);
+    bool done = true;
+    while (true) {
+        uint64_t version;
+        BTREE_LEAF_NODE *leaf = BTREE_FUNC(optimistic_find_leaf)(tree, key, &version);
+        if (!BTREE_FUNC(node_try_upgrade)(&leaf->node, version)) continue;
+        size_t degree = (size_t)leaf->node.degree;
+        size_t i = degree > 0 ? BTREE_FUNC(binary_search_keys)(leaf->keys, degree, key) : 0;
+        if (degree == 0 || !BTREE_KEY_EQUALS(key, leaf->keys[i])) {
+            BTREE_FUNC(node_unlock_unchanged)(&leaf->node, version);
+            *removed = false;
+        } else if (degree > BTREE_LEAF_MIN_DEGREE || __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) == &leaf->node) {
+            // the root can't change while its leaf is locked, and has no minimum degree
+            if (value != NULL) {
+                *value = leaf->values[i];
+            }
+            BTREE_FUNC(leaf_remove_at)(leaf, i);
+            BTREE_FUNC(node_unlock)(&leaf->node);
+            *removed = true;
+        } else {
+            BTREE_FUNC(node_unlock_unchanged)(&leaf->node, version);
+            done = false;
+        }
+        break;
+    }
+    btree_epoch_exit(epoch);
+    return done;
+}
+#endif
+
+static bool BTREE_FUNC(remove_entry)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE *value) {
+    if (tree == NULL || tree->root == NULL) return false;
+#ifdef BTREE_BUFFERED
+    // read the key through the buffers, then buffer its delete
+    BTREE_VALUE_TYPE *slot = BTREE_FUNC(get_ptr)(tree->root, key);
+    if (slot == NULL) return false;
+    BTREE_VALUE_TYPE removed = *slot;
+    if (!BTREE_FUNC(buffer_write_one)(tree, BTREE_MESSAGE_DELETE, key, removed)) return false;
+    if (value != NULL) *value = removed;
+    return true;
+#endif
+#ifdef BTREE_CONCURRENT
+    // most deletes leave the leaf full enough, the others rebalance under the write mutex
+    bool removed;
+    if (BTREE_FUNC(optimistic_remove)(tree, key, value, &removed)) return removed;
+#endif
+    BTREE_FUNC(write_begin)(tree);
+    BTREE_NODE *current = BTREE_FUNC(node_writable)(tree, &tree->root);
+
+    size_t stack_size = 0;
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+
+    while (current != NULL && current->height > 0 && stack_size < BTREE_MAX_HEIGHT) {
+        // not at the leaf level
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(current);
+        size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)current->degree, key);
+        index_stack[stack_size] = idx;
+        stack[stack_size++] = inner;
+        current = BTREE_FUNC(node_writable)(tree, &inner->children[idx]);
+    }
+    if (current == NULL || current->height > 0) {
+        BTREE_FUNC(write_end)(tree);
+        return false;
+    }
+    // current is now a leaf node where we can delete
+    BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(current);
+    BTREE_FUNC(write_lock)(tree, current);
+    size_t i = leaf->node.degree > 0 ? BTREE_FUNC(binary_search_keys)(leaf->keys, (size_t)leaf->node.degree, key) : 0;
+    if (leaf->node.degree == 0 || !BTREE_KEY_EQUALS(key, leaf->keys[i])) {
+        // key was not found
+        BTREE_FUNC(write_end)(tree);
+        return false;
+    }
+    // key exists, delete from leaf node
+    if (value != NULL) {
+        *value = leaf->values[i];
+    }
+    BTREE_FUNC(leaf_remove_at)(leaf, i);
+    BTREE_FUNC(path_count_add)(stack, index_stack, stack_size, -1);
+
+    // deleted from node, rebalance while nodes are underfull
+    while (current->degree < BTREE_FUNC(node_min_degree)(current) && stack_size > 0) {
+        BTREE_INNER_NODE *parent = stack[--stack_size];
+        // current node's index in its parent's children array
+        size_t current_idx = index_stack[stack_size];
+        bool merged = current->height > 0 ? BTREE_FUNC(rebalance_inner)(tree, parent, current_idx)
+                                          : BTREE_FUNC(rebalance_leaf)(tree, parent, current_idx);
+        if (!merged) break;
+        // deleted from parent, propagate up
+        current = &parent->node;
+    }
+
+    // the root can be underfull, but an inner root with a single child is removed
+    current = tree->root;
+    if (current->height > 0 && current->degree == 1) {
+        BTREE_FUNC(write_lock)(tree, current);
+        BTREE_FUNC(set_root)(tree, BTREE_AS_INNER(current)->children[0]);
+        BTREE_FUNC(node_retire)(tree, current);
+        BTREE_STAT_ADD(tree, root_shrinks, 1);
+    }
+    BTREE_FUNC(write_end)(tree);
+    return true;
+}
+
+bool BTREE_FUNC(remove)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE *value) {
+    /* Delete key from the tree, storing its value in *value (if not NULL).
+       Returns false if the key was not found.
+    */
+    uint64_t start = BTREE_LATENCY_START();
+    bool removed = BTREE_FUNC(remove_entry)(tree, key, value);
+    if (tree != NULL) {
+#ifndef BTREE_BUFFERED
+        if (removed) BTREE_STAT_ADD(tree, deletes, 1);
+#endif
+        BTREE_LATENCY_RECORD(tree, remove, start);
+    }
+    return removed;
+}
+
+BTREE_VALUE_TYPE BTREE_FUNC(delete)(BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    BTREE_VALUE_TYPE value;
+    if (!BTREE_FUNC(remove)(tree, key, &value)) return BTREE_VALUE_NULL;
+    return value;
+}
+
+#ifdef BTREE_BUFFERED
+/*
+Buffered writes. A message travels down from the root's buffer with the run of messages for
+the same child. When it reaches a node just above the leaves, the run is merged into the
+leaves (apply_to_leaves), with the splits and rebalancing that insert and remove would do.
+*/
+static size_t BTREE_FUNC(leaf_apply_messages)(BTREE_NAME *tree, BTREE_LEAF_NODE *leaf, const BTREE_MESSAGE *messages, size_t n,
+                                              BTREE_KEY_TYPE *keys, BTREE_VALUE_TYPE *values) {
+    /* Merge n sorted messages with the entries of leaf into keys/values, which have room for
+       both, and return the number of entries that come out. The messages for a key apply in
+       order to the run of entries with that key: an insert adds one at the end of the run,
+       an upsert replaces the last one (or adds one to an empty run), a delete drops the last one.
+    */
+    size_t degree = (size_t)leaf->node.degree;
+    size_t a = 0;
+    size_t b = 0;
+    size_t len = 0;
+#ifndef BTREE_STATS
+    (void)tree;
+#endif
+    while (b < n) {
+        BTREE_KEY_TYPE key = messages[b].key;
+        while (a < degree && BTREE_KEY_LESS_THAN(leaf->keys[a], key)) {
+            keys[len] = leaf->keys[a];
+            values[len++] = leaf->values[a++];
+        }
+        size_t run = len;
+        while (a < degree && BTREE_KEY_EQUALS(key, leaf->keys[a])) {
+            keys[len] = leaf->keys[a];
+            values[len++] = leaf->values[a++];
+        }
+        for (; b < n && BTREE_KEY_EQUALS(key, messages[b].key); b++) {
+            if (messages[b].op == BTREE_MESSAGE_DELETE) {
+                if (len > run) {
+                    len--;
+                    BTREE_STAT_ADD(tree, deletes, 1);
+                }
+            } else if (messages[b].op == BTREE_MESSAGE_UPSERT && len > run) {
+                values[len - 1] = messages[b].value;
+            } else {
+                keys[len] = key;
+                values[len++] = messages[b].value;
+                BTREE_STAT_ADD(tree, inserts, 1);
+            }
+        }
+    }
+    memcpy(keys + len, leaf->keys + a, (degree - a) * sizeof(BTREE_KEY_TYPE));
+    memcpy(values + len, leaf->values + a, (degree - a) * sizeof(BTREE_VALUE_TYPE));
+    len += degree - a;
+    return len;
+}
+
+static void BTREE_FUNC(buffer_shrink_root)(BTREE_NAME *tree) {
+    /* An inner root left with a single child is removed, as after remove. Its messages go down
+       to the child first, or if the child is a leaf, the root stays until they're applied.
+    */
+    while (tree->root->height > 0 && tree->root->degree == 1) {
+        BTREE_INNER_NODE *root = BTREE_AS_INNER(tree->root);
+        BTREE_NODE *child = root->children[0];
+        if (root->num_messages > 0) {
+            if (child->height == 0) return;
+            if (!BTREE_FUNC(messages_add)(tree, BTREE_AS_INNER(child), root->messages, (size_t)root->num_messages)) return;
+        }
+        BTREE_FUNC(set_root)(tree, child);
+        BTREE_FUNC(node_retire)(tree, &root->node);
+        BTREE_STAT_ADD(tree, root_shrinks, 1);
+    }
+}
+
+static bool BTREE_FUNC(apply_to_leaves)(BTREE_NAME *tree, const BTREE_MESSAGE *messages, size_t n) {
+    /* Apply n sorted messages to the leaves. As in insert_many, the messages below the upper
+       bound of a leaf are merged into it at once, but at most a leaf's worth, so that it splits
+       in two at most. A leaf left underfull is rebalanced the same way as after remove.
+       The path is found again from the root for each leaf, since the nodes above may change.
+
+       Returns false if out of memory, with the messages before the failing leaf applied. The
+       failing leaf and the nodes above it are left as they were, so a run for a single leaf
+       is either applied in full or not at all.
+    */
+    if (n == 0) return true;
+    BTREE_KEY_TYPE *keys = malloc(2 * BTREE_LEAF_MAX_DEGREE * sizeof(BTREE_KEY_TYPE));
+    BTREE_VALUE_TYPE *values = malloc(2 * BTREE_LEAF_MAX_DEGREE * sizeof(BTREE_VALUE_TYPE));
+    bool applied = keys != NULL && values != NULL;
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+    BTREE_INNER_NODE *spare[BTREE_MAX_HEIGHT + 1];
+    size_t num_spare;
+    size_t i = 0;
+    while (applied && i < n) {
+        BTREE_KEY_TYPE key = messages[i].key;
+        // the leaf ends at the nearest separator to the right of the path
+        BTREE_KEY_TYPE bound = key;
+        bool bounded = false;
+        size_t stack_size = 0;
+        BTREE_NODE *current = tree->root;
+        while (current->height > 0 && stack_size < BTREE_MAX_HEIGHT) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(current);
+            size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)current->degree, key);
+            if (idx + 1 < (size_t)current->degree) {
+                bound = inner->keys[idx + 1];
+                bounded = true;
+            }
+            index_stack[stack_size] = idx;
+            stack[stack_size++] = inner;
+            current = inner->children[idx];
+        }
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(current);
+        size_t run = 1;
+        while (i + run < n && run < BTREE_LEAF_MAX_DEGREE && (!bounded || BTREE_KEY_LESS_THAN(messages[i + run].key, bound))) {
+            run++;
+        }
+
+        size_t total = BTREE_FUNC(leaf_apply_messages)(tree, leaf, messages + i, run, keys, values);
+        size_t left_degree = total;
+        BTREE_LEAF_NODE *right = NULL;
+        if (total > BTREE_LEAF_MAX_DEGREE) {
+            // split the same way insert_many does
+            left_degree = total - total / 2;
+            right = BTREE_FUNC(leaf_node_new)(tree);
+            if (right == NULL) {
+                applied = false;
+                break;
+            }
+            if (!BTREE_FUNC(split_reserve)(tree, stack, stack_size, 0, spare, &num_spare)) {
+                BTREE_FUNC(node_release)(tree, &right->node);
+                applied = false;
+                break;
+            }
+            BTREE_STAT_ADD(tree, leaf_splits, 1);
+        }
+        i += run;
+        memcpy(leaf->keys, keys, left_degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(leaf->values, values, left_degree * sizeof(BTREE_VALUE_TYPE));
+        leaf->node.degree = (uint32_t)left_degree;
+        if (right != NULL) {
+            memcpy(right->keys, keys + left_degree, (total - left_degree) * sizeof(BTREE_KEY_TYPE));
+            memcpy(right->values, values + left_degree, (total - left_degree) * sizeof(BTREE_VALUE_TYPE));
+            right->node.degree = (uint32_t)(total - left_degree);
+            BTREE_FUNC(leaf_link_after)(leaf, right);
+            BTREE_FUNC(insert_into_inner)(tree, stack, index_stack, stack_size, right->keys[0], &right->node, spare, &num_spare);
+            BTREE_FUNC(spare_release)(tree, spare, num_spare);
+            continue;
+        }
+
+        /* Rebalance while nodes are underfull, as remove does. The deletes can leave a leaf more
+           than one entry short, so it keeps borrowing until it has enough or is merged.
+        */
+        current = &leaf->node;
+        while (current->degree < BTREE_FUNC(node_min_degree)(current) && stack_size > 0) {
+            BTREE_INNER_NODE *parent = stack[stack_size - 1];
+            // a root kept above a single leaf (see buffer_shrink_root) has no sibling to offer
+            if (parent->node.degree < 2) break;
+            size_t current_idx = index_stack[stack_size - 1];
+            uint32_t degree = current->degree;
+            bool merged = current->height > 0 ? BTREE_FUNC(rebalance_inner)(tree, parent, current_idx)
+                                              : BTREE_FUNC(rebalance_leaf)(tree, parent, current_idx);
+            if (merged) {
+                stack_size--;
+                current = &parent->node;
+            } else if (current->degree == degree) {
+                break;
+            }
+        }
+        BTREE_FUNC(buffer_shrink_root)(tree);
+    }
+    free(keys);
+    free(values);
+    return applied;
+}
+
+static bool BTREE_FUNC(buffer_apply_run)(BTREE_NAME *tree, BTREE_INNER_NODE *inner, size_t start, size_t count) {
+    /* Apply inner's messages [start, start + count), all of them for the same leaf child, to
+       that leaf, at most a leaf's worth at a time. Applying them can split or merge the nodes
+       above, so they're taken out of the buffer first. If that runs out of memory nothing has
+       changed, inner included, and they go back where they were, in room the buffer still has.
+    */
+    if (count > BTREE_LEAF_MAX_DEGREE) count = BTREE_LEAF_MAX_DEGREE;
+    BTREE_MESSAGE *batch = malloc(count * sizeof(BTREE_MESSAGE));
+    if (batch == NULL) return false;
+    size_t rest = (size_t)inner->num_messages - start - count;
+    memcpy(batch, inner->messages + start, count * sizeof(BTREE_MESSAGE));
+    memmove(inner->messages + start, inner->messages + start + count, rest * sizeof(BTREE_MESSAGE));
+    inner->num_messages -= (uint32_t)count;
+    bool applied = BTREE_FUNC(apply_to_leaves)(tree, batch, count);
+    if (applied) {
+        tree->num_messages -= count;
+    } else {
+        memmove(inner->messages + start + count, inner->messages + start, rest * sizeof(BTREE_MESSAGE));
+        memcpy(inner->messages + start, batch, count * sizeof(BTREE_MESSAGE));
+        inner->num_messages += (uint32_t)count;
+    }
+    free(batch);
+    return applied;
+}
+
+static BTREE_INNER_NODE *BTREE_FUNC(buffer_leaf_parent)(BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    // the node just above the leaves whose range holds key, NULL if the root is a leaf
+    BTREE_NODE *current = tree->root;
+    if (current->height == 0) return NULL;
+    while (current->height > 1) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(current);
+        current = inner->children[BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)current->degree, key)];
+    }
+    return BTREE_AS_INNER(current);
+}
+
+static bool BTREE_FUNC(flush_step)(BTREE_NAME *tree) {
+    /* Move the messages in the root's buffer bound for the child with the most of them down
+       into that child's buffer, and on down from there while that leaves the child's buffer
+       over BTREE_BUFFER_SIZE. Messages for a leaf are applied to it, a leaf's worth at a time
+       while the buffer just above the leaves stays over BTREE_BUFFER_SIZE.
+       Returns false if out of memory, with every message still buffered somewhere.
+    */
+    BTREE_INNER_NODE *inner = BTREE_AS_INNER(tree->root);
+    while (true) {
+        size_t degree = (size_t)inner->node.degree;
+        size_t best = 0;
+        size_t best_start = 0;
+        size_t best_count = 0;
+        size_t start = 0;
+        for (size_t c = 0; c < degree; c++) {
+            size_t end = c + 1 < degree ? BTREE_FUNC(messages_lower_bound)(inner, inner->keys[c + 1]) : (size_t)inner->num_messages;
+            if (end - start > best_count) {
+                best = c;
+                best_start = start;
+                best_count = end - start;
+            }
+            start = end;
+        }
+        BTREE_NODE *child = inner->children[best];
+        if (child->height == 0) {
+            BTREE_KEY_TYPE key = inner->messages[best_start].key;
+            if (!BTREE_FUNC(buffer_apply_run)(tree, inner, best_start, best_count)) return false;
+            // the run may have split or merged inner, the rest of its messages are wherever key went
+            inner = BTREE_FUNC(buffer_leaf_parent)(tree, key);
+            if (inner == NULL || inner->num_messages <= BTREE_BUFFER_SIZE) return true;
+            continue;
+        }
+        BTREE_INNER_NODE *child_inner = BTREE_AS_INNER(child);
+        if (!BTREE_FUNC(messages_add)(tree, child_inner, inner->messages + best_start, best_count)) return false;
+        size_t rest = (size_t)inner->num_messages - best_start - best_count;
+        memmove(inner->messages + best_start, inner->messages + best_start + best_count, rest * sizeof(BTREE_MESSAGE));
+        inner->num_messages -= (uint32_t)best_count;
+        if (child_inner->num_messages <= BTREE_BUFFER_SIZE) return true;
+        inner = child_inner;
+    }
+}
+
+static bool BTREE_FUNC(buffer_write)(BTREE_NAME *tree, const BTREE_MESSAGE *messages, size_t n) {
+    /* Add n sorted messages to the root's buffer, flushing it down first until they fit in
+       BTREE_BUFFER_SIZE. A tree that is a single leaf has no buffer, so they're applied to it.
+
+       Returns false if out of memory, in which case a single write hasn't been made and the
+       messages already buffered stay buffered for the next write to try again. More than
+       BTREE_BUFFER_SIZE messages (from insert_many) are flushed on down once they're in the
+       root's buffer, and if that runs out of memory they're left there, still written.
+    */
+    while (tree->root->height > 0) {
+        size_t buffered = (size_t)BTREE_AS_INNER(tree->root)->num_messages;
+        if (buffered == 0 || buffered + n <= BTREE_BUFFER_SIZE) break;
+        if (!BTREE_FUNC(flush_step)(tree)) return false;
+    }
+    if (tree->root->height == 0) return BTREE_FUNC(apply_to_leaves)(tree, messages, n);
+    if (!BTREE_FUNC(messages_add)(tree, BTREE_AS_INNER(tree->root), messages, n)) return false;
+    tree->num_messages += n;
+    while (tree->root->height > 0 && BTREE_AS_INNER(tree->root)->num_messages > BTREE_BUFFER_SIZE) {
+        if (!BTREE_FUNC(flush_step)(tree)) break;
+    }
+    return true;
+}
+
+bool BTREE_FUNC(put)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value) {
+    /* Set the value of key, inserting it if it's not in the tree, like upsert but without
+       looking up the old value first. With duplicate keys, the entry replaced is the one get
+       returns. Only with BTREE_BUFFERED, where this just buffers the write.
+
+       Returns false if out of memory.
+    */
+    if (tree == NULL || tree->root == NULL) return false;
+    return BTREE_FUNC(buffer_write_one)(tree, BTREE_MESSAGE_UPSERT, key, value);
+}
+
+bool BTREE_FUNC(erase)(BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    /* Delete key if it's in the tree, like remove but without looking it up first, so there's
+       no telling whether it was. Only with BTREE_BUFFERED, where this just buffers the write.
+
+       Returns false if out of memory.
+    */
+    if (tree == NULL || tree->root == NULL) return false;
+    return BTREE_FUNC(buffer_write_one)(tree, BTREE_MESSAGE_DELETE, key, BTREE_VALUE_NULL);
+}
+
+static bool BTREE_FUNC(flush_down)(BTREE_NAME *tree, BTREE_NODE *node) {
+    /* Move the messages buffered in node and below it down to the buffers just above the
+       leaves, freeing the ones they leave empty. A node's messages are newer than its
+       children's, so each node's go into its children before theirs go on down.
+       Returns false if out of memory, with every message still buffered somewhere.
+    */
+    if (node->height < 2) return true;
+    BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+    // from the last child back, so each child's run is at the end of what's left
+    for (size_t c = (size_t)node->degree; c-- > 0;) {
+        size_t start = c > 0 ? BTREE_FUNC(messages_lower_bound)(inner, inner->keys[c]) : 0;
+        size_t count = (size_t)inner->num_messages - start;
+        if (count == 0) continue;
+        if (!BTREE_FUNC(messages_add)(tree, BTREE_AS_INNER(inner->children[c]), inner->messages + start, count)) return false;
+        inner->num_messages = (uint32_t)start;
+    }
+    if (inner->messages != NULL) BTREE_FUNC(messages_free)(tree, inner);
+    for (size_t c = 0; c < (size_t)node->degree; c++) {
+        if (!BTREE_FUNC(flush_down)(tree, inner->children[c])) return false;
+    }
+    return true;
+}
+
+static bool BTREE_FUNC(flush_apply)(BTREE_NAME *tree) {
+    /* Apply the messages in the buffers just above the leaves, the only ones left after
+       flush_down, going through those nodes left to right and freeing each buffer once it's
+       empty. Applying a run can split or merge the nodes on the path, so after each one the
+       path is found again from the root, by its first key, which no message left is below.
+    */
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+    size_t depth = 0;
+    if (tree->root->height == 0) return true;
+    BTREE_KEY_TYPE from = BTREE_FUNC(node_first_key)(tree->root);
+    bool started = false;
+    BTREE_INNER_NODE *inner = NULL;
+    while (true) {
+        if (inner == NULL) {
+            if (tree->root->height == 0) return true;
+            depth = 0;
+            BTREE_NODE *current = tree->root;
+            while (current->height > 1) {
+                BTREE_INNER_NODE *node = BTREE_AS_INNER(current);
+                size_t idx = started ? BTREE_FUNC(binary_search_keys)(node->keys, (size_t)current->degree, from) : 0;
+                index_stack[depth] = idx;
+                stack[depth++] = node;
+                current = node->children[idx];
+            }
+            inner = BTREE_AS_INNER(current);
+        }
+        if (inner->num_messages > 0) {
+            // the run for the child of the first message
+            from = inner->messages[0].key;
+            started = true;
+            size_t degree = (size_t)inner->node.degree;
+            size_t idx = BTREE_FUNC(binary_search_keys)(inner->keys, degree, from);
+            size_t end = idx + 1 < degree ? BTREE_FUNC(messages_lower_bound)(inner, inner->keys[idx + 1]) : (size_t)inner->num_messages;
+            if (!BTREE_FUNC(buffer_apply_run)(tree, inner, 0, end)) return false;
+            inner = NULL;
+            continue;
+        }
+        if (inner->messages != NULL) BTREE_FUNC(messages_free)(tree, inner);
+        // up to the first ancestor with a child right of the path, then down its leftmost path
+        while (depth > 0 && index_stack[depth - 1] + 1 >= (size_t)stack[depth - 1]->node.degree) {
+            depth--;
+        }
+        if (depth == 0) return true;
+        BTREE_NODE *current = stack[depth - 1]->children[++index_stack[depth - 1]];
+        while (current->height > 1) {
+            index_stack[depth] = 0;
+            stack[depth++] = BTREE_AS_INNER(current);
+            current = BTREE_AS_INNER(current)->children[0];
+        }
+        inner = BTREE_AS_INNER(current);
+    }
+}
+
+bool BTREE_FUNC(flush)(BTREE_NAME *tree) {
+    /* Apply every buffered write to the leaves and free the buffers that held them. Cursors,
+       delete_range, split_at, join, freeze and compact do this first, since they work on the leaves.
+
+       Returns false if out of memory, with the writes that weren't applied yet still buffered.
+    */
+    if (tree == NULL || tree->root == NULL) return false;
+    if (tree->num_messages > 0) {
+        if (!BTREE_FUNC(flush_down)(tree, tree->root) || !BTREE_FUNC(flush_apply)(tree)) return false;
+    }
+    BTREE_FUNC(buffer_shrink_root)(tree);
+    return true;
+}
+#endif
+
+typedef void (*BTREE_TYPED(delete_callback))(BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value, void *data);
+
+static size_t BTREE_FUNC(delete_subtree)(BTREE_NAME *tree, BTREE_NODE *node, bool release,
+                                         BTREE_TYPED(delete_callback) callback, void *data) {
+    /* Drop a subtree that lies entirely inside a deleted range, reporting its entries to callback
+       (if not NULL) and giving its nodes back to the memory pool. Returns the number of entries.
+
+       With snapshots, a node still used by another tree is only dropped from this one,
+       release is false below it and its entries are just visited.
+    */
+#ifdef BTREE_SNAPSHOTS
+    if (release && --node->refcount > 0) release = false;
+#endif
+#ifdef BTREE_CONCURRENT
+    // an optimistic insert or delete may still hold the leaf, wait for it
+    BTREE_FUNC(node_lock)(node);
+#endif
+    size_t count = 0;
+    if (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        for (size_t i = 0; i < (size_t)node->degree; i++) {
+            count += BTREE_FUNC(delete_subtree)(tree, inner->children[i], release, callback, data);
+        }
+    } else {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+        count = (size_t)node->degree;
+        if (callback != NULL) {
+            for (size_t i = 0; i < count; i++) {
+                callback(leaf->keys[i], leaf->values[i], data);
+            }
+        }
+        if (release) BTREE_FUNC(leaf_unlink)(leaf);
+    }
+    if (release) BTREE_FUNC(node_retire)(tree, node);
+#ifdef BTREE_CONCURRENT
+    BTREE_FUNC(node_unlock)(node);
+#endif
+    return count;
+}
+
+static size_t BTREE_FUNC(delete_range_node)(BTREE_NAME *tree, BTREE_NODE *node, BTREE_KEY_TYPE lo, BTREE_KEY_TYPE hi,
+                                            bool above_lo, bool below_hi,
+                                            BTREE_TYPED(delete_callback) callback, void *data) {
+    /* Delete the entries in [lo, hi) below a writable node without rebalancing. above_lo means every
+       key below the node is >= lo, below_hi that every key is < hi, never both.
+
+       Only the children holding lo and hi are descended into, everything between them is dropped
+       whole. One of those two children is always kept, so an inner node never becomes empty,
+       but the nodes on the paths to lo and hi can be left underfull.
+    */
+    BTREE_FUNC(write_lock)(tree, node);
+    size_t degree = (size_t)node->degree;
+    if (node->height == 0) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+        if (degree == 0) return 0;
+        size_t start = 0;
+        if (!above_lo) {
+            start = BTREE_FUNC(binary_search_keys_before)(leaf->keys, degree, lo);
+            if (BTREE_KEY_LESS_THAN(leaf->keys[start], lo)) start++;
+        }
+        size_t end = degree;
+        if (!below_hi) {
+            end = BTREE_FUNC(binary_search_keys_before)(leaf->keys, degree, hi);
+            if (BTREE_KEY_LESS_THAN(leaf->keys[end], hi)) end++;
+        }
+        if (end <= start) return 0;
+        if (callback != NULL) {
+            for (size_t i = start; i < end; i++) {
+                callback(leaf->keys[i], leaf->values[i], data);
+            }
+        }
+        memmove(leaf->keys + start, leaf->keys + end, (degree - end) * sizeof(BTREE_KEY_TYPE));
+        memmove(leaf->values + start, leaf->values + end, (degree - end) * sizeof(BTREE_VALUE_TYPE));
+        node->degree = (uint32_t)(degree - (end - start));
+        return end - start;
+    }
+
+    // with duplicates, keys equal to a separator can also be in the child to its left
+    BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+    size_t first = above_lo ? 0 : BTREE_FUNC(binary_search_keys_before)(inner->keys, degree, lo);
+    size_t last = below_hi ? degree - 1 : BTREE_FUNC(binary_search_keys_before)(inner->keys, degree, hi);
+    size_t count = 0;
+    if (first == last) {
+        BTREE_NODE *child = BTREE_FUNC(node_writable)(tree, &inner->children[first]);
+        if (child == NULL) return count;
+        count = BTREE_FUNC(delete_range_node)(tree, child, lo, hi, above_lo, below_hi, callback, data);
+        BTREE_FUNC(count_add)(inner, first, -(ptrdiff_t)count);
+        return count;
+    }
+
+    // every key below first is < keys[last] < hi and every key below last is >= keys[last] >= lo
+    size_t drop_start = first + 1, drop_end = last;
+    if (above_lo) {
+        drop_start = first;
+    } else {
+        BTREE_NODE *child = BTREE_FUNC(node_writable)(tree, &inner->children[first]);
+        if (child == NULL) return count;
+        count += BTREE_FUNC(delete_range_node)(tree, child, lo, hi, false, true, callback, data);
+        BTREE_FUNC(count_add)(inner, first, -(ptrdiff_t)count);
+    }
+    if (below_hi) drop_end = last + 1;
+    for (size_t i = drop_start; i < drop_end; i++) {
+        count += BTREE_FUNC(delete_subtree)(tree, inner->children[i], true, callback, data);
+    }
+    // the first key is the node's lower bound and stays
+    BTREE_KEY_TYPE lower_bound = inner->keys[0];
+    memmove(inner->keys + drop_start, inner->keys + drop_end, (degree - drop_end) * sizeof(BTREE_KEY_TYPE));
+    memmove(inner->children + drop_start, inner->children + drop_end, (degree - drop_end) * sizeof(BTREE_NODE *));
+    BTREE_FUNC(counts_move)(inner, drop_start, inner, drop_end, degree - drop_end);
+    inner->keys[0] = lower_bound;
+    node->degree = (uint32_t)(degree - (drop_end - drop_start));
+
+    if (!below_hi) {
+        BTREE_NODE *child = BTREE_FUNC(node_writable)(tree, &inner->children[drop_start]);
+        if (child == NULL) return count;
+        size_t removed = BTREE_FUNC(delete_range_node)(tree, child, lo, hi, true, false, callback, data);
+        BTREE_FUNC(count_add)(inner, drop_start, -(ptrdiff_t)removed);
+        count += removed;
+    }
+    return count;
+}
+
+static void BTREE_FUNC(rebalance_path)(BTREE_NAME *tree, BTREE_KEY_TYPE key, bool before) {
+    /* Fix the underfull nodes left on the path to key, one borrow or merge at a time from the
+       bottom up. With before, the path takes the child left of separators equal to key
+       (like delete_range_node), otherwise the one right of them.
+       A node whose parent has no other child can't be fixed yet, but then the parent is
+       underfull too, and once it has been merged with a neighbor the node has siblings.
+       Every merge removes a node and every borrow leaves both nodes with at least the
+       minimum degree, so this stops.
+    */
+    while (true) {
+        BTREE_NODE *root = BTREE_FUNC(node_writable)(tree, &tree->root);
+        if (root == NULL) return;
+        if (root->height > 0 && root->degree == 1) {
+            BTREE_FUNC(write_lock)(tree, root);
+            BTREE_FUNC(set_root)(tree, BTREE_AS_INNER(root)->children[0]);
+            BTREE_FUNC(node_retire)(tree, root);
+            BTREE_STAT_ADD(tree, root_shrinks, 1);
+            BTREE_FUNC(write_unlock_all)(tree);
+            continue;
+        }
+
+        BTREE_NODE *path[BTREE_MAX_HEIGHT + 1];
+        size_t index_stack[BTREE_MAX_HEIGHT];
+        size_t depth = 0;
+        path[0] = root;
+        while (path[depth] != NULL && path[depth]->height > 0 && depth < BTREE_MAX_HEIGHT) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(path[depth]);
+            size_t degree = (size_t)inner->node.degree;
+            size_t idx = before ? BTREE_FUNC(binary_search_keys_before)(inner->keys, degree, key)
+                                : BTREE_FUNC(binary_search_keys)(inner->keys, degree, key);
+            index_stack[depth] = idx;
+            path[depth + 1] = BTREE_FUNC(node_writable)(tree, &inner->children[idx]);
+            depth++;
+        }
+        if (path[depth] == NULL) return;
+
+        bool fixed = false;
+        size_t d = depth;
+        for (; d > 0; d--) {
+            if (path[d]->degree < BTREE_FUNC(node_min_degree)(path[d]) && path[d - 1]->degree >= 2) break;
+        }
+        if (d > 0) {
+            BTREE_NODE *current = path[d];
+            BTREE_INNER_NODE *parent = BTREE_AS_INNER(path[d - 1]);
+            size_t degree_before = (size_t)current->degree;
+            bool merged = current->height > 0 ? BTREE_FUNC(rebalance_inner)(tree, parent, index_stack[d - 1])
+                                               : BTREE_FUNC(rebalance_leaf)(tree, parent, index_stack[d - 1]);
+            // a sibling shared with a snapshot that can't be copied leaves the node as it is
+            fixed = merged || (size_t)current->degree != degree_before;
+        }
+        BTREE_FUNC(write_unlock_all)(tree);
+        if (!fixed) return;
+    }
+}
+
+size_t BTREE_FUNC(delete_range)(BTREE_NAME *tree, BTREE_KEY_TYPE lo, BTREE_KEY_TYPE hi,
+                                BTREE_TYPED(delete_callback) callback, void *data) {
+    /* Delete every entry with lo <= key < hi, calling callback(key, value, data) for each one
+       in key order (if callback is not NULL), e.g. to free the values. Returns the number
+       of entries deleted.
+
+       Rather than deleting the keys one by one, every subtree between the leaves holding lo
+       and hi is handed back to the memory pool whole, only those two boundary leaves are
+       trimmed, and the nodes on the two paths down to them are rebalanced once at the end.
+    */
+    if (tree == NULL || tree->root == NULL || !BTREE_KEY_LESS_THAN(lo, hi)) return 0;
+#ifdef BTREE_BUFFERED
+    if (!BTREE_FUNC(flush)(tree)) return 0;
+#endif
+    BTREE_FUNC(write_begin)(tree);
+    size_t count = 0;
+    BTREE_NODE *root = BTREE_FUNC(node_writable)(tree, &tree->root);
+    if (root != NULL) {
+        count = BTREE_FUNC(delete_range_node)(tree, root, lo, hi, false, false, callback, data);
+        BTREE_FUNC(write_unlock_all)(tree);
+        BTREE_FUNC(rebalance_path)(tree, lo, true);
+        BTREE_FUNC(rebalance_path)(tree, hi, true);
+    }
+    BTREE_STAT_ADD(tree, deletes, count);
+    BTREE_FUNC(write_end)(tree);
+    return count;
+}
+
+/*
+split_at and join move whole subtrees between trees instead of entries. Both only
+restructure the nodes along one path from the root down to a leaf: split_at cuts every
+node on the path to the key in two, join hangs the root of the shorter tree off the edge
+of the taller one at the matching height (see grow_root and insert_into_inner), then
+both fix the underfull nodes left along the cut or the seam (see rebalance_path).
+
+The tree from split_at shares the original's memory pools, like a snapshot, so the two
+trees must not be written to at the same time, and compact declines to run on either until
+one is destroyed. The pools aren't thread safe, so with BTREE_CONCURRENT the new tree gets
+pools of its own instead and the subtrees it takes over are copied into them, which makes
+split_at linear in the size of the right half there. Trees with pools of their own are
+joined by copying the right tree's nodes first, so join is linear as well. Both need
+BTREE_CONCURRENT trees to themselves while they run.
+*/
+static BTREE_LEAF_NODE *BTREE_FUNC(edge_leaf)(BTREE_NODE *node, bool last) {
+    // the first or last leaf under node
+    while (node->height > 0) {
+        node = BTREE_AS_INNER(node)->children[last ? (size_t)node->degree - 1 : 0];
+    }
+    return BTREE_AS_LEAF(node);
+}
+
+#ifndef BTREE_CONCURRENT
+static BTREE_NAME *BTREE_FUNC(new_sharing_pools)(BTREE_NAME *tree) {
+    // an empty tree, without even a root, drawing its nodes from tree's memory pools
+    BTREE_NAME *shared = BTREE_FUNC(memory_calloc)(tree, sizeof(BTREE_NAME));
+    if (shared == NULL) return NULL;
+#ifdef BTREE_ALLOCATOR
+    shared->allocator = tree->allocator;
+#endif
+    shared->leaf_pool = tree->leaf_pool;
+    shared->inner_pool = tree->inner_pool;
+    shared->pool_users = tree->pool_users;
+    (*shared->pool_users)++;
+    return shared;
+}
+#else
+static BTREE_NAME *BTREE_FUNC(new_with_own_pools)(BTREE_NAME *tree) {
+    // an empty tree, without even a root, with memory pools of its own from tree's allocator
+    BTREE_NAME *own = BTREE_FUNC(memory_calloc)(tree, sizeof(BTREE_NAME));
+    if (own == NULL) return NULL;
+#ifdef BTREE_ALLOCATOR
+    own->allocator = tree->allocator;
+#endif
+    if (!BTREE_FUNC(init)(own)) {
+        BTREE_FUNC(memory_free)(tree, own, sizeof(BTREE_NAME));
+        return NULL;
+    }
+    BTREE_FUNC(node_release)(own, own->root);
+    own->root = NULL;
+    return own;
+}
+
+static void BTREE_FUNC(subtree_lock)(BTREE_NODE *node) {
+    // lock a node and everything below it, an optimistic insert or delete may still hold a leaf
+    BTREE_FUNC(node_lock)(node);
+    if (node->height == 0) return;
+    for (size_t i = 0; i < (size_t)node->degree; i++) {
+        BTREE_FUNC(subtree_lock)(BTREE_AS_INNER(node)->children[i]);
+    }
+}
+
+static void BTREE_FUNC(subtree_unlock)(BTREE_NAME *tree, BTREE_NODE *node, bool retire) {
+    // unlock a subtree locked by subtree_lock, retiring its nodes first if it has been copied
+    if (node->height > 0) {
+        for (size_t i = 0; i < (size_t)node->degree; i++) {
+            BTREE_FUNC(subtree_unlock)(tree, BTREE_AS_INNER(node)->children[i], retire);
+        }
+    }
+    if (retire) BTREE_FUNC(node_retire)(tree, node);
+    BTREE_FUNC(node_unlock)(node);
+}
+#endif
+
+bool BTREE_FUNC(split_at)(BTREE_NAME *tree, BTREE_KEY_TYPE key, BTREE_NAME **right) {
+    /* Move every entry with key >= key into a new tree, stored in *right, in O(log n).
+       Returns false if out of memory, leaving the tree as it was and *right NULL.
+
+       The new tree shares tree's memory pools, so the two mustn't be written to at the same
+       time. With BTREE_CONCURRENT that is what they're for, and the pools aren't thread safe,
+       so there the new tree gets pools of its own and the split takes time linear in the
+       size of the right half, which is copied into them.
+    */
+    if (right != NULL) *right = NULL;
+    if (tree == NULL || tree->root == NULL || right == NULL) return false;
+#ifdef BTREE_BUFFERED
+    if (!BTREE_FUNC(flush)(tree)) return false;
+#endif
+#ifdef BTREE_CONCURRENT
+    BTREE_NAME *right_tree = BTREE_FUNC(new_with_own_pools)(tree);
+#else
+    BTREE_NAME *right_tree = BTREE_FUNC(new_sharing_pools)(tree);
+#endif
+    if (right_tree == NULL) return false;
+
+    BTREE_FUNC(write_begin)(tree);
+    // down the path to key, taking the child left of separators equal to key
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+    size_t stack_size = 0;
+    BTREE_NODE *node = BTREE_FUNC(node_writable)(tree, &tree->root);
+    while (node != NULL && node->height > 0 && stack_size < BTREE_MAX_HEIGHT) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        size_t idx = BTREE_FUNC(binary_search_keys_before)(inner->keys, (size_t)node->degree, key);
+        index_stack[stack_size] = idx;
+        stack[stack_size++] = inner;
+        node = BTREE_FUNC(node_writable)(tree, &inner->children[idx]);
+    }
+
+    // every node the right halves need, so that nothing has changed if one can't be had
+    BTREE_INNER_NODE *right_nodes[BTREE_MAX_HEIGHT];
+    size_t num_right_nodes = 0;
+    BTREE_LEAF_NODE *right_leaf = NULL, *empty_leaves[2] = {NULL, NULL};
+    bool allocated = node != NULL && node->height == 0;
+    for (; allocated && num_right_nodes < stack_size; num_right_nodes++) {
+        right_nodes[num_right_nodes] = BTREE_FUNC(inner_node_new)(right_tree, stack[num_right_nodes]->node.height);
+        allocated = right_nodes[num_right_nodes] != NULL;
+    }
+    if (allocated) {
+        right_leaf = BTREE_FUNC(leaf_node_new)(right_tree);
+        empty_leaves[0] = BTREE_FUNC(leaf_node_new)(tree);
+        empty_leaves[1] = BTREE_FUNC(leaf_node_new)(right_tree);
+        allocated = right_leaf != NULL && empty_leaves[0] != NULL && empty_leaves[1] != NULL;
+    }
+#ifdef BTREE_CONCURRENT
+    /* and copies of the subtrees right of the path, bottom level first so that their leaves
+       chain up in order. Each right node holds its copies from children[1] on, counted in
+       its degree until the split puts it together. The originals stay locked until they are
+       retired, so an optimistic insert that reaches one starts over and lands in tree.
+    */
+    BTREE_LEAF_NODE *first_copy = NULL, *last_copy = NULL;
+    bool locked = allocated;
+    for (size_t k = 0; locked && k < stack_size; k++) {
+        BTREE_INNER_NODE *inner = stack[k];
+        for (size_t i = index_stack[k] + 1; i < (size_t)inner->node.degree; i++) {
+            BTREE_FUNC(subtree_lock)(inner->children[i]);
+        }
+    }
+    for (size_t k = stack_size; allocated && k-- > 0;) {
+        BTREE_INNER_NODE *inner = stack[k];
+        for (size_t i = index_stack[k] + 1; allocated && i < (size_t)inner->node.degree; i++) {
+            BTREE_NODE *copy = BTREE_FUNC(copy_subtree)(right_tree, inner->children[i], &last_copy);
+            allocated = copy != NULL;
+            if (!allocated) break;
+            if (first_copy == NULL) first_copy = BTREE_FUNC(edge_leaf)(copy, false);
+            right_nodes[k]->children[++right_nodes[k]->node.degree] = copy;
+        }
+    }
+    if (locked && !allocated) {
+        // the copying failed, everything that was locked for it is let go unchanged
+        for (size_t k = 0; k < stack_size; k++) {
+            BTREE_INNER_NODE *inner = stack[k];
+            for (size_t i = index_stack[k] + 1; i < (size_t)inner->node.degree; i++) {
+                BTREE_FUNC(subtree_unlock)(tree, inner->children[i], false);
+            }
+        }
+    }
+#endif
+    if (!allocated) {
+        for (size_t i = 0; i < num_right_nodes; i++) {
+            if (right_nodes[i] == NULL) continue;
+#ifdef BTREE_CONCURRENT
+            for (size_t j = 1; j <= (size_t)right_nodes[i]->node.degree; j++) {
+                BTREE_FUNC(release_subtree)(right_tree, right_nodes[i]->children[j]);
+            }
+#endif
+            BTREE_FUNC(node_release)(right_tree, &right_nodes[i]->node);
+        }
+        if (right_leaf != NULL) BTREE_FUNC(node_release)(right_tree, &right_leaf->node);
+        if (empty_leaves[0] != NULL) BTREE_FUNC(node_release)(tree, &empty_leaves[0]->node);
+        if (empty_leaves[1] != NULL) BTREE_FUNC(node_release)(right_tree, &empty_leaves[1]->node);
+        BTREE_FUNC(write_end)(tree);
+        BTREE_FUNC(destroy)(right_tree);
+        return false;
+    }
+
+    // split the leaf, the right half takes over the rest of the leaf chain
+    BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+    BTREE_FUNC(write_lock)(tree, node);
+    size_t degree = (size_t)node->degree;
+    size_t start = 0;
+    if (degree > 0) {
+        start = BTREE_FUNC(binary_search_keys_before)(leaf->keys, degree, key);
+        if (BTREE_KEY_LESS_THAN(leaf->keys[start], key)) start++;
+    }
+    memcpy(right_leaf->keys, leaf->keys + start, (degree - start) * sizeof(BTREE_KEY_TYPE));
+    memcpy(right_leaf->values, leaf->values + start, (degree - start) * sizeof(BTREE_VALUE_TYPE));
+    right_leaf->node.degree = (uint32_t)(degree - start);
+    leaf->node.degree = (uint32_t)start;
+#ifndef BTREE_SNAPSHOTS
+    BTREE_LEAF_NODE *next = leaf->next;
+    BTREE_FUNC(leaf_chain_cut)(leaf);
+#ifdef BTREE_CONCURRENT
+    // the rest of the chain is the copies
+    next = first_copy;
+#endif
+    if (next != NULL && start < degree) BTREE_FUNC(leaf_chain_join)(right_leaf, next);
+#endif
+    // empty halves are dropped, a node whose halves are both kept has one on each side
+    BTREE_NODE *left_part = &leaf->node, *right_part = &right_leaf->node;
+    if (start == 0 && stack_size > 0) {
+        BTREE_FUNC(leaf_unlink)(leaf);
+        BTREE_FUNC(node_retire)(tree, &leaf->node);
+        left_part = NULL;
+    }
+    if (start == degree) {
+        BTREE_FUNC(node_release)(right_tree, &right_leaf->node);
+        right_part = NULL;
+    }
+
+    // then each inner node on the path from the bottom up, around the child that was split
+    while (stack_size > 0) {
+        BTREE_INNER_NODE *inner = stack[--stack_size];
+        BTREE_FUNC(write_lock)(tree, &inner->node);
+        size_t idx = index_stack[stack_size];
+        degree = (size_t)inner->node.degree;
+
+        BTREE_INNER_NODE *right_inner = right_nodes[stack_size];
+        size_t j = 0;
+        if (right_part != NULL) {
+            right_inner->keys[0] = key;
+            right_inner->children[0] = right_part;
+            BTREE_FUNC(count_set)(right_inner, 0, BTREE_FUNC(subtree_count)(right_part));
+            j = 1;
+        }
+        memcpy(right_inner->keys + j, inner->keys + idx + 1, (degree - idx - 1) * sizeof(BTREE_KEY_TYPE));
+#ifdef BTREE_CONCURRENT
+        // the copies move down to follow right_part, if there is one, and the originals go
+        memmove(right_inner->children + j, right_inner->children + 1, (degree - idx - 1) * sizeof(BTREE_NODE *));
+        for (size_t i = idx + 1; i < degree; i++) {
+            BTREE_FUNC(subtree_unlock)(tree, inner->children[i], true);
+        }
+#else
+        memcpy(right_inner->children + j, inner->children + idx + 1, (degree - idx - 1) * sizeof(BTREE_NODE *));
+#endif
+        BTREE_FUNC(counts_move)(right_inner, j, inner, idx + 1, degree - idx - 1);
+        right_inner->node.degree = (uint32_t)(j + degree - idx - 1);
+        if (right_inner->node.degree > 0) {
+            right_part = &right_inner->node;
+        } else {
+            BTREE_FUNC(node_release)(right_tree, &right_inner->node);
+            right_part = NULL;
+        }
+
+        inner->node.degree = (uint32_t)idx;
+        if (left_part != NULL) {
+            inner->children[idx] = left_part;
+            BTREE_FUNC(count_set)(inner, idx, BTREE_FUNC(subtree_count)(left_part));
+            inner->node.degree++;
+        }
+        if (inner->node.degree > 0) {
+            left_part = &inner->node;
+        } else {
+            BTREE_FUNC(node_retire)(tree, &inner->node);
+            left_part = NULL;
+        }
+    }
+
+    if (left_part == NULL) {
+        left_part = &empty_leaves[0]->node;
+        empty_leaves[0] = NULL;
+    }
+    if (right_part == NULL) {
+        right_part = &empty_leaves[1]->node;
+        empty_leaves[1] = NULL;
+    }
+    if (empty_leaves[0] != NULL) BTREE_FUNC(node_release)(tree, &empty_leaves[0]->node);
+    if (empty_leaves[1] != NULL) BTREE_FUNC(node_release)(right_tree, &empty_leaves[1]->node);
+    BTREE_FUNC(set_root)(tree, left_part);
+    right_tree->root = right_part;
+#ifdef BTREE_APPEND_FAST_PATH
+    tree->last_leaf = NULL;
+#endif
+    tree->compact_pending = false;
+
+    // the cut left the right edge of the tree and the left edge of the new one underfull
+    BTREE_FUNC(write_unlock_all)(tree);
+    BTREE_FUNC(rebalance_path)(tree, key, true);
+    BTREE_FUNC(write_end)(tree);
+    BTREE_FUNC(write_begin)(right_tree);
+    BTREE_FUNC(rebalance_path)(right_tree, key, true);
+    BTREE_FUNC(write_end)(right_tree);
+    *right = right_tree;
+    return true;
+}
+
+bool BTREE_FUNC(join)(BTREE_NAME *left, BTREE_NAME *right) {
+    /* Move every entry of right into left and destroy right, in O(log n) when the trees share
+       memory pools (see split_at) and otherwise in time linear in the size of right.
+       Every key in left must be less than every key in right. Returns false if they overlap,
+       leaving both trees as they were, or if out of memory.
+    */
+    if (left == NULL || right == NULL || left == right || left->root == NULL || right->root == NULL) return false;
+#ifdef BTREE_BUFFERED
+    if (!BTREE_FUNC(flush)(left) || !BTREE_FUNC(flush)(right)) return false;
+#endif
+    if (right->root->degree == 0) {
+        BTREE_FUNC(destroy)(right);
+        return true;
+    }
+    BTREE_LEAF_NODE *last = left->root->degree > 0 ? BTREE_FUNC(edge_leaf)(left->root, true) : NULL;
+    BTREE_KEY_TYPE min_key = BTREE_FUNC(edge_leaf)(right->root, false)->keys[0];
+    if (last != NULL && !BTREE_KEY_LESS_THAN(last->keys[last->node.degree - 1], min_key)) return false;
+
+    // right's nodes have to come from left's pools
+    BTREE_NODE *copy = NULL;
+    if (right->leaf_pool != left->leaf_pool) {
+        BTREE_LEAF_NODE *last_copy = NULL;
+        copy = BTREE_FUNC(copy_subtree)(left, right->root, &last_copy);
+        if (copy == NULL) return false;
+    }
+    BTREE_NODE **root_slot = copy != NULL ? &copy : &right->root;
+
+    BTREE_FUNC(write_begin)(left);
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
     size_t stack_size = 0;
-    BTREE_NODE *stack[BTREE_MAX_HEIGHT];
-
-    while (current_node->height > 0) {
-        if (stack_size >= BTREE_MAX_HEIGHT) return false;
-        stack[stack_size++] = current_node;
-        size_t idx = BTREE_FUNC(binary_search_node)(current_node, key);
-        current_node = current_node->children[idx];
-    }
-    // current_node is now a leaf at which we insert
-    BTREE_NODE *insert_value = (BTREE_NODE *)value;
-    BTREE_KEY_TYPE insert_key = key;
-    while (!finished) {
-        uint32_t start = 0;
-        int32_t i = 0;
-        if (current_node->height > 0) {
-            // insert in non-leaf starts at 1
-            start = 1;
+    BTREE_NODE *node = NULL;
+    bool taller = left->root->height >= (*root_slot)->height;
+    if (last == NULL) {
+        // left is empty, right's root just replaces its root leaf
+    } else if (taller) {
+        // right's root goes after the last node at its height on the right edge of left
+        node = BTREE_FUNC(node_writable)(left, &left->root);
+        while (node != NULL && node->height > (*root_slot)->height && stack_size < BTREE_MAX_HEIGHT) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+            index_stack[stack_size] = (size_t)node->degree - 1;
+            stack[stack_size++] = inner;
+            node = BTREE_FUNC(node_writable)(left, &inner->children[(size_t)node->degree - 1]);
+        }
+    } else {
+        // left's root goes before the first node at its height on the left edge of right
+        node = BTREE_FUNC(node_writable)(left, root_slot);
+        while (node != NULL && node->height > left->root->height + 1 && stack_size < BTREE_MAX_HEIGHT) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+            index_stack[stack_size] = 0;
+            stack[stack_size++] = inner;
+            node = BTREE_FUNC(node_writable)(left, &inner->children[0]);
+        }
+    }
+    if (last != NULL && node == NULL) {
+        BTREE_FUNC(release_subtree)(left, copy);
+        BTREE_FUNC(write_end)(left);
+        return false;
+    }
+    BTREE_INNER_NODE *spare[BTREE_MAX_HEIGHT + 1];
+    size_t num_spare = 0;
+    if (last != NULL) {
+        uint16_t child_height = (*root_slot)->height;
+        if (!taller) {
+            // node takes left's root in front of its first child, which goes back in after it
+            index_stack[stack_size] = 0;
+            stack[stack_size++] = BTREE_AS_INNER(node);
+            child_height = left->root->height;
+        }
+        // the nodes the seam can split into, taken while both trees are still as they were
+        if (!BTREE_FUNC(split_reserve)(left, stack, stack_size, child_height, spare, &num_spare)) {
+            BTREE_FUNC(release_subtree)(left, copy);
+            BTREE_FUNC(write_end)(left);
+            return false;
+        }
+    }
+    // from here on right's nodes belong to left
+    BTREE_NODE *root = *root_slot;
+    if (copy == NULL) right->root = NULL;
+    BTREE_FUNC(destroy)(right);
+#ifdef BTREE_APPEND_FAST_PATH
+    left->last_leaf = NULL;
+#endif
+    left->compact_pending = false;
+
+    if (last == NULL) {
+        BTREE_NODE *empty = left->root;
+        BTREE_FUNC(write_lock)(left, empty);
+        BTREE_FUNC(set_root)(left, root);
+        BTREE_FUNC(node_retire)(left, empty);
+        BTREE_FUNC(write_end)(left);
+        return true;
+    }
+#ifndef BTREE_SNAPSHOTS
+    BTREE_FUNC(leaf_chain_join)(last, BTREE_FUNC(edge_leaf)(root, false));
+#endif
+
+    if (taller) {
+        BTREE_FUNC(path_count_add)(stack, index_stack, stack_size, (ptrdiff_t)BTREE_FUNC(subtree_count)(root));
+        BTREE_FUNC(insert_into_inner)(left, stack, index_stack, stack_size, min_key, root, spare, &num_spare);
+    } else {
+        /* insert_into_inner only adds a child after another one, so left's root takes the place
+           of the first child of node (already at the bottom of the path), which is then added back after it
+        */
+        BTREE_NODE *left_root = left->root;
+        BTREE_INNER_NODE *parent = BTREE_AS_INNER(node);
+        BTREE_NODE *first_child = parent->children[0];
+        BTREE_FUNC(path_count_add)(stack, index_stack, stack_size, (ptrdiff_t)BTREE_FUNC(subtree_count)(left_root));
+        // the lower bounds down the left edge now come from left
+        BTREE_KEY_TYPE lower_bound = BTREE_FUNC(node_first_key)(left_root);
+        for (size_t i = 0; i < stack_size; i++) {
+            BTREE_FUNC(write_lock)(left, &stack[i]->node);
+            stack[i]->keys[0] = lower_bound;
+        }
+        parent->children[0] = left_root;
+        BTREE_FUNC(set_root)(left, root);
+        BTREE_FUNC(insert_into_inner)(left, stack, index_stack, stack_size, min_key, first_child, spare, &num_spare);
+    }
+    BTREE_FUNC(spare_release)(left, spare, num_spare);
+
+    // the right edge of left and the root of right may be underfull on either side of the seam
+    BTREE_FUNC(write_unlock_all)(left);
+    BTREE_FUNC(rebalance_path)(left, min_key, true);
+    BTREE_FUNC(rebalance_path)(left, min_key, false);
+    BTREE_FUNC(write_end)(left);
+    return true;
+}
+
+typedef bool (*BTREE_TYPED(copy_callback))(BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value, BTREE_VALUE_TYPE *copy, void *data);
+
+static bool BTREE_FUNC(copy_values)(BTREE_NODE *node, BTREE_TYPED(copy_callback) copy, void *data, size_t *copied) {
+    // replace each value below node with copy's copy of it, counting them in *copied
+    if (node->height == 0) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+        for (size_t i = 0; i < (size_t)node->degree; i++) {
+            if (!copy(leaf->keys[i], leaf->values[i], &leaf->values[i], data)) return false;
+            (*copied)++;
+        }
+        return true;
+    }
+    for (size_t i = 0; i < (size_t)node->degree; i++) {
+        if (!BTREE_FUNC(copy_values)(BTREE_AS_INNER(node)->children[i], copy, data, copied)) return false;
+    }
+    return true;
+}
+
+static void BTREE_FUNC(release_values)(BTREE_NODE *node, BTREE_TYPED(delete_callback) release, void *data, size_t *remaining) {
+    // hand the first *remaining values below node to release, in order
+    if (node->height == 0) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+        for (size_t i = 0; i < (size_t)node->degree && *remaining > 0; i++, (*remaining)--) {
+            release(leaf->keys[i], leaf->values[i], data);
+        }
+        return;
+    }
+    for (size_t i = 0; i < (size_t)node->degree && *remaining > 0; i++) {
+        BTREE_FUNC(release_values)(BTREE_AS_INNER(node)->children[i], release, data, remaining);
+    }
+}
+
+BTREE_NAME *BTREE_FUNC(clone_with)(BTREE_NAME *tree, BTREE_TYPED(copy_callback) copy, BTREE_TYPED(delete_callback) release, void *data) {
+    /* Make an independent copy of the tree with pools of its own, node by node: every node is
+       copied as it is, so there's no searching, splitting or rebalancing, and the source is read
+       in order with the next node prefetched, at close to the speed of copying the memory.
+       The clone uses the same allocator, and starts with no counters or latency history.
+
+       Keys and values are copied as they are, unless copy is given, in which case it's called
+       on every entry in order to set *copy to the clone's value (e.g. a deep copy).
+       If it returns false the copies made so far go to release (if given), in the same
+       order, and clone_with returns NULL, as it does when out of memory.
+
+       With BTREE_BUFFERED the source is flushed first. A BTREE_CONCURRENT tree has to be
+       left alone by writers for the duration, like freeze. With snapshots, see snapshot for
+       an O(1) copy that shares nodes and pools.
+    */
+    if (tree == NULL || tree->root == NULL) return NULL;
+#ifdef BTREE_BUFFERED
+    if (!BTREE_FUNC(flush)(tree)) return NULL;
+#endif
+#ifdef BTREE_ALLOCATOR
+    BTREE_NAME *clone = BTREE_FUNC(new_with_allocator)(&tree->allocator);
+#else
+    BTREE_NAME *clone = BTREE_FUNC(new)();
+#endif
+    if (clone == NULL) return NULL;
+    BTREE_LEAF_NODE *last_leaf = NULL;
+    BTREE_NODE *root = BTREE_FUNC(copy_subtree)(clone, tree->root, &last_leaf);
+    if (root == NULL) {
+        BTREE_FUNC(destroy)(clone);
+        return NULL;
+    }
+    BTREE_FUNC(node_release)(clone, clone->root);
+    clone->root = root;
+    size_t copied = 0;
+    if (copy != NULL && !BTREE_FUNC(copy_values)(root, copy, data, &copied)) {
+        if (release != NULL) {
+            BTREE_FUNC(release_values)(root, release, data, &copied);
+        }
+        BTREE_FUNC(destroy)(clone);
+        return NULL;
+    }
+    return clone;
+}
+
+BTREE_NAME *BTREE_FUNC(clone)(BTREE_NAME *tree) {
+    return BTREE_FUNC(clone_with)(tree, NULL, NULL, NULL);
+}
+
+static inline size_t BTREE_FUNC(bulk_load_per_node)(double fill_factor, size_t max_degree, size_t min_degree) {
+    // entries per node for fill_factor, clamped to [min_degree, max_degree] and at least 2
+    size_t per_node = (size_t)(fill_factor * max_degree + 0.5);
+    size_t min_per_node = min_degree > 2 ? min_degree : 2;
+    if (per_node < min_per_node) per_node = min_per_node;
+    if (per_node > max_degree) per_node = max_degree;
+    return per_node;
+}
+
+static inline size_t BTREE_FUNC(bulk_load_num_nodes)(size_t num_entries, size_t per_node, size_t min_degree) {
+    /* Number of nodes to spread num_entries over, so that each node gets
+       about per_node entries but never fewer than min_degree
+       (a single node is the root, which has no minimum).
+    */
+    size_t num_nodes = (num_entries + per_node - 1) / per_node;
+    if (num_nodes > 1 && num_entries / num_nodes < min_degree) {
+        num_nodes = num_entries / min_degree;
+    }
+    return num_nodes > 0 ? num_nodes : 1;
+}
+
+static inline size_t BTREE_FUNC(bulk_load_first_child)(size_t num_children, size_t num_nodes, size_t i) {
+    // index of node i's first child when num_children are spread evenly over num_nodes, the first (num_children % num_nodes) getting one extra
+    size_t extra = num_children % num_nodes;
+    return i * (num_children / num_nodes) + (i < extra ? i : extra);
+}
+
+static inline void BTREE_FUNC(bulk_load_set_children)(BTREE_INNER_NODE *node, BTREE_NODE **children, size_t degree) {
+    // each child's first key becomes its separator in the parent
+    for (size_t j = 0; j < degree; j++) {
+        node->children[j] = children[j];
+        node->keys[j] = BTREE_FUNC(node_first_key)(children[j]);
+        BTREE_FUNC(count_set)(node, j, BTREE_FUNC(subtree_count)(children[j]));
+    }
+    node->node.degree = (uint32_t)degree;
+}
+
+static BTREE_NODE *BTREE_FUNC(bulk_load_levels)(BTREE_NAME *tree, BTREE_NODE **level, size_t num_nodes, size_t per_node) {
+    /* Build the inner levels over the num_nodes nodes in level, which are in key order,
+       until only the root is left and return it. Each level is written over the one below it.
+       If the memory pool runs out, releases all of the nodes and returns NULL.
+    */
+    uint16_t height = level[0]->height;
+    while (num_nodes > 1) {
+        height++;
+        size_t num_children = num_nodes;
+        num_nodes = BTREE_FUNC(bulk_load_num_nodes)(num_children, per_node, BTREE_INNER_MIN_DEGREE);
+        size_t offset = 0;
+        for (size_t i = 0; i < num_nodes; i++) {
+            size_t degree = BTREE_FUNC(bulk_load_first_child)(num_children, num_nodes, i + 1) - offset;
+            BTREE_INNER_NODE *node = BTREE_FUNC(inner_node_new)(tree, height);
+            if (node == NULL) {
+                // level[0..i) are the new parents, level[offset..num_children) are still orphans
+                for (size_t j = 0; j < i; j++) {
+                    BTREE_FUNC(release_subtree)(tree, level[j]);
+                }
+                for (size_t j = offset; j < num_children; j++) {
+                    BTREE_FUNC(release_subtree)(tree, level[j]);
+                }
+                return NULL;
+            }
+            BTREE_FUNC(bulk_load_set_children)(node, level + offset, degree);
+            // offset + degree > i, so this never overwrites a child that is still needed
+            level[i] = &node->node;
+            offset += degree;
+        }
+    }
+    return level[0];
+}
+
+bool BTREE_FUNC(bulk_load)(BTREE_NAME *tree, BTREE_KEY_TYPE *keys, BTREE_VALUE_TYPE *values, size_t n, double fill_factor) {
+    /* Build the tree bottom-up from n keys sorted in ascending order.
+
+       Rather than inserting one key at a time, the leaves are filled left to right,
+       then each level of inner nodes is built over the level below it until only
+       the root is left. Every node is filled to fill_factor times its maximum degree
+       (clamped to its [minimum, maximum] degree, leaves and inner nodes each their own), so a
+       fill_factor below 1.0 leaves room for later inserts without immediate splits.
+
+       The tree must be empty. Returns false if it isn't, if the keys are not sorted,
+       or if the memory pool runs out, in which case the tree is left empty.
+    */
+    if (tree == NULL || tree->root == NULL || keys == NULL || values == NULL) return false;
+    if (tree->root->height > 0 || tree->root->degree > 0) return false;
+    if (n == 0) return true;
+    for (size_t i = 1; i < n; i++) {
+        if (BTREE_KEY_LESS_THAN(keys[i], keys[i - 1])) return false;
+    }
+
+    size_t leaf_per_node = BTREE_FUNC(bulk_load_per_node)(fill_factor, BTREE_LEAF_MAX_DEGREE, BTREE_LEAF_MIN_DEGREE);
+    size_t inner_per_node = BTREE_FUNC(bulk_load_per_node)(fill_factor, BTREE_INNER_MAX_DEGREE, BTREE_INNER_MIN_DEGREE);
+
+    size_t num_nodes = BTREE_FUNC(bulk_load_num_nodes)(n, leaf_per_node, BTREE_LEAF_MIN_DEGREE);
+    // holds one level at a time, each level is written over the one below it
+    BTREE_NODE **level = malloc(num_nodes * sizeof(BTREE_NODE *));
+    if (level == NULL) return false;
+
+    // leaf level, entries are spread evenly so the first (n % num_nodes) leaves get one extra
+    size_t offset = 0;
+    BTREE_LEAF_NODE *prev = NULL;
+    for (size_t i = 0; i < num_nodes; i++) {
+        size_t degree = n / num_nodes + (i < n % num_nodes ? 1 : 0);
+        BTREE_LEAF_NODE *leaf = BTREE_FUNC(leaf_node_new)(tree);
+        if (leaf == NULL) {
+            for (size_t j = 0; j < i; j++) {
+                BTREE_FUNC(node_release)(tree, level[j]);
+            }
+            free(level);
+            return false;
+        }
+        memcpy(leaf->keys, keys + offset, degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(leaf->values, values + offset, degree * sizeof(BTREE_VALUE_TYPE));
+        leaf->node.degree = (uint32_t)degree;
+        if (prev != NULL) {
+            BTREE_FUNC(leaf_link_after)(prev, leaf);
+        }
+        prev = leaf;
+        level[i] = &leaf->node;
+        offset += degree;
+    }
+
+    BTREE_NODE *root = BTREE_FUNC(bulk_load_levels)(tree, level, num_nodes, inner_per_node);
+    free(level);
+    if (root == NULL) return false;
+
+    // the top node replaces the empty root leaf
+    BTREE_FUNC(release_subtree)(tree, tree->root);
+    BTREE_FUNC(set_root)(tree, root);
+    return true;
+}
+
+#ifdef BTREE_PARALLEL
+typedef struct {
+    // levels[k] holds the nodes at height k, counts[k] of them, for k up to part_height
+    BTREE_NODE ***levels;
+    size_t *counts;
+    uint16_t part_height;
+    BTREE_KEY_TYPE *keys;
+    BTREE_VALUE_TYPE *values;
+    size_t n;
+    // the subtrees under levels[part_height][first..last) are this part's
+    size_t first;
+    size_t last;
+    // the ends of the part's leaf chain
+    BTREE_LEAF_NODE *first_leaf;
+    BTREE_LEAF_NODE *last_leaf;
+    bool sorted;
+    pthread_t thread;
+    bool started;
+} BTREE_TYPED(bulk_load_part_t);
+
+static void *BTREE_FUNC(bulk_load_part)(void *arg) {
+    /* Build one part's subtrees bottom-up from nodes that were already taken from the
+       memory pool: fill its leaves from the keys and values they cover (chained to each
+       other but not yet to the other parts, checking that the keys are sorted), then each
+       inner level up to part_height over the one below, spread as in bulk_load_levels
+    */
+    BTREE_TYPED(bulk_load_part_t) *part = arg;
+    part->sorted = true;
+    for (uint16_t height = 0; height <= part->part_height; height++) {
+        // this part's nodes at height, going down from its nodes at part_height
+        size_t first = part->first;
+        size_t last = part->last;
+        for (uint16_t k = part->part_height; k > height; k--) {
+            first = BTREE_FUNC(bulk_load_first_child)(part->counts[k - 1], part->counts[k], first);
+            last = BTREE_FUNC(bulk_load_first_child)(part->counts[k - 1], part->counts[k], last);
+        }
+        BTREE_NODE **level = part->levels[height];
+        if (height == 0) {
+            size_t offset = BTREE_FUNC(bulk_load_first_child)(part->n, part->counts[0], first);
+            part->first_leaf = BTREE_AS_LEAF(level[first]);
+            part->last_leaf = BTREE_AS_LEAF(level[last - 1]);
+            BTREE_LEAF_NODE *prev = NULL;
+            for (size_t i = first; i < last; i++) {
+                size_t degree = BTREE_FUNC(bulk_load_first_child)(part->n, part->counts[0], i + 1) - offset;
+                for (size_t j = offset > 0 ? offset : 1; j < offset + degree; j++) {
+                    if (BTREE_KEY_LESS_THAN(part->keys[j], part->keys[j - 1])) part->sorted = false;
+                }
+                BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(level[i]);
+                memcpy(leaf->keys, part->keys + offset, degree * sizeof(BTREE_KEY_TYPE));
+                memcpy(leaf->values, part->values + offset, degree * sizeof(BTREE_VALUE_TYPE));
+                leaf->node.degree = (uint32_t)degree;
+                if (prev != NULL) {
+                    BTREE_FUNC(leaf_chain_join)(prev, leaf);
+                }
+                prev = leaf;
+                offset += degree;
+            }
+            // the inner levels of a part with keys out of order would be thrown away
+            if (!part->sorted) return NULL;
+        } else {
+            BTREE_NODE **children = part->levels[height - 1];
+            for (size_t i = first; i < last; i++) {
+                size_t offset = BTREE_FUNC(bulk_load_first_child)(part->counts[height - 1], part->counts[height], i);
+                size_t degree = BTREE_FUNC(bulk_load_first_child)(part->counts[height - 1], part->counts[height], i + 1) - offset;
+                BTREE_FUNC(bulk_load_set_children)(BTREE_AS_INNER(level[i]), children + offset, degree);
+            }
+        }
+    }
+    return NULL;
+}
+
+bool BTREE_FUNC(parallel_bulk_load)(BTREE_NAME *tree, BTREE_KEY_TYPE *keys, BTREE_VALUE_TYPE *values, size_t n,
+                                    double fill_factor, size_t num_threads) {
+    /* bulk_load on up to num_threads threads (the calling thread being one of them), building
+       exactly the same tree.
+
+       The shape of the tree only depends on n and fill_factor, so the number of nodes at
+       each height is known before anything is built. The parts are cut at the highest level
+       with at least 4 nodes per thread (down to the leaves for a small tree): each thread
+       gets a run of neighboring subtrees hanging off that level, and fills their leaves and
+       builds their inner levels itself. The memory pool isn't thread-safe, so every node
+       below the cut is taken from it up front on the calling thread and handed out to the
+       parts. Once they are done, the parts' leaf chains are joined and the calling thread
+       builds the few levels above the cut as in bulk_load.
+
+       Returns false under the same conditions as bulk_load, leaving the tree empty.
+    */
+    if (tree == NULL || tree->root == NULL || keys == NULL || values == NULL) return false;
+    if (tree->root->height > 0 || tree->root->degree > 0) return false;
+    if (n == 0) return true;
+
+    size_t leaf_per_node = BTREE_FUNC(bulk_load_per_node)(fill_factor, BTREE_LEAF_MAX_DEGREE, BTREE_LEAF_MIN_DEGREE);
+    size_t inner_per_node = BTREE_FUNC(bulk_load_per_node)(fill_factor, BTREE_INNER_MAX_DEGREE, BTREE_INNER_MIN_DEGREE);
+    size_t num_leaves = BTREE_FUNC(bulk_load_num_nodes)(n, leaf_per_node, BTREE_LEAF_MIN_DEGREE);
+
+    size_t num_parts = num_threads;
+    if (num_parts > n / BTREE_PARALLEL_MIN_ENTRIES) num_parts = n / BTREE_PARALLEL_MIN_ENTRIES;
+    if (num_parts > num_leaves) num_parts = num_leaves;
+    if (num_parts == 0) num_parts = 1;
+
+    // the highest level that still has a few nodes for each part, which is never the root
+    uint16_t part_height = 0;
+    size_t num_nodes = num_leaves;
+    size_t total_nodes = num_leaves;
+    while (num_nodes > 1) {
+        size_t parents = BTREE_FUNC(bulk_load_num_nodes)(num_nodes, inner_per_node, BTREE_INNER_MIN_DEGREE);
+        if (parents < 4 * num_parts) break;
+        part_height++;
+        num_nodes = parents;
+        total_nodes += parents;
+    }
+    if (num_parts > num_nodes) num_parts = num_nodes;
+
+    BTREE_NODE **nodes = malloc(total_nodes * sizeof(BTREE_NODE *));
+    BTREE_NODE ***levels = malloc((part_height + 1) * sizeof(BTREE_NODE **));
+    size_t *counts = malloc((part_height + 1) * sizeof(size_t));
+    BTREE_TYPED(bulk_load_part_t) *parts = calloc(num_parts, sizeof(BTREE_TYPED(bulk_load_part_t)));
+    if (nodes == NULL || levels == NULL || counts == NULL || parts == NULL) {
+        free(nodes);
+        free(levels);
+        free(counts);
+        free(parts);
+        return false;
+    }
+    size_t allocated = 0;
+    bool out_of_memory = false;
+    num_nodes = num_leaves;
+    for (uint16_t height = 0; height <= part_height && !out_of_memory; height++) {
+        if (height > 0) {
+            num_nodes = BTREE_FUNC(bulk_load_num_nodes)(num_nodes, inner_per_node, BTREE_INNER_MIN_DEGREE);
+        }
+        levels[height] = nodes + allocated;
+        counts[height] = num_nodes;
+        for (size_t i = 0; i < num_nodes; i++) {
+            BTREE_NODE *node;
+            if (height == 0) {
+                BTREE_LEAF_NODE *leaf = BTREE_FUNC(leaf_node_new)(tree);
+                node = leaf != NULL ? &leaf->node : NULL;
+            } else {
+                BTREE_INNER_NODE *inner = BTREE_FUNC(inner_node_new)(tree, height);
+                node = inner != NULL ? &inner->node : NULL;
+            }
+            if (node == NULL) {
+                out_of_memory = true;
+                break;
+            }
+            nodes[allocated++] = node;
+        }
+    }
+
+    bool sorted = true;
+    if (!out_of_memory) {
+        for (size_t p = 0; p < num_parts; p++) {
+            BTREE_TYPED(bulk_load_part_t) *part = &parts[p];
+            part->levels = levels;
+            part->counts = counts;
+            part->part_height = part_height;
+            part->keys = keys;
+            part->values = values;
+            part->n = n;
+            part->first = num_nodes * p / num_parts;
+            part->last = num_nodes * (p + 1) / num_parts;
+            // the calling thread takes the first part, and any part whose thread didn't start
+            if (p > 0) {
+                part->started = pthread_create(&part->thread, NULL, BTREE_FUNC(bulk_load_part), part) == 0;
+            }
+        }
+        for (size_t p = 0; p < num_parts; p++) {
+            if (parts[p].started) {
+                pthread_join(parts[p].thread, NULL);
+            } else {
+                BTREE_FUNC(bulk_load_part)(&parts[p]);
+            }
+            sorted = sorted && parts[p].sorted;
+            if (p > 0) {
+                BTREE_FUNC(leaf_chain_join)(parts[p - 1].last_leaf, parts[p].first_leaf);
+            }
+        }
+    }
+    free(parts);
+    free(counts);
+    if (out_of_memory || !sorted) {
+        // nothing has been linked to a parent that could be released with it
+        for (size_t i = 0; i < allocated; i++) {
+            BTREE_FUNC(node_release)(tree, nodes[i]);
+        }
+        free(levels);
+        free(nodes);
+        return false;
+    }
+
+    BTREE_NODE *root = BTREE_FUNC(bulk_load_levels)(tree, levels[part_height], num_nodes, inner_per_node);
+    free(levels);
+    free(nodes);
+    if (root == NULL) return false;
+    BTREE_FUNC(release_subtree)(tree, tree->root);
+    BTREE_FUNC(set_root)(tree, root);
+    return true;
+}
+
+typedef void (*BTREE_TYPED(scan_callback))(BTREE_KEY_TYPE key, BTREE_VALUE_TYPE value, size_t part, void *data);
+
+typedef struct {
+    // this part's subtrees, in key order
+    BTREE_NODE **nodes;
+    size_t num_nodes;
+    BTREE_KEY_TYPE lo;
+    BTREE_KEY_TYPE hi;
+    BTREE_TYPED(scan_callback) callback;
+    void *data;
+    size_t index;
+    pthread_t thread;
+    bool started;
+} BTREE_TYPED(scan_part_t);
+
+static void BTREE_FUNC(scan_node)(BTREE_NODE *node, BTREE_TYPED(scan_part_t) *part) {
+    // call back for each entry below node with lo <= key < hi, only going into children that can hold one
+    if (node->height == 0) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+        size_t i = BTREE_FUNC(binary_search_keys_before)(leaf->keys, (size_t)node->degree, part->lo);
+        if (BTREE_KEY_LESS_THAN(leaf->keys[i], part->lo)) i++;
+        for (; i < (size_t)node->degree && BTREE_KEY_LESS_THAN(leaf->keys[i], part->hi); i++) {
+            part->callback(leaf->keys[i], leaf->values[i], part->index, part->data);
+        }
+        return;
+    }
+    BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+    size_t start = BTREE_FUNC(binary_search_keys_before)(inner->keys, (size_t)node->degree, part->lo);
+    size_t end = BTREE_FUNC(binary_search_keys_before)(inner->keys, (size_t)node->degree, part->hi);
+    for (size_t i = start; i <= end; i++) {
+        BTREE_FUNC(scan_node)(inner->children[i], part);
+    }
+}
+
+static void *BTREE_FUNC(scan_part)(void *arg) {
+    BTREE_TYPED(scan_part_t) *part = arg;
+    for (size_t i = 0; i < part->num_nodes; i++) {
+        BTREE_FUNC(scan_node)(part->nodes[i], part);
+    }
+    return NULL;
+}
+
+size_t BTREE_FUNC(parallel_scan)(BTREE_NAME *tree, BTREE_KEY_TYPE lo, BTREE_KEY_TYPE hi,
+                                 BTREE_TYPED(scan_callback) callback, void *data, size_t num_threads) {
+    /* Call callback(key, value, part, data) for every entry with lo <= key < hi, on up to
+       num_threads threads (the calling thread being one of them). Returns the number of parts
+       the range was cut into, at most num_threads, or 0 if there was nothing to scan (an empty
+       tree or hi <= lo) or if out of memory.
+
+       The range is cut along the children of inner nodes: going down from the root, the
+       subtrees overlapping the range are collected a level at a time until there are a few for
+       each thread, and each thread gets a run of neighboring subtrees. Part p runs on one
+       thread in key order, and every key in part p is less than those in part p + 1, so
+       callbacks can accumulate into a slot per part without locking and combine them after.
+
+       The tree must not be written to during the scan (with BTREE_CONCURRENT neither),
+       and a BTREE_BUFFERED tree is flushed first.
+    */
+    if (tree == NULL || tree->root == NULL || callback == NULL) return 0;
+#ifdef BTREE_BUFFERED
+    if (!BTREE_FUNC(flush)(tree)) return 0;
+#endif
+    if (tree->root->degree == 0 || !BTREE_KEY_LESS_THAN(lo, hi)) return 0;
+    if (num_threads == 0) num_threads = 1;
+
+    // a few subtrees per thread, so that the parts come out about the same size
+    size_t wanted = 4 * num_threads;
+    size_t num_nodes = 1;
+    BTREE_NODE **nodes = malloc(sizeof(BTREE_NODE *));
+    if (nodes == NULL) return 0;
+    nodes[0] = tree->root;
+    while (num_nodes < wanted && nodes[0]->height > 0) {
+        BTREE_NODE **children = malloc(num_nodes * BTREE_INNER_MAX_DEGREE * sizeof(BTREE_NODE *));
+        if (children == NULL) {
+            free(nodes);
+            return 0;
+        }
+        size_t num_children = 0;
+        for (size_t i = 0; i < num_nodes; i++) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(nodes[i]);
+            size_t start = BTREE_FUNC(binary_search_keys_before)(inner->keys, (size_t)inner->node.degree, lo);
+            size_t end = BTREE_FUNC(binary_search_keys_before)(inner->keys, (size_t)inner->node.degree, hi);
+            for (size_t j = start; j <= end; j++) {
+                children[num_children++] = inner->children[j];
+            }
+        }
+        free(nodes);
+        nodes = children;
+        num_nodes = num_children;
+    }
+
+    size_t num_parts = num_threads < num_nodes ? num_threads : num_nodes;
+    BTREE_TYPED(scan_part_t) *parts = calloc(num_parts, sizeof(BTREE_TYPED(scan_part_t)));
+    if (parts == NULL) {
+        free(nodes);
+        return 0;
+    }
+    for (size_t p = 0; p < num_parts; p++) {
+        BTREE_TYPED(scan_part_t) *part = &parts[p];
+        size_t first = num_nodes * p / num_parts;
+        part->nodes = nodes + first;
+        part->num_nodes = num_nodes * (p + 1) / num_parts - first;
+        part->lo = lo;
+        part->hi = hi;
+        part->callback = callback;
+        part->data = data;
+        part->index = p;
+        if (p > 0) {
+            part->started = pthread_create(&part->thread, NULL, BTREE_FUNC(scan_part), part) == 0;
+        }
+    }
+    for (size_t p = 0; p < num_parts; p++) {
+        if (parts[p].started) {
+            pthread_join(parts[p].thread, NULL);
+        } else {
+            BTREE_FUNC(scan_part)(&parts[p]);
+        }
+    }
+    free(parts);
+    free(nodes);
+    return num_parts;
+}
+#endif
+
+/*
+A cursor points at one entry of a leaf and moves through the leaf chain in key order,
+so a range scan only pays for one descent from the root:
+
+    BTREE_TYPED(cursor_t) cursor;
+    for (bool valid = BTREE_FUNC(cursor_seek)(&cursor, tree, lo);
+         valid && BTREE_KEY_LESS_THAN(BTREE_FUNC(cursor_key)(&cursor), hi);
+         valid = BTREE_FUNC(cursor_next)(&cursor)) {
+        BTREE_VALUE_TYPE value = BTREE_FUNC(cursor_value)(&cursor);
+        ...
+    }
+
+Any insert or delete on the tree invalidates its cursors, since entries move between nodes.
+
+With BTREE_SNAPSHOTS there is no leaf chain, so the cursor also keeps the path from the root
+to its leaf and finds the neighboring leaves through their common ancestor. Otherwise it
+only keeps the lowest BTREE_CURSOR_PATH_HEIGHT inner nodes of the path its last descent took,
+for the hinted searches below. Moving along the leaf chain leaves that path where it was.
+*/
+typedef struct {
+    BTREE_LEAF_NODE *node;
+    size_t index;
+#ifdef BTREE_SNAPSHOTS
+    BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+    size_t index_stack[BTREE_MAX_HEIGHT];
+    size_t stack_size;
+#else
+    // path[h - 1] is the inner node at height h on the last descent, for h up to path_height
+    BTREE_INNER_NODE *path[BTREE_CURSOR_PATH_HEIGHT];
+    size_t path_index[BTREE_CURSOR_PATH_HEIGHT];
+    size_t path_height;
+#endif
+} BTREE_TYPED(cursor_t);
+
+static inline bool BTREE_FUNC(cursor_valid)(BTREE_TYPED(cursor_t) *cursor) {
+    return cursor != NULL && cursor->node != NULL && cursor->index < (size_t)cursor->node->node.degree;
+}
+
+static inline bool BTREE_FUNC(cursor_reset)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree) {
+    // returns false if the tree is empty, or with BTREE_BUFFERED if its writes can't be flushed
+    cursor->node = NULL;
+    cursor->index = 0;
+#ifdef BTREE_SNAPSHOTS
+    cursor->stack_size = 0;
+#else
+    cursor->path_height = 0;
+#endif
+#ifdef BTREE_BUFFERED
+    // the cursor walks the leaves, which only hold what's been flushed, so it can't start without that
+    if (tree != NULL && tree->root != NULL && !BTREE_FUNC(flush)(tree)) return false;
+#endif
+    return tree != NULL && tree->root != NULL && tree->root->degree > 0;
+}
+
+static inline BTREE_NODE *BTREE_FUNC(cursor_child)(BTREE_TYPED(cursor_t) *cursor, BTREE_NODE *node, size_t idx) {
+    // step down to child idx of an inner node, remembering the way back up if needed
+#ifdef BTREE_SNAPSHOTS
+    cursor->stack[cursor->stack_size] = BTREE_AS_INNER(node);
+    cursor->index_stack[cursor->stack_size++] = idx;
+#else
+    // every descent goes on down to a leaf, so the levels below are filled in before they're used
+    size_t height = (size_t)node->height;
+    if (height <= BTREE_CURSOR_PATH_HEIGHT) {
+        cursor->path[height - 1] = BTREE_AS_INNER(node);
+        cursor->path_index[height - 1] = idx;
+        if (cursor->path_height < height) cursor->path_height = height;
+    }
+#endif
+    return BTREE_AS_INNER(node)->children[idx];
+}
+
+static BTREE_LEAF_NODE *BTREE_FUNC(cursor_next_leaf)(BTREE_TYPED(cursor_t) *cursor) {
+#ifdef BTREE_SNAPSHOTS
+    // back up to the first ancestor with a child right of the path, then down its leftmost path
+    while (cursor->stack_size > 0) {
+        size_t depth = cursor->stack_size - 1;
+        BTREE_INNER_NODE *inner = cursor->stack[depth];
+        size_t idx = cursor->index_stack[depth] + 1;
+        if (idx < (size_t)inner->node.degree) {
+            cursor->stack_size--;
+            BTREE_NODE *current = BTREE_FUNC(cursor_child)(cursor, &inner->node, idx);
+            while (current->height > 0) {
+                current = BTREE_FUNC(cursor_child)(cursor, current, 0);
+            }
+            return BTREE_AS_LEAF(current);
+        }
+        cursor->stack_size--;
+    }
+    return NULL;
+#else
+    return cursor->node->next;
+#endif
+}
+
+static BTREE_LEAF_NODE *BTREE_FUNC(cursor_prev_leaf)(BTREE_TYPED(cursor_t) *cursor) {
+#ifdef BTREE_SNAPSHOTS
+    while (cursor->stack_size > 0) {
+        size_t depth = cursor->stack_size - 1;
+        BTREE_INNER_NODE *inner = cursor->stack[depth];
+        size_t idx = cursor->index_stack[depth];
+        if (idx > 0) {
+            cursor->stack_size--;
+            BTREE_NODE *current = BTREE_FUNC(cursor_child)(cursor, &inner->node, idx - 1);
+            while (current->height > 0) {
+                current = BTREE_FUNC(cursor_child)(cursor, current, (size_t)current->degree - 1);
+            }
+            return BTREE_AS_LEAF(current);
+        }
+        cursor->stack_size--;
+    }
+    return NULL;
+#else
+    return cursor->node->prev;
+#endif
+}
+
+static void BTREE_FUNC(cursor_find)(BTREE_TYPED(cursor_t) *cursor, BTREE_NODE *node, BTREE_KEY_TYPE key, bool after) {
+    /* Go down from node (the root or where cursor_climb stopped) to the leaf a search for key ends in and
+       point the cursor at its first entry > key (after) or >= key, which may be one past its end
+    */
+    while (node->height > 0) {
+        BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+        size_t idx = after ? BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)node->degree, key)
+                           : BTREE_FUNC(binary_search_keys_before)(inner->keys, (size_t)node->degree, key);
+        node = BTREE_FUNC(cursor_child)(cursor, node, idx);
+    }
+    BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(node);
+    size_t i;
+    if (after) {
+        i = BTREE_FUNC(binary_search_keys)(leaf->keys, (size_t)leaf->node.degree, key);
+        if (!BTREE_KEY_LESS_THAN(key, leaf->keys[i])) i++;
+    } else {
+        i = BTREE_FUNC(binary_search_keys_before)(leaf->keys, (size_t)leaf->node.degree, key);
+        if (BTREE_KEY_LESS_THAN(leaf->keys[i], key)) i++;
+    }
+    cursor->node = leaf;
+    cursor->index = i;
+}
+
+static bool BTREE_FUNC(cursor_settle)(BTREE_TYPED(cursor_t) *cursor, bool before) {
+    // after cursor_find, move back to the entry before (for floor) or on past the end of the leaf
+    if (before) {
+        if (cursor->index > 0) {
+            cursor->index--;
+            return true;
+        }
+        cursor->node = BTREE_FUNC(cursor_prev_leaf)(cursor);
+        cursor->index = cursor->node != NULL ? (size_t)cursor->node->node.degree - 1 : 0;
+    } else if (cursor->index >= (size_t)cursor->node->node.degree) {
+        // every key in this leaf is smaller, the one wanted starts the next leaf
+        cursor->node = BTREE_FUNC(cursor_next_leaf)(cursor);
+        cursor->index = 0;
+    }
+    return BTREE_FUNC(cursor_valid)(cursor);
+}
+
+bool BTREE_FUNC(cursor_seek)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    // position the cursor at the first entry whose key is >= key
+    if (cursor == NULL) return false;
+    if (!BTREE_FUNC(cursor_reset)(cursor, tree)) return false;
+    BTREE_FUNC(cursor_find)(cursor, tree->root, key, false);
+    return BTREE_FUNC(cursor_settle)(cursor, false);
+}
+
+bool BTREE_FUNC(cursor_first)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree) {
+    if (cursor == NULL) return false;
+    if (!BTREE_FUNC(cursor_reset)(cursor, tree)) return false;
+    BTREE_NODE *current = tree->root;
+    while (current->height > 0) {
+        current = BTREE_FUNC(cursor_child)(cursor, current, 0);
+    }
+    cursor->node = BTREE_AS_LEAF(current);
+    return true;
+}
+
+bool BTREE_FUNC(cursor_last)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree) {
+    if (cursor == NULL) return false;
+    if (!BTREE_FUNC(cursor_reset)(cursor, tree)) return false;
+    BTREE_NODE *current = tree->root;
+    while (current->height > 0) {
+        current = BTREE_FUNC(cursor_child)(cursor, current, (size_t)current->degree - 1);
+    }
+    cursor->node = BTREE_AS_LEAF(current);
+    cursor->index = (size_t)current->degree - 1;
+    return true;
+}
+
+bool BTREE_FUNC(cursor_next)(BTREE_TYPED(cursor_t) *cursor) {
+    if (!BTREE_FUNC(cursor_valid)(cursor)) return false;
+    cursor->index++;
+    if (cursor->index >= (size_t)cursor->node->node.degree) {
+        // walked off the end of the leaf, move on to the next one
+        cursor->node = BTREE_FUNC(cursor_next_leaf)(cursor);
+        cursor->index = 0;
+    }
+    return BTREE_FUNC(cursor_valid)(cursor);
+}
+
+bool BTREE_FUNC(cursor_prev)(BTREE_TYPED(cursor_t) *cursor) {
+    if (!BTREE_FUNC(cursor_valid)(cursor)) return false;
+    if (cursor->index > 0) {
+        cursor->index--;
+        return true;
+    }
+    cursor->node = BTREE_FUNC(cursor_prev_leaf)(cursor);
+    cursor->index = cursor->node != NULL ? (size_t)cursor->node->node.degree - 1 : 0;
+    return BTREE_FUNC(cursor_valid)(cursor);
+}
+
+static inline BTREE_KEY_TYPE BTREE_FUNC(cursor_key)(BTREE_TYPED(cursor_t) *cursor) {
+    return cursor->node->keys[cursor->index];
+}
+
+static inline BTREE_VALUE_TYPE BTREE_FUNC(cursor_value)(BTREE_TYPED(cursor_t) *cursor) {
+    return cursor->node->values[cursor->index];
+}
+
+/*
+Nearest-key searches, each of which positions a cursor and returns false if there is no
+such entry: lower_bound (or ceil) finds the first entry with a key >= key, upper_bound the
+first > key and floor the last <= key. The entry before lower_bound is the predecessor of
+key, upper_bound is its successor.
+
+The _hint versions take a cursor left by an earlier search or move on the same tree, with no
+writes to the tree since, and start from where the cursor is rather than the root. The search
+goes up the cursor's path only to the lowest node a search from the root would pass through,
+about log(k) levels for a key k leaves away, and back down from there. A key in the cursor's
+own leaf costs one search within the leaf. Outside BTREE_SNAPSHOTS the cursor only has the
+lowest BTREE_CURSOR_PATH_HEIGHT levels of its path, so keys farther away than those cover
+are found from the root as usual.
+*/
+static inline bool BTREE_FUNC(cursor_level_holds)(BTREE_INNER_NODE *inner, size_t i, BTREE_KEY_TYPE key, bool after,
+                                                  bool *lower_found, bool *upper_found) {
+    /* Check key against the sides of the range of inner's child i that inner bounds, i.e. the
+       separators of the children next to it, and mark each side found in range. A side of a
+       node's range is bounded by the separator of the nearest ancestor that has a child on that
+       side of the path. Returns false if key is out of range on a side, so the search has to go
+       up to inner at least.
+    */
+    bool holds = true;
+    if (!*lower_found && i > 0) {
+        if (after ? !BTREE_KEY_LESS_THAN(key, inner->keys[i]) : BTREE_KEY_LESS_THAN(inner->keys[i], key)) {
+            *lower_found = true;
+        } else {
+            holds = false;
+        }
+    }
+    if (!*upper_found && i + 1 < (size_t)inner->node.degree) {
+        if (after ? BTREE_KEY_LESS_THAN(key, inner->keys[i + 1]) : !BTREE_KEY_LESS_THAN(inner->keys[i + 1], key)) {
+            *upper_found = true;
         } else {
-            // insert in a leaf starts at 0
-            start = 0;
+            holds = false;
+        }
+    }
+    return holds;
+}
+
+#ifdef BTREE_SNAPSHOTS
+static BTREE_NODE *BTREE_FUNC(cursor_climb)(BTREE_TYPED(cursor_t) *cursor, BTREE_NODE *root, BTREE_KEY_TYPE key, bool after) {
+    /* Cut the cursor's path back to the lowest node on it whose key range holds key. Going up
+       stops once both sides of key have been found in range.
+    */
+    (void)root;
+    size_t depth = cursor->stack_size;
+    bool lower_found = false, upper_found = false;
+    for (size_t d = cursor->stack_size; d-- > 0 && !(lower_found && upper_found);) {
+        if (!BTREE_FUNC(cursor_level_holds)(cursor->stack[d], cursor->index_stack[d], key, after, &lower_found, &upper_found)) {
+            depth = d;
+        }
+    }
+    if (depth == cursor->stack_size) return &cursor->node->node;
+    cursor->stack_size = depth;
+    return &cursor->stack[depth]->node;
+}
+#else
+static inline bool BTREE_FUNC(cursor_below)(BTREE_KEY_TYPE k, BTREE_KEY_TYPE key, bool after) {
+    // whether an entry with key k comes before the first entry > key (after) or >= key
+    return after ? !BTREE_KEY_LESS_THAN(key, k) : BTREE_KEY_LESS_THAN(k, key);
+}
+
+static bool BTREE_FUNC(cursor_leaf_holds)(BTREE_LEAF_NODE *leaf, BTREE_KEY_TYPE key, bool after) {
+    /* Whether the entry a search for key wants is in leaf or else starts the next one: every entry
+       before the leaf comes before it, and some entry from the leaf's last one on doesn't.
+       The leaf's own keys usually decide this, so the neighbors are only read when they don't.
+    */
+    size_t last = (size_t)leaf->node.degree - 1;
+    BTREE_LEAF_NODE *prev = leaf->prev, *next = leaf->next;
+    return (prev == NULL || BTREE_FUNC(cursor_below)(leaf->keys[0], key, after) ||
+            BTREE_FUNC(cursor_below)(prev->keys[(size_t)prev->node.degree - 1], key, after)) &&
+           (next == NULL || !BTREE_FUNC(cursor_below)(leaf->keys[last], key, after) ||
+            !BTREE_FUNC(cursor_below)(next->keys[0], key, after));
+}
+
+static BTREE_NODE *BTREE_FUNC(cursor_climb)(BTREE_TYPED(cursor_t) *cursor, BTREE_NODE *root, BTREE_KEY_TYPE key, bool after) {
+    /* The cursor's leaf and its neighbor on key's side are checked first, since their own keys
+       are cheaper to read than the separators above them. Past those, the same as with
+       snapshots through the levels of the path of the cursor's last descent, which is still
+       a path through the tree even if the cursor has since moved along the leaf chain.
+       If key may be outside the highest of them and that isn't the root, returns NULL
+       to search from the root.
+    */
+    BTREE_LEAF_NODE *leaf = cursor->node;
+    if (BTREE_FUNC(cursor_leaf_holds)(leaf, key, after)) return &leaf->node;
+    leaf = BTREE_FUNC(cursor_below)(leaf->keys[0], key, after) ? leaf->next : leaf->prev;
+    if (leaf != NULL && BTREE_FUNC(cursor_leaf_holds)(leaf, key, after)) return &leaf->node;
+    size_t path_height = cursor->path_height;
+    if (path_height == 0) return NULL;
+    size_t height = 0;
+    bool lower_found = false, upper_found = false;
+    for (size_t h = 0; h < path_height && !(lower_found && upper_found); h++) {
+        if (!BTREE_FUNC(cursor_level_holds)(cursor->path[h], cursor->path_index[h], key, after, &lower_found, &upper_found)) {
+            height = h + 1;
         }
+    }
+    if (!(lower_found && upper_found) && &cursor->path[path_height - 1]->node != root) return NULL;
+    // the leaf at the end of the path, which the cursor may have moved on from
+    if (height == 0) return cursor->path[0]->children[cursor->path_index[0]];
+    return &cursor->path[height - 1]->node;
+}
+#endif
 
-        if (current_node->degree < BTREE_NODE_MAX_DEGREE) {
-            /* Node still has room to insert
-               move everything up to create the insertion gap
+static bool BTREE_FUNC(cursor_search)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key,
+                                      bool after, bool before, bool hint) {
+    // after finds the first entry > key rather than >= key, before then moves back one for floor
+    if (cursor == NULL) return false;
+    BTREE_NODE *node = NULL;
+    if (hint && cursor->node != NULL && tree != NULL && tree->root != NULL) {
+        node = BTREE_FUNC(cursor_climb)(cursor, tree->root, key, after);
+    }
+    if (node == NULL) {
+        if (!BTREE_FUNC(cursor_reset)(cursor, tree)) return false;
+        node = tree->root;
+    }
+    BTREE_FUNC(cursor_find)(cursor, node, key, after);
+    return BTREE_FUNC(cursor_settle)(cursor, before);
+}
 
-               Example:
-               [1, 2, 4, 6, 8]
+bool BTREE_FUNC(lower_bound)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, false, false, false);
+}
 
-                insert 5
-                [1, 2, 4, 6, 8] -> [1, 2, 4, 5, 6, 8]
-            */
-            i = BTREE_FUNC(binary_search_node)(current_node, insert_key);
-            // ensures that i is at least 1 in non-leaf/internal nodes
-            if (i < start) i = start;
-
-            /* Binary search returns the index of the closest key
-               that is less than the search key if it (by definition) did not exist.
-               
-               There is one special case however if the search returns 0.
-               Here we have to compare the insert key to the first key in the node.
-               If the insert key is greater, we have to increment i by 1 to insert at the correct position.
-               If it's less than the first key, we can insert at the first position.
-            */
-            if (!BTREE_KEY_LESS_THAN(insert_key, current_node->keys[i])) {
-                i++;
+bool BTREE_FUNC(upper_bound)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, true, false, false);
+}
+
+bool BTREE_FUNC(floor)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, true, true, false);
+}
+
+bool BTREE_FUNC(ceil)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, false, false, false);
+}
+
+bool BTREE_FUNC(lower_bound_hint)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, false, false, true);
+}
+
+bool BTREE_FUNC(upper_bound_hint)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, true, false, true);
+}
+
+bool BTREE_FUNC(floor_hint)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, true, true, true);
+}
+
+bool BTREE_FUNC(ceil_hint)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+    return BTREE_FUNC(cursor_search)(cursor, tree, key, false, false, true);
+}
+
+/*
+Compaction brings a tree that has been through many inserts and deletes, and has
+underfull nodes scattered over its memory pools, back to well-filled nodes.
+
+compact rebuilds the whole tree at once, like bulk_load, into nodes allocated from new
+memory pools in key order, so that a scan walks through memory sequentially, then
+destroys the old pools to return all of their memory to the system.
+
+compact_step is the incremental version, which can run between requests without a long
+pause, but it only does part of the job. Each call repacks the leaves under the next parents
+in key order into as few leaves as target_fill allows, releasing the rest to the pool for
+later inserts. It brings the fill factor back up, but it doesn't move nodes: the leaves it
+keeps stay where they are in the pools, inner nodes are left as they are, and memory only
+goes back to the system with compact. The pools hand out and take back single nodes and
+don't say which block a node is in, so there is no way to steer nodes into fresh contiguous
+blocks, or to free a block once it is empty, a step at a time. Run compact when the tree
+can be had to itself for a moment to get the layout and the memory back.
+
+compact needs a BTREE_CONCURRENT tree to itself, like freeze, while compact_step can run
+alongside the other writers and readers.
+*/
+bool BTREE_FUNC(compact)(BTREE_NAME *tree, double target_fill) {
+    /* Rebuild the tree with every node filled to target_fill (see bulk_load).
+       Both copies of the tree exist until it's done. Returns false if out of memory,
+       leaving the tree as it was. It also returns false while the pools are shared with
+       snapshots or with trees split from this one (see split_at).
+    */
+    if (tree == NULL || tree->root == NULL) return false;
+    if (*tree->pool_users > 1) return false;
+#ifdef BTREE_BUFFERED
+    if (!BTREE_FUNC(flush)(tree)) return false;
+#endif
+#ifdef BTREE_ALLOCATOR
+    BTREE_NAME *fresh = BTREE_FUNC(new_with_allocator)(&tree->allocator);
+#else
+    BTREE_NAME *fresh = BTREE_FUNC(new)();
+#endif
+    if (fresh == NULL) return false;
+
+    BTREE_TYPED(cursor_t) cursor;
+    size_t n = 0;
+    if (BTREE_FUNC(cursor_first)(&cursor, tree)) {
+        for (BTREE_LEAF_NODE *leaf = cursor.node; leaf != NULL; leaf = cursor.node = BTREE_FUNC(cursor_next_leaf)(&cursor)) {
+            n += (size_t)leaf->node.degree;
+        }
+    }
+
+    if (n > 0) {
+        size_t leaf_per_node = BTREE_FUNC(bulk_load_per_node)(target_fill, BTREE_LEAF_MAX_DEGREE, BTREE_LEAF_MIN_DEGREE);
+        size_t inner_per_node = BTREE_FUNC(bulk_load_per_node)(target_fill, BTREE_INNER_MAX_DEGREE, BTREE_INNER_MIN_DEGREE);
+        size_t num_nodes = BTREE_FUNC(bulk_load_num_nodes)(n, leaf_per_node, BTREE_LEAF_MIN_DEGREE);
+        BTREE_NODE **level = malloc(num_nodes * sizeof(BTREE_NODE *));
+        if (level == NULL) {
+            BTREE_FUNC(destroy)(fresh);
+            return false;
+        }
+
+        // copy the entries into the new leaves, spread evenly as in bulk_load
+        BTREE_FUNC(cursor_first)(&cursor, tree);
+        BTREE_LEAF_NODE *src = cursor.node;
+        size_t src_index = 0;
+        BTREE_LEAF_NODE *prev = NULL;
+        for (size_t i = 0; i < num_nodes; i++) {
+            size_t degree = n / num_nodes + (i < n % num_nodes ? 1 : 0);
+            BTREE_LEAF_NODE *leaf = BTREE_FUNC(leaf_node_new)(fresh);
+            if (leaf == NULL) {
+                // the new nodes go with the new pools
+                free(level);
+                BTREE_FUNC(destroy)(fresh);
+                return false;
             }
-            // move everything to the right by 1 from the insertion index, insert the new key/child, and bump the degree
-            memmove(current_node->keys + i + 1, current_node->keys + i, (current_node->degree - i) * sizeof(BTREE_KEY_TYPE));
-            memmove(current_node->children + i + 1, current_node->children + i, (current_node->degree - i) * sizeof(BTREE_NODE *));
-            current_node->keys[i] = insert_key;
-            current_node->children[i] = insert_value;
-            current_node->degree++;
-            finished = true;
-        } else {
-            /* node is full, have to split
-               split the node in half and copy the keys/children while also
-               inserting the new key/child in the correct position.
-            */
-            bool insert_done = false;
-            BTREE_NODE *new_node = BTREE_NODE_MEMORY_POOL_FUNC(get)(tree->pool);
-            i = BTREE_NODE_MAX_DEGREE - 1;
-            int32_t j = (BTREE_NODE_MAX_DEGREE - 1) / 2;
-            while (j >= 0) {
-                if (insert_done || BTREE_KEY_LESS_THAN(insert_key, current_node->keys[i])) {
-                    new_node->children[j] = current_node->children[i];
-                    new_node->keys[j--] = current_node->keys[i--];
-                } else {
-                    new_node->children[j] = insert_value;
-                    new_node->keys[j--] = insert_key;
-                    insert_done = true;
+            size_t filled = 0;
+            while (filled < degree) {
+                while (src_index == (size_t)src->node.degree) {
+                    src = cursor.node = BTREE_FUNC(cursor_next_leaf)(&cursor);
+                    src_index = 0;
                 }
+                size_t run = (size_t)src->node.degree - src_index;
+                if (run > degree - filled) run = degree - filled;
+                memcpy(leaf->keys + filled, src->keys + src_index, run * sizeof(BTREE_KEY_TYPE));
+                memcpy(leaf->values + filled, src->values + src_index, run * sizeof(BTREE_VALUE_TYPE));
+                filled += run;
+                src_index += run;
             }
-            // upper half done. If key has not been inserted, insert it in the lower half
-            while (!insert_done) {
-                if (BTREE_KEY_LESS_THAN(insert_key, current_node->keys[i]) && i >= start) {
-                    current_node->children[i + 1] = current_node->children[i];
-                    current_node->keys[i + 1] = current_node->keys[i];
-                    i--;
-                } else {
-                    current_node->children[i + 1] = insert_value;
-                    current_node->keys[i + 1] = insert_key;
-                    insert_done = true;
-                }
-            } // finished insertion
-            current_node->degree = (BTREE_NODE_MAX_DEGREE + 1) - ((BTREE_NODE_MAX_DEGREE + 1) / 2);
-            new_node->degree = (BTREE_NODE_MAX_DEGREE + 1) / 2;
-            new_node->height = current_node->height;
-            // split nodes complete, insert the new node above
-            insert_value = new_node;
-            insert_key = new_node->keys[0];
-            if (stack_size > 0) {
-                // not at the root, move up one level
-                current_node = stack[--stack_size];
-            } else {
-                // splitting the root, need copy to keep root address
-                new_node = BTREE_NODE_MEMORY_POOL_FUNC(get)(tree->pool);
-                memcpy(new_node->children, current_node->children, current_node->degree * sizeof(BTREE_NODE *));
-                memcpy(new_node->keys, current_node->keys, current_node->degree * sizeof(BTREE_KEY_TYPE));
-                new_node->height = current_node->height;
-                new_node->degree = current_node->degree;
-                current_node->height++;
-                current_node->degree = 2;
-                current_node->children[0] = new_node;
-                current_node->children[1] = insert_value;
-                current_node->keys[1] = insert_key;
-                finished = true;
+            leaf->node.degree = (uint32_t)degree;
+            if (prev != NULL) {
+                BTREE_FUNC(leaf_link_after)(prev, leaf);
             }
+            prev = leaf;
+            level[i] = &leaf->node;
+        }
+
+        BTREE_NODE *root = BTREE_FUNC(bulk_load_levels)(fresh, level, num_nodes, inner_per_node);
+        free(level);
+        if (root == NULL) {
+            BTREE_FUNC(destroy)(fresh);
+            return false;
+        }
+        BTREE_FUNC(release_subtree)(fresh, fresh->root);
+        fresh->root = root;
+    }
+
+    // swap the new nodes and pools in, the old ones go with fresh
+    BTREE_NODE *root = tree->root;
+    tree->root = fresh->root;
+    fresh->root = root;
+    BTREE_TYPED(leaf_memory_pool) *leaf_pool = tree->leaf_pool;
+    tree->leaf_pool = fresh->leaf_pool;
+    fresh->leaf_pool = leaf_pool;
+    BTREE_TYPED(inner_memory_pool) *inner_pool = tree->inner_pool;
+    tree->inner_pool = fresh->inner_pool;
+    fresh->inner_pool = inner_pool;
+#ifdef BTREE_APPEND_FAST_PATH
+    tree->last_leaf = NULL;
+#endif
+#ifdef BTREE_CONCURRENT
+    // retired nodes are in the old pools too
+    for (size_t i = 0; i < 3; i++) {
+        tree->num_retired[i] = 0;
+    }
+#endif
+    tree->compact_pending = false;
+    BTREE_FUNC(destroy)(fresh);
+    return true;
+}
+
+static size_t BTREE_FUNC(compact_num_leaves)(size_t total, size_t degree, bool root, size_t per_node) {
+    size_t num_leaves = BTREE_FUNC(bulk_load_num_nodes)(total, per_node, BTREE_LEAF_MIN_DEGREE);
+    // a parent keeps enough children for its own minimum, and rebalancing needs two
+    size_t min_leaves = degree < BTREE_INNER_MIN_DEGREE ? degree : BTREE_INNER_MIN_DEGREE;
+    if (!root && num_leaves < min_leaves) num_leaves = min_leaves;
+    return num_leaves;
+}
+
+static bool BTREE_FUNC(compact_leaves)(BTREE_NAME *tree, BTREE_INNER_NODE *parent, bool root, size_t per_node) {
+    /* Repack the entries of parent's leaves into as few leaves as per_node allows, reusing
+       the first ones and retiring the rest. Returns false if out of memory.
+    */
+    size_t degree = (size_t)parent->node.degree;
+    size_t total = 0;
+    for (size_t i = 0; i < degree; i++) {
+        total += (size_t)parent->children[i]->degree;
+    }
+    if (BTREE_FUNC(compact_num_leaves)(total, degree, root, per_node) >= degree) return true;
+
+    // the leaves are locked directly, there can be more of them than the lock set holds,
+    // and concurrent inserts and removes that only lock a leaf may have changed the count
+    BTREE_FUNC(write_lock)(tree, &parent->node);
+    total = 0;
+    for (size_t i = 0; i < degree; i++) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(BTREE_FUNC(node_writable)(tree, &parent->children[i]));
+        if (leaf == NULL) return false;
+#ifdef BTREE_CONCURRENT
+        BTREE_FUNC(node_lock)(&leaf->node);
+#endif
+        total += (size_t)leaf->node.degree;
+    }
+    // the entries are copied out in between, sized to this parent rather than the most it could hold
+    BTREE_KEY_TYPE *keys = malloc(total * sizeof(BTREE_KEY_TYPE));
+    BTREE_VALUE_TYPE *values = malloc(total * sizeof(BTREE_VALUE_TYPE));
+    if (keys == NULL || values == NULL) {
+        free(keys);
+        free(values);
+#ifdef BTREE_CONCURRENT
+        for (size_t i = 0; i < degree; i++) {
+            BTREE_FUNC(node_unlock)(parent->children[i]);
         }
+#endif
+        return false;
+    }
+    total = 0;
+    for (size_t i = 0; i < degree; i++) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(parent->children[i]);
+        memcpy(keys + total, leaf->keys, (size_t)leaf->node.degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(values + total, leaf->values, (size_t)leaf->node.degree * sizeof(BTREE_VALUE_TYPE));
+        total += (size_t)leaf->node.degree;
     }
+    size_t num_leaves = BTREE_FUNC(compact_num_leaves)(total, degree, root, per_node);
+    if (num_leaves >= degree) num_leaves = degree;
+    size_t offset = 0;
+    for (size_t i = 0; i < num_leaves; i++) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(parent->children[i]);
+        size_t leaf_degree = total / num_leaves + (i < total % num_leaves ? 1 : 0);
+        memcpy(leaf->keys, keys + offset, leaf_degree * sizeof(BTREE_KEY_TYPE));
+        memcpy(leaf->values, values + offset, leaf_degree * sizeof(BTREE_VALUE_TYPE));
+        leaf->node.degree = (uint32_t)leaf_degree;
+        // keys[0] is the lower bound of the whole parent and stays as it is
+        if (i > 0) parent->keys[i] = leaf->keys[0];
+        BTREE_FUNC(count_set)(parent, i, leaf_degree);
+        offset += leaf_degree;
+#ifdef BTREE_CONCURRENT
+        BTREE_FUNC(node_unlock)(&leaf->node);
+#endif
+    }
+    for (size_t i = num_leaves; i < degree; i++) {
+        BTREE_LEAF_NODE *leaf = BTREE_AS_LEAF(parent->children[i]);
+        BTREE_FUNC(leaf_unlink)(leaf);
+        BTREE_FUNC(node_retire)(tree, &leaf->node);
+#ifdef BTREE_CONCURRENT
+        // marked obsolete, readers that reach it now start over
+        BTREE_FUNC(node_unlock)(&leaf->node);
+#endif
+    }
+    parent->node.degree = (uint32_t)num_leaves;
+    free(keys);
+    free(values);
     return true;
 }
 
+bool BTREE_FUNC(compact_step)(BTREE_NAME *tree, double target_fill, size_t max_nodes) {
+    /* Repack the leaves under the next parents in key order, at least max_nodes leaves
+       (unless the pass reaches the end of the tree) and at most a parent's worth more.
+       Only the fill of the leaves changes, see above for what is left to compact.
+       Returns true while the pass has more of the tree to go, and false once it has covered
+       all of it (or is out of memory), after which the next call starts a new pass.
+
+       The position is kept as a key, so the tree can change in between calls.
+    */
+    if (tree == NULL || tree->root == NULL) return false;
+    if (tree->root->height == 0) {
+        tree->compact_pending = false;
+        return false;
+    }
+    size_t per_node = BTREE_FUNC(bulk_load_per_node)(target_fill, BTREE_LEAF_MAX_DEGREE, BTREE_LEAF_MIN_DEGREE);
+
+    BTREE_FUNC(write_begin)(tree);
+    bool more = true;
+    size_t nodes = 0;
+    while (more && nodes < max_nodes) {
+        // down to the parent of the leaves holding compact_key, or the first one
+        BTREE_INNER_NODE *stack[BTREE_MAX_HEIGHT];
+        size_t index_stack[BTREE_MAX_HEIGHT];
+        size_t stack_size = 0;
+        BTREE_NODE *node = BTREE_FUNC(node_writable)(tree, &tree->root);
+        while (node != NULL && node->height > 1 && stack_size < BTREE_MAX_HEIGHT) {
+            BTREE_INNER_NODE *inner = BTREE_AS_INNER(node);
+            size_t idx = tree->compact_pending ? BTREE_FUNC(binary_search_keys)(inner->keys, (size_t)node->degree, tree->compact_key) : 0;
+            index_stack[stack_size] = idx;
+            stack[stack_size++] = inner;
+            node = BTREE_FUNC(node_writable)(tree, &inner->children[idx]);
+        }
+        if (node == NULL || node->height != 1) {
+            more = false;
+            break;
+        }
+        BTREE_INNER_NODE *parent = BTREE_AS_INNER(node);
+        nodes += (size_t)node->degree;
+        if (!BTREE_FUNC(compact_leaves)(tree, parent, stack_size == 0, per_node)) {
+            more = false;
+            break;
+        }
+
+        // the next parent starts at the separator after the deepest child that isn't the last one
+        more = false;
+        while (stack_size > 0) {
+            stack_size--;
+            BTREE_INNER_NODE *inner = stack[stack_size];
+            size_t idx = index_stack[stack_size];
+            if (idx + 1 < (size_t)inner->node.degree) {
+                tree->compact_key = inner->keys[idx + 1];
+                more = true;
+                break;
+            }
+        }
+        tree->compact_pending = more;
+    }
+    if (!more) tree->compact_pending = false;
+    BTREE_FUNC(write_end)(tree);
+    return more;
+}
+
+/*
+A frozen tree is a read-only copy of a tree for data that is built once and then only read.
+
+The nodes are stored contiguously in breadth-first order (root first, leaves last),
+each one starting on a BTREE_FROZEN_ALIGNMENT boundary. Every node except the last one
+on each level is completely full, so child j of node i on a level is simply node
+i * BTREE_NODE_MAX_DEGREE + j on the level below and no child pointers are stored.
+Inner nodes hold only keys, as in a CSS-tree, and the values are kept in a separate
+array so that the leaves are as dense as the inner nodes.
+
+Since the leaves are full and in order, entry i of the frozen tree is simply the i-th key
+in sorted order, and lookups can return positions rather than cursors:
+
+    size_t start;
+    size_t count = BTREE_FUNC(frozen_range)(frozen, lo, hi, &start);
+    for (size_t i = start; i < start + count; i++) {
+        BTREE_KEY_TYPE key = BTREE_FUNC(frozen_key)(frozen, i);
+        BTREE_VALUE_TYPE value = BTREE_FUNC(frozen_value)(frozen, i);
+        ...
+    }
+
+The frozen tree doesn't reference the tree it was made from, which can be modified
+or destroyed afterward.
+*/
+typedef struct {
+    size_t count;
+    // height of the root, the leaves are at height 0
+    uint16_t height;
+    // bytes from the start of one node to the next
+    size_t node_size;
+    // index of the first node at each height, and the number of entries (keys) at that height
+    size_t level_offsets[BTREE_MAX_HEIGHT];
+    size_t level_entries[BTREE_MAX_HEIGHT];
+    char *nodes;
+    BTREE_VALUE_TYPE *values;
+    void *memory;
+    // set instead of memory and values when the tree was loaded with open_mmap
+    void *mapping;
+    size_t mapping_size;
+} BTREE_TYPED(frozen_t);
+
+static inline BTREE_KEY_TYPE *BTREE_FUNC(frozen_node_keys)(BTREE_TYPED(frozen_t) *frozen, uint16_t height, size_t i) {
+    return (BTREE_KEY_TYPE *)(frozen->nodes + (frozen->level_offsets[height] + i) * frozen->node_size);
+}
+
+static inline size_t BTREE_FUNC(frozen_node_degree)(BTREE_TYPED(frozen_t) *frozen, uint16_t height, size_t i) {
+    // all nodes are full except possibly the last one on the level
+    size_t remaining = frozen->level_entries[height] - i * BTREE_NODE_MAX_DEGREE;
+    return remaining < BTREE_NODE_MAX_DEGREE ? remaining : BTREE_NODE_MAX_DEGREE;
+}
+
+static size_t BTREE_FUNC(frozen_layout)(BTREE_TYPED(frozen_t) *frozen, size_t count) {
+    /* Fill in the count, height, node size and level tables of a frozen tree with count entries.
+       Returns the total number of nodes, or 0 if the tree would be taller than BTREE_MAX_HEIGHT.
+    */
+    frozen->count = count;
+    // node counts per level, from the leaves up, until a level fits in one node
+    size_t num_nodes = 0;
+    size_t entries = count;
+    uint16_t height = 0;
+    while (true) {
+        if (height >= BTREE_MAX_HEIGHT) return 0;
+        frozen->level_entries[height] = entries;
+        size_t level_nodes = entries > 0 ? (entries + BTREE_NODE_MAX_DEGREE - 1) / BTREE_NODE_MAX_DEGREE : 1;
+        num_nodes += level_nodes;
+        if (level_nodes == 1) break;
+        entries = level_nodes;
+        height++;
+    }
+    frozen->height = height;
+    // breadth-first order, the root is node 0
+    size_t offset = 0;
+    for (int32_t h = (int32_t)height; h >= 0; h--) {
+        frozen->level_offsets[h] = offset;
+        size_t level_entries = frozen->level_entries[h];
+        offset += level_entries > 0 ? (level_entries + BTREE_NODE_MAX_DEGREE - 1) / BTREE_NODE_MAX_DEGREE : 1;
+    }
+    frozen->node_size = (BTREE_NODE_MAX_DEGREE * sizeof(BTREE_KEY_TYPE) + BTREE_FROZEN_ALIGNMENT - 1)
+                        / BTREE_FROZEN_ALIGNMENT * BTREE_FROZEN_ALIGNMENT;
+    return num_nodes;
+}
+
+void BTREE_FUNC(frozen_destroy)(BTREE_TYPED(frozen_t) *frozen) {
+    if (frozen == NULL) return;
+#ifdef BTREE_MMAP_AVAILABLE
+    if (frozen->mapping != NULL) {
+        munmap(frozen->mapping, frozen->mapping_size);
+        free(frozen);
+        return;
+    }
+#endif
+    free(frozen->memory);
+    free(frozen->values);
+    free(frozen);
+}
+
+BTREE_TYPED(frozen_t) *BTREE_FUNC(freeze)(BTREE_NAME *tree) {
+    /* Make a frozen copy of the tree, or return NULL if out of memory.
 
-void *BTREE_FUNC(delete)(BTREE_NAME *tree, BTREE_KEY_TYPE key) {
+       The entries are copied out of the leaf chain into completely full leaves,
+       then each inner level is built from the first key of every node on the level below.
+    */
     if (tree == NULL || tree->root == NULL) return NULL;
-    BTREE_NODE *current = tree->root;
-    BTREE_NODE *tmp = NULL;
-    bool finished = false;
+    BTREE_TYPED(frozen_t) *frozen = calloc(1, sizeof(BTREE_TYPED(frozen_t)));
+    if (frozen == NULL) return NULL;
 
-    size_t stack_size = 0;
-    BTREE_NODE *stack[BTREE_MAX_HEIGHT];
-    size_t index_stack[BTREE_MAX_HEIGHT];
+    BTREE_TYPED(cursor_t) cursor;
+    size_t count = 0;
+    if (BTREE_FUNC(cursor_first)(&cursor, tree)) {
+        for (BTREE_LEAF_NODE *leaf = cursor.node; leaf != NULL; leaf = cursor.node = BTREE_FUNC(cursor_next_leaf)(&cursor)) {
+            count += (size_t)leaf->node.degree;
+        }
+    }
+    size_t num_nodes = BTREE_FUNC(frozen_layout)(frozen, count);
+    if (num_nodes == 0) {
+        free(frozen);
+        return NULL;
+    }
 
-    while (current->height > 0) {
-        // not at the leaf level
-        if (stack_size >= BTREE_MAX_HEIGHT) return NULL;
+    // zeroed so the padding after the keys of each node is deterministic when saved
+    frozen->memory = calloc(num_nodes * frozen->node_size + BTREE_FROZEN_ALIGNMENT - 1, 1);
+    frozen->values = malloc((count > 0 ? count : 1) * sizeof(BTREE_VALUE_TYPE));
+    if (frozen->memory == NULL || frozen->values == NULL) {
+        BTREE_FUNC(frozen_destroy)(frozen);
+        return NULL;
+    }
+    frozen->nodes = (char *)(((uintptr_t)frozen->memory + BTREE_FROZEN_ALIGNMENT - 1) & ~(uintptr_t)(BTREE_FROZEN_ALIGNMENT - 1));
 
-        size_t idx = BTREE_FUNC(binary_search_node(current, key));
-        index_stack[stack_size] = idx;
-        stack[stack_size++] = current;
-        current = current->children[idx];
+    // leaves, entry i goes to slot i % MAX of leaf i / MAX
+    size_t i = 0;
+    if (BTREE_FUNC(cursor_first)(&cursor, tree)) {
+        for (BTREE_LEAF_NODE *leaf = cursor.node; leaf != NULL; leaf = cursor.node = BTREE_FUNC(cursor_next_leaf)(&cursor)) {
+            for (size_t j = 0; j < (size_t)leaf->node.degree; j++, i++) {
+                BTREE_FUNC(frozen_node_keys)(frozen, 0, i / BTREE_NODE_MAX_DEGREE)[i % BTREE_NODE_MAX_DEGREE] = leaf->keys[j];
+                frozen->values[i] = leaf->values[j];
+            }
+        }
     }
-    // current is now a leaf node where we can delete
-    size_t i = BTREE_FUNC(binary_search_node)(current, key);
-    if (!BTREE_KEY_EQUALS(key, current->keys[i])) {
-        // key was not found
+
+    // inner levels, key j of a node is the first key of its child j
+    for (uint16_t h = 1; h <= frozen->height; h++) {
+        for (size_t c = 0; c < frozen->level_entries[h]; c++) {
+            BTREE_KEY_TYPE *parent_keys = BTREE_FUNC(frozen_node_keys)(frozen, h, c / BTREE_NODE_MAX_DEGREE);
+            parent_keys[c % BTREE_NODE_MAX_DEGREE] = BTREE_FUNC(frozen_node_keys)(frozen, h - 1, c)[0];
+        }
+    }
+    return frozen;
+}
+
+static inline size_t BTREE_FUNC(frozen_find_leaf)(BTREE_TYPED(frozen_t) *frozen, BTREE_KEY_TYPE key, bool before) {
+    // index of the leaf to search for key, using binary_search_keys_before if before is set
+    size_t i = 0;
+    for (uint16_t h = frozen->height; h > 0; h--) {
+        BTREE_KEY_TYPE *keys = BTREE_FUNC(frozen_node_keys)(frozen, h, i);
+        size_t degree = BTREE_FUNC(frozen_node_degree)(frozen, h, i);
+        size_t idx = before ? BTREE_FUNC(binary_search_keys_before)(keys, degree, key)
+                            : BTREE_FUNC(binary_search_keys)(keys, degree, key);
+        i = i * BTREE_NODE_MAX_DEGREE + idx;
+    }
+    return i;
+}
+
+static inline BTREE_KEY_TYPE BTREE_FUNC(frozen_key)(BTREE_TYPED(frozen_t) *frozen, size_t i) {
+    return BTREE_FUNC(frozen_node_keys)(frozen, 0, i / BTREE_NODE_MAX_DEGREE)[i % BTREE_NODE_MAX_DEGREE];
+}
+
+static inline BTREE_VALUE_TYPE BTREE_FUNC(frozen_value)(BTREE_TYPED(frozen_t) *frozen, size_t i) {
+    return frozen->values[i];
+}
+
+BTREE_VALUE_TYPE *BTREE_FUNC(frozen_get_ptr)(BTREE_TYPED(frozen_t) *frozen, BTREE_KEY_TYPE key) {
+    // pointer to the value for key, or NULL if the key is not found
+    if (frozen == NULL || frozen->count == 0) return NULL;
+    size_t leaf = BTREE_FUNC(frozen_find_leaf)(frozen, key, false);
+    BTREE_KEY_TYPE *keys = BTREE_FUNC(frozen_node_keys)(frozen, 0, leaf);
+    size_t idx = BTREE_FUNC(binary_search_keys)(keys, BTREE_FUNC(frozen_node_degree)(frozen, 0, leaf), key);
+    if (BTREE_KEY_EQUALS(key, keys[idx])) {
+        return &frozen->values[leaf * BTREE_NODE_MAX_DEGREE + idx];
+    }
+    return NULL;
+}
+
+BTREE_VALUE_TYPE BTREE_FUNC(frozen_get)(BTREE_TYPED(frozen_t) *frozen, BTREE_KEY_TYPE key) {
+    BTREE_VALUE_TYPE *value = BTREE_FUNC(frozen_get_ptr)(frozen, key);
+    if (value == NULL) return BTREE_VALUE_NULL;
+    return *value;
+}
+
+size_t BTREE_FUNC(frozen_lower_bound)(BTREE_TYPED(frozen_t) *frozen, BTREE_KEY_TYPE key) {
+    // position of the first entry whose key is >= key, or frozen->count if there is none
+    if (frozen == NULL || frozen->count == 0) return 0;
+    size_t leaf = BTREE_FUNC(frozen_find_leaf)(frozen, key, true);
+    BTREE_KEY_TYPE *keys = BTREE_FUNC(frozen_node_keys)(frozen, 0, leaf);
+    size_t idx = BTREE_FUNC(binary_search_keys_before)(keys, BTREE_FUNC(frozen_node_degree)(frozen, 0, leaf), key);
+    if (BTREE_KEY_LESS_THAN(keys[idx], key)) {
+        // may be one past the end of the leaf, which is the first entry of the next one
+        idx++;
+    }
+    return leaf * BTREE_NODE_MAX_DEGREE + idx;
+}
+
+size_t BTREE_FUNC(frozen_range)(BTREE_TYPED(frozen_t) *frozen, BTREE_KEY_TYPE lo, BTREE_KEY_TYPE hi, size_t *start) {
+    /* Find the entries with lo <= key < hi, which are at positions [*start, *start + count).
+       Returns count.
+    */
+    size_t first = BTREE_FUNC(frozen_lower_bound)(frozen, lo);
+    if (start != NULL) *start = first;
+    if (!BTREE_KEY_LESS_THAN(lo, hi)) return 0;
+    size_t end = BTREE_FUNC(frozen_lower_bound)(frozen, hi);
+    return end - first;
+}
+
+static inline size_t BTREE_FUNC(frozen_num_nodes)(BTREE_TYPED(frozen_t) *frozen) {
+    // the leaves are the last level
+    size_t leaf_entries = frozen->level_entries[0];
+    return frozen->level_offsets[0] + (leaf_entries > 0 ? (leaf_entries + BTREE_NODE_MAX_DEGREE - 1) / BTREE_NODE_MAX_DEGREE : 1);
+}
+
+static inline uint64_t BTREE_FUNC(file_align)(uint64_t offset) {
+    return (offset + BTREE_FROZEN_ALIGNMENT - 1) / BTREE_FROZEN_ALIGNMENT * BTREE_FROZEN_ALIGNMENT;
+}
+
+static void BTREE_FUNC(file_header)(BTREE_TYPED(frozen_t) *frozen, btree_file_header_t *header) {
+    memset(header, 0, sizeof(btree_file_header_t));
+    memcpy(header->magic, BTREE_FILE_MAGIC, sizeof(header->magic));
+    header->version = BTREE_FILE_VERSION;
+    header->byte_order = BTREE_FILE_BYTE_ORDER;
+    header->key_size = (uint32_t)sizeof(BTREE_KEY_TYPE);
+    header->value_size = (uint32_t)sizeof(BTREE_VALUE_TYPE);
+    header->node_max_degree = BTREE_NODE_MAX_DEGREE;
+    header->alignment = BTREE_FROZEN_ALIGNMENT;
+    header->count = (uint64_t)frozen->count;
+    header->node_size = (uint64_t)frozen->node_size;
+    header->nodes_offset = BTREE_FUNC(file_align)(sizeof(btree_file_header_t));
+    header->values_offset = BTREE_FUNC(file_align)(header->nodes_offset + BTREE_FUNC(frozen_num_nodes)(frozen) * header->node_size);
+    header->file_size = header->values_offset + header->count * header->value_size;
+}
+
+#ifdef BTREE_MMAP_AVAILABLE
+
+static bool BTREE_FUNC(file_write)(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool BTREE_FUNC(file_write_padding)(int fd, uint64_t from, uint64_t to) {
+    static const char zeros[BTREE_FROZEN_ALIGNMENT] = {0};
+    return to <= from || BTREE_FUNC(file_write)(fd, zeros, (size_t)(to - from));
+}
+
+bool BTREE_FUNC(frozen_save)(BTREE_TYPED(frozen_t) *frozen, int fd) {
+    /* Write a frozen tree to fd, starting at its current position.
+       Only meaningful for keys and values that don't contain pointers.
+       Returns false on a write error, with errno set by write.
+    */
+    if (frozen == NULL || fd < 0) return false;
+    btree_file_header_t header;
+    BTREE_FUNC(file_header)(frozen, &header);
+    uint64_t nodes_end = header.nodes_offset + BTREE_FUNC(frozen_num_nodes)(frozen) * header.node_size;
+    return BTREE_FUNC(file_write)(fd, &header, sizeof(header))
+        && BTREE_FUNC(file_write_padding)(fd, sizeof(header), header.nodes_offset)
+        && BTREE_FUNC(file_write)(fd, frozen->nodes, (size_t)(nodes_end - header.nodes_offset))
+        && BTREE_FUNC(file_write_padding)(fd, nodes_end, header.values_offset)
+        && BTREE_FUNC(file_write)(fd, frozen->values, frozen->count * sizeof(BTREE_VALUE_TYPE));
+}
+
+bool BTREE_FUNC(save)(BTREE_NAME *tree, int fd) {
+    // write the tree to fd in the frozen format, to be loaded again with open_mmap
+    BTREE_TYPED(frozen_t) *frozen = BTREE_FUNC(freeze)(tree);
+    if (frozen == NULL) return false;
+    bool ok = BTREE_FUNC(frozen_save)(frozen, fd);
+    BTREE_FUNC(frozen_destroy)(frozen);
+    return ok;
+}
+
+BTREE_TYPED(frozen_t) *BTREE_FUNC(open_mmap)(const char *path) {
+    /* Map a file written by save or frozen_save and return it as a frozen tree.
+
+       Lookups and range scans read the mapped pages directly, nothing is copied
+       or fixed up, and processes that map the same file share one copy of it
+       in the page cache. The mapping is read-only, so values must not be written
+       through frozen_get_ptr. Release it with frozen_destroy.
+
+       Returns NULL if the file can't be mapped or was written by a different tree type.
+    */
+    if (path == NULL) return NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(btree_file_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    BTREE_TYPED(frozen_t) *frozen = calloc(1, sizeof(BTREE_TYPED(frozen_t)));
+    if (frozen == NULL) {
+        munmap(mapping, size);
+        return NULL;
+    }
+    btree_file_header_t *header = mapping;
+    btree_file_header_t expected;
+    if (header->count > SIZE_MAX / sizeof(BTREE_VALUE_TYPE) || BTREE_FUNC(frozen_layout)(frozen, (size_t)header->count) == 0) {
+        free(frozen);
+        munmap(mapping, size);
+        return NULL;
+    }
+    // everything in the header follows from the count, so it must match exactly
+    BTREE_FUNC(file_header)(frozen, &expected);
+    if (memcmp(header, &expected, sizeof(btree_file_header_t)) != 0 || expected.file_size != (uint64_t)size) {
+        free(frozen);
+        munmap(mapping, size);
         return NULL;
-    } else {
-        // key exists, delete from leaf node
-        void *deleted_value = (void *)current->children[i];
-        current->degree--;
-        memmove(current->children + i, current->children + i + 1, (current->degree - i) * sizeof(BTREE_NODE *));
-        memmove(current->keys + i, current->keys + i + 1, (current->degree - i) * sizeof(BTREE_KEY_TYPE));
-        // deleted from node, rebalance
-        finished = false;
-        while (!finished) {
-            if (current->degree >= BTREE_NODE_MIN_DEGREE) {
-                // node is still full enough, we're done
-                finished = true;
-            } else {
-                // node became underfull
-                if (stack_size == 0) {
-                    // current node is the root
-                    if (current->degree >= 2) {
-                        // root has at least 2 children, keep it
-                        finished = true;
-                    } else if (current->height == 0) {
-                        // deleted last key from the root, tree is empty, finished
-                        finished = true;
-                    } else {
-                        // delete the root, copy to keep address
-                        tmp = current->children[0];
-                        memcpy(current->keys, tmp->keys, tmp->degree * sizeof(BTREE_KEY_TYPE));
-                        memcpy(current->children, tmp->children, tmp->degree * sizeof(BTREE_NODE *));
-                        current->degree = tmp->degree;
-                        current->height = tmp->height;
-                        BTREE_NODE_MEMORY_POOL_FUNC(release)(tree->pool, tmp);
-                        finished = true;
-                    }
-                } else {
-                    // delete from a non-root node, stack_size > 0
-                    BTREE_NODE *parent = stack[--stack_size];
-                    // current node's index in its parent's children array
-                    size_t current_idx = index_stack[stack_size];
-                    BTREE_NODE *neighbor = NULL;
-                    if (current_idx < (size_t)parent->degree - 1) {
-                        // current is not parent's last child, check right sibling
-                        neighbor = parent->children[current_idx + 1];
-                        if (neighbor->degree > BTREE_NODE_MIN_DEGREE) {
-                            // neighbor has at least A + 1 keys, borrow one
-                            i = (size_t)current->degree;
-                            if (current->height > 0) {
-                                current->keys[i] = parent->keys[current_idx + 1];
-                            } else {
-                                // on leaf level, take leaf key
-                                current->keys[i] = neighbor->keys[0];
-                                neighbor->keys[0] = neighbor->keys[1];
-                            }
-                            current->children[i] = neighbor->children[0];
-                            parent->keys[current_idx + 1] = neighbor->keys[1];
-                            neighbor->children[0] = neighbor->children[1];
-                            memmove(neighbor->keys + 1, neighbor->keys + 2, (neighbor->degree - 2) * sizeof(BTREE_KEY_TYPE));
-                            memmove(neighbor->children + 1, neighbor->children + 2, (neighbor->degree - 2) * sizeof(BTREE_NODE *));
-                            neighbor->degree--;
-                            current->degree++;
-                            finished = true;
-                        } else {
-                            // sibling only has A keys, cannot borrow, have to merge
-                            i = (size_t)current->degree;
-                            if (current->height > 0) {
-                                // non-leaf, take neighbor's key from parent, copy all other keys from neighbor
-                                current->keys[i] = parent->keys[current_idx + 1];
-                                memcpy(current->keys + i + 1, neighbor->keys + 1, (neighbor->degree - 1) * sizeof(BTREE_KEY_TYPE));
-                            } else {
-                                // on leaf level, copy all leaf keys from neighbor
-                                memcpy(current->keys + i, neighbor->keys, neighbor->degree * sizeof(BTREE_KEY_TYPE));
-                            }
-                            // copy all children from neighbor
-                            memcpy(current->children + i, neighbor->children, neighbor->degree * sizeof(BTREE_NODE *));
-                            // add neighbor's degree to current
-                            current->degree += neighbor->degree;
-                            // release neighbor node to memory pool
-                            BTREE_NODE_MEMORY_POOL_FUNC(release)(tree->pool, neighbor);
-                            // remove neighbor from parent
-                            parent->degree--;
-                            i = current_idx + 1;
-                            // shift parent's keys and children to the left
-                            memmove(parent->keys + i, parent->keys + i + 1, (parent->degree - i) * sizeof(BTREE_KEY_TYPE));
-                            memmove(parent->children + i, parent->children + i + 1, (parent->degree - i) * sizeof(BTREE_NODE *));
-                            // deleted from parent, propagate up
-                            current = parent;
-                        }
-                    } else {
-                        // current is the last child, try left sibling
-                        neighbor = parent->children[current_idx - 1];
-                        if (neighbor->degree > BTREE_NODE_MIN_DEGREE) {
-                            /* Left sibling has at least A + 1 keys, take its last key/child
-                               and move it current's position 0.
-
-                               Diagram:
-
-                                      parent
-                                     /      \
-                                 neighbor   current
-                               0 1 2 3 4 5 | 6 7 8 9
-                            
-                               After sharing:
-
-                                     parent
-                                    /      \
-                                neighbor   current
-                               0 1 2 3 4 | 5 6 7 8 9
-                            */
-                            // move current node's keys and children to the right by 1
-                            memmove(current->children + 2, current->children + 1, (current->degree - 1) * sizeof(BTREE_NODE *));
-                            memmove(current->keys + 2, current->keys + 1, (current->degree - 1) * sizeof(BTREE_KEY_TYPE));
-                            // move neighbor's last child to current's first child
-                            current->children[1] = current->children[0];
-                            i = neighbor->degree;
-                            current->children[0] = neighbor->children[i - 1];
-                            if (current->height > 0) {
-                                // if not a leaf, put parent's key in the second position of current
-                                current->keys[1] = parent->keys[current_idx];
-                                current->keys[0] = neighbor->keys[i - 1];
-                            } else {
-                                // if a leaf, put neighbor's last key in the first position
-                                current->keys[1] = current->keys[0];
-                                current->keys[0] = neighbor->keys[i - 1];
-                            }
-                            parent->keys[current_idx] = neighbor->keys[i - 1];
-                            neighbor->degree--;
-                            current->degree++;
-                            finished = true;
-                        } else {
-                            // left sibling only has A keys, cannot borrow, have to merge
-                            i = neighbor->degree;
-                            if (current->height > 0) {
-                                //non-leaf, take parent's key
-                                neighbor->keys[i] = parent->keys[current_idx];
-                            } else {
-                                // on leaf level, take leaf key
-                                neighbor->keys[i] = current->keys[0];
-                            }
-                            // copy all keys except the first from current to neighbor
-                            // (since first key is set above)
-                            memcpy(neighbor->keys + i + 1, current->keys + 1, (current->degree - 1) * sizeof(BTREE_KEY_TYPE));
-                            // copy over all children from sibling
-                            memcpy(neighbor->children + i, current->children, current->degree * sizeof(BTREE_NODE *));
-                            // add current's degree to neighbor's
-                            neighbor->degree += current->degree;
-                            // release current node to memory pool
-                            BTREE_NODE_MEMORY_POOL_FUNC(release)(tree->pool, current);
-                            // decrease parent's degree. Since current is the last child,
-                            // it's like popping from a stack. No need to shift keys/children
-                            parent->degree--;
-                            // deleted from parent, propagate up
-                            current = parent;
-                        } // end of share/join for left sibling
-                    } // end of current is last child in parent
-                } // end of delete root/non-root
-            } // end of full/underfull check
-        } // end of rebalance
-        return deleted_value;
     }
+    frozen->nodes = (char *)mapping + expected.nodes_offset;
+    frozen->values = (BTREE_VALUE_TYPE *)((char *)mapping + expected.values_offset);
+    frozen->mapping = mapping;
+    frozen->mapping_size = size;
+    return frozen;
 }
 
+#endif
+
+#ifdef BTREE_SIMD_SEARCH
+#undef BTREE_SIMD_SEARCH
+#undef BTREE_KEY_TYPE_IS
+#undef BTREE_KEY_IS_SIMD_INTEGER
+#endif
+
+#ifdef BTREE_KEY_LESS_THAN_DEFINED
+#undef BTREE_KEY_LESS_THAN
+#undef BTREE_KEY_LESS_THAN_DEFINED
+#endif
+
+#ifdef BTREE_KEY_EQUALS_DEFINED
+#undef BTREE_KEY_EQUALS
+#undef BTREE_KEY_EQUALS_DEFINED
+#endif
+
+#ifdef BTREE_VALUE_NULL_DEFINED
+#undef BTREE_VALUE_NULL
+#undef BTREE_VALUE_NULL_DEFINED
+#endif
+
+#ifdef BTREE_VALUE_TYPE_DEFINED
+#undef BTREE_VALUE_TYPE
+#undef BTREE_VALUE_TYPE_DEFINED
+#endif
+
 #ifdef BTREE_NODE_MAX_DEGREE_DEFINED
 #undef BTREE_NODE_MAX_DEGREE
 #undef BTREE_NODE_MAX_DEGREE_DEFINED
 #endif
 
-#ifdef BTREE_NODE_MIN_DEGREE_DEFINED
-#undef BTREE_NODE_MIN_DEGREE
-#undef BTREE_NODE_MIN_DEGREE_DEFINED
+#ifdef BTREE_LEAF_NODE_SIZE_DEFINED
+#undef BTREE_LEAF_NODE_SIZE
+#undef BTREE_LEAF_NODE_SIZE_DEFINED
+#endif
+
+#ifdef BTREE_INNER_NODE_SIZE_DEFINED
+#undef BTREE_INNER_NODE_SIZE
+#undef BTREE_INNER_NODE_SIZE_DEFINED
+#endif
+
+#ifdef BTREE_LEAF_MAX_DEGREE_DEFINED
+#undef BTREE_LEAF_MAX_DEGREE
+#undef BTREE_LEAF_MAX_DEGREE_DEFINED
+#endif
+
+#ifdef BTREE_INNER_MAX_DEGREE_DEFINED
+#undef BTREE_INNER_MAX_DEGREE
+#undef BTREE_INNER_MAX_DEGREE_DEFINED
+#endif
+
+#ifdef BTREE_LEAF_MIN_DEGREE_DEFINED
+#undef BTREE_LEAF_MIN_DEGREE
+#undef BTREE_LEAF_MIN_DEGREE_DEFINED
+#endif
+
+#ifdef BTREE_INNER_MIN_DEGREE_DEFINED
+#undef BTREE_INNER_MIN_DEGREE
+#undef BTREE_INNER_MIN_DEGREE_DEFINED
+#endif
+
+#ifdef BTREE_LEAF_NODE_ALIGNMENT_DEFINED
+#undef BTREE_LEAF_NODE_ALIGNMENT
+#undef BTREE_LEAF_NODE_ALIGNMENT_DEFINED
+#endif
+
+#ifdef BTREE_INNER_NODE_ALIGNMENT_DEFINED
+#undef BTREE_INNER_NODE_ALIGNMENT
+#undef BTREE_INNER_NODE_ALIGNMENT_DEFINED
+#endif
+
+#ifdef BTREE_INNER_ENTRY_SIZE
+#undef BTREE_INNER_ENTRY_SIZE
+#endif
+
+#ifdef BTREE_INNER_HEADER_SIZE
+#undef BTREE_INNER_HEADER_SIZE
+#endif
+
+#ifdef BTREE_BUFFER_SIZE_DEFINED
+#undef BTREE_BUFFER_SIZE
+#undef BTREE_BUFFER_SIZE_DEFINED
+#endif
+
+#ifdef BTREE_PARALLEL_MIN_ENTRIES_DEFINED
+#undef BTREE_PARALLEL_MIN_ENTRIES
+#undef BTREE_PARALLEL_MIN_ENTRIES_DEFINED
+#endif
+
+#ifdef BTREE_APPEND_FAST_PATH
+#undef BTREE_APPEND_FAST_PATH
 #endif
+
+#undef BTREE_STAT_ADD
+#undef BTREE_LATENCY_START
+#undef BTREE_LATENCY_RECORD
@@ -0,0 +1,116 @@
+#ifndef BTREE_ALIGNED_POOL_H
+#define BTREE_ALIGNED_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree_allocator.h"
+
+// items are carved from blocks of about this many bytes, or one item per block if larger
+#define BTREE_ALIGNED_POOL_BLOCK_SIZE (1 << 20)
+
+#endif // BTREE_ALIGNED_POOL_H
+
+/*
+A memory pool with the same interface as memory_pool.h (new, get, release, destroy) whose
+items start on a MEMORY_POOL_ALIGNMENT byte boundary, a power of two such as a cache line
+or a page. Each item takes sizeof(MEMORY_POOL_TYPE) rounded up to the alignment, so items
+that fill their size exactly (like sized B-tree nodes) never straddle an extra cache line
+or page. Released items go on a free list and are only returned to the system on destroy.
+Blocks come from a btree_allocator_t, malloc with new() or any other with new_with_allocator.
+*/
+#ifndef MEMORY_POOL_NAME
+#error "Must define MEMORY_POOL_NAME"
+#endif
+
+#ifndef MEMORY_POOL_TYPE
+#error "Must define MEMORY_POOL_TYPE"
+#endif
+
+#ifndef MEMORY_POOL_ALIGNMENT
+#error "Must define MEMORY_POOL_ALIGNMENT"
+#endif
+
+#define BTREE_ALIGNED_POOL_CONCAT_(a, b) a ## b
+#define BTREE_ALIGNED_POOL_CONCAT(a, b) BTREE_ALIGNED_POOL_CONCAT_(a, b)
+#define BTREE_ALIGNED_POOL_FUNC(name) BTREE_ALIGNED_POOL_CONCAT(MEMORY_POOL_NAME, _##name)
+
+#define BTREE_ALIGNED_POOL_ITEM_SIZE \
+    ((sizeof(MEMORY_POOL_TYPE) + (MEMORY_POOL_ALIGNMENT) - 1) / (MEMORY_POOL_ALIGNMENT) * (MEMORY_POOL_ALIGNMENT))
+
+// leaves room for the pointer to the previous block, so two blocks fit a 2 MiB huge page
+#define BTREE_ALIGNED_POOL_BLOCK_ITEMS \
+    (BTREE_ALIGNED_POOL_ITEM_SIZE + sizeof(void *) <= BTREE_ALIGNED_POOL_BLOCK_SIZE ? (BTREE_ALIGNED_POOL_BLOCK_SIZE - sizeof(void *)) / BTREE_ALIGNED_POOL_ITEM_SIZE : 1)
+
+#define BTREE_ALIGNED_POOL_BLOCK_BYTES (BTREE_ALIGNED_POOL_BLOCK_ITEMS * BTREE_ALIGNED_POOL_ITEM_SIZE + sizeof(void *))
+
+typedef struct {
+    btree_allocator_t allocator;
+    // each block holds its items, followed by a pointer to the previous block
+    void *blocks;
+    // the unused part of the newest block
+    char *next_item;
+    char *end;
+    // released items, linked through their first bytes
+    void *free_list;
+} MEMORY_POOL_NAME;
+
+static inline MEMORY_POOL_NAME *BTREE_ALIGNED_POOL_FUNC(new_with_allocator)(const btree_allocator_t *allocator) {
+    MEMORY_POOL_NAME *pool = btree_allocator_calloc(allocator, sizeof(MEMORY_POOL_NAME));
+    if (pool == NULL) return NULL;
+    pool->allocator = *allocator;
+    return pool;
+}
+
+static inline MEMORY_POOL_NAME *BTREE_ALIGNED_POOL_FUNC(new)(void) {
+    btree_allocator_t allocator = btree_default_allocator();
+    return BTREE_ALIGNED_POOL_FUNC(new_with_allocator)(&allocator);
+}
+
+static inline MEMORY_POOL_TYPE *BTREE_ALIGNED_POOL_FUNC(get)(MEMORY_POOL_NAME *pool) {
+    if (pool->free_list != NULL) {
+        void *item = pool->free_list;
+        pool->free_list = *(void **)item;
+        return (MEMORY_POOL_TYPE *)item;
+    }
+    if (pool->next_item == NULL || (size_t)(pool->end - pool->next_item) < BTREE_ALIGNED_POOL_ITEM_SIZE) {
+        size_t items_size = BTREE_ALIGNED_POOL_BLOCK_ITEMS * BTREE_ALIGNED_POOL_ITEM_SIZE;
+        char *block = pool->allocator.alloc(pool->allocator.context, BTREE_ALIGNED_POOL_BLOCK_BYTES, MEMORY_POOL_ALIGNMENT);
+        if (block == NULL) return NULL;
+        memcpy(block + items_size, &pool->blocks, sizeof(void *));
+        pool->blocks = block;
+        pool->next_item = block;
+        pool->end = block + items_size;
+    }
+    MEMORY_POOL_TYPE *item = (MEMORY_POOL_TYPE *)pool->next_item;
+    pool->next_item += BTREE_ALIGNED_POOL_ITEM_SIZE;
+    return item;
+}
+
+static inline void BTREE_ALIGNED_POOL_FUNC(release)(MEMORY_POOL_NAME *pool, MEMORY_POOL_TYPE *item) {
+    *(void **)item = pool->free_list;
+    pool->free_list = item;
+}
+
+static inline void BTREE_ALIGNED_POOL_FUNC(destroy)(MEMORY_POOL_NAME *pool) {
+    if (pool == NULL) return;
+    btree_allocator_t allocator = pool->allocator;
+    size_t items_size = BTREE_ALIGNED_POOL_BLOCK_ITEMS * BTREE_ALIGNED_POOL_ITEM_SIZE;
+    char *block = pool->blocks;
+    while (block != NULL) {
+        char *prev;
+        memcpy(&prev, block + items_size, sizeof(void *));
+        allocator.free(allocator.context, block, BTREE_ALIGNED_POOL_BLOCK_BYTES);
+        block = prev;
+    }
+    btree_allocator_free(&allocator, pool, sizeof(MEMORY_POOL_NAME));
+}
+
+#undef BTREE_ALIGNED_POOL_CONCAT_
+#undef BTREE_ALIGNED_POOL_CONCAT
+#undef BTREE_ALIGNED_POOL_FUNC
+#undef BTREE_ALIGNED_POOL_ITEM_SIZE
+#undef BTREE_ALIGNED_POOL_BLOCK_ITEMS
+#undef BTREE_ALIGNED_POOL_BLOCK_BYTES
@@ -0,0 +1,237 @@
+#ifndef BTREE_ALLOCATOR_H
+#define BTREE_ALLOCATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+An allocator for the memory of a tree: its nodes (in blocks of about a megabyte, see
+btree_aligned_pool.h), its memory pools and the tree struct itself. alloc returns size bytes
+starting on an alignment boundary (a power of two), or NULL, and free gets back the same
+size. context is passed to both, e.g. an arena.
+*/
+typedef struct {
+    void *(*alloc)(void *context, size_t size, size_t alignment);
+    void (*free)(void *context, void *ptr, size_t size);
+    void *context;
+} btree_allocator_t;
+
+// enough for any of the structs, like malloc
+#define BTREE_ALLOCATOR_MIN_ALIGNMENT 16
+
+static inline void *btree_malloc_alloc(void *context, size_t size, size_t alignment) {
+    // over-allocate and keep the pointer from malloc right before the aligned one
+    (void)context;
+    if (alignment < sizeof(void *)) alignment = sizeof(void *);
+    char *memory = malloc(size + alignment - 1 + sizeof(void *));
+    if (memory == NULL) return NULL;
+    uintptr_t address = (uintptr_t)(memory + sizeof(void *));
+    char *ptr = memory + sizeof(void *) + (alignment - address % alignment) % alignment;
+    memcpy(ptr - sizeof(void *), &memory, sizeof(void *));
+    return ptr;
+}
+
+static inline void btree_malloc_free(void *context, void *ptr, size_t size) {
+    (void)context;
+    (void)size;
+    if (ptr == NULL) return;
+    void *memory;
+    memcpy(&memory, (char *)ptr - sizeof(void *), sizeof(void *));
+    free(memory);
+}
+
+static inline btree_allocator_t btree_default_allocator(void) {
+    // malloc and free
+    btree_allocator_t allocator = {btree_malloc_alloc, btree_malloc_free, NULL};
+    return allocator;
+}
+
+static inline void *btree_allocator_calloc(const btree_allocator_t *allocator, size_t size) {
+    void *ptr = allocator->alloc(allocator->context, size, BTREE_ALLOCATOR_MIN_ALIGNMENT);
+    if (ptr != NULL) memset(ptr, 0, size);
+    return ptr;
+}
+
+static inline void btree_allocator_free(const btree_allocator_t *allocator, void *ptr, size_t size) {
+    if (ptr != NULL) allocator->free(allocator->context, ptr, size);
+}
+
+/*
+A huge page arena hands out memory from regions of BTREE_HUGE_PAGE_SIZE (2 MiB) bytes, aligned
+to their size, so that the nodes of a large tree sit on a few huge pages instead of thousands of
+4 KiB ones and lookups miss the TLB far less often.
+
+A region is mapped with MAP_HUGETLB if the system has huge pages reserved
+(/proc/sys/vm/nr_hugepages), and otherwise advised to transparent huge pages with
+madvise(MADV_HUGEPAGE). With numa_node >= 0 the regions are bound to that NUMA node with
+mbind before they're first touched, so the nodes live next to the threads reading them.
+These need Linux, and mmap/madvise flags that glibc only declares with _DEFAULT_SOURCE or
+_GNU_SOURCE defined before the first #include, without them (or elsewhere) the regions just
+come from malloc, still aligned to 2 MiB.
+
+Memory handed out by the arena is only given back when the arena is destroyed, so it suits one
+or a few long-lived trees, and has to outlive them. It's safe to use from several threads.
+*/
+#define BTREE_HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+#define BTREE_HUGE_PAGES_AVAILABLE
+#endif
+
+typedef struct btree_hugepage_region {
+    struct btree_hugepage_region *next;
+    void *memory;
+    size_t size;
+    bool mapped;
+} btree_hugepage_region_t;
+
+typedef struct {
+    int numa_node;
+    // the unused part of the newest region
+    char *next;
+    char *end;
+    btree_hugepage_region_t *regions;
+    // number of regions, how many are MAP_HUGETLB or advised to transparent huge pages, bound to numa_node
+    size_t num_regions;
+    size_t hugetlb_regions;
+    size_t advised_regions;
+    size_t bound_regions;
+    // bytes handed out
+    size_t allocated;
+    volatile int lock;
+} btree_hugepage_arena_t;
+
+static inline btree_hugepage_arena_t *btree_hugepage_arena_new(int numa_node) {
+    // numa_node < 0 leaves the placement to the system
+    btree_hugepage_arena_t *arena = calloc(1, sizeof(btree_hugepage_arena_t));
+    if (arena == NULL) return NULL;
+    arena->numa_node = numa_node;
+    return arena;
+}
+
+static inline bool btree_hugepage_arena_map(btree_hugepage_arena_t *arena, btree_hugepage_region_t *region, size_t size) {
+    // map size bytes (a multiple of BTREE_HUGE_PAGE_SIZE) aligned to BTREE_HUGE_PAGE_SIZE into region
+#ifdef BTREE_HUGE_PAGES_AVAILABLE
+    char *memory = MAP_FAILED;
+    bool hugetlb = false;
+#ifdef MAP_HUGETLB
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    hugetlb = memory != MAP_FAILED;
+#endif
+    if (memory == MAP_FAILED) {
+        // map a huge page more than needed and trim it down to an aligned range
+        char *mapped = mmap(NULL, size + BTREE_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped != MAP_FAILED) {
+            size_t head = (BTREE_HUGE_PAGE_SIZE - (uintptr_t)mapped % BTREE_HUGE_PAGE_SIZE) % BTREE_HUGE_PAGE_SIZE;
+            if (head > 0) munmap(mapped, head);
+            memory = mapped + head;
+            if (BTREE_HUGE_PAGE_SIZE - head > 0) munmap(memory + size, BTREE_HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+            if (madvise(memory, size, MADV_HUGEPAGE) == 0) arena->advised_regions++;
+#endif
+        }
+    }
+    if (memory != MAP_FAILED) {
+        if (hugetlb) arena->hugetlb_regions++;
+#if defined(SYS_mbind)
+        if (arena->numa_node >= 0) {
+            // MPOL_BIND to the one node, the mask holds as many bits as it is wide
+            unsigned long mask[4] = {0};
+            size_t bits = 8 * sizeof(unsigned long);
+            if ((size_t)arena->numa_node < 4 * bits) {
+                mask[(size_t)arena->numa_node / bits] = 1UL << ((size_t)arena->numa_node % bits);
+                if (syscall(SYS_mbind, memory, size, 2, mask, 4 * bits + 1, 0) == 0) arena->bound_regions++;
+            }
+        }
+#endif
+        region->memory = memory;
+        region->size = size;
+        region->mapped = true;
+        return true;
+    }
+#else
+    (void)arena;
+#endif
+    region->memory = btree_malloc_alloc(NULL, size, BTREE_HUGE_PAGE_SIZE);
+    region->size = size;
+    region->mapped = false;
+    return region->memory != NULL;
+}
+
+static inline void *btree_hugepage_arena_alloc(void *context, size_t size, size_t alignment) {
+    btree_hugepage_arena_t *arena = context;
+    if (alignment == 0 || alignment > BTREE_HUGE_PAGE_SIZE) return NULL;
+    while (__atomic_test_and_set((void *)&arena->lock, __ATOMIC_ACQUIRE)) {
+    }
+    char *ptr = NULL;
+    if (arena->next != NULL) {
+        ptr = arena->next + (alignment - (uintptr_t)arena->next % alignment) % alignment;
+        if (ptr > arena->end || (size_t)(arena->end - ptr) < size) ptr = NULL;
+    }
+    if (ptr == NULL) {
+        // a new region, the rest of the current one stays unused
+        btree_hugepage_region_t *region = malloc(sizeof(btree_hugepage_region_t));
+        size_t region_size = (size + BTREE_HUGE_PAGE_SIZE - 1) / BTREE_HUGE_PAGE_SIZE * BTREE_HUGE_PAGE_SIZE;
+        if (region != NULL && btree_hugepage_arena_map(arena, region, region_size)) {
+            region->next = arena->regions;
+            arena->regions = region;
+            arena->num_regions++;
+            ptr = region->memory;
+            arena->end = ptr + region_size;
+        } else {
+            free(region);
+        }
+    }
+    if (ptr != NULL) {
+        arena->next = ptr + size;
+        arena->allocated += size;
+    }
+    __atomic_clear((void *)&arena->lock, __ATOMIC_RELEASE);
+    return ptr;
+}
+
+static inline void btree_hugepage_arena_free(void *context, void *ptr, size_t size) {
+    // given back with the rest of the arena on destroy
+    (void)context;
+    (void)ptr;
+    (void)size;
+}
+
+static inline btree_allocator_t btree_hugepage_arena_allocator(btree_hugepage_arena_t *arena) {
+    btree_allocator_t allocator = {btree_hugepage_arena_alloc, btree_hugepage_arena_free, arena};
+    return allocator;
+}
+
+static inline void btree_hugepage_arena_destroy(btree_hugepage_arena_t *arena) {
+    // after every tree using the arena has been destroyed
+    if (arena == NULL) return;
+    btree_hugepage_region_t *region = arena->regions;
+    while (region != NULL) {
+        btree_hugepage_region_t *next = region->next;
+#ifdef BTREE_HUGE_PAGES_AVAILABLE
+        if (region->mapped) {
+            munmap(region->memory, region->size);
+        } else {
+            btree_malloc_free(NULL, region->memory, region->size);
+        }
+#else
+        btree_malloc_free(NULL, region->memory, region->size);
+#endif
+        free(region);
+        region = next;
+    }
+    free(arena);
+}
+
+#endif // BTREE_ALLOCATOR_H
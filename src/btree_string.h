@@ -0,0 +1,726 @@
+#ifndef BTREE_STRING_H
+#define BTREE_STRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BTREE_STRING_DEFAULT_NODE_SIZE 4096
+#define BTREE_STRING_MAX_HEIGHT 128
+
+static inline uint32_t btree_string_head(const unsigned char *key, size_t length) {
+    /* The first four bytes of a key, big-endian and zero-padded. Two different heads
+       compare the same way as the keys they came from, so only equal heads need memcmp.
+    */
+    uint32_t head = 0;
+    for (size_t i = 0; i < 4; i++) {
+        head = (head << 8) | (i < length ? key[i] : 0);
+    }
+    return head;
+}
+
+static inline int btree_string_compare(const unsigned char *a, size_t a_length, const unsigned char *b, size_t b_length) {
+    // bytewise order, a key that is a prefix of another sorts first
+    size_t n = a_length < b_length ? a_length : b_length;
+    int cmp = n > 0 ? memcmp(a, b, n) : 0;
+    if (cmp != 0) return cmp;
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+static inline size_t btree_string_common_prefix(const unsigned char *a, size_t a_length, const unsigned char *b, size_t b_length) {
+    size_t n = a_length < b_length ? a_length : b_length;
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) i++;
+    return i;
+}
+
+#endif // BTREE_STRING_H
+
+#ifndef BTREE_NAME
+#error "Must define BTREE_NAME"
+#endif
+
+#define BTREE_CONCAT_(a, b) a ## b
+#define BTREE_CONCAT(a, b) BTREE_CONCAT_(a, b)
+#define BTREE_TYPED(name) BTREE_CONCAT(BTREE_NAME, _##name)
+#define BTREE_FUNC(func) BTREE_CONCAT(BTREE_NAME, _##func)
+
+/*
+A B+tree for variable-length byte-string keys such as URLs or paths, ordered bytewise
+(memcmp order, with a key sorting before any longer key it is a prefix of).
+Keys are passed as a pointer and a length and are copied into the tree, so they
+don't need to be NUL-terminated and may contain zero bytes. Each key is stored once,
+inserting a key that is already present replaces its value.
+
+Values are stored inline, as in btree.h: void pointers by default, or BTREE_VALUE_TYPE.
+BTREE_VALUE_NULL is what get/delete return for a missing key.
+*/
+#ifndef BTREE_VALUE_TYPE
+#define BTREE_VALUE_TYPE void *
+#define BTREE_VALUE_TYPE_DEFINED
+#endif
+
+#ifndef BTREE_VALUE_NULL
+#ifdef BTREE_VALUE_TYPE_DEFINED
+#define BTREE_VALUE_NULL NULL
+#else
+#define BTREE_VALUE_NULL ((BTREE_VALUE_TYPE){0})
+#endif
+#define BTREE_VALUE_NULL_DEFINED
+#endif
+
+// bytes per node, a multiple of 8 and small enough for 16-bit offsets within the node
+#ifndef BTREE_STRING_NODE_SIZE
+#define BTREE_STRING_NODE_SIZE BTREE_STRING_DEFAULT_NODE_SIZE
+#define BTREE_STRING_NODE_SIZE_DEFINED
+#endif
+
+#if BTREE_STRING_NODE_SIZE > 32768 || BTREE_STRING_NODE_SIZE % 8 != 0
+#error "BTREE_STRING_NODE_SIZE must be a multiple of 8 and at most 32768"
+#endif
+
+/*
+Every node is a fixed-size slotted page. The header is followed by an array of slots
+growing up, and the key bytes live in a heap growing down from the end of the node,
+each key followed by its value (in a leaf) or child pointer (in an inner node).
+
+Each node also keeps its fence keys: every key in the node's subtree is >= the lower fence
+and < the upper fence (the rightmost nodes have no upper fence). Any key between the fences
+starts with their common prefix, so that prefix is stored once, as part of the lower fence,
+and only the rest of each key (its suffix) is kept in the heap. The prefix only depends on
+the fences, so it never changes as keys come and go, only when nodes are split or merged.
+
+A slot holds the offset and length of its key suffix and the first four bytes of the suffix
+as an integer (see btree_string_head), so most comparisons in a search never leave
+the slot array.
+
+As in btree.h, inner nodes have one slot per child and the key of slot i is a lower bound
+for child i, so slot 0 holds the lower fence. When a leaf splits, the separator is the shortest
+prefix of the first key on the right that is still greater than the last key on the left,
+which keeps inner nodes small and the fanout high for long keys with common prefixes.
+*/
+typedef struct {
+    uint16_t offset;
+    uint16_t length;
+    uint32_t head;
+} BTREE_TYPED(slot_t);
+
+#define BTREE_STRING_SLOT BTREE_TYPED(slot_t)
+
+typedef struct BTREE_TYPED(node) {
+    uint16_t height;
+    uint16_t count;
+    uint16_t prefix_length;
+    // lowest heap byte in use, the heap grows down from BTREE_STRING_NODE_SIZE
+    uint16_t heap_start;
+    // heap bytes still referenced, the rest are holes left by removed keys
+    uint16_t heap_used;
+    uint16_t lower_offset;
+    uint16_t lower_length;
+    uint16_t upper_offset;
+    uint16_t upper_length;
+    uint16_t has_upper;
+    BTREE_STRING_SLOT slots[];
+} BTREE_TYPED(node_t);
+
+#define BTREE_STRING_NODE BTREE_TYPED(node_t)
+
+typedef struct {
+    uint64_t words[BTREE_STRING_NODE_SIZE / sizeof(uint64_t)];
+} BTREE_TYPED(node_block_t);
+
+#define BTREE_STRING_PAYLOAD_SIZE (sizeof(BTREE_VALUE_TYPE) > sizeof(BTREE_STRING_NODE *) ? sizeof(BTREE_VALUE_TYPE) : sizeof(BTREE_STRING_NODE *))
+
+/* The longest key that can be stored. With at most this many bytes per key,
+   the two halves of any split node still have room for the key that caused the split
+   and both fences.
+*/
+#ifndef BTREE_STRING_MAX_KEY_LENGTH
+#define BTREE_STRING_MAX_KEY_LENGTH ((BTREE_STRING_NODE_SIZE - sizeof(BTREE_STRING_NODE)) / 8 - (sizeof(BTREE_STRING_SLOT) + BTREE_STRING_PAYLOAD_SIZE) / 2)
+#define BTREE_STRING_MAX_KEY_LENGTH_DEFINED
+#endif
+
+// nodes using less than this are merged into a neighbor after a delete if the two fit in one node
+#ifndef BTREE_STRING_MERGE_THRESHOLD
+#define BTREE_STRING_MERGE_THRESHOLD (BTREE_STRING_NODE_SIZE / 4)
+#define BTREE_STRING_MERGE_THRESHOLD_DEFINED
+#endif
+
+#define BTREE_STRING_MEMORY_POOL_NAME BTREE_TYPED(node_memory_pool)
+
+#define MEMORY_POOL_NAME BTREE_STRING_MEMORY_POOL_NAME
+#define MEMORY_POOL_TYPE BTREE_TYPED(node_block_t)
+#include "memory_pool/memory_pool.h"
+#undef MEMORY_POOL_NAME
+#undef MEMORY_POOL_TYPE
+
+#define BTREE_STRING_MEMORY_POOL_FUNC(name) BTREE_CONCAT(BTREE_STRING_MEMORY_POOL_NAME, _##name)
+
+typedef struct {
+    BTREE_STRING_NODE *root;
+    BTREE_TYPED(node_memory_pool) *pool;
+} BTREE_NAME;
+
+static inline size_t BTREE_FUNC(max_key_length)(void) {
+    return BTREE_STRING_MAX_KEY_LENGTH;
+}
+
+static inline unsigned char *BTREE_FUNC(node_bytes)(BTREE_STRING_NODE *node) {
+    return (unsigned char *)node;
+}
+
+static inline size_t BTREE_FUNC(node_payload_size)(BTREE_STRING_NODE *node) {
+    return node->height > 0 ? sizeof(BTREE_STRING_NODE *) : sizeof(BTREE_VALUE_TYPE);
+}
+
+static inline const unsigned char *BTREE_FUNC(node_lower)(BTREE_STRING_NODE *node) {
+    return BTREE_FUNC(node_bytes)(node) + node->lower_offset;
+}
+
+static inline const unsigned char *BTREE_FUNC(node_upper)(BTREE_STRING_NODE *node) {
+    return BTREE_FUNC(node_bytes)(node) + node->upper_offset;
+}
+
+static inline unsigned char *BTREE_FUNC(node_suffix)(BTREE_STRING_NODE *node, size_t i) {
+    return BTREE_FUNC(node_bytes)(node) + node->slots[i].offset;
+}
+
+static inline unsigned char *BTREE_FUNC(node_payload)(BTREE_STRING_NODE *node, size_t i) {
+    // unaligned, always accessed with memcpy
+    return BTREE_FUNC(node_suffix)(node, i) + node->slots[i].length;
+}
+
+static inline BTREE_STRING_NODE *BTREE_FUNC(node_child)(BTREE_STRING_NODE *node, size_t i) {
+    BTREE_STRING_NODE *child;
+    memcpy(&child, BTREE_FUNC(node_payload)(node, i), sizeof(child));
+    return child;
+}
+
+static inline size_t BTREE_FUNC(node_entry_size)(BTREE_STRING_NODE *node, size_t i) {
+    return sizeof(BTREE_STRING_SLOT) + (size_t)node->slots[i].length + BTREE_FUNC(node_payload_size)(node);
+}
+
+static inline size_t BTREE_FUNC(node_space_used)(BTREE_STRING_NODE *node) {
+    return sizeof(BTREE_STRING_NODE) + (size_t)node->count * sizeof(BTREE_STRING_SLOT) + (size_t)node->heap_used;
+}
+
+static inline size_t BTREE_FUNC(node_free_contiguous)(BTREE_STRING_NODE *node) {
+    // the gap between the slot array and the heap
+    return (size_t)node->heap_start - sizeof(BTREE_STRING_NODE) - (size_t)node->count * sizeof(BTREE_STRING_SLOT);
+}
+
+static inline uint16_t BTREE_FUNC(node_heap_alloc)(BTREE_STRING_NODE *node, size_t size) {
+    node->heap_start = (uint16_t)(node->heap_start - size);
+    node->heap_used = (uint16_t)(node->heap_used + size);
+    return node->heap_start;
+}
+
+static void BTREE_FUNC(node_init)(BTREE_STRING_NODE *node, uint16_t height,
+                                  const unsigned char *lower, size_t lower_length,
+                                  const unsigned char *upper, size_t upper_length, bool has_upper) {
+    // the fences are copied before anything else, so they may point into another node
+    node->height = height;
+    node->count = 0;
+    node->heap_start = BTREE_STRING_NODE_SIZE;
+    node->heap_used = 0;
+    node->lower_offset = BTREE_FUNC(node_heap_alloc)(node, lower_length);
+    node->lower_length = (uint16_t)lower_length;
+    if (lower_length > 0) memcpy(BTREE_FUNC(node_bytes)(node) + node->lower_offset, lower, lower_length);
+    node->has_upper = has_upper;
+    if (has_upper) {
+        node->upper_offset = BTREE_FUNC(node_heap_alloc)(node, upper_length);
+        node->upper_length = (uint16_t)upper_length;
+        if (upper_length > 0) memcpy(BTREE_FUNC(node_bytes)(node) + node->upper_offset, upper, upper_length);
+        node->prefix_length = (uint16_t)btree_string_common_prefix(lower, lower_length, upper, upper_length);
+    } else {
+        node->upper_offset = node->heap_start;
+        node->upper_length = 0;
+        node->prefix_length = 0;
+    }
+}
+
+static inline BTREE_STRING_NODE *BTREE_FUNC(node_new)(BTREE_NAME *tree) {
+    return (BTREE_STRING_NODE *)BTREE_STRING_MEMORY_POOL_FUNC(get)(tree->pool);
+}
+
+static inline void BTREE_FUNC(node_release)(BTREE_NAME *tree, BTREE_STRING_NODE *node) {
+    BTREE_STRING_MEMORY_POOL_FUNC(release)(tree->pool, (BTREE_TYPED(node_block_t) *)node);
+}
+
+static inline size_t BTREE_FUNC(node_key)(BTREE_STRING_NODE *node, size_t i, unsigned char *key) {
+    // reassemble the full key of slot i into key, returns its length
+    size_t prefix_length = (size_t)node->prefix_length;
+    memcpy(key, BTREE_FUNC(node_lower)(node), prefix_length);
+    memcpy(key + prefix_length, BTREE_FUNC(node_suffix)(node, i), (size_t)node->slots[i].length);
+    return prefix_length + (size_t)node->slots[i].length;
+}
+
+static size_t BTREE_FUNC(node_lower_bound)(BTREE_STRING_NODE *node, const unsigned char *key, size_t length, bool *found) {
+    /* Index of the first slot whose key is >= key, and whether it is equal.
+       The key has to be between the node's fences, so it starts with the node prefix.
+    */
+    const unsigned char *suffix = key + node->prefix_length;
+    size_t suffix_length = length - (size_t)node->prefix_length;
+    uint32_t head = btree_string_head(suffix, suffix_length);
+    size_t lo = 0;
+    size_t hi = (size_t)node->count;
+    int cmp = 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        BTREE_STRING_SLOT *slot = &node->slots[mid];
+        if (slot->head != head) {
+            cmp = slot->head < head ? -1 : 1;
+        } else {
+            cmp = btree_string_compare(BTREE_FUNC(node_suffix)(node, mid), (size_t)slot->length, suffix, suffix_length);
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < (size_t)node->count
+             && node->slots[lo].head == head
+             && btree_string_compare(BTREE_FUNC(node_suffix)(node, lo), (size_t)node->slots[lo].length, suffix, suffix_length) == 0;
+    return lo;
+}
+
+static inline size_t BTREE_FUNC(node_child_index)(BTREE_STRING_NODE *node, const unsigned char *key, size_t length) {
+    // the last child whose lower bound is <= key
+    bool found;
+    size_t i = BTREE_FUNC(node_lower_bound)(node, key, length, &found);
+    if (found) return i;
+    return i > 0 ? i - 1 : 0;
+}
+
+static void BTREE_FUNC(node_compact)(BTREE_STRING_NODE *node);
+
+static bool BTREE_FUNC(node_insert_at)(BTREE_STRING_NODE *node, size_t i, const unsigned char *key, size_t length, const void *payload) {
+    // store a full key (without the node prefix) and its payload in slot i, false if it doesn't fit
+    size_t suffix_length = length - (size_t)node->prefix_length;
+    size_t size = suffix_length + BTREE_FUNC(node_payload_size)(node);
+    if (BTREE_FUNC(node_space_used)(node) + sizeof(BTREE_STRING_SLOT) + size > BTREE_STRING_NODE_SIZE) return false;
+    if (BTREE_FUNC(node_free_contiguous)(node) < sizeof(BTREE_STRING_SLOT) + size) {
+        // there is enough room in the holes left by removed keys
+        BTREE_FUNC(node_compact)(node);
+    }
+    memmove(&node->slots[i + 1], &node->slots[i], ((size_t)node->count - i) * sizeof(BTREE_STRING_SLOT));
+    uint16_t offset = BTREE_FUNC(node_heap_alloc)(node, size);
+    const unsigned char *suffix = key + node->prefix_length;
+    if (suffix_length > 0) memcpy(BTREE_FUNC(node_bytes)(node) + offset, suffix, suffix_length);
+    memcpy(BTREE_FUNC(node_bytes)(node) + offset + suffix_length, payload, BTREE_FUNC(node_payload_size)(node));
+    node->slots[i].offset = offset;
+    node->slots[i].length = (uint16_t)suffix_length;
+    node->slots[i].head = btree_string_head(suffix, suffix_length);
+    node->count++;
+    return true;
+}
+
+static inline void BTREE_FUNC(node_remove_at)(BTREE_STRING_NODE *node, size_t i) {
+    node->heap_used = (uint16_t)(node->heap_used - (node->slots[i].length + BTREE_FUNC(node_payload_size)(node)));
+    memmove(&node->slots[i], &node->slots[i + 1], ((size_t)node->count - i - 1) * sizeof(BTREE_STRING_SLOT));
+    node->count--;
+}
+
+static inline bool BTREE_FUNC(node_append_from)(BTREE_STRING_NODE *node, BTREE_STRING_NODE *src, size_t i) {
+    // copy entry i of src to the end of node, which may have a different prefix
+    unsigned char key[BTREE_STRING_MAX_KEY_LENGTH];
+    size_t length = BTREE_FUNC(node_key)(src, i, key);
+    return BTREE_FUNC(node_insert_at)(node, (size_t)node->count, key, length, BTREE_FUNC(node_payload)(src, i));
+}
+
+static void BTREE_FUNC(node_compact)(BTREE_STRING_NODE *node) {
+    // rewrite the node without the holes in its heap
+    BTREE_TYPED(node_block_t) block;
+    BTREE_STRING_NODE *copy = (BTREE_STRING_NODE *)&block;
+    BTREE_FUNC(node_init)(copy, node->height, BTREE_FUNC(node_lower)(node), (size_t)node->lower_length,
+                          BTREE_FUNC(node_upper)(node), (size_t)node->upper_length, node->has_upper);
+    for (size_t i = 0; i < (size_t)node->count; i++) {
+        BTREE_FUNC(node_append_from)(copy, node, i);
+    }
+    memcpy(node, copy, BTREE_STRING_NODE_SIZE);
+}
+
+static void BTREE_FUNC(node_split)(BTREE_STRING_NODE *node, BTREE_STRING_NODE *right, unsigned char *separator, size_t *separator_length) {
+    /* Move the upper half (by bytes) of the node's entries to right, a node fresh from the pool.
+       separator gets the new lower fence of the right node, which goes into the parent.
+    */
+    size_t count = (size_t)node->count;
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += BTREE_FUNC(node_entry_size)(node, i);
+    }
+    size_t m = 0;
+    size_t left_size = 0;
+    while (m < count - 1 && left_size + BTREE_FUNC(node_entry_size)(node, m) <= total / 2) {
+        left_size += BTREE_FUNC(node_entry_size)(node, m);
+        m++;
+    }
+    if (m == 0) m = 1;
+
+    size_t length = BTREE_FUNC(node_key)(node, m, separator);
+    if (node->height == 0) {
+        // shortest prefix of the first key on the right that is still greater than the last key on the left
+        unsigned char last[BTREE_STRING_MAX_KEY_LENGTH];
+        size_t last_length = BTREE_FUNC(node_key)(node, m - 1, last);
+        length = btree_string_common_prefix(last, last_length, separator, length) + 1;
+    }
+    *separator_length = length;
+
+    BTREE_TYPED(node_block_t) block;
+    BTREE_STRING_NODE *left = (BTREE_STRING_NODE *)&block;
+    BTREE_FUNC(node_init)(left, node->height, BTREE_FUNC(node_lower)(node), (size_t)node->lower_length, separator, length, true);
+    BTREE_FUNC(node_init)(right, node->height, separator, length, BTREE_FUNC(node_upper)(node), (size_t)node->upper_length, node->has_upper);
+    // the narrower fences only make the prefixes longer, so both halves fit
+    for (size_t i = 0; i < m; i++) {
+        BTREE_FUNC(node_append_from)(left, node, i);
+    }
+    for (size_t i = m; i < count; i++) {
+        BTREE_FUNC(node_append_from)(right, node, i);
+    }
+    memcpy(node, left, BTREE_STRING_NODE_SIZE);
+}
+
+BTREE_NAME *BTREE_FUNC(new)(void) {
+    BTREE_NAME *tree = calloc(1, sizeof(BTREE_NAME));
+    if (tree == NULL) return NULL;
+    tree->pool = BTREE_STRING_MEMORY_POOL_FUNC(new)();
+    if (tree->pool == NULL) {
+        free(tree);
+        return NULL;
+    }
+    tree->root = BTREE_FUNC(node_new)(tree);
+    if (tree->root == NULL) {
+        BTREE_STRING_MEMORY_POOL_FUNC(destroy)(tree->pool);
+        free(tree);
+        return NULL;
+    }
+    // the root covers every key, from the empty string up
+    BTREE_FUNC(node_init)(tree->root, 0, NULL, 0, NULL, 0, false);
+    return tree;
+}
+
+void BTREE_FUNC(destroy)(BTREE_NAME *tree) {
+    if (tree == NULL) return;
+    if (tree->pool != NULL) {
+        BTREE_STRING_MEMORY_POOL_FUNC(destroy)(tree->pool);
+    }
+    free(tree);
+}
+
+static BTREE_STRING_NODE *BTREE_FUNC(find_leaf)(BTREE_NAME *tree, const unsigned char *key, size_t length) {
+    BTREE_STRING_NODE *node = tree->root;
+    while (node->height > 0) {
+        node = BTREE_FUNC(node_child)(node, BTREE_FUNC(node_child_index)(node, key, length));
+    }
+    return node;
+}
+
+bool BTREE_FUNC(lookup)(BTREE_NAME *tree, const char *key, size_t length, BTREE_VALUE_TYPE *value) {
+    // copy the value for key to *value (if not NULL), returns false if the key is not in the tree
+    if (tree == NULL || tree->root == NULL || (key == NULL && length > 0)) return false;
+    if (length > BTREE_STRING_MAX_KEY_LENGTH) return false;
+    const unsigned char *k = (const unsigned char *)key;
+    BTREE_STRING_NODE *leaf = BTREE_FUNC(find_leaf)(tree, k, length);
+    bool found;
+    size_t i = BTREE_FUNC(node_lower_bound)(leaf, k, length, &found);
+    if (!found) return false;
+    // values are not aligned in the heap
+    if (value != NULL) memcpy(value, BTREE_FUNC(node_payload)(leaf, i), sizeof(BTREE_VALUE_TYPE));
+    return true;
+}
+
+BTREE_VALUE_TYPE BTREE_FUNC(get)(BTREE_NAME *tree, const char *key, size_t length) {
+    BTREE_VALUE_TYPE value;
+    if (!BTREE_FUNC(lookup)(tree, key, length, &value)) return BTREE_VALUE_NULL;
+    return value;
+}
+
+bool BTREE_FUNC(insert)(BTREE_NAME *tree, const char *key, size_t length, BTREE_VALUE_TYPE value) {
+    /* Insert key with value, or replace the value if the key is already present.
+       Returns false if the key is longer than BTREE_STRING_MAX_KEY_LENGTH or out of memory,
+       in which case the tree is unchanged.
+    */
+    if (tree == NULL || tree->root == NULL || (key == NULL && length > 0)) return false;
+    if (length > BTREE_STRING_MAX_KEY_LENGTH) return false;
+    const unsigned char *k = (const unsigned char *)key;
+
+    size_t stack_size = 0;
+    BTREE_STRING_NODE *stack[BTREE_STRING_MAX_HEIGHT];
+    BTREE_STRING_NODE *node = tree->root;
+    while (node->height > 0) {
+        if (stack_size == BTREE_STRING_MAX_HEIGHT) return false;
+        stack[stack_size++] = node;
+        node = BTREE_FUNC(node_child)(node, BTREE_FUNC(node_child_index)(node, k, length));
+    }
+    bool found;
+    size_t i = BTREE_FUNC(node_lower_bound)(node, k, length, &found);
+    if (found) {
+        memcpy(BTREE_FUNC(node_payload)(node, i), &value, sizeof(BTREE_VALUE_TYPE));
+        return true;
+    }
+    if (BTREE_FUNC(node_insert_at)(node, i, k, length, &value)) return true;
+
+    /* The leaf is full, split it and insert into whichever half the key belongs to,
+       then insert the separator and the new node into the parent the same way, up to the root.
+       Every node the splits could take (one per level and a new root) comes from the pool
+       first, so running out of memory leaves the tree as it was.
+    */
+    BTREE_STRING_NODE *spare[BTREE_STRING_MAX_HEIGHT + 2];
+    size_t num_spare = 0;
+    while (num_spare < stack_size + 2) {
+        spare[num_spare] = BTREE_FUNC(node_new)(tree);
+        if (spare[num_spare] == NULL) {
+            while (num_spare > 0) {
+                BTREE_FUNC(node_release)(tree, spare[--num_spare]);
+            }
+            return false;
+        }
+        num_spare++;
+    }
+    unsigned char separator[BTREE_STRING_MAX_KEY_LENGTH];
+    unsigned char pending[BTREE_STRING_MAX_KEY_LENGTH];
+    const unsigned char *insert_key = k;
+    size_t insert_length = length;
+    const void *payload = &value;
+    // the node to add to the parent along with the separator in pending
+    BTREE_STRING_NODE *child = NULL;
+    bool inserted = false;
+    while (true) {
+        size_t separator_length;
+        BTREE_STRING_NODE *right = spare[--num_spare];
+        BTREE_FUNC(node_split)(node, right, separator, &separator_length);
+        BTREE_STRING_NODE *target = btree_string_compare(insert_key, insert_length, separator, separator_length) < 0 ? node : right;
+        i = BTREE_FUNC(node_lower_bound)(target, insert_key, insert_length, &found);
+        BTREE_FUNC(node_insert_at)(target, i, insert_key, insert_length, payload);
+
+        memcpy(pending, separator, separator_length);
+        insert_key = pending;
+        insert_length = separator_length;
+        child = right;
+        payload = &child;
+        if (stack_size == 0) break;
+        node = stack[--stack_size];
+        i = BTREE_FUNC(node_lower_bound)(node, insert_key, insert_length, &found);
+        if (BTREE_FUNC(node_insert_at)(node, i, insert_key, insert_length, payload)) {
+            inserted = true;
+            break;
+        }
+    }
+
+    if (!inserted) {
+        // the root was split, add a new root above the two halves
+        BTREE_STRING_NODE *root = spare[--num_spare];
+        BTREE_STRING_NODE *left = tree->root;
+        BTREE_FUNC(node_init)(root, (uint16_t)(left->height + 1), NULL, 0, NULL, 0, false);
+        BTREE_FUNC(node_insert_at)(root, 0, (const unsigned char *)"", 0, &left);
+        BTREE_FUNC(node_insert_at)(root, 1, insert_key, insert_length, &child);
+        tree->root = root;
+    }
+    while (num_spare > 0) {
+        BTREE_FUNC(node_release)(tree, spare[--num_spare]);
+    }
+    return true;
+}
+
+static bool BTREE_FUNC(node_merge)(BTREE_NAME *tree, BTREE_STRING_NODE *parent, size_t i) {
+    // merge child i + 1 of parent into child i if everything fits in one node
+    BTREE_STRING_NODE *left = BTREE_FUNC(node_child)(parent, i);
+    BTREE_STRING_NODE *right = BTREE_FUNC(node_child)(parent, i + 1);
+    BTREE_TYPED(node_block_t) block;
+    BTREE_STRING_NODE *merged = (BTREE_STRING_NODE *)&block;
+    // the wider fences may shorten the prefix, so the entries can take more room than before
+    BTREE_FUNC(node_init)(merged, left->height, BTREE_FUNC(node_lower)(left), (size_t)left->lower_length,
+                          BTREE_FUNC(node_upper)(right), (size_t)right->upper_length, right->has_upper);
+    for (size_t j = 0; j < (size_t)left->count; j++) {
+        if (!BTREE_FUNC(node_append_from)(merged, left, j)) return false;
+    }
+    for (size_t j = 0; j < (size_t)right->count; j++) {
+        if (!BTREE_FUNC(node_append_from)(merged, right, j)) return false;
+    }
+    memcpy(left, merged, BTREE_STRING_NODE_SIZE);
+    BTREE_FUNC(node_remove_at)(parent, i + 1);
+    BTREE_FUNC(node_release)(tree, right);
+    return true;
+}
+
+bool BTREE_FUNC(remove)(BTREE_NAME *tree, const char *key, size_t length, BTREE_VALUE_TYPE *value) {
+    /* Remove key, copying its value to *value (if not NULL).
+       Returns false if the key is not in the tree.
+    */
+    if (tree == NULL || tree->root == NULL || (key == NULL && length > 0)) return false;
+    if (length > BTREE_STRING_MAX_KEY_LENGTH) return false;
+    const unsigned char *k = (const unsigned char *)key;
+
+    size_t stack_size = 0;
+    BTREE_STRING_NODE *stack[BTREE_STRING_MAX_HEIGHT];
+    size_t index_stack[BTREE_STRING_MAX_HEIGHT];
+    BTREE_STRING_NODE *node = tree->root;
+    while (node->height > 0) {
+        if (stack_size == BTREE_STRING_MAX_HEIGHT) return false;
+        size_t idx = BTREE_FUNC(node_child_index)(node, k, length);
+        index_stack[stack_size] = idx;
+        stack[stack_size++] = node;
+        node = BTREE_FUNC(node_child)(node, idx);
+    }
+    bool found;
+    size_t i = BTREE_FUNC(node_lower_bound)(node, k, length, &found);
+    if (!found) return false;
+    if (value != NULL) memcpy(value, BTREE_FUNC(node_payload)(node, i), sizeof(BTREE_VALUE_TYPE));
+    BTREE_FUNC(node_remove_at)(node, i);
+
+    /* Merge a node that has become sparse with its right or left neighbor, and keep going up
+       while the parent, which just lost a child, is sparse too. A neighbor that doesn't fit
+       (the merged node can have a shorter prefix) is left alone, nodes may be sparse
+       or even empty without affecting correctness.
+    */
+    while (stack_size > 0 && BTREE_FUNC(node_space_used)(node) < BTREE_STRING_MERGE_THRESHOLD) {
+        BTREE_STRING_NODE *parent = stack[stack_size - 1];
+        size_t idx = index_stack[stack_size - 1];
+        bool merged = false;
+        if (idx + 1 < (size_t)parent->count) {
+            merged = BTREE_FUNC(node_merge)(tree, parent, idx);
+        }
+        if (!merged && idx > 0) {
+            merged = BTREE_FUNC(node_merge)(tree, parent, idx - 1);
+        }
+        // an only child has no neighbor to merge with, but then its parent is sparse too
+        if (!merged && parent->count > 1) break;
+        node = parent;
+        stack_size--;
+    }
+
+    // a root with a single child is replaced by the child, which has the same (open) fences
+    while (tree->root->height > 0 && tree->root->count == 1) {
+        BTREE_STRING_NODE *root = tree->root;
+        tree->root = BTREE_FUNC(node_child)(root, 0);
+        BTREE_FUNC(node_release)(tree, root);
+    }
+    return true;
+}
+
+BTREE_VALUE_TYPE BTREE_FUNC(delete)(BTREE_NAME *tree, const char *key, size_t length) {
+    BTREE_VALUE_TYPE value;
+    if (!BTREE_FUNC(remove)(tree, key, length, &value)) return BTREE_VALUE_NULL;
+    return value;
+}
+
+/*
+A cursor walks the entries in key order. Keys are prefix-compressed in the nodes,
+so the cursor keeps a copy of the current key:
+
+    BTREE_TYPED(cursor_t) cursor;
+    for (bool valid = BTREE_FUNC(cursor_seek)(&cursor, tree, lo, lo_length);
+         valid; valid = BTREE_FUNC(cursor_next)(&cursor)) {
+        size_t length;
+        const char *key = BTREE_FUNC(cursor_key)(&cursor, &length);
+        BTREE_VALUE_TYPE value = BTREE_FUNC(cursor_value)(&cursor);
+        ...
+    }
+
+There are no sibling links, the next leaf is found by searching for the upper fence
+of the current one. Any insert or delete on the tree invalidates its cursors.
+*/
+typedef struct {
+    BTREE_NAME *tree;
+    BTREE_STRING_NODE *node;
+    size_t index;
+    size_t key_length;
+    char key[BTREE_STRING_MAX_KEY_LENGTH];
+} BTREE_TYPED(cursor_t);
+
+static inline bool BTREE_FUNC(cursor_valid)(BTREE_TYPED(cursor_t) *cursor) {
+    return cursor != NULL && cursor->node != NULL && cursor->index < (size_t)cursor->node->count;
+}
+
+static bool BTREE_FUNC(cursor_settle)(BTREE_TYPED(cursor_t) *cursor) {
+    // move past the end of a leaf (or an empty leaf) to the next entry and load its key
+    while (cursor->index >= (size_t)cursor->node->count) {
+        if (!cursor->node->has_upper) {
+            cursor->node = NULL;
+            return false;
+        }
+        // the next leaf's lower fence is this leaf's upper fence, so its entries start at 0
+        unsigned char upper[BTREE_STRING_MAX_KEY_LENGTH];
+        size_t upper_length = (size_t)cursor->node->upper_length;
+        memcpy(upper, BTREE_FUNC(node_upper)(cursor->node), upper_length);
+        cursor->node = BTREE_FUNC(find_leaf)(cursor->tree, upper, upper_length);
+        cursor->index = 0;
+    }
+    cursor->key_length = BTREE_FUNC(node_key)(cursor->node, cursor->index, (unsigned char *)cursor->key);
+    return true;
+}
+
+bool BTREE_FUNC(cursor_seek)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree, const char *key, size_t length) {
+    // position the cursor at the first entry whose key is >= key
+    if (cursor == NULL) return false;
+    cursor->tree = tree;
+    cursor->node = NULL;
+    cursor->index = 0;
+    cursor->key_length = 0;
+    if (tree == NULL || tree->root == NULL || (key == NULL && length > 0)) return false;
+    const unsigned char *k = (const unsigned char *)key;
+    unsigned char truncated[BTREE_STRING_MAX_KEY_LENGTH];
+    bool past = false;
+    if (length > BTREE_STRING_MAX_KEY_LENGTH) {
+        // no stored key is this long, seek to the first key after its longest storable prefix
+        memcpy(truncated, k, BTREE_STRING_MAX_KEY_LENGTH);
+        k = truncated;
+        length = BTREE_STRING_MAX_KEY_LENGTH;
+        past = true;
+    }
+    bool found;
+    cursor->node = BTREE_FUNC(find_leaf)(tree, k, length);
+    cursor->index = BTREE_FUNC(node_lower_bound)(cursor->node, k, length, &found);
+    if (found && past) cursor->index++;
+    return BTREE_FUNC(cursor_settle)(cursor);
+}
+
+bool BTREE_FUNC(cursor_first)(BTREE_TYPED(cursor_t) *cursor, BTREE_NAME *tree) {
+    return BTREE_FUNC(cursor_seek)(cursor, tree, NULL, 0);
+}
+
+bool BTREE_FUNC(cursor_next)(BTREE_TYPED(cursor_t) *cursor) {
+    if (!BTREE_FUNC(cursor_valid)(cursor)) return false;
+    cursor->index++;
+    return BTREE_FUNC(cursor_settle)(cursor);
+}
+
+static inline const char *BTREE_FUNC(cursor_key)(BTREE_TYPED(cursor_t) *cursor, size_t *length) {
+    if (length != NULL) *length = cursor->key_length;
+    return cursor->key;
+}
+
+static inline BTREE_VALUE_TYPE BTREE_FUNC(cursor_value)(BTREE_TYPED(cursor_t) *cursor) {
+    BTREE_VALUE_TYPE value;
+    memcpy(&value, BTREE_FUNC(node_payload)(cursor->node, cursor->index), sizeof(BTREE_VALUE_TYPE));
+    return value;
+}
+
+#ifdef BTREE_VALUE_NULL_DEFINED
+#undef BTREE_VALUE_NULL
+#undef BTREE_VALUE_NULL_DEFINED
+#endif
+
+#ifdef BTREE_VALUE_TYPE_DEFINED
+#undef BTREE_VALUE_TYPE
+#undef BTREE_VALUE_TYPE_DEFINED
+#endif
+
+#ifdef BTREE_STRING_NODE_SIZE_DEFINED
+#undef BTREE_STRING_NODE_SIZE
+#undef BTREE_STRING_NODE_SIZE_DEFINED
+#endif
+
+#ifdef BTREE_STRING_MAX_KEY_LENGTH_DEFINED
+#undef BTREE_STRING_MAX_KEY_LENGTH
+#undef BTREE_STRING_MAX_KEY_LENGTH_DEFINED
+#endif
+
+#ifdef BTREE_STRING_MERGE_THRESHOLD_DEFINED
+#undef BTREE_STRING_MERGE_THRESHOLD
+#undef BTREE_STRING_MERGE_THRESHOLD_DEFINED
+#endif
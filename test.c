@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "greatest/greatest.h"
 
@@ -15,6 +18,187 @@
 #undef BTREE_KEY_TYPE
 #undef BTREE_NODE_MAX_DEGREE
 
+#define BTREE_NAME btree_int64
+#define BTREE_KEY_TYPE int64_t
+#define BTREE_NODE_MAX_DEGREE 100
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+
+#define BTREE_NAME btree_int64_scalar
+#define BTREE_KEY_TYPE int64_t
+#define BTREE_NODE_MAX_DEGREE 100
+#define BTREE_NO_SIMD
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_NO_SIMD
+
+#define BTREE_NAME btree_uint64_values
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 8
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+
+#define BTREE_NAME btree_concurrent
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 8
+#define BTREE_CONCURRENT
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_CONCURRENT
+
+#define BTREE_NAME btree_snapshot
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 4
+#define BTREE_SNAPSHOTS
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_SNAPSHOTS
+
+#define BTREE_NAME btree_ranked
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 4
+#define BTREE_ORDER_STATISTICS
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_ORDER_STATISTICS
+
+#define BTREE_NAME btree_stats
+#define BTREE_KEY_TYPE uint32_t
+#define BTREE_NODE_MAX_DEGREE 4
+#define BTREE_STATS
+#define BTREE_STATS_LATENCY
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_STATS
+#undef BTREE_STATS_LATENCY
+
+#define BTREE_NAME btree_fanout
+#define BTREE_KEY_TYPE uint32_t
+#define BTREE_LEAF_MAX_DEGREE 8
+#define BTREE_INNER_MAX_DEGREE 4
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_LEAF_MAX_DEGREE
+#undef BTREE_INNER_MAX_DEGREE
+
+#define BTREE_NAME btree_sized
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_LEAF_NODE_SIZE 256
+#define BTREE_INNER_NODE_SIZE 512
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_LEAF_NODE_SIZE
+#undef BTREE_INNER_NODE_SIZE
+
+#define BTREE_NAME btree_allocated
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 8
+#define BTREE_ALLOCATOR
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_ALLOCATOR
+
+#define BTREE_NAME btree_buffered
+#define BTREE_KEY_TYPE uint32_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_LEAF_MAX_DEGREE 8
+#define BTREE_INNER_MAX_DEGREE 4
+#define BTREE_BUFFERED
+#define BTREE_STATS
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_LEAF_MAX_DEGREE
+#undef BTREE_INNER_MAX_DEGREE
+#undef BTREE_BUFFERED
+#undef BTREE_STATS
+
+#define BTREE_NAME btree_parallel
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 8
+#define BTREE_PARALLEL
+#define BTREE_PARALLEL_MIN_ENTRIES 1000
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_PARALLEL
+#undef BTREE_PARALLEL_MIN_ENTRIES
+
+#define BTREE_NAME btree_limited
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_NODE_MAX_DEGREE 4
+#define BTREE_ALLOCATOR
+// larger than half a pool block, so every node is an allocation of its own
+#define BTREE_NODE_ALIGNMENT (1 << 19)
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_NODE_MAX_DEGREE
+#undef BTREE_ALLOCATOR
+#undef BTREE_NODE_ALIGNMENT
+
+#define BTREE_NAME btree_buffered_limited
+#define BTREE_KEY_TYPE uint64_t
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_LEAF_MAX_DEGREE 8
+#define BTREE_INNER_MAX_DEGREE 4
+#define BTREE_BUFFERED
+#define BTREE_ALLOCATOR
+#define BTREE_NODE_ALIGNMENT (1 << 19)
+#include "btree.h"
+#undef BTREE_NAME
+#undef BTREE_KEY_TYPE
+#undef BTREE_VALUE_TYPE
+#undef BTREE_LEAF_MAX_DEGREE
+#undef BTREE_INNER_MAX_DEGREE
+#undef BTREE_BUFFERED
+#undef BTREE_ALLOCATOR
+#undef BTREE_NODE_ALIGNMENT
+
+#define BTREE_NAME btree_string
+#define BTREE_VALUE_TYPE uint64_t
+#define BTREE_STRING_NODE_SIZE 512
+#include "btree_string.h"
+#undef BTREE_NAME
+#undef BTREE_VALUE_TYPE
+#undef BTREE_STRING_NODE_SIZE
+
 TEST test_btree(void) {
     btree_uint32 *tree = btree_uint32_new();
 
@@ -150,6 +334,1937 @@ TEST test_btree(void) {
 }
 
 
+TEST test_btree_cursor(void) {
+    btree_uint32 *tree = btree_uint32_new();
+    btree_uint32_cursor_t cursor;
+
+    ASSERT_FALSE(btree_uint32_cursor_seek(&cursor, tree, 0));
+    ASSERT_FALSE(btree_uint32_cursor_first(&cursor, tree));
+
+    // enough keys for several levels at degree 4, inserted out of order
+    for (uint32_t i = 0; i < 100; i++) {
+        uint32_t key = (i * 37) % 100;
+        btree_uint32_insert(tree, key * 2, (void *)(uintptr_t)(key * 2 + 1));
+    }
+    ASSERT(tree->root->height > 1);
+
+    // full forward scan
+    uint32_t expected = 0;
+    for (bool valid = btree_uint32_cursor_first(&cursor, tree); valid; valid = btree_uint32_cursor_next(&cursor)) {
+        ASSERT_EQ(btree_uint32_cursor_key(&cursor), expected);
+        ASSERT_EQ((uintptr_t)btree_uint32_cursor_value(&cursor), expected + 1);
+        expected += 2;
+    }
+    ASSERT_EQ(expected, 200);
+
+    // full backward scan
+    for (bool valid = btree_uint32_cursor_last(&cursor, tree); valid; valid = btree_uint32_cursor_prev(&cursor)) {
+        expected -= 2;
+        ASSERT_EQ(btree_uint32_cursor_key(&cursor), expected);
+    }
+    ASSERT_EQ(expected, 0);
+
+    // seek to an existing key and to a key between two entries
+    ASSERT(btree_uint32_cursor_seek(&cursor, tree, 50));
+    ASSERT_EQ(btree_uint32_cursor_key(&cursor), 50);
+    ASSERT(btree_uint32_cursor_seek(&cursor, tree, 51));
+    ASSERT_EQ(btree_uint32_cursor_key(&cursor), 52);
+    ASSERT(btree_uint32_cursor_prev(&cursor));
+    ASSERT_EQ(btree_uint32_cursor_key(&cursor), 50);
+    ASSERT_FALSE(btree_uint32_cursor_seek(&cursor, tree, 199));
+
+    // range scan [20, 40)
+    size_t count = 0;
+    for (bool valid = btree_uint32_cursor_seek(&cursor, tree, 20);
+         valid && btree_uint32_cursor_key(&cursor) < 40;
+         valid = btree_uint32_cursor_next(&cursor)) {
+        count++;
+    }
+    ASSERT_EQ(count, 10);
+
+    // delete every other entry so leaves merge and borrow, the chain must stay in order
+    for (uint32_t key = 0; key < 200; key += 4) {
+        ASSERT_EQ((uintptr_t)btree_uint32_delete(tree, key), key + 1);
+    }
+    expected = 2;
+    for (bool valid = btree_uint32_cursor_first(&cursor, tree); valid; valid = btree_uint32_cursor_next(&cursor)) {
+        ASSERT_EQ(btree_uint32_cursor_key(&cursor), expected);
+        expected += 4;
+    }
+    ASSERT_EQ(expected, 202);
+    for (bool valid = btree_uint32_cursor_last(&cursor, tree); valid; valid = btree_uint32_cursor_prev(&cursor)) {
+        expected -= 4;
+        ASSERT_EQ(btree_uint32_cursor_key(&cursor), expected);
+    }
+    ASSERT_EQ(expected, 2);
+
+    btree_uint32_destroy(tree);
+    PASS();
+}
+
+#define NEAREST_KEYS 1500
+
+static uint32_t nearest_keys[NEAREST_KEYS];
+static uintptr_t nearest_values[NEAREST_KEYS];
+
+static size_t nearest_index(uint32_t key, bool after, bool before) {
+    // the reference answer, first entry >= key (> key if after), or the one before it
+    size_t i = 0;
+    while (i < NEAREST_KEYS && (after ? nearest_keys[i] <= key : nearest_keys[i] < key)) i++;
+    if (before) return i > 0 ? i - 1 : NEAREST_KEYS;
+    return i;
+}
+
+static bool nearest_matches(btree_uint32_cursor_t *cursor, bool valid, size_t i) {
+    if (i == NEAREST_KEYS) return !valid;
+    return valid && btree_uint32_cursor_key(cursor) == nearest_keys[i]
+           && (uintptr_t)btree_uint32_cursor_value(cursor) == nearest_values[i];
+}
+
+TEST test_btree_nearest(void) {
+    // lower_bound, upper_bound, floor and ceil against a sorted array, with duplicate keys
+    btree_uint32 *tree = btree_uint32_new();
+    btree_uint32_cursor_t cursor;
+    ASSERT_FALSE(btree_uint32_lower_bound(&cursor, tree, 0));
+    ASSERT_FALSE(btree_uint32_floor(&cursor, tree, 10));
+    ASSERT_FALSE(btree_uint32_floor_hint(&cursor, tree, 10));
+
+    size_t counts[1001] = {0};
+    for (uint32_t i = 0; i < NEAREST_KEYS; i++) {
+        uint32_t key = (i * 7919) % 1000 * 2;
+        ASSERT(btree_uint32_insert(tree, key, (void *)(uintptr_t)(i + 1)));
+        counts[key / 2]++;
+    }
+    ASSERT(tree->root->height > 2);
+    // equal keys stay in insertion order
+    size_t n = 0;
+    for (uint32_t k = 0; k < 1000; k++) {
+        for (uint32_t i = 0; i < NEAREST_KEYS; i++) {
+            if ((i * 7919) % 1000 == k) {
+                nearest_keys[n] = k * 2;
+                nearest_values[n++] = i + 1;
+            }
+        }
+    }
+    ASSERT_EQ(n, NEAREST_KEYS);
+    for (uint32_t key = 0; key <= 2001; key++) {
+        ASSERT(nearest_matches(&cursor, btree_uint32_lower_bound(&cursor, tree, key), nearest_index(key, false, false)));
+        ASSERT(nearest_matches(&cursor, btree_uint32_ceil(&cursor, tree, key), nearest_index(key, false, false)));
+        ASSERT(nearest_matches(&cursor, btree_uint32_upper_bound(&cursor, tree, key), nearest_index(key, true, false)));
+        ASSERT(nearest_matches(&cursor, btree_uint32_floor(&cursor, tree, key), nearest_index(key, true, true)));
+    }
+
+    // hinted searches wandering from one key to the next, with cursor moves in between
+    uint64_t state = 42;
+    uint32_t key = 1000;
+    ASSERT(btree_uint32_lower_bound(&cursor, tree, key));
+    for (size_t i = 0; i < 20000; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t step = (uint32_t)(state >> 33);
+        uint32_t distance = step % 8 == 0 ? 400 : 12;
+        key = (key + 2001 + step % (2 * distance + 1) - distance) % 2002;
+        bool valid;
+        switch (i % 4) {
+        case 0:
+            valid = btree_uint32_lower_bound_hint(&cursor, tree, key);
+            ASSERT(nearest_matches(&cursor, valid, nearest_index(key, false, false)));
+            break;
+        case 1:
+            valid = btree_uint32_upper_bound_hint(&cursor, tree, key);
+            ASSERT(nearest_matches(&cursor, valid, nearest_index(key, true, false)));
+            break;
+        case 2:
+            valid = btree_uint32_floor_hint(&cursor, tree, key);
+            ASSERT(nearest_matches(&cursor, valid, nearest_index(key, true, true)));
+            break;
+        default:
+            valid = btree_uint32_ceil_hint(&cursor, tree, key);
+            ASSERT(nearest_matches(&cursor, valid, nearest_index(key, false, false)));
+            break;
+        }
+        if (valid && step % 5 == 0) {
+            for (size_t j = 0; j < step % 7; j++) {
+                if (step % 2 ? !btree_uint32_cursor_next(&cursor) : !btree_uint32_cursor_prev(&cursor)) break;
+            }
+        }
+    }
+    btree_uint32_destroy(tree);
+
+    // the same through the snapshot tree's cursors, which have no leaf chain to follow
+    btree_snapshot *snapshot_tree = btree_snapshot_new();
+    for (uint64_t k = 0; k < 500; k++) {
+        ASSERT(btree_snapshot_insert(snapshot_tree, k * 3, k));
+    }
+    btree_snapshot_cursor_t snapshot_cursor;
+    ASSERT(btree_snapshot_floor(&snapshot_cursor, snapshot_tree, 0));
+    for (uint64_t k = 1; k < 1500; k += 7) {
+        ASSERT(btree_snapshot_floor_hint(&snapshot_cursor, snapshot_tree, k));
+        ASSERT_EQ(btree_snapshot_cursor_key(&snapshot_cursor), k / 3 * 3);
+        ASSERT(btree_snapshot_upper_bound_hint(&snapshot_cursor, snapshot_tree, k) == (k < 1497));
+    }
+    btree_snapshot_destroy(snapshot_tree);
+    PASS();
+}
+
+TEST test_btree_bulk_load(void) {
+    uint32_t keys[1000];
+    void *values[1000];
+    for (uint32_t i = 0; i < 1000; i++) {
+        keys[i] = i * 3;
+        values[i] = (void *)(uintptr_t)(i + 1);
+    }
+
+    btree_uint32 *tree = btree_uint32_new();
+    ASSERT(btree_uint32_bulk_load(tree, keys, values, 1000, 1.0));
+    // packed leaves at degree 4 hold 1000 keys in 250 leaves, 5 levels
+    ASSERT_EQ(tree->root->height, 4);
+    // only empty trees can be bulk loaded
+    ASSERT_FALSE(btree_uint32_bulk_load(tree, keys, values, 1000, 1.0));
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        ASSERT_EQ((uintptr_t)btree_uint32_get(tree->root, i * 3), i + 1);
+        ASSERT(btree_uint32_get(tree->root, i * 3 + 1) == NULL);
+    }
+    btree_uint32_cursor_t cursor;
+    uint32_t count = 0;
+    for (bool valid = btree_uint32_cursor_first(&cursor, tree); valid; valid = btree_uint32_cursor_next(&cursor)) {
+        ASSERT_EQ(btree_uint32_cursor_key(&cursor), count * 3);
+        count++;
+    }
+    ASSERT_EQ(count, 1000);
+
+    // the loaded tree behaves like any other
+    for (uint32_t i = 0; i < 1000; i += 2) {
+        ASSERT_EQ((uintptr_t)btree_uint32_delete(tree, i * 3), i + 1);
+    }
+    ASSERT(btree_uint32_insert(tree, 1, "x"));
+    ASSERT_STR_EQ(btree_uint32_get(tree->root, 1), "x");
+    ASSERT_EQ((uintptr_t)btree_uint32_get(tree->root, 3), 2);
+    btree_uint32_destroy(tree);
+
+    // half-full nodes, and a tiny tree that fits in the root
+    tree = btree_uint32_new();
+    ASSERT(btree_uint32_bulk_load(tree, keys, values, 1000, 0.5));
+    ASSERT(tree->root->height > 4);
+    ASSERT_EQ((uintptr_t)btree_uint32_get(tree->root, 999 * 3), 1000);
+    btree_uint32_destroy(tree);
+
+    tree = btree_uint32_new();
+    ASSERT(btree_uint32_bulk_load(tree, keys, values, 3, 1.0));
+    ASSERT_EQ(tree->root->height, 0);
+    ASSERT_EQ(tree->root->degree, 3);
+    btree_uint32_destroy(tree);
+
+    // unsorted input is rejected
+    tree = btree_uint32_new();
+    keys[10] = 0;
+    ASSERT_FALSE(btree_uint32_bulk_load(tree, keys, values, 1000, 1.0));
+    ASSERT_EQ(tree->root->degree, 0);
+    btree_uint32_destroy(tree);
+    PASS();
+}
+TEST test_btree_insert_many(void) {
+    uint32_t keys[1000];
+    void *values[1000];
+
+    btree_uint32 *tree = btree_uint32_new();
+    // empty tree, more keys than fit in one leaf
+    for (uint32_t i = 0; i < 500; i++) {
+        keys[i] = i * 4;
+        values[i] = (void *)(uintptr_t)(i * 4 + 1);
+    }
+    ASSERT(btree_uint32_insert_many(tree, keys, values, 500));
+
+    // second batch interleaves with the first, with a duplicate of an existing key
+    for (uint32_t i = 0; i < 1000; i++) {
+        keys[i] = i * 2 + 1;
+        values[i] = (void *)(uintptr_t)(i * 2 + 2);
+    }
+    keys[0] = 0;
+    values[0] = "dup";
+    ASSERT(btree_uint32_insert_many(tree, keys, values, 1000));
+
+    btree_uint32_cursor_t cursor;
+    ASSERT(btree_uint32_cursor_first(&cursor, tree));
+    ASSERT_EQ(btree_uint32_cursor_key(&cursor), 0);
+    ASSERT_EQ((uintptr_t)btree_uint32_cursor_value(&cursor), 1);
+    ASSERT(btree_uint32_cursor_next(&cursor));
+    ASSERT_EQ(btree_uint32_cursor_key(&cursor), 0);
+    ASSERT_STR_EQ(btree_uint32_cursor_value(&cursor), "dup");
+    size_t count = 2;
+    uint32_t last = 0;
+    while (btree_uint32_cursor_next(&cursor)) {
+        ASSERT(btree_uint32_cursor_key(&cursor) > last);
+        last = btree_uint32_cursor_key(&cursor);
+        count++;
+    }
+    ASSERT_EQ(count, 1500);
+
+    for (uint32_t i = 1; i < 500; i++) {
+        ASSERT_EQ((uintptr_t)btree_uint32_get(tree->root, i * 4), i * 4 + 1);
+    }
+    for (uint32_t i = 1; i < 1000; i++) {
+        ASSERT_EQ((uintptr_t)btree_uint32_get(tree->root, i * 2 + 1), i * 2 + 2);
+    }
+
+    // unsorted input is rejected
+    keys[5] = 0;
+    ASSERT_FALSE(btree_uint32_insert_many(tree, keys, values, 1000));
+
+    btree_uint32_destroy(tree);
+    PASS();
+}
+TEST test_btree_get_many(void) {
+    btree_uint32 *tree = btree_uint32_new();
+    uint32_t keys[300];
+    void *values[300];
+
+    for (uint32_t i = 0; i < 300; i++) {
+        keys[i] = i;
+    }
+    // empty tree
+    ASSERT_EQ(btree_uint32_get_many(tree, keys, values, 300), 0);
+    ASSERT(values[0] == NULL);
+
+    for (uint32_t i = 0; i < 200; i++) {
+        btree_uint32_insert(tree, i * 3, (void *)(uintptr_t)(i + 1));
+    }
+    // unsorted lookups, a third of which are hits, in a count that isn't a multiple of the group size
+    for (uint32_t i = 0; i < 300; i++) {
+        keys[i] = (i * 7919) % 600;
+    }
+    size_t expected = 0;
+    for (uint32_t i = 0; i < 300; i++) {
+        if (keys[i] % 3 == 0) expected++;
+    }
+    ASSERT_EQ(btree_uint32_get_many(tree, keys, values, 299), expected - (keys[299] % 3 == 0));
+    for (uint32_t i = 0; i < 299; i++) {
+        ASSERT(values[i] == btree_uint32_get(tree->root, keys[i]));
+    }
+
+    btree_uint32_destroy(tree);
+    PASS();
+}
+TEST test_btree_simd_search(void) {
+    // same keys in a tree using the SIMD node search (where available) and one using the scalar search
+    btree_int64 *tree = btree_int64_new();
+    btree_int64_scalar *scalar_tree = btree_int64_scalar_new();
+
+    // signed keys on both sides of zero, at a degree that needs narrowing before the SIMD block
+    for (int64_t i = 0; i < 5000; i++) {
+        int64_t key = ((i * 7919) % 5000 - 2500) * 4;
+        btree_int64_insert(tree, key, (void *)(uintptr_t)(i + 1));
+        btree_int64_scalar_insert(scalar_tree, key, (void *)(uintptr_t)(i + 1));
+    }
+    ASSERT(tree->root->height > 0);
+
+    btree_int64_cursor_t cursor;
+    btree_int64_scalar_cursor_t scalar_cursor;
+    for (int64_t key = -10010; key < 10010; key++) {
+        void *value = btree_int64_get(tree->root, key);
+        ASSERT(value == btree_int64_scalar_get(scalar_tree->root, key));
+        ASSERT((value != NULL) == (key % 4 == 0 && key >= -10000 && key < 10000));
+
+        bool valid = btree_int64_cursor_seek(&cursor, tree, key);
+        ASSERT_EQ(valid, btree_int64_scalar_cursor_seek(&scalar_cursor, scalar_tree, key));
+        if (valid) {
+            ASSERT_EQ(btree_int64_cursor_key(&cursor), btree_int64_scalar_cursor_key(&scalar_cursor));
+        }
+    }
+    // the extremes of the key type
+    ASSERT(btree_int64_get(tree->root, INT64_MIN) == NULL);
+    ASSERT(btree_int64_get(tree->root, INT64_MAX) == NULL);
+    ASSERT(btree_int64_cursor_seek(&cursor, tree, INT64_MIN));
+    ASSERT_EQ(btree_int64_cursor_key(&cursor), -10000);
+
+    btree_int64_destroy(tree);
+    btree_int64_scalar_destroy(scalar_tree);
+    PASS();
+}
+
+TEST test_btree_value_type(void) {
+    // values stored inline in the leaves instead of behind a pointer
+    btree_uint64_values *tree = btree_uint64_values_new();
+    for (uint64_t i = 0; i < 1000; i++) {
+        ASSERT(btree_uint64_values_insert(tree, i * 2, i * 10));
+    }
+    ASSERT(tree->root->height > 1);
+    for (uint64_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(btree_uint64_values_get(tree->root, i * 2), i * 10);
+        ASSERT(btree_uint64_values_get_ptr(tree->root, i * 2 + 1) == NULL);
+    }
+
+    // 0 is a valid value here, get_ptr and remove tell it apart from a missing key
+    ASSERT_EQ(btree_uint64_values_get(tree->root, 0), 0);
+    ASSERT_EQ(btree_uint64_values_get(tree->root, 1), 0);
+    uint64_t *value = btree_uint64_values_get_ptr(tree->root, 0);
+    ASSERT(value != NULL);
+    ASSERT_EQ(*value, 0);
+    *value = 12345;
+    ASSERT_EQ(btree_uint64_values_get(tree->root, 0), 12345);
+
+    uint64_t removed = 0;
+    ASSERT(btree_uint64_values_remove(tree, 0, &removed));
+    ASSERT_EQ(removed, 12345);
+    ASSERT_FALSE(btree_uint64_values_remove(tree, 0, &removed));
+
+    // delete everything else, the tree shrinks back down to a single leaf
+    for (uint64_t i = 1; i < 1000; i++) {
+        ASSERT_EQ(btree_uint64_values_delete(tree, i * 2), i * 10);
+    }
+    ASSERT_EQ(tree->root->height, 0);
+    ASSERT_EQ(tree->root->degree, 0);
+
+    uint64_t keys[500];
+    uint64_t values[500];
+    for (uint64_t i = 0; i < 500; i++) {
+        keys[i] = i;
+        values[i] = i + 7;
+    }
+    ASSERT(btree_uint64_values_bulk_load(tree, keys, values, 500, 1.0));
+    btree_uint64_values_cursor_t cursor;
+    uint64_t i = 0;
+    for (bool valid = btree_uint64_values_cursor_first(&cursor, tree); valid; valid = btree_uint64_values_cursor_next(&cursor)) {
+        ASSERT_EQ(btree_uint64_values_cursor_key(&cursor), i);
+        ASSERT_EQ(btree_uint64_values_cursor_value(&cursor), i + 7);
+        i++;
+    }
+    ASSERT_EQ(i, 500);
+
+    btree_uint64_values_destroy(tree);
+    PASS();
+}
+
+TEST test_btree_freeze(void) {
+    btree_uint32 *tree = btree_uint32_new();
+    btree_uint32_frozen_t *frozen = btree_uint32_freeze(tree);
+    ASSERT(frozen != NULL);
+    ASSERT_EQ(frozen->count, 0);
+    ASSERT(btree_uint32_frozen_get(frozen, 1) == NULL);
+    ASSERT_EQ(btree_uint32_frozen_lower_bound(frozen, 1), 0);
+    btree_uint32_frozen_destroy(frozen);
+
+    // odd keys 1..1999, with every fourth one deleted again so the nodes are partly filled
+    for (uint32_t i = 0; i < 1000; i++) {
+        uint32_t key = ((i * 619) % 1000) * 2 + 1;
+        btree_uint32_insert(tree, key, (void *)(uintptr_t)(key + 1));
+    }
+    for (uint32_t key = 1; key < 2000; key += 8) {
+        btree_uint32_delete(tree, key);
+    }
+    frozen = btree_uint32_freeze(tree);
+    ASSERT(frozen != NULL);
+    ASSERT_EQ(frozen->count, 750);
+    // full 4-key nodes: 188 leaves, then 47, 12, 3 and the root
+    ASSERT_EQ(frozen->height, 4);
+    ASSERT_EQ((uintptr_t)frozen->nodes % BTREE_FROZEN_ALIGNMENT, 0);
+
+    // the frozen copy doesn't depend on the tree
+    btree_uint32_destroy(tree);
+
+    for (uint32_t key = 0; key < 2002; key++) {
+        void *value = btree_uint32_frozen_get(frozen, key);
+        if (key % 2 == 1 && key % 8 != 1) {
+            ASSERT_EQ((uintptr_t)value, key + 1);
+        } else {
+            ASSERT(value == NULL);
+        }
+        // lower bound is the next present key
+        size_t i = btree_uint32_frozen_lower_bound(frozen, key);
+        uint32_t next = key;
+        while (next < 2000 && !(next % 2 == 1 && next % 8 != 1)) next++;
+        if (next < 2000) {
+            ASSERT(i < frozen->count);
+            ASSERT_EQ(btree_uint32_frozen_key(frozen, i), next);
+            ASSERT_EQ((uintptr_t)btree_uint32_frozen_value(frozen, i), next + 1);
+        } else {
+            ASSERT_EQ(i, frozen->count);
+        }
+    }
+
+    size_t start;
+    size_t count = btree_uint32_frozen_range(frozen, 100, 200, &start);
+    // odd keys in [100, 200) without the ones = 1 mod 8
+    ASSERT_EQ(count, 50 - 12);
+    ASSERT_EQ(btree_uint32_frozen_key(frozen, start), 101);
+    ASSERT_EQ(btree_uint32_frozen_key(frozen, start + count - 1), 199);
+    for (size_t i = start + 1; i < start + count; i++) {
+        ASSERT(btree_uint32_frozen_key(frozen, i - 1) < btree_uint32_frozen_key(frozen, i));
+    }
+    ASSERT_EQ(btree_uint32_frozen_range(frozen, 200, 100, &start), 0);
+    ASSERT_EQ(btree_uint32_frozen_range(frozen, 5000, 6000, &start), 0);
+    ASSERT_EQ(start, frozen->count);
+    btree_uint32_frozen_destroy(frozen);
+
+    // larger nodes with the SIMD search and inline values
+    btree_uint64_values *value_tree = btree_uint64_values_new();
+    for (uint64_t i = 0; i < 5000; i++) {
+        btree_uint64_values_insert(value_tree, (i * 7919) % 5000 * 3, i);
+    }
+    btree_uint64_values_frozen_t *value_frozen = btree_uint64_values_freeze(value_tree);
+    ASSERT(value_frozen != NULL);
+    for (uint64_t key = 0; key < 15000; key++) {
+        uint64_t *value = btree_uint64_values_frozen_get_ptr(value_frozen, key);
+        uint64_t *tree_value = btree_uint64_values_get_ptr(value_tree->root, key);
+        ASSERT((value == NULL) == (tree_value == NULL));
+        if (value != NULL) {
+            ASSERT_EQ(*value, *tree_value);
+        }
+    }
+    btree_uint64_values_frozen_destroy(value_frozen);
+    btree_uint64_values_destroy(value_tree);
+    PASS();
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_KEYS_PER_THREAD 20000
+
+typedef struct {
+    btree_concurrent *tree;
+    uint64_t thread;
+    size_t errors;
+} concurrent_thread_t;
+
+static void *concurrent_writer(void *arg) {
+    /* Each thread owns the keys equal to its index mod CONCURRENT_THREADS, so it knows
+       exactly which of them must be in the tree, while the other threads split and merge
+       the same nodes around it.
+    */
+    concurrent_thread_t *t = arg;
+    for (uint64_t i = 0; i < CONCURRENT_KEYS_PER_THREAD; i++) {
+        uint64_t key = ((i * 7919) % CONCURRENT_KEYS_PER_THREAD) * CONCURRENT_THREADS + t->thread;
+        if (!btree_concurrent_insert(t->tree, key, key * 2)) t->errors++;
+        // replaces the value in place, with the same value so readers never see anything else
+        uint64_t old_value = 0;
+        if (!btree_concurrent_upsert(t->tree, key, key * 2, &old_value) || old_value != key * 2) t->errors++;
+        uint64_t value = 0;
+        if (!btree_concurrent_lookup(t->tree, key, &value) || value != key * 2) t->errors++;
+        // delete every other key again, which forces merges while the tree is still growing elsewhere
+        if (i % 2 == 1) {
+            uint64_t prev_key = (((i - 1) * 7919) % CONCURRENT_KEYS_PER_THREAD) * CONCURRENT_THREADS + t->thread;
+            if (!btree_concurrent_remove(t->tree, prev_key, &value) || value != prev_key * 2) t->errors++;
+            if (btree_concurrent_lookup(t->tree, prev_key, NULL)) t->errors++;
+        }
+        // the last 16 of the thread's keys in one get_many, only the odd-numbered ones are still there
+        if (i % 64 == 63) {
+            uint64_t keys[16];
+            uint64_t values[16];
+            for (uint64_t j = 0; j < 16; j++) {
+                keys[j] = (((i - j) * 7919) % CONCURRENT_KEYS_PER_THREAD) * CONCURRENT_THREADS + t->thread;
+            }
+            if (btree_concurrent_get_many(t->tree, keys, values, 16) != 8) t->errors++;
+            for (uint64_t j = 0; j < 16; j++) {
+                if (values[j] != ((i - j) % 2 == 1 ? keys[j] * 2 : 0)) t->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *concurrent_upserter(void *arg) {
+    /* Upserts a new value into each of the thread's keys every round, some of them new keys
+       landing in full leaves, and checks that each upsert got back the value of the round
+       before, so an upsert that wrote to another key's slot shows up on both keys
+    */
+    concurrent_thread_t *t = arg;
+    for (uint64_t round = 0; round < 4; round++) {
+        for (uint64_t i = 0; i < CONCURRENT_KEYS_PER_THREAD; i++) {
+            uint64_t key = ((i * 7919) % CONCURRENT_KEYS_PER_THREAD) * CONCURRENT_THREADS + t->thread;
+            uint64_t old_value = 0;
+            bool found = btree_concurrent_upsert(t->tree, key, key * 10 + round, &old_value);
+            if (round == 0 ? found : !found || old_value != key * 10 + round - 1) t->errors++;
+        }
+    }
+    return NULL;
+}
+
+TEST test_btree_concurrent_upsert(void) {
+    btree_concurrent *tree = btree_concurrent_new();
+    pthread_t threads[CONCURRENT_THREADS];
+    concurrent_thread_t args[CONCURRENT_THREADS];
+    for (uint64_t t = 0; t < CONCURRENT_THREADS; t++) {
+        args[t] = (concurrent_thread_t){tree, t, 0};
+        ASSERT_EQ(pthread_create(&threads[t], NULL, concurrent_upserter, &args[t]), 0);
+    }
+    for (uint64_t t = 0; t < CONCURRENT_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        ASSERT_EQ(args[t].errors, 0);
+    }
+    // every key once, with the last round's value
+    btree_concurrent_cursor_t cursor;
+    size_t count = 0;
+    for (bool valid = btree_concurrent_cursor_first(&cursor, tree); valid; valid = btree_concurrent_cursor_next(&cursor)) {
+        uint64_t key = btree_concurrent_cursor_key(&cursor);
+        ASSERT_EQ(key, count);
+        ASSERT_EQ(btree_concurrent_cursor_value(&cursor), key * 10 + 3);
+        count++;
+    }
+    ASSERT_EQ(count, CONCURRENT_THREADS * CONCURRENT_KEYS_PER_THREAD);
+    btree_concurrent_destroy(tree);
+    PASS();
+}
+
+TEST test_btree_concurrent(void) {
+    btree_concurrent *tree = btree_concurrent_new();
+    pthread_t threads[CONCURRENT_THREADS];
+    concurrent_thread_t args[CONCURRENT_THREADS];
+    for (uint64_t t = 0; t < CONCURRENT_THREADS; t++) {
+        args[t] = (concurrent_thread_t){tree, t, 0};
+        ASSERT_EQ(pthread_create(&threads[t], NULL, concurrent_writer, &args[t]), 0);
+    }
+    for (uint64_t t = 0; t < CONCURRENT_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        ASSERT_EQ(args[t].errors, 0);
+    }
+
+    // single threaded again, the leaf chain has every odd-numbered key of every thread in order
+    btree_concurrent_cursor_t cursor;
+    size_t count = 0;
+    uint64_t prev = 0;
+    for (bool valid = btree_concurrent_cursor_first(&cursor, tree); valid; valid = btree_concurrent_cursor_next(&cursor)) {
+        uint64_t key = btree_concurrent_cursor_key(&cursor);
+        if (count > 0) ASSERT(key > prev);
+        ASSERT_EQ(btree_concurrent_cursor_value(&cursor), key * 2);
+        prev = key;
+        count++;
+    }
+    ASSERT_EQ(count, CONCURRENT_THREADS * CONCURRENT_KEYS_PER_THREAD / 2);
+
+    uint64_t keys[100];
+    uint64_t values[100];
+    for (uint64_t i = 0; i < 100; i++) {
+        keys[i] = i;
+    }
+    size_t hits = btree_concurrent_get_many(tree, keys, values, 100);
+    size_t expected_hits = 0;
+    for (uint64_t i = 0; i < 100; i++) {
+        uint64_t value;
+        if (btree_concurrent_lookup(tree, keys[i], &value)) {
+            ASSERT_EQ(values[i], value);
+            expected_hits++;
+        } else {
+            ASSERT_EQ(values[i], 0);
+        }
+    }
+    ASSERT_EQ(hits, expected_hits);
+
+    btree_concurrent_destroy(tree);
+    PASS();
+}
+
+TEST test_btree_concurrent_split(void) {
+    // the two halves of a split have pools of their own, so threads can write to both at once
+    const uint64_t base = CONCURRENT_THREADS * CONCURRENT_KEYS_PER_THREAD;
+    btree_concurrent *tree = btree_concurrent_new();
+    for (uint64_t k = 0; k < 10000; k++) {
+        ASSERT(btree_concurrent_insert(tree, base + k, k));
+    }
+    btree_concurrent *right;
+    ASSERT(btree_concurrent_split_at(tree, base + 5000, &right));
+    ASSERT(right->leaf_pool != tree->leaf_pool);
+    ASSERT(right->inner_pool != tree->inner_pool);
+    ASSERT_FALSE(btree_concurrent_lookup(tree, base + 5000, NULL));
+    ASSERT(btree_concurrent_lookup(right, base + 5000, NULL));
+
+    pthread_t threads[CONCURRENT_THREADS];
+    concurrent_thread_t args[CONCURRENT_THREADS];
+    for (uint64_t t = 0; t < CONCURRENT_THREADS; t++) {
+        args[t] = (concurrent_thread_t){t % 2 == 0 ? tree : right, t, 0};
+        ASSERT_EQ(pthread_create(&threads[t], NULL, concurrent_writer, &args[t]), 0);
+    }
+    for (uint64_t t = 0; t < CONCURRENT_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        ASSERT_EQ(args[t].errors, 0);
+    }
+
+    // each half has its own keys and the odd-numbered keys of its own threads, in order
+    btree_concurrent *halves[2] = {tree, right};
+    for (size_t h = 0; h < 2; h++) {
+        btree_concurrent_cursor_t cursor;
+        size_t count = 0;
+        uint64_t prev = 0;
+        for (bool valid = btree_concurrent_cursor_first(&cursor, halves[h]); valid; valid = btree_concurrent_cursor_next(&cursor)) {
+            uint64_t key = btree_concurrent_cursor_key(&cursor);
+            if (count > 0) ASSERT(key > prev);
+            if (key < base) {
+                ASSERT_EQ(key % CONCURRENT_THREADS % 2, h);
+                ASSERT_EQ(btree_concurrent_cursor_value(&cursor), key * 2);
+            } else {
+                ASSERT_EQ(key >= base + 5000, h == 1);
+                ASSERT_EQ(btree_concurrent_cursor_value(&cursor), key - base);
+            }
+            prev = key;
+            count++;
+        }
+        ASSERT_EQ(count, 5000 + CONCURRENT_THREADS / 2 * CONCURRENT_KEYS_PER_THREAD / 2);
+    }
+    btree_concurrent_destroy(right);
+
+    // and are joined back by copying the right one
+    ASSERT(btree_concurrent_split_at(tree, base + 2500, &right));
+    ASSERT_FALSE(btree_concurrent_lookup(tree, base + 2500, NULL));
+    ASSERT(btree_concurrent_lookup(right, base + 2500, NULL));
+    ASSERT(btree_concurrent_join(tree, right));
+    for (uint64_t k = 0; k < 5000; k++) {
+        uint64_t value = 0;
+        ASSERT(btree_concurrent_lookup(tree, base + k, &value));
+        ASSERT_EQ(value, k);
+    }
+    btree_concurrent_destroy(tree);
+    PASS();
+}
+
+TEST test_btree_snapshot(void) {
+    btree_snapshot *tree = btree_snapshot_new();
+    for (uint64_t i = 0; i < 1000; i++) {
+        btree_snapshot_insert(tree, i, i);
+    }
+    btree_snapshot *snapshot = btree_snapshot_snapshot(tree);
+    ASSERT(snapshot != NULL);
+    ASSERT(snapshot->root == tree->root);
+    ASSERT_EQ(tree->root->refcount, 2);
+
+    // writes to the tree copy the nodes they touch, the snapshot keeps seeing the old version
+    for (uint64_t i = 0; i < 1000; i += 2) {
+        ASSERT(btree_snapshot_remove(tree, i, NULL));
+    }
+    for (uint64_t i = 1000; i < 1500; i++) {
+        btree_snapshot_insert(tree, i, i * 10);
+    }
+    ASSERT(snapshot->root != tree->root);
+
+    btree_snapshot_cursor_t cursor;
+    uint64_t expected = 0;
+    for (bool valid = btree_snapshot_cursor_first(&cursor, snapshot); valid; valid = btree_snapshot_cursor_next(&cursor)) {
+        ASSERT_EQ(btree_snapshot_cursor_key(&cursor), expected);
+        ASSERT_EQ(btree_snapshot_cursor_value(&cursor), expected);
+        expected++;
+    }
+    ASSERT_EQ(expected, 1000);
+    // and backward, leaf to leaf without the leaf chain
+    for (bool valid = btree_snapshot_cursor_last(&cursor, snapshot); valid; valid = btree_snapshot_cursor_prev(&cursor)) {
+        expected--;
+        ASSERT_EQ(btree_snapshot_cursor_key(&cursor), expected);
+    }
+    ASSERT_EQ(expected, 0);
+
+    uint64_t value;
+    for (uint64_t i = 0; i < 1500; i++) {
+        bool in_tree = btree_snapshot_lookup(tree, i, &value);
+        ASSERT_EQ(in_tree, i >= 1000 || i % 2 == 1);
+        if (in_tree) ASSERT_EQ(value, i >= 1000 ? i * 10 : i);
+        ASSERT_EQ(btree_snapshot_lookup(snapshot, i, NULL), i < 1000);
+    }
+    ASSERT(btree_snapshot_cursor_seek(&cursor, tree, 998));
+    ASSERT_EQ(btree_snapshot_cursor_key(&cursor), 999);
+    ASSERT(btree_snapshot_cursor_next(&cursor));
+    ASSERT_EQ(btree_snapshot_cursor_key(&cursor), 1000);
+
+    // a snapshot is a tree of its own, writing to it doesn't affect the original
+    btree_snapshot_insert(snapshot, 5000, 5000);
+    ASSERT(!btree_snapshot_lookup(tree, 5000, NULL));
+
+    // the tree can go first, the snapshot still has its nodes
+    btree_snapshot_destroy(tree);
+    ASSERT(btree_snapshot_lookup(snapshot, 500, &value));
+    ASSERT_EQ(value, 500);
+    btree_snapshot_frozen_t *frozen = btree_snapshot_freeze(snapshot);
+    ASSERT_EQ(frozen->count, 1001);
+    btree_snapshot_frozen_destroy(frozen);
+
+    // once the only other user is gone, nodes are no longer shared and writes don't copy
+    btree_snapshot *snapshot2 = btree_snapshot_snapshot(snapshot);
+    btree_snapshot_destroy(snapshot2);
+    ASSERT_EQ(snapshot->root->refcount, 1);
+    btree_snapshot_node_t *root = snapshot->root;
+    btree_snapshot_insert(snapshot, 5001, 5001);
+    ASSERT(snapshot->root == root);
+
+    btree_snapshot_destroy(snapshot);
+    PASS();
+}
+
+TEST test_btree_upsert(void) {
+    btree_uint64_values *tree = btree_uint64_values_new();
+    uint64_t old_value = 12345;
+    ASSERT_FALSE(btree_uint64_values_upsert(tree, 10, 100, &old_value));
+    ASSERT_EQ(old_value, 12345);
+    ASSERT(btree_uint64_values_upsert(tree, 10, 200, &old_value));
+    ASSERT_EQ(old_value, 100);
+    ASSERT_EQ(btree_uint64_values_get(tree->root, 10), 200);
+
+    // counters, most increments find the key and the rest insert it, splitting leaves on the way
+    for (uint64_t i = 0; i < 10000; i++) {
+        uint64_t *count;
+        bool found = btree_uint64_values_get_or_insert(tree, (i * 7919) % 500, &count);
+        ASSERT(count != NULL);
+        ASSERT_EQ(found, i >= 500 || (i * 7919) % 500 == 10);
+        (*count)++;
+    }
+    ASSERT(tree->root->height > 0);
+    btree_uint64_values_cursor_t cursor;
+    uint64_t expected = 0;
+    for (bool valid = btree_uint64_values_cursor_first(&cursor, tree); valid; valid = btree_uint64_values_cursor_next(&cursor)) {
+        ASSERT_EQ(btree_uint64_values_cursor_key(&cursor), expected);
+        ASSERT_EQ(btree_uint64_values_cursor_value(&cursor), expected == 10 ? 220 : 20);
+        expected++;
+    }
+    ASSERT_EQ(expected, 500);
+
+    // with duplicates, upsert replaces the same entry get returns and leaves the others
+    btree_uint64_values_insert(tree, 600, 1);
+    btree_uint64_values_insert(tree, 600, 2);
+    ASSERT(btree_uint64_values_upsert(tree, 600, 3, &old_value));
+    ASSERT_EQ(old_value, 2);
+    ASSERT_EQ(btree_uint64_values_get(tree->root, 600), 3);
+    ASSERT(btree_uint64_values_cursor_seek(&cursor, tree, 600));
+    ASSERT_EQ(btree_uint64_values_cursor_value(&cursor), 1);
+    btree_uint64_values_destroy(tree);
+
+    // a slot never points into a node shared with a snapshot
+    btree_snapshot *snapshot_tree = btree_snapshot_new();
+    for (uint64_t i = 0; i < 100; i++) {
+        btree_snapshot_insert(snapshot_tree, i, i);
+    }
+    btree_snapshot *snapshot = btree_snapshot_snapshot(snapshot_tree);
+    uint64_t *slot;
+    ASSERT(btree_snapshot_get_or_insert(snapshot_tree, 50, &slot));
+    *slot = 5000;
+    ASSERT(btree_snapshot_upsert(snapshot_tree, 51, 5100, NULL));
+    ASSERT_EQ(btree_snapshot_get(snapshot_tree->root, 50), 5000);
+    ASSERT_EQ(btree_snapshot_get(snapshot_tree->root, 51), 5100);
+    ASSERT_EQ(btree_snapshot_get(snapshot->root, 50), 50);
+    ASSERT_EQ(btree_snapshot_get(snapshot->root, 51), 51);
+    btree_snapshot_destroy(snapshot);
+    btree_snapshot_destroy(snapshot_tree);
+    PASS();
+}
+
+TEST test_btree_save(void) {
+    const char *path = "test_btree_save.tmp";
+    const char *copy_path = "test_btree_save_copy.tmp";
+    btree_uint64_values *tree = btree_uint64_values_new();
+
+    // an empty tree round-trips too
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    ASSERT(btree_uint64_values_save(tree, fd));
+    close(fd);
+    btree_uint64_values_frozen_t *frozen = btree_uint64_values_open_mmap(path);
+    ASSERT(frozen != NULL);
+    ASSERT_EQ(frozen->count, 0);
+    ASSERT_EQ(btree_uint64_values_frozen_get(frozen, 1), 0);
+    btree_uint64_values_frozen_destroy(frozen);
+
+    for (uint64_t i = 0; i < 10000; i++) {
+        uint64_t key = (i * 7919) % 10000 * 3;
+        btree_uint64_values_insert(tree, key, key * 10);
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    ASSERT(btree_uint64_values_save(tree, fd));
+    close(fd);
+    btree_uint64_values_destroy(tree);
+
+    frozen = btree_uint64_values_open_mmap(path);
+    ASSERT(frozen != NULL);
+    ASSERT_EQ(frozen->count, 10000);
+    ASSERT_EQ((uintptr_t)frozen->nodes % BTREE_FROZEN_ALIGNMENT, 0);
+    for (uint64_t key = 0; key < 30003; key++) {
+        ASSERT_EQ(btree_uint64_values_frozen_get(frozen, key), key % 3 == 0 && key < 30000 ? key * 10 : 0);
+    }
+    size_t start;
+    size_t count = btree_uint64_values_frozen_range(frozen, 100, 200, &start);
+    ASSERT_EQ(count, 33);
+    ASSERT_EQ(btree_uint64_values_frozen_key(frozen, start), 102);
+    ASSERT_EQ(btree_uint64_values_frozen_value(frozen, start + count - 1), 1980);
+
+    // a frozen tree saves to the same bytes as the tree it came from
+    fd = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    ASSERT(btree_uint64_values_frozen_save(frozen, fd));
+    close(fd);
+    btree_uint64_values_frozen_t *reopened = btree_uint64_values_open_mmap(copy_path);
+    ASSERT(reopened != NULL);
+    ASSERT_EQ(reopened->mapping_size, frozen->mapping_size);
+    ASSERT(memcmp(reopened->mapping, frozen->mapping, frozen->mapping_size) == 0);
+    btree_uint64_values_frozen_destroy(reopened);
+    btree_uint64_values_frozen_destroy(frozen);
+
+    // the key size and node degree are checked against the header
+    ASSERT(btree_uint32_open_mmap(path) == NULL);
+    ASSERT(btree_int64_open_mmap(path) == NULL);
+
+    // so is the file size
+    fd = open(path, O_WRONLY | O_TRUNC);
+    ASSERT(fd >= 0);
+    close(fd);
+    ASSERT(btree_uint64_values_open_mmap(path) == NULL);
+    ASSERT(btree_uint64_values_open_mmap("does/not/exist") == NULL);
+
+    unlink(path);
+    unlink(copy_path);
+    PASS();
+}
+
+TEST test_btree_string(void) {
+    btree_string *tree = btree_string_new();
+    char key[64];
+    ASSERT(btree_string_insert(tree, "", 0, 7));
+    ASSERT_EQ(btree_string_get(tree, "", 0), 7);
+    ASSERT_EQ(btree_string_delete(tree, "", 0), 7);
+    ASSERT_FALSE(btree_string_lookup(tree, "", 0, NULL));
+
+    // URL-like keys with long common prefixes, inserted out of order
+    for (uint64_t i = 0; i < 2000; i++) {
+        uint64_t n = (i * 7919) % 2000;
+        int length = sprintf(key, "https://example.com/items/%04u/view", (unsigned)n);
+        ASSERT(btree_string_insert(tree, key, (size_t)length, n));
+    }
+    ASSERT(tree->root->height > 0);
+    // the separators are much shorter than the keys, and leaves share the common prefix
+    ASSERT(tree->root->count > 1);
+    size_t separator_length = (size_t)tree->root->slots[1].length + tree->root->prefix_length;
+    ASSERT(separator_length < strlen("https://example.com/items/0000/view"));
+    btree_string_node_t *leaf = btree_string_node_child(tree->root, 1);
+    while (leaf->height > 0) leaf = btree_string_node_child(leaf, 0);
+    ASSERT(leaf->prefix_length >= strlen("https://example.com/items/"));
+
+    for (uint64_t n = 0; n < 2000; n++) {
+        int length = sprintf(key, "https://example.com/items/%04u/view", (unsigned)n);
+        uint64_t value;
+        ASSERT(btree_string_lookup(tree, key, (size_t)length, &value));
+        ASSERT_EQ(value, n);
+        // a prefix of a key is a different key
+        ASSERT_FALSE(btree_string_lookup(tree, key, (size_t)length - 1, NULL));
+    }
+    // inserting an existing key replaces the value
+    ASSERT(btree_string_insert(tree, "https://example.com/items/0042/view", 35, 4242));
+    ASSERT_EQ(btree_string_get(tree, "https://example.com/items/0042/view", 35), 4242);
+
+    // keys longer than the maximum are rejected
+    char long_key[1024];
+    memset(long_key, 'x', sizeof(long_key));
+    ASSERT_FALSE(btree_string_insert(tree, long_key, btree_string_max_key_length() + 1, 1));
+    ASSERT(btree_string_insert(tree, long_key, btree_string_max_key_length(), 1));
+    ASSERT_EQ(btree_string_delete(tree, long_key, btree_string_max_key_length()), 1);
+
+    // in order, from the first key or from a seek
+    btree_string_cursor_t cursor;
+    uint64_t expected = 0;
+    for (bool valid = btree_string_cursor_first(&cursor, tree); valid; valid = btree_string_cursor_next(&cursor)) {
+        size_t length;
+        const char *k = btree_string_cursor_key(&cursor, &length);
+        int expected_length = sprintf(key, "https://example.com/items/%04u/view", (unsigned)expected);
+        ASSERT_EQ(length, (size_t)expected_length);
+        ASSERT(memcmp(k, key, length) == 0);
+        ASSERT_EQ(btree_string_cursor_value(&cursor), expected == 42 ? 4242 : expected);
+        expected++;
+    }
+    ASSERT_EQ(expected, 2000);
+    ASSERT(btree_string_cursor_seek(&cursor, tree, "https://example.com/items/1234", 30));
+    size_t length;
+    const char *k = btree_string_cursor_key(&cursor, &length);
+    ASSERT(length == 35 && memcmp(k, "https://example.com/items/1234/view", 35) == 0);
+    ASSERT_FALSE(btree_string_cursor_seek(&cursor, tree, "https://example.com/items/x", 27));
+
+    for (uint64_t n = 0; n < 2000; n += 2) {
+        int length = sprintf(key, "https://example.com/items/%04u/view", (unsigned)n);
+        uint64_t value;
+        ASSERT(btree_string_remove(tree, key, (size_t)length, &value));
+        ASSERT_EQ(value, n == 42 ? 4242 : n);
+        ASSERT_FALSE(btree_string_remove(tree, key, (size_t)length, NULL));
+    }
+    for (uint64_t n = 0; n < 2000; n++) {
+        int length = sprintf(key, "https://example.com/items/%04u/view", (unsigned)n);
+        ASSERT_EQ(btree_string_lookup(tree, key, (size_t)length, NULL), n % 2 == 1);
+    }
+    for (uint64_t n = 1; n < 2000; n += 2) {
+        int length = sprintf(key, "https://example.com/items/%04u/view", (unsigned)n);
+        ASSERT_EQ(btree_string_delete(tree, key, (size_t)length), n);
+    }
+    // merges collapse the tree back to a single leaf
+    ASSERT_EQ(tree->root->height, 0);
+    ASSERT_EQ(tree->root->count, 0);
+    ASSERT_FALSE(btree_string_cursor_first(&cursor, tree));
+
+    btree_string_destroy(tree);
+    PASS();
+}
+
+typedef struct {
+    uint64_t count;
+    uint32_t last_key;
+    bool in_order;
+} delete_range_result_t;
+
+static void delete_range_callback(uint32_t key, void *value, void *data) {
+    delete_range_result_t *result = data;
+    if (result->count > 0 && key <= result->last_key) result->in_order = false;
+    if ((uintptr_t)value != (uintptr_t)key + 1) result->in_order = false;
+    result->last_key = key;
+    result->count++;
+}
+
+TEST test_btree_delete_range(void) {
+    btree_uint32 *tree = btree_uint32_new();
+    for (uint32_t i = 0; i < 1000; i++) {
+        btree_uint32_insert(tree, i * 2, (void *)(uintptr_t)(i * 2 + 1));
+    }
+    ASSERT(tree->root->height > 2);
+
+    // drops the whole subtrees in between and trims the leaves holding 101 and 1500
+    delete_range_result_t result = {0, 0, true};
+    ASSERT_EQ(btree_uint32_delete_range(tree, 101, 1500, delete_range_callback, &result), 699);
+    ASSERT_EQ(result.count, 699);
+    ASSERT(result.in_order);
+    ASSERT_EQ(result.last_key, 1498);
+    ASSERT_EQ(btree_uint32_delete_range(tree, 101, 1500, NULL, NULL), 0);
+    ASSERT_EQ(btree_uint32_delete_range(tree, 1500, 1500, NULL, NULL), 0);
+
+    for (uint32_t i = 0; i < 2000; i++) {
+        bool present = i % 2 == 0 && (i < 101 || i >= 1500);
+        ASSERT_EQ((uintptr_t)btree_uint32_get(tree->root, i), present ? i + 1 : 0);
+    }
+    btree_uint32_cursor_t cursor;
+    uint32_t count = 0;
+    for (bool valid = btree_uint32_cursor_first(&cursor, tree); valid; valid = btree_uint32_cursor_next(&cursor)) {
+        count++;
+    }
+    ASSERT_EQ(count, 301);
+    count = 0;
+    for (bool valid = btree_uint32_cursor_last(&cursor, tree); valid; valid = btree_uint32_cursor_prev(&cursor)) {
+        count++;
+    }
+    ASSERT_EQ(count, 301);
+
+    // the tree is still usable for inserts and deletes
+    for (uint32_t i = 102; i < 1500; i += 2) {
+        btree_uint32_insert(tree, i, (void *)(uintptr_t)(i + 1));
+    }
+    for (uint32_t i = 0; i < 2000; i += 4) {
+        ASSERT_EQ((uintptr_t)btree_uint32_delete(tree, i), i + 1);
+    }
+
+    // everything
+    ASSERT_EQ(btree_uint32_delete_range(tree, 0, UINT32_MAX, NULL, NULL), 500);
+    ASSERT_EQ(tree->root->height, 0);
+    ASSERT_EQ(tree->root->degree, 0);
+    ASSERT_FALSE(btree_uint32_cursor_first(&cursor, tree));
+    btree_uint32_insert(tree, 7, (void *)8);
+    ASSERT_EQ((uintptr_t)btree_uint32_get(tree->root, 7), 8);
+    btree_uint32_destroy(tree);
+
+    // a snapshot keeps the subtrees it shares
+    btree_snapshot *snapshot_tree = btree_snapshot_new();
+    for (uint64_t i = 0; i < 1000; i++) {
+        btree_snapshot_insert(snapshot_tree, i, i);
+    }
+    btree_snapshot *snapshot = btree_snapshot_snapshot(snapshot_tree);
+    ASSERT_EQ(btree_snapshot_delete_range(snapshot_tree, 10, 990, NULL, NULL), 980);
+    for (uint64_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(btree_snapshot_get(snapshot_tree->root, i), i < 10 || i >= 990 ? i : 0);
+        ASSERT_EQ(btree_snapshot_get(snapshot->root, i), i);
+    }
+    btree_snapshot_destroy(snapshot_tree);
+    for (uint64_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(btree_snapshot_get(snapshot->root, i), i);
+    }
+    btree_snapshot_destroy(snapshot);
+    PASS();
+}
+
+static bool check_ranked(btree_ranked *tree, uint64_t num_keys, const bool *present) {
+    // rank/select/count_range against the keys in present, every key k stored with value k * 10
+    uint64_t rank = 0;
+    for (uint64_t k = 0; k < num_keys; k++) {
+        if (btree_ranked_rank(tree, k) != rank) return false;
+        if (present[k]) {
+            uint64_t key, value;
+            if (!btree_ranked_select(tree, rank, &key, &value) || key != k || value != k * 10) return false;
+            rank++;
+        }
+    }
+    if (btree_ranked_count(tree) != rank || btree_ranked_select(tree, rank, NULL, NULL)) return false;
+    for (uint64_t lo = 0; lo < num_keys; lo += 37) {
+        uint64_t expected = 0;
+        for (uint64_t k = lo; k < lo + 100 && k < num_keys; k++) expected += present[k];
+        if (btree_ranked_count_range(tree, lo, lo + 100) != expected) return false;
+    }
+    return true;
+}
+
+TEST test_btree_order_statistics(void) {
+    static bool present[2000];
+    memset(present, 0, sizeof(present));
+    btree_ranked *tree = btree_ranked_new();
+    ASSERT_EQ(btree_ranked_count(tree), 0);
+    ASSERT_EQ(btree_ranked_rank(tree, 5), 0);
+    ASSERT_FALSE(btree_ranked_select(tree, 0, NULL, NULL));
+
+    // splits
+    for (uint64_t i = 0; i < 1000; i++) {
+        uint64_t k = (i * 7919) % 1000 * 2;
+        btree_ranked_insert(tree, k, k * 10);
+        present[k] = true;
+    }
+    ASSERT(check_ranked(tree, 2000, present));
+    ASSERT_EQ(btree_ranked_count_range(tree, 100, 200), 50);
+
+    // borrows and merges
+    for (uint64_t k = 0; k < 2000; k += 6) {
+        ASSERT(btree_ranked_remove(tree, k, NULL));
+        present[k] = false;
+    }
+    ASSERT(check_ranked(tree, 2000, present));
+
+    // runs of keys merged into leaves
+    uint64_t keys[500], values[500];
+    for (uint64_t i = 0; i < 500; i++) {
+        keys[i] = i * 4 + 1;
+        values[i] = keys[i] * 10;
+        present[keys[i]] = true;
+    }
+    ASSERT(btree_ranked_insert_many(tree, keys, values, 500));
+    ASSERT(btree_ranked_upsert(tree, 1, 10, NULL));
+    ASSERT(check_ranked(tree, 2000, present));
+
+    // whole subtrees dropped
+    ASSERT_EQ(btree_ranked_count_range(tree, 300, 1700), btree_ranked_delete_range(tree, 300, 1700, NULL, NULL));
+    for (uint64_t k = 300; k < 1700; k++) present[k] = false;
+    ASSERT(check_ranked(tree, 2000, present));
+
+    // duplicates rank before their first occurrence
+    btree_ranked_insert(tree, 5, 50);
+    btree_ranked_insert(tree, 5, 50);
+    ASSERT_EQ(btree_ranked_rank(tree, 6) - btree_ranked_rank(tree, 5), 3);
+    ASSERT_EQ(btree_ranked_count_range(tree, 5, 6), 3);
+    btree_ranked_destroy(tree);
+
+    tree = btree_ranked_new();
+    for (uint64_t i = 0; i < 500; i++) {
+        present[i] = i % 3 != 0;
+    }
+    uint64_t n = 0;
+    for (uint64_t k = 0; k < 500; k++) {
+        if (present[k]) {
+            keys[n] = k;
+            values[n++] = k * 10;
+        }
+    }
+    ASSERT(btree_ranked_bulk_load(tree, keys, values, n, 0.75));
+    ASSERT(check_ranked(tree, 500, present));
+    btree_ranked_destroy(tree);
+    PASS();
+}
+
+static uint64_t latency_total(const uint64_t *histogram) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < BTREE_LATENCY_BUCKETS; i++) total += histogram[i];
+    return total;
+}
+
+TEST test_btree_stats(void) {
+    btree_stats *tree = btree_stats_new();
+    btree_stats_t stats;
+    btree_stats_stats(tree, &stats);
+    ASSERT_EQ(stats.height, 1);
+    ASSERT_EQ(stats.leaves, 1);
+    ASSERT_EQ(stats.entries, 0);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        ASSERT(btree_stats_insert(tree, i, (void *)(uintptr_t)(i + 1)));
+    }
+    for (uint32_t i = 0; i < 2000; i++) {
+        btree_stats_lookup(tree, i, NULL);
+    }
+    btree_stats_stats(tree, &stats);
+    ASSERT_EQ(stats.counters.inserts, 1000);
+    ASSERT_EQ(stats.counters.lookups, 2000);
+    ASSERT_EQ(stats.entries, 1000);
+    ASSERT_EQ(stats.height, (size_t)tree->root->height + 1);
+    // every split adds a node, every root grow a level
+    ASSERT_EQ(stats.leaves, stats.counters.leaf_splits + 1);
+    ASSERT_EQ(stats.inner_nodes, stats.counters.inner_splits + stats.counters.root_grows);
+    ASSERT_EQ(stats.counters.root_grows, stats.height - 1);
+    size_t nodes = 0, histogram = 0;
+    for (size_t i = 0; i < BTREE_MAX_HEIGHT; i++) nodes += stats.nodes_per_level[i];
+    for (size_t i = 0; i <= BTREE_FILL_BUCKETS; i++) histogram += stats.fill_histogram[i];
+    ASSERT_EQ(nodes, stats.leaves + stats.inner_nodes);
+    ASSERT_EQ(histogram, nodes);
+    ASSERT_EQ(stats.nodes_per_level[0], stats.leaves);
+    ASSERT_EQ(stats.nodes_per_level[stats.height - 1], 1);
+    // with ascending keys leaves split at the right edge stay full, inner nodes keep 3 of 4 slots
+    ASSERT(stats.fill_factor > 0.9 && stats.fill_factor < 0.95);
+    ASSERT_EQ(stats.bytes_used, stats.leaves * sizeof(btree_stats_leaf_node_t) + stats.inner_nodes * sizeof(btree_stats_inner_node_t));
+    ASSERT_EQ(latency_total(stats.latency.insert), 1000);
+    ASSERT_EQ(latency_total(stats.latency.lookup), 2000);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        ASSERT_EQ((uintptr_t)btree_stats_delete(tree, i), i + 1);
+    }
+    ASSERT_FALSE(btree_stats_remove(tree, 0, NULL));
+    btree_stats_stats(tree, &stats);
+    ASSERT_EQ(stats.counters.deletes, 1000);
+    ASSERT(stats.counters.leaf_borrows > 0 && stats.counters.leaf_merges > 0);
+    ASSERT(stats.counters.inner_merges > 0);
+    ASSERT_EQ(stats.counters.root_shrinks, stats.counters.root_grows);
+    ASSERT_EQ(latency_total(stats.latency.remove), 1001);
+    ASSERT_EQ(stats.height, 1);
+    ASSERT_EQ(stats.entries, 0);
+    btree_stats_destroy(tree);
+    PASS();
+}
+
+static bool check_fanout_node(btree_fanout_node_t *node, bool root, bool rightmost) {
+    /* every node within its own kind's degree bounds, except that the root has no minimum
+       and nodes on the right edge can be underfull after appends (but inner ones keep two children)
+    */
+    size_t max_degree = node->height > 0 ? 4 : 8;
+    size_t min_degree = rightmost ? (node->height > 0 ? 2 : 1) : max_degree / 2;
+    if (node->degree > max_degree || (!root && node->degree < min_degree)) return false;
+    if (node->height == 0) return true;
+    for (size_t i = 0; i < node->degree; i++) {
+        bool last = rightmost && i == (size_t)node->degree - 1;
+        if (!check_fanout_node(((btree_fanout_inner_node_t *)node)->children[i], false, last)) return false;
+    }
+    return true;
+}
+
+static bool check_sized_node(btree_sized_node_t *node) {
+    // every node starts on a cache line
+    if ((uintptr_t)node % BTREE_CACHE_LINE_SIZE != 0) return false;
+    if (node->height == 0) return true;
+    for (size_t i = 0; i < node->degree; i++) {
+        if (!check_sized_node(((btree_sized_inner_node_t *)node)->children[i])) return false;
+    }
+    return true;
+}
+
+TEST test_btree_node_sizes(void) {
+    btree_fanout *fanout = btree_fanout_new();
+    for (uint32_t i = 0; i < 2000; i++) {
+        ASSERT(btree_fanout_insert(fanout, (i * 7919) % 2000, (void *)(uintptr_t)(i + 1)));
+    }
+    ASSERT(check_fanout_node(fanout->root, true, true));
+    for (uint32_t i = 0; i < 2000; i += 2) {
+        ASSERT(btree_fanout_remove(fanout, i, NULL));
+    }
+    ASSERT(check_fanout_node(fanout->root, true, true));
+    for (uint32_t i = 0; i < 2000; i++) {
+        ASSERT_EQ(btree_fanout_lookup(fanout, i, NULL), i % 2 == 1);
+    }
+    btree_stats_t stats;
+    btree_fanout_stats(fanout, &stats);
+    ASSERT_EQ(stats.entries, 1000);
+    ASSERT_EQ(stats.bytes_used, stats.leaves * sizeof(btree_fanout_leaf_node_t) + stats.inner_nodes * sizeof(btree_fanout_inner_node_t));
+    btree_fanout_destroy(fanout);
+
+    // the sized nodes fill their size to within a couple of entries
+    ASSERT(sizeof(btree_sized_leaf_node_t) <= 256 && sizeof(btree_sized_leaf_node_t) > 256 - 2 * 16);
+    ASSERT(sizeof(btree_sized_inner_node_t) <= 512 && sizeof(btree_sized_inner_node_t) > 512 - 2 * 16);
+    btree_sized *sized = btree_sized_new();
+    for (uint64_t i = 0; i < 10000; i++) {
+        ASSERT(btree_sized_insert(sized, (i * 7919) % 10000, i));
+    }
+    ASSERT(sized->root->height >= 2);
+    ASSERT(check_sized_node(sized->root));
+    for (uint64_t i = 0; i < 10000; i += 3) {
+        ASSERT(btree_sized_remove(sized, i, NULL));
+    }
+    for (uint64_t i = 0; i < 10000; i += 3) {
+        ASSERT(btree_sized_insert(sized, i, i));
+    }
+    ASSERT(check_sized_node(sized->root));
+    for (uint64_t i = 0; i < 10000; i++) {
+        uint64_t key = (i * 7919) % 10000, value;
+        ASSERT(btree_sized_lookup(sized, key, &value));
+        ASSERT_EQ(value, key % 3 == 0 ? key : i);
+    }
+    btree_sized_destroy(sized);
+    PASS();
+}
+
+TEST test_btree_append(void) {
+    // ascending keys take the rightmost leaf fast path and leave the leaves packed
+    btree_ranked *tree = btree_ranked_new();
+    static bool present[4000];
+    for (uint64_t k = 0; k < 4000; k += 2) {
+        ASSERT(btree_ranked_insert(tree, k, k * 10));
+        present[k] = true;
+    }
+    btree_stats_t stats;
+    btree_ranked_stats(tree, &stats);
+    ASSERT_EQ(stats.entries, 2000);
+    ASSERT_EQ(stats.leaves, 2000 / 4);
+    ASSERT(check_ranked(tree, 4000, present));
+
+    // keys in between go through the regular insert, and appends carry on after them
+    for (uint64_t k = 1; k < 4000; k += 4) {
+        ASSERT(btree_ranked_insert(tree, k, k * 10));
+        present[k] = true;
+    }
+    ASSERT(check_ranked(tree, 4000, present));
+    // removing from the underfull right edge borrows from or merges with its left neighbors
+    for (uint64_t k = 3999; k >= 3000; k--) {
+        if (present[k]) {
+            ASSERT(btree_ranked_remove(tree, k, NULL));
+            present[k] = false;
+        }
+    }
+    ASSERT(check_ranked(tree, 4000, present));
+    for (uint64_t k = 3000; k < 4000; k++) {
+        ASSERT(btree_ranked_insert(tree, k, k * 10));
+        present[k] = true;
+    }
+    ASSERT(check_ranked(tree, 4000, present));
+    uint64_t value;
+    ASSERT(btree_ranked_lookup(tree, 3999, &value));
+    ASSERT_EQ(value, 39990);
+    btree_ranked_destroy(tree);
+    PASS();
+}
+
+TEST test_btree_compact(void) {
+    // a tree left sparse by deletes gets its leaves repacked a few at a time
+    btree_ranked *tree = btree_ranked_new();
+    static bool present[4000];
+    for (uint64_t k = 0; k < 4000; k++) {
+        ASSERT(btree_ranked_insert(tree, (k * 7919) % 4000, (k * 7919) % 4000 * 10));
+        present[k] = true;
+    }
+    for (uint64_t k = 0; k < 4000; k++) {
+        if (k % 3 != 0) {
+            ASSERT(btree_ranked_remove(tree, k, NULL));
+            present[k] = false;
+        }
+    }
+    btree_stats_t before;
+    btree_ranked_stats(tree, &before);
+    size_t steps = 0;
+    while (btree_ranked_compact_step(tree, 1.0, 16)) {
+        ASSERT(check_ranked(tree, 4000, present));
+        steps++;
+    }
+    ASSERT(steps > 1);
+    ASSERT(check_ranked(tree, 4000, present));
+    btree_stats_t after;
+    btree_ranked_stats(tree, &after);
+    ASSERT_EQ(after.entries, before.entries);
+    ASSERT(after.leaves < before.leaves);
+
+    // the tree carries on as usual
+    for (uint64_t k = 1; k < 4000; k += 3) {
+        ASSERT(btree_ranked_insert(tree, k, k * 10));
+        present[k] = true;
+    }
+    ASSERT(check_ranked(tree, 4000, present));
+
+    // or the whole tree at once into full nodes
+    ASSERT(btree_ranked_compact(tree, 1.0));
+    ASSERT(check_ranked(tree, 4000, present));
+    btree_ranked_stats(tree, &after);
+    ASSERT_EQ(after.leaves, (after.entries + 3) / 4);
+    uint64_t value;
+    ASSERT(btree_ranked_lookup(tree, 3999, &value));
+    ASSERT_EQ(value, 39990);
+    btree_ranked_destroy(tree);
+
+    // pools shared with a snapshot stay where they are
+    btree_snapshot *snapshot_tree = btree_snapshot_new();
+    for (uint64_t i = 0; i < 1000; i++) {
+        btree_snapshot_insert(snapshot_tree, i, i);
+    }
+    btree_snapshot *snapshot = btree_snapshot_snapshot(snapshot_tree);
+    ASSERT_FALSE(btree_snapshot_compact(snapshot_tree, 1.0));
+    for (uint64_t i = 0; i < 1000; i += 2) {
+        ASSERT(btree_snapshot_remove(snapshot_tree, i, NULL));
+    }
+    while (btree_snapshot_compact_step(snapshot_tree, 1.0, 8));
+    for (uint64_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(btree_snapshot_lookup(snapshot_tree, i, NULL), i % 2 == 1);
+        ASSERT(btree_snapshot_lookup(snapshot, i, NULL));
+    }
+    btree_snapshot_destroy(snapshot);
+    ASSERT(btree_snapshot_compact(snapshot_tree, 1.0));
+    for (uint64_t i = 0; i < 1000; i++) {
+        ASSERT_EQ(btree_snapshot_lookup(snapshot_tree, i, NULL), i % 2 == 1);
+    }
+    btree_snapshot_destroy(snapshot_tree);
+    PASS();
+}
+
+TEST test_btree_split_join(void) {
+    // split a tree at a key into two and join them back, with the counts kept up to date
+    btree_ranked *tree = btree_ranked_new();
+    static bool present[4000], left_present[4000], right_present[4000];
+    for (uint64_t k = 0; k < 4000; k++) {
+        if (k % 5 == 3) continue;
+        ASSERT(btree_ranked_insert(tree, k, k * 10));
+        present[k] = true;
+    }
+    btree_ranked *right;
+    ASSERT(btree_ranked_split_at(tree, 1234, &right));
+    for (uint64_t k = 0; k < 4000; k++) {
+        left_present[k] = present[k] && k < 1234;
+        right_present[k] = present[k] && k >= 1234;
+    }
+    ASSERT(check_ranked(tree, 4000, left_present));
+    ASSERT(check_ranked(right, 4000, right_present));
+    ASSERT(btree_ranked_lookup(right, 1234, NULL));
+    ASSERT_FALSE(btree_ranked_lookup(tree, 1234, NULL));
+
+    // both halves carry on as trees of their own, and only join in key order
+    ASSERT(btree_ranked_insert(right, 3, 30));
+    ASSERT_FALSE(btree_ranked_join(tree, right));
+    ASSERT(btree_ranked_remove(right, 3, NULL));
+    ASSERT(btree_ranked_join(tree, right));
+    ASSERT(check_ranked(tree, 4000, present));
+
+    // a tree much smaller than the other, on either side
+    btree_ranked *small;
+    ASSERT(btree_ranked_split_at(tree, 3990, &small));
+    ASSERT_EQ(btree_ranked_count(small), 8);
+    ASSERT(btree_ranked_join(tree, small));
+    ASSERT(btree_ranked_split_at(tree, 10, &right));
+    ASSERT_EQ(btree_ranked_count(tree), 8);
+    ASSERT(btree_ranked_join(tree, right));
+    ASSERT(check_ranked(tree, 4000, present));
+
+    // splitting outside the keys leaves one side empty
+    ASSERT(btree_ranked_split_at(tree, 0, &right));
+    ASSERT_EQ(btree_ranked_count(tree), 0);
+    ASSERT(btree_ranked_join(tree, right));
+    ASSERT(btree_ranked_split_at(tree, 5000, &right));
+    ASSERT_EQ(btree_ranked_count(right), 0);
+    ASSERT(btree_ranked_join(tree, right));
+    ASSERT(check_ranked(tree, 4000, present));
+
+    // trees with pools of their own are joined by copying the right one
+    btree_ranked *other = btree_ranked_new();
+    static bool all_present[5000];
+    memcpy(all_present, present, sizeof(present));
+    for (uint64_t k = 4000; k < 5000; k++) {
+        ASSERT(btree_ranked_insert(other, k, k * 10));
+        all_present[k] = true;
+    }
+    ASSERT(btree_ranked_join(tree, other));
+    ASSERT(check_ranked(tree, 5000, all_present));
+
+    size_t n = 0;
+    btree_ranked_cursor_t cursor;
+    for (bool valid = btree_ranked_cursor_first(&cursor, tree); valid; valid = btree_ranked_cursor_next(&cursor)) {
+        n++;
+    }
+    ASSERT_EQ(n, btree_ranked_count(tree));
+    btree_ranked_destroy(tree);
+    PASS();
+}
+
+static bool copy_boxed_value(uint32_t key, void *value, void **copy, void *data) {
+    // a deep copy of a malloc'd uint32_t, failing once the limit in data runs out
+    size_t *limit = data;
+    (void)key;
+    if (*limit == 0) return false;
+    (*limit)--;
+    uint32_t *box = malloc(sizeof(uint32_t));
+    if (box == NULL) return false;
+    *box = *(uint32_t *)value;
+    *copy = box;
+    return true;
+}
+
+static void free_boxed_value(uint32_t key, void *value, void *data) {
+    (void)key;
+    (void)data;
+    free(value);
+}
+
+TEST test_btree_clone(void) {
+    // a clone has the same entries and shape as the source, and carries on independently
+    btree_ranked *tree = btree_ranked_new();
+    static bool present[3000], clone_present[3000];
+    for (uint64_t k = 0; k < 3000; k++) {
+        if (k % 7 == 2) continue;
+        ASSERT(btree_ranked_insert(tree, k, k * 10));
+        present[k] = true;
+    }
+    btree_ranked *clone = btree_ranked_clone(tree);
+    ASSERT(clone != NULL);
+    ASSERT(check_ranked(clone, 3000, present));
+    btree_stats_t stats, clone_stats;
+    btree_ranked_stats(tree, &stats);
+    btree_ranked_stats(clone, &clone_stats);
+    ASSERT_EQ(clone_stats.height, stats.height);
+    ASSERT_EQ(clone_stats.leaves, stats.leaves);
+    ASSERT_EQ(clone_stats.inner_nodes, stats.inner_nodes);
+
+    memcpy(clone_present, present, sizeof(present));
+    for (uint64_t k = 0; k < 3000; k += 3) {
+        if (clone_present[k]) {
+            ASSERT(btree_ranked_remove(clone, k, NULL));
+            clone_present[k] = false;
+        }
+    }
+    ASSERT(btree_ranked_insert(tree, 2, 20));
+    present[2] = true;
+    ASSERT(check_ranked(tree, 3000, present));
+    ASSERT(check_ranked(clone, 3000, clone_present));
+    btree_ranked_destroy(tree);
+    ASSERT(check_ranked(clone, 3000, clone_present));
+    btree_ranked_destroy(clone);
+
+    // an empty tree clones to an empty tree
+    tree = btree_ranked_new();
+    clone = btree_ranked_clone(tree);
+    ASSERT(clone != NULL);
+    ASSERT_EQ(btree_ranked_count(clone), 0);
+    ASSERT(btree_ranked_insert(clone, 1, 10));
+    ASSERT_EQ(btree_ranked_count(tree), 0);
+    btree_ranked_destroy(clone);
+    btree_ranked_destroy(tree);
+
+    // deep copies of the values, given back in full if a copy fails part of the way through
+    btree_uint32 *boxed = btree_uint32_new();
+    for (uint32_t k = 0; k < 500; k++) {
+        uint32_t *box = malloc(sizeof(uint32_t));
+        ASSERT(box != NULL);
+        *box = k * 3;
+        ASSERT(btree_uint32_insert(boxed, k, box));
+    }
+    size_t limit = 200;
+    ASSERT(btree_uint32_clone_with(boxed, copy_boxed_value, free_boxed_value, &limit) == NULL);
+    ASSERT_EQ(limit, 0);
+    limit = SIZE_MAX;
+    btree_uint32 *boxed_clone = btree_uint32_clone_with(boxed, copy_boxed_value, free_boxed_value, &limit);
+    ASSERT(boxed_clone != NULL);
+    ASSERT_EQ(limit, SIZE_MAX - 500);
+    for (uint32_t k = 0; k < 500; k++) {
+        uint32_t *original = btree_uint32_get(boxed->root, k);
+        uint32_t *copy = btree_uint32_get(boxed_clone->root, k);
+        ASSERT(original != copy);
+        ASSERT_EQ(*copy, k * 3);
+        *original = 0;
+        ASSERT_EQ(*copy, k * 3);
+    }
+    btree_uint32_delete_range(boxed, 0, 500, free_boxed_value, NULL);
+    btree_uint32_delete_range(boxed_clone, 0, 500, free_boxed_value, NULL);
+    btree_uint32_destroy(boxed);
+    btree_uint32_destroy(boxed_clone);
+    PASS();
+}
+
+#define PARALLEL_KEYS 100000
+#define PARALLEL_THREADS 8
+
+typedef struct {
+    uint64_t sum;
+    size_t count;
+    uint64_t min_key;
+    uint64_t max_key;
+    // keeps each part's totals on a cache line of its own
+    char padding[32];
+} parallel_scan_part_t;
+
+static void parallel_scan_entry(uint64_t key, uint64_t value, size_t part, void *data) {
+    parallel_scan_part_t *totals = &((parallel_scan_part_t *)data)[part];
+    if (totals->count == 0 || key < totals->min_key) totals->min_key = key;
+    if (totals->count == 0 || key > totals->max_key) totals->max_key = key;
+    totals->sum += value;
+    totals->count++;
+}
+
+static bool parallel_same_tree(btree_parallel_node_t *a, btree_parallel_node_t *b) {
+    // same shape and the same keys in every node
+    if (a->height != b->height || a->degree != b->degree) return false;
+    if (a->height == 0) {
+        btree_parallel_leaf_node_t *leaf_a = (btree_parallel_leaf_node_t *)a;
+        btree_parallel_leaf_node_t *leaf_b = (btree_parallel_leaf_node_t *)b;
+        return memcmp(leaf_a->keys, leaf_b->keys, a->degree * sizeof(uint64_t)) == 0;
+    }
+    btree_parallel_inner_node_t *inner_a = (btree_parallel_inner_node_t *)a;
+    btree_parallel_inner_node_t *inner_b = (btree_parallel_inner_node_t *)b;
+    for (size_t i = 0; i < a->degree; i++) {
+        if (inner_a->keys[i] != inner_b->keys[i]) return false;
+        if (!parallel_same_tree(inner_a->children[i], inner_b->children[i])) return false;
+    }
+    return true;
+}
+
+TEST test_btree_parallel(void) {
+    // a parallel bulk load builds the same tree as bulk_load, on several threads
+    static uint64_t keys[PARALLEL_KEYS], values[PARALLEL_KEYS];
+    for (uint64_t i = 0; i < PARALLEL_KEYS; i++) {
+        keys[i] = i * 3;
+        values[i] = i;
+    }
+    btree_parallel *serial = btree_parallel_new();
+    btree_parallel *tree = btree_parallel_new();
+    ASSERT(btree_parallel_bulk_load(serial, keys, values, PARALLEL_KEYS, 0.75));
+    ASSERT(btree_parallel_parallel_bulk_load(tree, keys, values, PARALLEL_KEYS, 0.75, PARALLEL_THREADS));
+    btree_stats_t serial_stats, stats;
+    btree_parallel_stats(serial, &serial_stats);
+    btree_parallel_stats(tree, &stats);
+    ASSERT_EQ(stats.height, serial_stats.height);
+    ASSERT_EQ(stats.leaves, serial_stats.leaves);
+    ASSERT_EQ(stats.inner_nodes, serial_stats.inner_nodes);
+    ASSERT_EQ(stats.entries, PARALLEL_KEYS);
+    ASSERT(parallel_same_tree(tree->root, serial->root));
+
+    // the leaf chain runs across the parts in both directions
+    btree_parallel_cursor_t cursor;
+    uint64_t i = 0;
+    for (bool valid = btree_parallel_cursor_first(&cursor, tree); valid; valid = btree_parallel_cursor_next(&cursor), i++) {
+        ASSERT_EQ(btree_parallel_cursor_key(&cursor), i * 3);
+        ASSERT_EQ(btree_parallel_cursor_value(&cursor), i);
+    }
+    ASSERT_EQ(i, PARALLEL_KEYS);
+    for (btree_parallel_leaf_node_t *leaf = btree_parallel_edge_leaf(tree->root, true); leaf != NULL; leaf = leaf->prev) {
+        i -= leaf->node.degree;
+    }
+    ASSERT_EQ(i, 0);
+    ASSERT(btree_parallel_insert(tree, 1, 1));
+    ASSERT_EQ(btree_parallel_get(tree->root, 1), 1);
+    btree_parallel_destroy(serial);
+
+    // keys out of order in any one part fail the load and leave the tree empty
+    btree_parallel *unsorted = btree_parallel_new();
+    keys[PARALLEL_KEYS - 10] = 0;
+    ASSERT_FALSE(btree_parallel_parallel_bulk_load(unsorted, keys, values, PARALLEL_KEYS, 1.0, PARALLEL_THREADS));
+    ASSERT_EQ(unsorted->root->height, 0);
+    ASSERT_EQ(unsorted->root->degree, 0);
+    keys[PARALLEL_KEYS - 10] = (PARALLEL_KEYS - 10) * 3;
+    ASSERT(btree_parallel_parallel_bulk_load(unsorted, keys, values, 500, 1.0, PARALLEL_THREADS));
+    btree_parallel_destroy(unsorted);
+
+    // a parallel scan over part of the range, each part after the one before it
+    static parallel_scan_part_t parts[PARALLEL_THREADS];
+    memset(parts, 0, sizeof(parts));
+    size_t num_parts = btree_parallel_parallel_scan(tree, 3000, 240001, parallel_scan_entry, parts, PARALLEL_THREADS);
+    ASSERT(num_parts > 1 && num_parts <= PARALLEL_THREADS);
+    uint64_t sum = 0;
+    size_t count = 0;
+    for (size_t p = 0; p < num_parts; p++) {
+        ASSERT(parts[p].count > 0);
+        if (p > 0) ASSERT(parts[p - 1].max_key < parts[p].min_key);
+        sum += parts[p].sum;
+        count += parts[p].count;
+    }
+    ASSERT_EQ(parts[0].min_key, 3000);
+    ASSERT_EQ(parts[num_parts - 1].max_key, 240000);
+    ASSERT_EQ(count, 80001 - 1000);
+    ASSERT_EQ(sum, (uint64_t)(1000 + 80000) * (80001 - 1000) / 2);
+
+    memset(parts, 0, sizeof(parts));
+    ASSERT_EQ(btree_parallel_parallel_scan(tree, 5, 5, parallel_scan_entry, parts, PARALLEL_THREADS), 0);
+    ASSERT_EQ(btree_parallel_parallel_scan(tree, 0, 2, parallel_scan_entry, parts, 1), 1);
+    ASSERT_EQ(parts[0].count, 2);
+    btree_parallel_destroy(tree);
+    PASS();
+}
+
+typedef struct {
+    size_t allocations;
+    size_t bytes;
+    bool misaligned;
+} counting_allocator_t;
+
+static void *counting_alloc(void *context, size_t size, size_t alignment) {
+    counting_allocator_t *counter = context;
+    void *ptr = btree_malloc_alloc(NULL, size, alignment);
+    if (ptr == NULL) return NULL;
+    if ((uintptr_t)ptr % alignment != 0) counter->misaligned = true;
+    counter->allocations++;
+    counter->bytes += size;
+    return ptr;
+}
+
+static void counting_free(void *context, void *ptr, size_t size) {
+    counting_allocator_t *counter = context;
+    counter->allocations--;
+    counter->bytes -= size;
+    btree_malloc_free(NULL, ptr, size);
+}
+
+TEST test_btree_allocator(void) {
+    // every allocation of a tree, its snapshots and split halves goes through its allocator
+    counting_allocator_t counter = {0, 0, false};
+    btree_allocator_t allocator = {counting_alloc, counting_free, &counter};
+    btree_allocated *tree = btree_allocated_new_with_allocator(&allocator);
+    ASSERT(tree != NULL);
+    ASSERT(counter.allocations > 0);
+    for (uint64_t k = 0; k < 20000; k++) {
+        ASSERT(btree_allocated_insert(tree, k * 3, k));
+    }
+    ASSERT((uintptr_t)tree->root % BTREE_CACHE_LINE_SIZE == 0);
+    btree_allocated *right;
+    ASSERT(btree_allocated_split_at(tree, 30000, &right));
+    ASSERT(btree_allocated_join(tree, right));
+    ASSERT(btree_allocated_compact(tree, 1.0));
+    uint64_t value;
+    for (uint64_t k = 0; k < 20000; k++) {
+        ASSERT(btree_allocated_lookup(tree, k * 3, &value));
+        ASSERT_EQ(value, k);
+    }
+    btree_allocated_destroy(tree);
+    ASSERT_FALSE(counter.misaligned);
+    ASSERT_EQ(counter.allocations, 0);
+    ASSERT_EQ(counter.bytes, 0);
+
+    // a huge page arena, on the first NUMA node if there is more than one
+    btree_hugepage_arena_t *arena = btree_hugepage_arena_new(0);
+    ASSERT(arena != NULL);
+    allocator = btree_hugepage_arena_allocator(arena);
+    tree = btree_allocated_new_with_allocator(&allocator);
+    ASSERT(tree != NULL);
+    for (uint64_t k = 0; k < 100000; k++) {
+        ASSERT(btree_allocated_insert(tree, k, k + 1));
+    }
+    for (uint64_t k = 0; k < 100000; k += 7) {
+        ASSERT(btree_allocated_lookup(tree, k, &value));
+        ASSERT_EQ(value, k + 1);
+    }
+    ASSERT(arena->num_regions > 0);
+    ASSERT((uintptr_t)arena->regions->memory % BTREE_HUGE_PAGE_SIZE == 0);
+    btree_allocated_destroy(tree);
+    btree_hugepage_arena_destroy(arena);
+    PASS();
+}
+
+typedef struct {
+    bool limited;
+    size_t remaining;
+} limited_allocator_t;
+
+static void *limited_alloc(void *context, size_t size, size_t alignment) {
+    limited_allocator_t *limit = context;
+    if (limit->limited) {
+        if (limit->remaining == 0) return NULL;
+        limit->remaining--;
+    }
+    return btree_malloc_alloc(NULL, size, alignment);
+}
+
+static bool limited_tree_holds(btree_limited *tree, uint64_t n) {
+    // every even key below 2n, and no odd ones
+    uint64_t value;
+    for (uint64_t k = 0; k < n; k++) {
+        if (!btree_limited_lookup(tree, 2 * k, &value) || value != k) return false;
+        if (btree_limited_lookup(tree, 2 * k + 1, NULL)) return false;
+    }
+    return true;
+}
+
+TEST test_btree_out_of_memory(void) {
+    // a split cascade that can't get all of its nodes leaves the tree as it was
+    limited_allocator_t limit = {false, 0};
+    btree_allocator_t allocator = {limited_alloc, btree_malloc_free, &limit};
+    for (uint64_t n = 1; n <= 120; n++) {
+        btree_limited *tree = btree_limited_new_with_allocator(&allocator);
+        ASSERT(tree != NULL);
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t k = i * 127 % n;
+            ASSERT(btree_limited_insert(tree, 2 * k, k));
+        }
+        uint64_t keys[2] = {n | 1, (n | 1) + 2};
+        uint64_t values[2] = {0, 0};
+        for (limit.remaining = 0; ; limit.remaining++) {
+            limit.limited = true;
+            bool inserted = btree_limited_insert_many(tree, keys, values, 2);
+            limit.limited = false;
+            if (inserted) break;
+            // keys that went into a leaf before the one that failed stay inserted
+            btree_limited_remove(tree, keys[0], NULL);
+            ASSERT(limited_tree_holds(tree, n));
+        }
+        ASSERT(btree_limited_remove(tree, keys[0], NULL));
+        ASSERT(btree_limited_remove(tree, keys[1], NULL));
+        for (limit.remaining = 0; ; limit.remaining++) {
+            limit.limited = true;
+            bool inserted = btree_limited_insert(tree, 2 * n, n);
+            limit.limited = false;
+            if (inserted) break;
+            ASSERT(limited_tree_holds(tree, n));
+        }
+        ASSERT(limited_tree_holds(tree, n + 1));
+        btree_limited_destroy(tree);
+    }
+    PASS();
+}
+
+#define BUFFERED_LIMITED_KEYS 512
+
+static bool buffered_limited_holds(btree_buffered_limited *tree, const bool *present, const uint64_t *expected) {
+    uint64_t value;
+    for (uint64_t key = 0; key < BUFFERED_LIMITED_KEYS; key++) {
+        if (btree_buffered_limited_lookup(tree, key, &value) != present[key]) return false;
+        if (present[key] && value != expected[key]) return false;
+    }
+    return true;
+}
+
+TEST test_btree_buffered_out_of_memory(void) {
+    // a buffered write that returns true is never lost, and one that returns false never happens
+    static uint64_t expected[BUFFERED_LIMITED_KEYS];
+    static bool present[BUFFERED_LIMITED_KEYS];
+    memset(present, 0, sizeof(present));
+    limited_allocator_t limit = {false, 0};
+    btree_allocator_t allocator = {limited_alloc, btree_malloc_free, &limit};
+    btree_buffered_limited *tree = btree_buffered_limited_new_with_allocator(&allocator);
+    ASSERT(tree != NULL);
+    uint64_t state = 88172645463325252ULL;
+    size_t failures = 0;
+    for (uint64_t i = 0; i < 20000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint64_t key = state % BUFFERED_LIMITED_KEYS;
+        // one allocation for each write, enough for most but not for a flush that splits
+        limit.limited = true;
+        limit.remaining = 1;
+        bool erase = (state >> 32) % 3 == 0;
+        bool written = erase ? btree_buffered_limited_erase(tree, key) : btree_buffered_limited_put(tree, key, i);
+        limit.limited = false;
+        if (!written) {
+            failures++;
+        } else if (erase) {
+            present[key] = false;
+        } else {
+            present[key] = true;
+            expected[key] = i;
+        }
+        if (i % 1000 == 0) ASSERT(buffered_limited_holds(tree, present, expected));
+    }
+    ASSERT(failures > 0);
+    ASSERT(buffered_limited_holds(tree, present, expected));
+    btree_stats_t stats;
+    btree_buffered_limited_stats(tree, &stats);
+    ASSERT_EQ(stats.messages, tree->num_messages);
+
+    // a flush or cursor that runs out of memory keeps what it hasn't applied for the next try
+    btree_buffered_limited_cursor_t cursor;
+    for (limit.remaining = 0; ; limit.remaining++) {
+        limit.limited = true;
+        bool started = btree_buffered_limited_cursor_first(&cursor, tree);
+        limit.limited = false;
+        if (started) break;
+        ASSERT(buffered_limited_holds(tree, present, expected));
+    }
+    size_t seen = 0;
+    for (bool valid = true; valid; valid = btree_buffered_limited_cursor_next(&cursor)) {
+        uint64_t key = btree_buffered_limited_cursor_key(&cursor);
+        ASSERT(present[key]);
+        ASSERT_EQ(btree_buffered_limited_cursor_value(&cursor), expected[key]);
+        seen++;
+    }
+    size_t count = 0;
+    for (uint64_t key = 0; key < BUFFERED_LIMITED_KEYS; key++) {
+        if (present[key]) count++;
+    }
+    ASSERT_EQ(seen, count);
+    ASSERT(buffered_limited_holds(tree, present, expected));
+    btree_buffered_limited_destroy(tree);
+    PASS();
+}
+
+#define BUFFERED_KEYS 4096
+
+TEST test_btree_buffered(void) {
+    // writes wait in the inner nodes' buffers, reads and cursors see them all the same
+    static uint64_t expected[BUFFERED_KEYS];
+    static bool present[BUFFERED_KEYS];
+    memset(present, 0, sizeof(present));
+    btree_buffered *tree = btree_buffered_new();
+    ASSERT(tree != NULL);
+    uint64_t state = 88172645463325252ULL;
+    size_t count = 0;
+    uint64_t value;
+    for (uint64_t i = 0; i < 100000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint32_t key = (uint32_t)(state % BUFFERED_KEYS);
+        switch ((state >> 32) % 4) {
+        case 0:
+            if (present[key]) break;
+            ASSERT(btree_buffered_insert(tree, key, i));
+            present[key] = true;
+            expected[key] = i;
+            count++;
+            break;
+        case 1:
+            ASSERT(btree_buffered_put(tree, key, i));
+            if (!present[key]) count++;
+            present[key] = true;
+            expected[key] = i;
+            break;
+        case 2:
+            ASSERT(btree_buffered_erase(tree, key));
+            if (present[key]) count--;
+            present[key] = false;
+            break;
+        default:
+            ASSERT_EQ(btree_buffered_remove(tree, key, &value), present[key]);
+            if (present[key]) {
+                ASSERT_EQ(value, expected[key]);
+                present[key] = false;
+                count--;
+            }
+        }
+        if (i % 101 == 0) {
+            key = (uint32_t)((state >> 40) % BUFFERED_KEYS);
+            ASSERT_EQ(btree_buffered_lookup(tree, key, &value), present[key]);
+            if (present[key]) ASSERT_EQ(value, expected[key]);
+        }
+    }
+    btree_stats_t stats;
+    btree_buffered_stats(tree, &stats);
+    ASSERT(stats.messages > 0);
+    ASSERT_EQ(stats.messages, tree->num_messages);
+    for (uint32_t key = 0; key < BUFFERED_KEYS; key++) {
+        ASSERT_EQ(btree_buffered_lookup(tree, key, &value), present[key]);
+        if (present[key]) ASSERT_EQ(value, expected[key]);
+    }
+
+    // a cursor applies the buffered writes first
+    btree_buffered_cursor_t cursor;
+    size_t seen = 0;
+    uint32_t last = 0;
+    for (bool valid = btree_buffered_cursor_first(&cursor, tree); valid; valid = btree_buffered_cursor_next(&cursor)) {
+        uint32_t key = btree_buffered_cursor_key(&cursor);
+        ASSERT(seen == 0 || key > last);
+        ASSERT(present[key]);
+        ASSERT_EQ(btree_buffered_cursor_value(&cursor), expected[key]);
+        last = key;
+        seen++;
+    }
+    ASSERT_EQ(seen, count);
+    btree_buffered_stats(tree, &stats);
+    ASSERT_EQ(stats.messages, 0);
+    ASSERT_EQ(stats.entries, count);
+    ASSERT_EQ(stats.counters.inserts - stats.counters.deletes, count);
+
+    // equal keys go after each other, and each delete takes out the last one
+    uint32_t dup = BUFFERED_KEYS;
+    ASSERT(btree_buffered_insert(tree, dup, 1));
+    ASSERT(btree_buffered_insert(tree, dup, 2));
+    ASSERT(btree_buffered_insert(tree, dup, 3));
+    ASSERT_EQ(btree_buffered_get(tree->root, dup), 3);
+    ASSERT(btree_buffered_erase(tree, dup));
+    ASSERT_EQ(btree_buffered_get(tree->root, dup), 2);
+    ASSERT(btree_buffered_put(tree, dup, 4));
+    ASSERT(btree_buffered_upsert(tree, dup, 5, &value));
+    ASSERT_EQ(value, 4);
+    ASSERT_EQ(btree_buffered_get(tree->root, dup), 5);
+    ASSERT(btree_buffered_flush(tree));
+    ASSERT(btree_buffered_cursor_seek(&cursor, tree, dup));
+    ASSERT_EQ(btree_buffered_cursor_value(&cursor), 1);
+    ASSERT(btree_buffered_cursor_next(&cursor));
+    ASSERT_EQ(btree_buffered_cursor_value(&cursor), 5);
+    ASSERT_FALSE(btree_buffered_cursor_next(&cursor));
+    btree_buffered_destroy(tree);
+    PASS();
+}
 
 /* Add definitions that need to be in the test runner's main file. */
 GREATEST_MAIN_DEFS();
@@ -158,6 +2273,34 @@ int main(int argc, char **argv) {
     GREATEST_MAIN_BEGIN();      /* command-line options, initialization. */
 
     RUN_TEST(test_btree);
+    RUN_TEST(test_btree_cursor);
+    RUN_TEST(test_btree_nearest);
+    RUN_TEST(test_btree_bulk_load);
+    RUN_TEST(test_btree_insert_many);
+    RUN_TEST(test_btree_get_many);
+    RUN_TEST(test_btree_simd_search);
+    RUN_TEST(test_btree_value_type);
+    RUN_TEST(test_btree_freeze);
+    RUN_TEST(test_btree_concurrent);
+    RUN_TEST(test_btree_concurrent_upsert);
+    RUN_TEST(test_btree_concurrent_split);
+    RUN_TEST(test_btree_snapshot);
+    RUN_TEST(test_btree_upsert);
+    RUN_TEST(test_btree_save);
+    RUN_TEST(test_btree_string);
+    RUN_TEST(test_btree_delete_range);
+    RUN_TEST(test_btree_order_statistics);
+    RUN_TEST(test_btree_stats);
+    RUN_TEST(test_btree_node_sizes);
+    RUN_TEST(test_btree_append);
+    RUN_TEST(test_btree_compact);
+    RUN_TEST(test_btree_split_join);
+    RUN_TEST(test_btree_clone);
+    RUN_TEST(test_btree_parallel);
+    RUN_TEST(test_btree_allocator);
+    RUN_TEST(test_btree_out_of_memory);
+    RUN_TEST(test_btree_buffered);
+    RUN_TEST(test_btree_buffered_out_of_memory);
 
     GREATEST_MAIN_END();        /* display results */
 }
\ No newline at end of file